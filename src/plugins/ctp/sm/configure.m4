@@ -33,6 +33,10 @@ AC_DEFUN([PLUGINS_cci_ctp_sm_CONFIG],[
                              [],
                              [$1],
                              [$2])
+    # Cross-memory attach (Linux 3.2+) for single-copy RMA
+    AC_CHECK_FUNCS([process_vm_readv process_vm_writev])
+    # Anonymous conn buffers passed over the socket (Linux 3.17+)
+    AC_CHECK_FUNCS([memfd_create])
     cflags_save=$CFLAGS
     ldflags_save=$LDFLAGS
     libs_save=$LIBS
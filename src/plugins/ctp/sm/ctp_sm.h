@@ -20,11 +20,26 @@
 #include "xpmem.h"
 #endif
 
+/* Cross-memory attach, single-copy RMA from the initiator */
+#if defined(HAVE_PROCESS_VM_READV) && defined(HAVE_PROCESS_VM_WRITEV)
+#define SM_HAVE_CMA		1
+#else
+#define SM_HAVE_CMA		0
+#endif
+
+/* Anonymous conn buffers, else unlinked files */
+#if defined(HAVE_MEMFD_CREATE)
+#define SM_HAVE_MEMFD		1
+#else
+#define SM_HAVE_MEMFD		0
+#endif
+
 BEGIN_C_DECLS
 #define SM_BLOCK_SIZE		(64)		/* uint64_t sized ep id blocks */
 #define SM_NUM_BLOCKS		(1)		/* start with one block for 64 ep ids */
 
-/* These are ignored. We use per-connection counts. */
+/* Only SM_EP_TX_CNT is used, by endpoints with a receive pool. Others
+ * use per-connection counts. */
 #define SM_EP_RX_CNT		(1024)		/* number of rx messages */
 #define SM_EP_TX_CNT		(1024)		/* number of tx messages */
 
@@ -37,19 +52,50 @@ BEGIN_C_DECLS
 #define SM_MIN_MSS		(SM_LINE)	/* Minimum cache line size */
 #define SM_MAX_MSS		(4096)		/* page size */
 
+#define SM_MSG_BUF		(64 * 1024)	/* Default per-conn MSG buffer */
+#define SM_MSG_BUF_MIN		(SM_LINE * 64)	/* Smallest MSG buffer */
+#define SM_MSG_BUF_MAX		(1024 * 1024)	/* Largest MSG buffer */
+#define SM_CONN_TX_CNT		(256)		/* SEND events per conn */
+#define SM_RNDV_MAX		(64 * 1024 * 1024) /* Largest rendezvous MSG */
+
+#define SM_RING_DEPTH		(64)		/* Default MSG header ring depth */
+#define SM_RING_DEPTH_MAX	(1 << 16)	/* Largest MSG header ring depth */
+#define SM_RMA_RING_DEPTH	(256)		/* Fragments and acks, both ways */
+#define SM_RING_SLOT		(4)		/* Default MSG header ring slot */
+#define SM_RING_SLOT_MAX	(256)		/* Largest MSG header ring slot */
+#define SM_INLINE_HDR		(8)		/* Slot bytes before inline payload */
+#define SM_INLINE_RX_CNT	(256)		/* Inline RECVs per conn */
+#define SM_POOL_MIN		(64)		/* Smallest receive pool, in slots */
+#define SM_POOL_MAX		(1 << 16)	/* Largest, inbox elements name a
+						   slot in 16 bits */
+#define SM_POOL_HDR		(8)		/* Slot bytes before the payload */
+
 #define SM_TX_BIT		((uintptr_t) 1)
 #define SM_SET_TX(x)		(((uintptr_t)(x) << 1) | SM_TX_BIT)
 #define SM_IS_TX(x)		((uintptr_t)(x) &  SM_TX_BIT)
 #define SM_TX(x)		((uintptr_t)(x) >> 1)
+#define SM_RNDV			((void *) ~SM_TX_BIT) /* priv of rndv events */
+#define SM_INLINE		((void *) ~(uintptr_t) 3) /* priv of inline RECVs */
+#define SM_POOL			((void *) ~(uintptr_t) 5) /* priv of pool RECVs */
 
 #define SM_RMA_MTU		(4096)		/* Common page size */
 #define SM_RMA_SHIFT		(12)
 #define SM_RMA_MASK		(SM_RMA_MTU - 1)
-#define SM_RMA_DEPTH		(2)		/* how many in-flight msgs per RMA */
-#define SM_RMA_FRAG_SIZE	(2*SM_RMA_MTU)	/* optimal for POSIX shmem */
+#define SM_RMA_DEPTH		(8)		/* Default in-flight frags per RMA */
+#define SM_RMA_DEPTH_MAX	(SM_RMA_RING_DEPTH / 2) /* Also per conn, so that
+						   frags and acks fit the ring */
+#define SM_RMA_FRAG_SIZE	(16*SM_RMA_MTU)	/* Default RMA fragment */
+#define SM_RMA_BUF		(512 * 1024)	/* Default RMA bounce buffer */
+#define SM_RMA_BUF_MIN		(16 * SM_RMA_MTU)
+#define SM_RMA_BUF_MAX		((1 << 16) * SM_RMA_MTU) /* Headers name a page
+						   in 16 bits */
 #define SM_RMA_FRAG_MAX		(16*SM_RMA_MTU)	/* optimal for knem and CMA */
 
 #define SM_EP_MAX_CONNS		(1024)		/* Number of cores? */
+#define SM_DB_WORDS		(SM_EP_MAX_CONNS / 64) /* Doorbell words */
+#define SM_PROGRESS_BATCH	(16)		/* Headers per ring and conn visit */
+#define SM_IDLE_SPINS		(64)		/* Empty polls before yielding */
+#define SM_PROG_TIME_MS		(1000)		/* Progress thread's idle sleep */
 #define SM_EP_MAX_ID		((1 << 14) - 1)	/* Largest supported endpoint ID -
 						   base + index */
 
@@ -86,6 +132,41 @@ BEGIN_C_DECLS
  *
  * id = 32		# Base ep_id for this process. The default is 0.
  *
+ * ring_depth = 256	# Depth of the per-connection MSG header rings,
+			  a power of two. The default is 64.
+ *
+ * inline = 64		# Slot size of the MSG header rings, a power of two
+			  up to 256. MSGs of up to 8 bytes less are sent
+			  in the slot. The default is 4 (off).
+ *
+ * msg_buf = 262144	# Size of the per-connection MSG buffers, a power
+			  of two from 4KB to 1MB. The default is 64KB.
+ *
+ * cma = 0		# Do not use cross-memory attach for RMA. It is used
+			  by default when both peers support it.
+ *
+ * rndv = 1048576	# Send MSGs larger than the mss, up to this size,
+			  by rendezvous: the receiver pulls the payload.
+			  Off (0) by default, at most 64MB.
+ *
+ * pool = 1024		# Receive MSGs in a per-endpoint pool of this many
+			  slots, a power of two from 64 to 65536, instead of
+			  per-connection buffers. Off (0) by default.
+ *
+ * credits = 64		# Slots of a peer's pool one connection may hold.
+			  The default is a quarter of the pool.
+ *
+ * rma_buf = 4194304	# Size of the per-connection RMA bounce buffers
+			  (without CMA), a power of two from 64KB to 256MB.
+			  The default is 512KB.
+ *
+ * rma_frag = 262144	# Bytes per RMA fragment through the bounce buffer,
+			  in pages, at most half of rma_buf. The default
+			  is 64KB.
+ *
+ * rma_depth = 16	# Fragments one RMA keeps in flight, 1 to 128.
+			  The default is 8.
+ *
  * path = /tmp/cci	# Path to the base directory holding the UNIX Domain
 			  Socket names. The endpoint URI will be stored as
 			  pid/ep_id where pid is the process id and the ep_id
@@ -126,14 +207,18 @@ typedef union sm_conn_hdr {
 		uint32_t version	:  8;	/* version */
 		uint32_t len		: 12;	/* payload length */
 		uint32_t attribute	:  2;	/* CCI_CONN_ATTR_* */
-		uint32_t pad1		:  8;	/* Reserved */
+		uint32_t pool		:  1;	/* Client passed its receive pool */
+		uint32_t pad1		:  7;	/* Reserved */
 		/* 32b */
 		uint32_t server_id	: 16;	/* Client-assigned ID for server */
 		uint32_t pad2		: 16;	/* Reserved */
 		/* 64b */
+		uint32_t pid;			/* Client's pid for CMA, or 0 */
+		uint32_t rndv;			/* Client's largest rendezvous MSG */
+		/* 128b */
 #if HAVE_XPMEM_H
 		uint64_t segid;			/* xpmem segid */
-		/* 128b */
+		/* 192b */
 #endif
 	} connect;
 
@@ -146,9 +231,12 @@ typedef union sm_conn_hdr {
 		uint32_t server_id	: 16;	/* Client-assigned ID for server */
 		uint32_t client_id	: 16;	/* Server-assigned ID for client */
 		/* 64b */
+		uint32_t pid;			/* Server's pid for CMA, or 0 */
+		uint32_t rndv;			/* Server's largest rendezvous MSG */
+		/* 128b */
 #if HAVE_XPMEM_H
 		uint64_t segid;			/* xpmem segid */
-		/* 128b */
+		/* 192b */
 #endif
 	} reply;
 
@@ -170,6 +258,8 @@ typedef enum sm_msg_type {
 	SM_MSG_RMA_WRITE,
 	SM_MSG_RMA_READ,
 	SM_MSG_RMA_ACK,
+	SM_MSG_RNDV,
+	SM_MSG_INLINE,
 	SM_MSG_MAX
 } sm_msg_type_t;
 
@@ -183,12 +273,12 @@ typedef union sm_hdr {
 		/* 32b */
 	} generic;
 
-	/* Send (header only, payload in sender's MMAP MSG buffer) */
+	/* Send (header only, payload in sender's MMAP MSG buffer or, if
+	 * inline, in the ring slot after SM_INLINE_HDR bytes) */
 	struct sm_hdr_send {
-		uint32_t type		:  4;	/* SM_MSG_SEND[_ACK|_NACK] */
-		uint32_t offset		:  8;	/* MMAP cacheline index */
-		uint32_t len		: 12;	/* payload length */
-		uint32_t pad		:  8;	/* Reserve */
+		uint32_t type		:  4;	/* SM_MSG_SEND|RNDV|INLINE */
+		uint32_t offset		: 15;	/* MMAP cacheline index */
+		uint32_t len		: 13;	/* payload length */
 		/* 32b */
 	} send;
 
@@ -268,6 +358,10 @@ sm_msg_str(sm_msg_type_t type)
 		return "SM_MSG_RMA_READ";
 	case SM_MSG_RMA_ACK:
 		return "SM_MSG_RMA_ACK";
+	case SM_MSG_RNDV:
+		return "SM_MSG_RNDV";
+	case SM_MSG_INLINE:
+		return "SM_MSG_INLINE";
 	case SM_MSG_MAX:
 		return "SM_MSG_MAX";
 	}
@@ -280,11 +374,14 @@ typedef struct sm_dev		sm_dev_t;
 typedef struct sm_ep		sm_ep_t;
 typedef struct sm_conn		sm_conn_t;
 typedef struct sm_conn_buffer	sm_conn_buffer_t;
+typedef struct sm_pool		sm_pool_t;
 typedef struct sm_rma_buffer	sm_rma_buffer_t;
 typedef struct sm_rx		sm_rx_t;
 typedef struct sm_rma		sm_rma_t;
 typedef struct sm_rma_op	sm_rma_op_t;
 typedef struct sm_rma_handle	sm_rma_handle_t;
+typedef struct sm_rndv		sm_rndv_t;
+typedef struct sm_rndv_desc	sm_rndv_desc_t;
 
 typedef enum sm_ctx {
 	SM_TX = 0,
@@ -292,6 +389,17 @@ typedef enum sm_ctx {
 	SM_RMA
 } sm_ctx_t;
 
+/* Per-endpoint doorbell, mmapped by every peer. After posting to one of
+ * its rings, a sender sets the bit of the receiver's id for the conn
+ * (the sender's peer_id). Progress swaps out the non-zero words and only
+ * visits the conns whose bits were set. A progress thread about to sleep
+ * sets armed; the first sender to see it clears it and writes the
+ * receiver's FIFO. */
+typedef struct sm_doorbell {
+	uint64_t		bits[SM_DB_WORDS];
+	uint64_t		armed;		/* Progress thread sleeps */
+} sm_doorbell_t;
+
 struct sm_rma_handle {
 	cci__ep_t		*ep;		/* Owning endpoint */
 	void			*addr;		/* Starting address */
@@ -312,6 +420,30 @@ struct sm_rma {
 	uint32_t		completed;	/* Number of completed frags */
 	uint32_t		msg_len;	/* Completion msg length */
 	int			flags;		/* CCI flags */
+	sm_rndv_t		*rndv;		/* Rendezvous MSG this read pulls */
+	TAILQ_ENTRY(sm_rma)	entry;		/* Entry in sconn->rma_waits */
+};
+
+/* A rendezvous MSG's descriptor, in the MSG line its header names. The
+ * sender releases the line once the receiver set done. */
+struct sm_rndv_desc {
+	uint64_t		addr;		/* Sender's payload, for CMA */
+	uint64_t		handle;		/* Sender's sm_rma_handle_t *, for reads */
+	uint32_t		len;		/* Payload length */
+	uint32_t		status;		/* Receiver's outcome */
+	uint32_t		done;		/* Set last by the receiver */
+};
+
+/* A rendezvous MSG, the sender's SEND or the receiver's RECV. Its
+ * event's priv is SM_RNDV. */
+struct sm_rndv {
+	cci__evt_t		evt;		/* SEND or RECV event */
+	sm_rma_handle_t		handle;		/* Payload, for the peer's reads */
+	uint32_t		offset;		/* Descriptor line */
+	int			flags;		/* CCI flags */
+	TAILQ_ENTRY(sm_rndv)	entry;		/* Sender's pending rndvs */
+	uint32_t		size;		/* Size of buf */
+	char			buf[];		/* Staged or received payload */
 };
 
 struct sm_ep {
@@ -322,6 +454,9 @@ struct sm_ep {
 	uint32_t		pad       : 16;	/* Reserved */
 
 	cci_os_handle_t		fifo;		/* FIFO fd for receiving headers */
+	sm_doorbell_t		*doorbell;	/* Our mmapped doorbell */
+	uint32_t		idle;		/* Empty polls in a row */
+	uint32_t		spins;		/* Empty polls before yielding */
 
 	void			*conns;		/* Tree of conns sorted by IDs */
 	pthread_rwlock_t	conns_lock;	/* Lock for conns tree */
@@ -338,6 +473,17 @@ struct sm_ep {
 	TAILQ_HEAD(cls, sm_conn) closing;	/* Closing conns */
 
 	pthread_t		conn_tid;	/* Connection thread */
+	pthread_t		prog_tid;	/* Progress thread, with an OS handle */
+
+	/* With a receive pool, every conn's MSGs land in it */
+	sm_pool_t		*pool;		/* Our mmapped pool */
+	size_t			pool_len;	/* Its length */
+	int			pool_fd;	/* Passed to each peer */
+	uint32_t		inbox_busy;	/* A thread drains the inbox */
+	cci__evt_t		*prxs;		/* RECV events, one per slot */
+	cci__evt_t		*ptxs;		/* SEND events of all conns */
+	uint64_t		ptxs_avail[SM_EP_TX_CNT / 64];
+						/* Bitmap of available ptxs */
 };
 
 typedef enum sm_conn_state {
@@ -376,38 +522,230 @@ typedef struct sm_conn_params {
 	int			flags;		/* Flags */
 } sm_conn_params_t;
 
+/* A conn's MSG buffer is this header, the bitmap of the cache lines the
+ * receiver released, the cache lines, and the header ring. The owner
+ * hands out the lines in order, as a ring, and moves its tail over the
+ * released ones. */
 struct sm_conn_buffer {
-	uint64_t		avail;		/* Bitmask for available cache lines */
-	char			pad[SM_LINE - sizeof(uint64_t)];
-	char			buf[SM_LINE * 64]; /* Cache lines */
-	ring_t			ring;		/* For headers */
+	uint32_t		lines;		/* Number of cache lines, a power of two */
+	char			pad[SM_LINE - sizeof(uint32_t)];
 };
 
+/* A conn's RMA buffer is this page, a cache line per page for the frag
+ * headers and the pages. The owner hands out the pages in order, as a
+ * ring, and the frag header of a run of pages sits in the line of its
+ * first page. */
 struct sm_rma_buffer {
-	uint64_t		avail;		/* Bitmask for available pages */
-	ring_t			ring;		/* For MSG headers */
-	char			pad[SM_RMA_MTU - sizeof(uint64_t) - sizeof(ring_t)];
-	char			hdr[SM_LINE * 64]; /* Cache lines for RMA frag headers */
-	char			buf[SM_RMA_MTU * 64]; /* Pages */
+	uint32_t		pages;		/* Number of pages, a power of two */
+	char			pad[SM_LINE - sizeof(uint32_t)];
+	uint64_t		ring[(SM_RMA_MTU - SM_LINE) / sizeof(uint64_t)];
+						/* For RMA headers */
+};
+
+static inline size_t
+sm_conn_freed_len(uint32_t lines)
+{
+	return ((lines / 8) + SM_MASK) & ~((size_t)SM_MASK);
+}
+
+static inline size_t
+sm_conn_buffer_len(uint32_t lines, uint32_t depth, uint32_t slot)
+{
+	return sizeof(sm_conn_buffer_t) + sm_conn_freed_len(lines) +
+		(size_t)lines * SM_LINE + ring_spsc_wide_size(depth, slot);
+}
+
+static inline uint64_t *
+sm_conn_freed(sm_conn_buffer_t *cb)
+{
+	return (uint64_t *)(cb + 1);
+}
+
+static inline char *
+sm_conn_buf(sm_conn_buffer_t *cb, uint32_t lines)
+{
+	return (char *)(cb + 1) + sm_conn_freed_len(lines);
+}
+
+static inline ring_spsc_t *
+sm_conn_ring(sm_conn_buffer_t *cb, uint32_t lines)
+{
+	return (ring_spsc_t *)(sm_conn_buf(cb, lines) + (size_t)lines * SM_LINE);
+}
+
+/* Lines a MSG takes, at least one so that its first line names it */
+static inline uint32_t
+sm_msg_lines(uint32_t len)
+{
+	return len ? (len + SM_MASK) >> SM_SHIFT : 1;
+}
+
+/* An endpoint's receive pool is this header, the inbox, the ring of
+ * free slots and the slots. A sender takes one of its credits and a free
+ * slot, fills it and posts the slot and the ID the receiver gave it to
+ * the inbox. The receiver puts the slot back in the free ring and counts
+ * the credit in the sender's pool once the RECV is returned. */
+struct sm_pool {
+	uint32_t		slots;		/* Number of slots, a power of two */
+	uint32_t		slot_len;	/* Slot size, SM_POOL_HDR included */
+	uint32_t		credits;	/* Slots one conn may hold */
+	char			pad[SM_LINE - 3 * sizeof(uint32_t)];
+	uint32_t		returned[SM_EP_MAX_CONNS];
+						/* Slots returned by the peers,
+						   by the ID we gave them */
 };
 
+static inline size_t
+sm_pool_ring_len(uint32_t slots)
+{
+	return ((size_t)ring_size(slots) + SM_MASK) & ~((size_t)SM_MASK);
+}
+
+static inline size_t
+sm_pool_len(uint32_t slots, uint32_t slot_len)
+{
+	return sizeof(sm_pool_t) + 2 * sm_pool_ring_len(slots) +
+		(size_t)slots * slot_len;
+}
+
+static inline uint32_t
+sm_pool_slot_len(uint32_t mss)
+{
+	return (SM_POOL_HDR + mss + SM_MASK) & ~SM_MASK;
+}
+
+static inline ring_t *
+sm_pool_inbox(sm_pool_t *p)
+{
+	return (ring_t *)(p + 1);
+}
+
+static inline ring_t *
+sm_pool_free(sm_pool_t *p)
+{
+	return (ring_t *)((char *)(p + 1) + sm_pool_ring_len(p->slots));
+}
+
+/* A slot starts with the MSG length, the payload follows */
+static inline char *
+sm_pool_slot(sm_pool_t *p, uint32_t slot)
+{
+	return (char *)(p + 1) + 2 * sm_pool_ring_len(p->slots) +
+		(size_t)slot * p->slot_len;
+}
+
+static inline ring_spsc_t *
+sm_rma_ring(sm_rma_buffer_t *rb)
+{
+	return (ring_spsc_t *)rb->ring;
+}
+
+static inline size_t
+sm_rma_hdrs_len(uint32_t pages)
+{
+	return ((size_t)pages * SM_LINE + SM_RMA_MASK) & ~((size_t)SM_RMA_MASK);
+}
+
+static inline size_t
+sm_rma_buffer_len(uint32_t pages)
+{
+	return sizeof(sm_rma_buffer_t) + sm_rma_hdrs_len(pages) +
+		(size_t)pages * SM_RMA_MTU;
+}
+
+static inline sm_rma_hdr_t *
+sm_rma_frag_hdr(sm_rma_buffer_t *rb, uint32_t page)
+{
+	return (sm_rma_hdr_t *)((char *)(rb + 1) + (size_t)page * SM_LINE);
+}
+
+static inline char *
+sm_rma_page(sm_rma_buffer_t *rb, uint32_t page)
+{
+	return (char *)(rb + 1) + sm_rma_hdrs_len(rb->pages) +
+		(size_t)page * SM_RMA_MTU;
+}
+
+/* Pages a RMA fragment takes */
+static inline uint32_t
+sm_rma_pages(uint64_t len)
+{
+	return (uint32_t)((len + SM_RMA_MASK) >> SM_RMA_SHIFT);
+}
+
 struct sm_conn {
 	cci__conn_t		*conn;		/* Owning conn */
 	sm_conn_state_t		state;		/* SM_CONN_* */
 	cci_os_handle_t		fifo;		/* for sending keepalives and wakeups */
+	sm_doorbell_t		*peer_doorbell;	/* Peer endpoint's doorbell */
 
 	int			id;		/* ID we assigned to peer */
 	int			peer_id;	/* ID peer assigned to us */
+	pid_t			peer_pid;	/* Peer's pid if it allows CMA, or 0 */
+	int			cma;		/* Use CMA for RMA */
+
+	int			msgs_fd;	/* Our buffers' fds, until the */
+	int			rma_fd;		/* peer has them */
+	int			peer_msgs_fd;	/* Peer's buffers' fds, until */
+	int			peer_rma_fd;	/* we mapped them */
 
 	void			*mmap;		/* Mmapped buffer */
 	sm_conn_buffer_t	*tx;		/* Pointer to mmap */
-	void			*peer_mmap;	/* Peer's mmap */
+	size_t			mmap_len;	/* Buffer and ring length */
+	void			*peer_mmap;	/* Peer's mmap, or pool */
 	sm_conn_buffer_t	*rx;		/* Pointer to peer's mmap */
+	size_t			peer_mmap_len;	/* Peer's buffer and ring length */
+
+	/* Parts of our buffer, its lines handed out under tx_lock */
+	char			*tx_buf;	/* Cache lines */
+	uint64_t		*tx_freed;	/* Lines released by the peer */
+	ring_spsc_t		*tx_ring;	/* Header ring */
+	uint32_t		tx_lines;	/* Number of cache lines */
+	uint32_t		tx_head;	/* Next line to hand out */
+	uint32_t		tx_tail;	/* Oldest line not reclaimed */
+	uint32_t		tx_inline;	/* Largest MSG sent in a slot, or 0 */
+
+	/* Parts of the peer's buffer */
+	char			*rx_buf;	/* Cache lines */
+	uint64_t		*rx_freed;	/* Lines we released */
+	ring_spsc_t		*rx_ring;	/* Header ring */
+	uint32_t		rx_lines;	/* Number of cache lines */
+
+	/* With receive pools, MSGs go to the peer's instead */
+	sm_pool_t		*peer_pool;	/* Pointer to peer's mmap */
+	uint32_t		pool_slots;	/* Its number of slots */
+	uint32_t		pool_credits;	/* Slots we may hold */
+	uint32_t		pool_sent;	/* Slots taken, under tx_lock */
+
+	/* Inline MSGs are copied out of the peer's ring slots */
+	cci__evt_t		*irxs;		/* Inline RECV events */
+	char			*irx_buf;	/* Their payloads */
+	uint32_t		irx_len;	/* Payload room per event */
+	uint32_t		irx_starved;	/* An inline MSG waits for an event */
+	uint64_t		irxs_avail[SM_INLINE_RX_CNT / 64];
+						/* Bitmap of available irxs */
+
+	/* Our rings have one producer and the peer's rings one consumer */
+	pthread_mutex_t		tx_lock;	/* Serializes MSG lines and inserts */
+	pthread_mutex_t		rma_lock;	/* Serializes RMA ring inserts and
+						   the RMA buffer's pages */
+	uint32_t		rx_busy;	/* A thread drains the peer's rings */
 
 	void			*rma_mmap;	/* Mmapped RMA buffer */
+	size_t			rma_mmap_len;	/* RMA buffer length */
 	sm_rma_buffer_t		*rma;		/* Pointer to RMA mmap */
 	void			*peer_rma_mmap;	/* Peer's RMA mmap */
+	size_t			peer_rma_mmap_len; /* Its length */
 	sm_rma_buffer_t		*peer_rma;	/* Pointer to peer's RMA mmap */
+	uint32_t		peer_rma_pages;	/* Its number of pages */
+
+	/* Our RMA buffer's pages, under rma_lock */
+	uint64_t		*rma_freed;	/* Pages whose frag was acked */
+	uint32_t		rma_pages;	/* Number of pages */
+	uint32_t		rma_head;	/* Next page to hand out */
+	uint32_t		rma_tail;	/* Oldest page not reclaimed */
+	uint32_t		rma_frags;	/* Our frags in flight */
+	TAILQ_HEAD(rma_waits, sm_rma) rma_waits; /* RMAs waiting for pages */
 
 #if HAVE_XPMEM_H
 	xpmem_segid_t		segid;		/* xpmem segid */
@@ -415,9 +753,15 @@ struct sm_conn {
 	void			*base;		/* xpmem address */
 #endif
 
-	cci__evt_t		*rxs;		/* RECV events */
+	cci__evt_t		*rxs;		/* RECV events, one per peer's line */
 	cci__evt_t		*txs;		/* SEND events */
-	uint64_t		txs_avail;	/* Bitmap of available txs */
+	uint64_t		txs_avail[SM_CONN_TX_CNT / 64];
+						/* Bitmap of available txs */
+
+	TAILQ_HEAD(rndvs, sm_rndv) rndvs;	/* Sent rndvs, under tx_lock */
+	sm_rma_t		*rndv_rx;	/* Read pulling a received rndv */
+	sm_rndv_t		*tx_spare;	/* Last freed sent rndv */
+	sm_rndv_t		*rx_spare;	/* Last freed received rndv */
 
 	TAILQ_ENTRY(sm_conn)	entry;		/* Entry in sep->conns|active|passive */
 	char			*name;		/* sockaddr_un.sun_path */
@@ -431,6 +775,18 @@ struct sm_dev {
 	uint32_t		pid;		/* Process id */
 	uint32_t		id;		/* Starting endpoint id */
 	uint32_t		num_blocks;	/* Number of ids blocks */
+	uint32_t		ring_depth;	/* MSG header ring depth */
+	uint32_t		ring_slot;	/* MSG header ring slot size */
+	uint32_t		msg_lines;	/* Cache lines in a conn's MSG buffer */
+	int			cma;		/* Offer and use CMA for RMA */
+	uint32_t		rndv;		/* Largest rendezvous MSG, or 0 */
+	int			memfd;		/* Conn buffers in memfds */
+	size_t			huge;		/* Huge page size for them, or 0 */
+	uint32_t		pool;		/* Receive pool slots, or 0 */
+	uint32_t		credits;	/* Pool slots one conn may hold */
+	uint32_t		rma_pages;	/* Pages in a conn's RMA buffer */
+	uint32_t		rma_frag;	/* Largest RMA fragment, in bytes */
+	uint32_t		rma_depth;	/* In-flight frags per RMA */
 };
 
 struct sm_globals {
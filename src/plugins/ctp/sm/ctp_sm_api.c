@@ -18,7 +18,10 @@
 #include <search.h>
 #include <assert.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <fts.h>
+#include <sched.h>
+#include <sys/uio.h>
 
 #include "cci.h"
 #include "plugins/ctp/ctp.h"
@@ -234,6 +237,30 @@ sm_create_path(const char *path)
 	return ret;
 }
 
+/* The default huge page size, or 0 if memfds cannot use huge pages */
+static size_t
+sm_huge_page_size(void)
+{
+	size_t size = 0;
+#if SM_HAVE_MEMFD && defined(MFD_HUGETLB)
+	char line[128];
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long kb = 0;
+
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			size = (size_t) kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+#endif
+	return size;
+}
+
 static int ctp_sm_init(cci_plugin_ctp_t *plugin, uint32_t abi_ver, uint32_t flags, uint32_t * caps)
 {
 	int ret = CCI_SUCCESS;
@@ -307,6 +334,14 @@ static int ctp_sm_init(cci_plugin_ctp_t *plugin, uint32_t abi_ver, uint32_t flag
 			goto out;
 
 		sdev->id = 0;
+		sdev->ring_depth = SM_RING_DEPTH;
+		sdev->ring_slot = SM_RING_SLOT;
+		sdev->msg_lines = SM_MSG_BUF / SM_LINE;
+		sdev->rma_pages = SM_RMA_BUF / SM_RMA_MTU;
+		sdev->rma_frag = SM_RMA_FRAG_SIZE;
+		sdev->rma_depth = SM_RMA_DEPTH;
+		sdev->cma = SM_HAVE_CMA;
+		sdev->memfd = SM_HAVE_MEMFD;
 
 		device->up = 1;
 		device->rate = UINT64_C(64000000000);
@@ -353,6 +388,11 @@ static int ctp_sm_init(cci_plugin_ctp_t *plugin, uint32_t abi_ver, uint32_t flag
 			}
 			sdev->ids[0] = ~((uint64_t)0);
 			sdev->num_blocks = 1;
+			sdev->cma = SM_HAVE_CMA;
+			sdev->memfd = SM_HAVE_MEMFD;
+			sdev->rma_pages = SM_RMA_BUF / SM_RMA_MTU;
+			sdev->rma_frag = SM_RMA_FRAG_SIZE;
+			sdev->rma_depth = SM_RMA_DEPTH;
 
 			device->up = 1;
 			device->rate = UINT64_C(64000000000);
@@ -465,6 +505,178 @@ static int ctp_sm_init(cci_plugin_ctp_t *plugin, uint32_t abi_ver, uint32_t flag
 							"of two.", __func__, mss);
 					}
 					device->max_send_size = mss;
+				} else if (0 == strncmp("ring_depth=", *arg, 11)) {
+					const char *depth_str = *arg + 11;
+					uint32_t depth = strtoul(depth_str, NULL, 0);
+
+					if (depth < 2 || depth > SM_RING_DEPTH_MAX ||
+						(depth & (depth - 1))) {
+						debug(CCI_DB_WARN,
+							"%s: device %s ring_depth "
+							"%u must be a power of two "
+							"between 2 and %u",
+							__func__, device->name,
+							depth, SM_RING_DEPTH_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->ring_depth = depth;
+				} else if (0 == strncmp("inline=", *arg, 7)) {
+					const char *slot_str = *arg + 7;
+					uint32_t slot = strtoul(slot_str, NULL, 0);
+
+					if (slot < SM_RING_SLOT || slot > SM_RING_SLOT_MAX ||
+						(slot & (slot - 1))) {
+						debug(CCI_DB_WARN,
+							"%s: device %s inline "
+							"%u must be a power of two "
+							"between %u and %u",
+							__func__, device->name,
+							slot, SM_RING_SLOT,
+							SM_RING_SLOT_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->ring_slot = slot;
+				} else if (0 == strncmp("msg_buf=", *arg, 8)) {
+					const char *buf_str = *arg + 8;
+					uint32_t size = strtoul(buf_str, NULL, 0);
+
+					if (size < SM_MSG_BUF_MIN || size > SM_MSG_BUF_MAX ||
+						(size & (size - 1))) {
+						debug(CCI_DB_WARN,
+							"%s: device %s msg_buf "
+							"%u must be a power of two "
+							"between %u and %u",
+							__func__, device->name,
+							size, SM_MSG_BUF_MIN,
+							SM_MSG_BUF_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->msg_lines = size / SM_LINE;
+				} else if (0 == strncmp("cma=", *arg, 4)) {
+					const char *cma_str = *arg + 4;
+
+					sdev->cma = SM_HAVE_CMA &&
+						strtol(cma_str, NULL, 0) != 0;
+				} else if (0 == strncmp("rndv=", *arg, 5)) {
+					const char *rndv_str = *arg + 5;
+					uint32_t rndv = strtoul(rndv_str, NULL, 0);
+
+					if (rndv > SM_RNDV_MAX) {
+						debug(CCI_DB_WARN,
+							"%s: device %s rndv %u "
+							"is larger than %u",
+							__func__, device->name,
+							rndv, SM_RNDV_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->rndv = rndv;
+				} else if (0 == strncmp("memfd=", *arg, 6)) {
+					const char *memfd_str = *arg + 6;
+
+					sdev->memfd = SM_HAVE_MEMFD &&
+						strtol(memfd_str, NULL, 0) != 0;
+				} else if (0 == strncmp("hugetlb=", *arg, 8)) {
+					const char *huge_str = *arg + 8;
+
+					if (strtol(huge_str, NULL, 0))
+						sdev->huge = sm_huge_page_size();
+					if (strtol(huge_str, NULL, 0) && !sdev->huge)
+						debug(CCI_DB_WARN,
+							"%s: device %s cannot "
+							"use huge pages, ignoring "
+							"hugetlb", __func__,
+							device->name);
+				} else if (0 == strncmp("pool=", *arg, 5)) {
+					const char *pool_str = *arg + 5;
+					uint32_t pool = strtoul(pool_str, NULL, 0);
+
+					if (pool && (pool < SM_POOL_MIN ||
+						pool > SM_POOL_MAX ||
+						(pool & (pool - 1)))) {
+						debug(CCI_DB_WARN,
+							"%s: device %s pool "
+							"%u must be a power of two "
+							"between %u and %u",
+							__func__, device->name,
+							pool, SM_POOL_MIN,
+							SM_POOL_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->pool = pool;
+				} else if (0 == strncmp("credits=", *arg, 8)) {
+					const char *credits_str = *arg + 8;
+
+					sdev->credits = strtoul(credits_str, NULL, 0);
+				} else if (0 == strncmp("rma_buf=", *arg, 8)) {
+					const char *buf_str = *arg + 8;
+					uint32_t size = strtoul(buf_str, NULL, 0);
+
+					if (size < SM_RMA_BUF_MIN || size > SM_RMA_BUF_MAX ||
+						(size & (size - 1))) {
+						debug(CCI_DB_WARN,
+							"%s: device %s rma_buf "
+							"%u must be a power of two "
+							"between %u and %u",
+							__func__, device->name,
+							size, SM_RMA_BUF_MIN,
+							SM_RMA_BUF_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->rma_pages = size / SM_RMA_MTU;
+				} else if (0 == strncmp("rma_frag=", *arg, 9)) {
+					const char *frag_str = *arg + 9;
+					uint32_t frag = strtoul(frag_str, NULL, 0);
+
+					if (!frag || (frag & SM_RMA_MASK)) {
+						debug(CCI_DB_WARN,
+							"%s: device %s rma_frag "
+							"%u must be a multiple of %u",
+							__func__, device->name,
+							frag, SM_RMA_MTU);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->rma_frag = frag;
+				} else if (0 == strncmp("rma_depth=", *arg, 10)) {
+					const char *depth_str = *arg + 10;
+					uint32_t depth = strtoul(depth_str, NULL, 0);
+
+					if (!depth || depth > SM_RMA_DEPTH_MAX) {
+						debug(CCI_DB_WARN,
+							"%s: device %s rma_depth "
+							"%u must be between 1 and %u",
+							__func__, device->name,
+							depth, SM_RMA_DEPTH_MAX);
+						ret = CCI_EINVAL;
+						goto out;
+					}
+					sdev->rma_depth = depth;
+				}
+			}
+
+			/* a frag at most half the buffer, so two fit */
+			if (sdev->rma_frag > sdev->rma_pages / 2 * SM_RMA_MTU)
+				sdev->rma_frag = sdev->rma_pages / 2 * SM_RMA_MTU;
+
+			if (!sdev->memfd)
+				sdev->huge = 0;
+
+			if (sdev->pool) {
+				if (!sdev->credits)
+					sdev->credits = sdev->pool / 4;
+				if (sdev->credits > sdev->pool)
+					sdev->credits = sdev->pool;
+				if (sdev->rndv) {
+					debug(CCI_DB_WARN, "%s: device %s "
+						"ignores rndv with a pool",
+						__func__, device->name);
+					sdev->rndv = 0;
 				}
 			}
 
@@ -490,12 +702,56 @@ static int ctp_sm_init(cci_plugin_ctp_t *plugin, uint32_t abi_ver, uint32_t flag
 			if (device->max_send_size == 0)
 				device->max_send_size = SM_DEFAULT_MSS;
 
+			if (device->max_send_size > SM_MAX_MSS) {
+				debug(CCI_DB_WARN, "%s: device %s mss %u is larger "
+					"than %u", __func__, device->name,
+					device->max_send_size, SM_MAX_MSS);
+				ret = CCI_EINVAL;
+				goto out;
+			}
+
+			if (!sdev->ring_depth)
+				sdev->ring_depth = SM_RING_DEPTH;
+
+			if (!sdev->ring_slot)
+				sdev->ring_slot = SM_RING_SLOT;
+
+			if (!sdev->msg_lines)
+				sdev->msg_lines = SM_MSG_BUF / SM_LINE;
+
+			if (device->max_send_size > sdev->msg_lines * SM_LINE) {
+				debug(CCI_DB_WARN, "%s: device %s mss %u is larger "
+					"than its msg_buf %u", __func__, device->name,
+					device->max_send_size,
+					sdev->msg_lines * SM_LINE);
+				ret = CCI_EINVAL;
+				goto out;
+			}
+
 			debug(CCI_DB_INFO, "%s: device %s path is %s", __func__,
 				device->name, sdev->path);
 			debug(CCI_DB_INFO, "%s: device %s base id is %u",
 				__func__, device->name, sdev->id);
 			debug(CCI_DB_INFO, "%s: device %s max_send_size is %u",
 				__func__, device->name, device->max_send_size);
+			debug(CCI_DB_INFO, "%s: device %s ring_depth is %u",
+				__func__, device->name, sdev->ring_depth);
+			debug(CCI_DB_INFO, "%s: device %s ring slot is %u bytes",
+				__func__, device->name, sdev->ring_slot);
+			debug(CCI_DB_INFO, "%s: device %s msg_buf is %u",
+				__func__, device->name, sdev->msg_lines * SM_LINE);
+			debug(CCI_DB_INFO, "%s: device %s %s CMA for RMA",
+				__func__, device->name,
+				sdev->cma ? "uses" : "does not use");
+			debug(CCI_DB_INFO, "%s: device %s rndv is %u",
+				__func__, device->name, sdev->rndv);
+			debug(CCI_DB_INFO, "%s: device %s rma_buf is %u, "
+				"%u frags of %u per RMA", __func__, device->name,
+				sdev->rma_pages * SM_RMA_MTU, sdev->rma_depth,
+				sdev->rma_frag);
+			debug(CCI_DB_INFO, "%s: device %s pool is %u slots, "
+				"%u per conn", __func__, device->name,
+				sdev->pool, sdev->credits);
 
 			/* queue to the main device list now */
 			TAILQ_REMOVE(&globals->configfile_devs, dev, entry);
@@ -757,6 +1013,9 @@ sm_compare_conns(const void *pa, const void *pb)
 static int
 sm_progress_sock(cci__ep_t *ep);
 
+static void *
+sm_progress_thread(void *arg);
+
 static void *
 sm_conn_thread(void *arg)
 {
@@ -777,12 +1036,15 @@ sm_conn_thread(void *arg)
 	pthread_exit(NULL);
 }
 
+static int
+sm_create_pool(cci__ep_t *ep);
+
 static int ctp_sm_create_endpoint(cci_device_t * device,
 				    int flags,
 				    cci_endpoint_t ** endpointp,
 				    cci_os_handle_t * fd)
 {
-	int ret = CCI_SUCCESS;
+	int ret = CCI_SUCCESS, doorbell_fd = 0;
 	uint32_t id = 0;
 	struct cci_endpoint *endpoint = (struct cci_endpoint *) *endpointp;
 	cci__dev_t *dev = NULL;
@@ -800,17 +1062,6 @@ static int ctp_sm_create_endpoint(cci_device_t * device,
 		return CCI_ENODEV;
 	}
 
-	/* TODO support blocking mode
-	 * in the meantime, fail if the fd is requested */
-	if (fd) {
-		debug(CCI_DB_WARN, "%s: The SM transport does not yet "
-			"support blocking mode via the OS handle. "
-			"Either choose another transport or set the "
-			"OS handle to NULL\n", __func__);
-		CCI_EXIT;
-		return CCI_ERR_NOT_IMPLEMENTED;
-	}
-
 	dev = container_of(device, cci__dev_t, device);
 	if (0 != strcmp("sm", device->transport)) {
 		CCI_EXIT;
@@ -841,6 +1092,9 @@ static int ctp_sm_create_endpoint(cci_device_t * device,
 	TAILQ_INIT(&sep->passive);
 	TAILQ_INIT(&sep->closing);
 
+	/* with a single core, the peer cannot run while we spin */
+	sep->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SM_IDLE_SPINS : 0;
+
 	ret = sm_get_ep_id(dev, &id);
 	if (ret) goto out;
 
@@ -916,6 +1170,46 @@ static int ctp_sm_create_endpoint(cci_device_t * device,
 	}
 	sep->fifo = ret;
 
+	/* Create the doorbell our peers ring */
+
+	/* If there is not enough space to append "/doorbell", bail */
+	if (strlen(uri) >= (sizeof(name) - 10)) {
+		ret = CCI_EINVAL;
+		goto out;
+	}
+
+	memset(name, 0, sizeof(name));
+	snprintf(name, sizeof(name), "%s/doorbell", uri);
+
+	ret = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (ret == -1) {
+		debug(CCI_DB_WARN, "%s: open(%s) failed with %s", __func__,
+				name, strerror(errno));
+		ret = CCI_ERROR;
+		goto out;
+	}
+	doorbell_fd = ret;
+
+	ret = ftruncate(doorbell_fd, sizeof(*sep->doorbell));
+	if (ret) {
+		debug(CCI_DB_WARN, "%s: ftruncate(%s) failed with %s", __func__,
+				name, strerror(errno));
+		close(doorbell_fd);
+		ret = CCI_ERROR;
+		goto out;
+	}
+
+	sep->doorbell = mmap(NULL, sizeof(*sep->doorbell), PROT_READ | PROT_WRITE,
+			MAP_SHARED, doorbell_fd, 0);
+	close(doorbell_fd);
+	if (sep->doorbell == MAP_FAILED) {
+		debug(CCI_DB_WARN, "%s: mmap(%s) failed with %s", __func__,
+				name, strerror(errno));
+		sep->doorbell = NULL;
+		ret = CCI_ERROR;
+		goto out;
+	}
+
 	sep->conn_ids = malloc(SM_EP_MAX_CONNS / sizeof(*sep->conn_ids));
 	if (!sep->conn_ids) {
 		ret = CCI_ENOMEM;
@@ -923,6 +1217,12 @@ static int ctp_sm_create_endpoint(cci_device_t * device,
 	}
 	memset(sep->conn_ids, 0xFF, SM_EP_MAX_CONNS / sizeof(*sep->conn_ids));
 
+	if (sdev->pool) {
+		ret = sm_create_pool(ep);
+		if (ret)
+			goto out;
+	}
+
 #if HAVE_XPMEM_H
 	sep->segid = xpmem_make(0, XPMEM_MAXADDR_SIZE, XPMEM_PERMIT_MODE,
 			(void*)((uintptr_t)0600));
@@ -961,10 +1261,35 @@ static int ctp_sm_create_endpoint(cci_device_t * device,
 	}
 
 	ret = pthread_create(&sep->conn_tid, NULL, sm_conn_thread, (void *)ep);
+	if (ret)
+		goto out;
+
+	/* With an OS handle, a thread progresses the endpoint and the pipe
+	 * is readable while events are queued */
+	if (fd) {
+		int i = 0;
+
+		ret = pipe(sep->pipe);
+		if (ret) {
+			debug(CCI_DB_WARN, "%s: pipe() failed with %s", __func__,
+					strerror(errno));
+			ret = CCI_ERROR;
+			goto out;
+		}
+		for (i = 0; i < 2; i++)
+			fcntl(sep->pipe[i], F_SETFL,
+				fcntl(sep->pipe[i], F_GETFL) | O_NONBLOCK);
+		*fd = sep->pipe[0];
+
+		ret = pthread_create(&sep->prog_tid, NULL, sm_progress_thread,
+				(void *)ep);
+	}
 
 out:
-	if (ret)
+	if (ret) {
+		ep->closing = 1;
 		ctp_sm_destroy_endpoint(endpoint);
+	}
 
 	CCI_EXIT;
 	return ret;
@@ -991,6 +1316,16 @@ static int ctp_sm_destroy_endpoint(cci_endpoint_t * endpoint)
 
 	pthread_join(sep->conn_tid, NULL);
 
+	if (sep && sep->prog_tid) {
+		uint32_t id = 0;
+
+		/* do not wait for its poll() timeout */
+		if (write(sep->fifo, &id, sizeof(id)) != sizeof(id))
+			debug(CCI_DB_EP, "%s: write(fifo) failed with %s",
+				__func__, strerror(errno));
+		pthread_join(sep->prog_tid, NULL);
+	}
+
 	if (ep->uri)
 		path = (void*)((uintptr_t)ep->uri + strlen("sm://"));
 
@@ -1006,6 +1341,21 @@ static int ctp_sm_destroy_endpoint(cci_endpoint_t * endpoint)
 		if (sep->fifo)
 			close(sep->fifo);
 
+		if (sep->pipe[0]) {
+			close(sep->pipe[0]);
+			close(sep->pipe[1]);
+		}
+
+		if (sep->doorbell)
+			munmap(sep->doorbell, sizeof(*sep->doorbell));
+
+		if (sep->pool) {
+			munmap(sep->pool, sep->pool_len);
+			close(sep->pool_fd);
+		}
+		free(sep->prxs);
+		free(sep->ptxs);
+
 		remove_path(path);
 
 		sm_put_ep_id(dev, sep->id);
@@ -1027,6 +1377,56 @@ static int ctp_sm_destroy_endpoint(cci_endpoint_t * endpoint)
 #define ID_SHIFT	(6)
 #define ID_MASK		((1 << ID_SHIFT) - 1)
 
+/* Wake a doorbell's progress thread if it is going to sleep. The
+ * fetch_or() that rang it is a full barrier, pairing with the barrier
+ * between the sleeper setting armed and its last look at the bits. */
+static inline void
+sm_wake(sm_doorbell_t *db, cci_os_handle_t fifo, uint32_t id)
+{
+	if (read_u64(&db->armed, 0) && fetch_clear_u64(&db->armed)) {
+		if (write(fifo, &id, sizeof(id)) != sizeof(id))
+			debug(CCI_DB_MSG, "%s: write(fifo) failed with %s",
+				__func__, strerror(errno));
+	}
+}
+
+/* Tell the peer that one of our rings to it has new headers */
+static inline void
+sm_ring_doorbell(sm_conn_t *sconn)
+{
+	fetch_or_u64(&sconn->peer_doorbell->bits[sconn->peer_id >> ID_SHIFT],
+			(uint64_t)1 << (sconn->peer_id & ID_MASK));
+	sm_wake(sconn->peer_doorbell, sconn->fifo, sconn->peer_id);
+}
+
+/* Have progress visit this conn again */
+static inline void
+sm_ring_own_doorbell(sm_ep_t *sep, sm_conn_t *sconn)
+{
+	fetch_or_u64(&sep->doorbell->bits[sconn->id >> ID_SHIFT],
+			(uint64_t)1 << (sconn->id & ID_MASK));
+	sm_wake(sep->doorbell, sep->fifo, sconn->id);
+}
+
+/* Queue an event. With an OS handle, make the pipe readable when the
+ * queue was empty; get_event() drains it with the last event. */
+static void
+sm_queue_evt(cci__ep_t *ep, cci__evt_t *evt)
+{
+	sm_ep_t *sep = ep->priv;
+	char one = 1;
+
+	pthread_mutex_lock(&ep->lock);
+	if (sep->pipe[1] && TAILQ_EMPTY(&ep->evts)) {
+		debug(CCI_DB_EP, "%s: writing to pipe", __func__);
+		if (write(sep->pipe[1], &one, 1) != 1)
+			debug(CCI_DB_WARN, "%s: write(pipe) failed with %s",
+				__func__, strerror(errno));
+	}
+	TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
+	pthread_mutex_unlock(&ep->lock);
+}
+
 static int
 sm_get_conn_id(sm_conn_t *sconn)
 {
@@ -1081,29 +1481,106 @@ sm_put_conn_id(sm_conn_t *sconn)
 	return ret;
 }
 
+/* Map the receive pool the peer passed in place of its buffers. MSGs
+ * to it are limited to its slots. */
+static int
+sm_map_pool(sm_ep_t *sep, sm_conn_t *sconn, int fd)
+{
+	int ret = 0;
+	cci__conn_t *conn = sconn->conn;
+	sm_pool_t *pool = NULL;
+	uint32_t slots = 0, slot_len = 0;
+	struct stat st;
+
+	ret = fstat(fd, &st);
+	if (ret || st.st_size < (off_t)sm_pool_len(SM_POOL_MIN, SM_LINE)) {
+		debug(CCI_DB_CONN, "%s: %s's pool is too short", __func__,
+				sconn->conn->uri);
+		ret = EHOSTUNREACH;
+		goto out;
+	}
+
+	sconn->peer_mmap = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (sconn->peer_mmap == MAP_FAILED) {
+		debug(CCI_DB_WARN, "%s: mmap() failed with %s", __func__,
+				strerror(errno));
+		ret = CCI_ERROR;
+		goto out;
+	}
+	sconn->peer_mmap_len = st.st_size;
+
+	pool = sconn->peer_mmap;
+	slots = pool->slots;
+	slot_len = pool->slot_len;
+	if (slots < SM_POOL_MIN || slots > SM_POOL_MAX || (slots & (slots - 1)) ||
+		slot_len <= SM_POOL_HDR || (slot_len & SM_MASK) ||
+		sm_pool_len(slots, slot_len) > (size_t) st.st_size ||
+		sm_pool_inbox(pool)->num_elem0 != slots ||
+		sm_pool_free(pool)->num_elem1 != slots) {
+		debug(CCI_DB_CONN, "%s: %s's pool exceeds its mmap buf",
+				__func__, sconn->conn->uri);
+		ret = EHOSTUNREACH;
+		goto out;
+	}
+
+	if (conn->connection.max_send_size > slot_len - SM_POOL_HDR)
+		conn->connection.max_send_size = slot_len - SM_POOL_HDR;
+	sconn->pool_slots = slots;
+	sconn->pool_credits = pool->credits ? pool->credits : 1;
+	/* the peer may still return slots of this ID's previous conn */
+	sconn->pool_sent = read_u32(&sep->pool->returned[sconn->id], 0);
+
+	/* Progress takes a set peer_pool as the sign the pool is mapped */
+	mb();
+	sconn->peer_pool = pool;
+
+    out:
+	close(fd);
+	return ret;
+}
+
 static int
 sm_map_conn(sm_ep_t *sep, sm_conn_t *sconn)
 {
 	int ret = 0, msgs_fd = 0, rma_fd = 0, len = 0;
-	char name[MAXPATHLEN], rma_name[MAXPATHLEN], *ptr = NULL;
+	cci__ep_t *ep = container_of(sconn->conn->connection.endpoint,
+					cci__ep_t, endpoint);
+	uint32_t lines = 0, slot = 0, i = 0;
+	ring_spsc_t *ring = NULL;
+	struct stat st;
+
+	/* The peer passed its buffers' fds with its CONNECT or REPLY */
+	msgs_fd = sconn->peer_msgs_fd;
+	rma_fd = sconn->peer_rma_fd;
+	sconn->peer_msgs_fd = 0;
+	sconn->peer_rma_fd = 0;
+
+	if (!msgs_fd) {
+		debug(CCI_DB_CONN, "%s: %s did not pass its mmap buf", __func__,
+				sconn->conn->uri);
+		ret = EHOSTUNREACH;
+		goto out;
+	}
 
-	memset(name, 0, sizeof(name));
-	snprintf(name, sizeof(name), "%s", sconn->name);
-	ptr = strstr(name, "/sock");
-	snprintf(ptr, sizeof(name) - (ptr - name),
-			"/conns/%d", sconn->peer_id);
+	if (sep->pool) {
+		ret = sm_map_pool(sep, sconn, msgs_fd);
+		msgs_fd = 0;
+		if (ret)
+			goto out;
+		goto rma;
+	}
 
-	ret = open(name, O_RDWR, 0666);
-	if (ret == -1) {
-		debug(CCI_DB_CONN, "%s: unable to open %s's mmap buf", __func__,
+	/* The peer picked its buffer size and ring depth */
+	ret = fstat(msgs_fd, &st);
+	if (ret || st.st_size < (off_t)sm_conn_buffer_len(SM_MSG_BUF_MIN / SM_LINE,
+				0, 0)) {
+		debug(CCI_DB_CONN, "%s: %s's mmap buf is too short", __func__,
 				sconn->conn->uri);
 		ret = EHOSTUNREACH;
 		goto out;
 	}
-	msgs_fd = ret;
-	ret = 0;
-
-	len = sizeof(*sconn->rx);
+	len = (int) st.st_size;
 
 	/* MMAP the buffer */
 	sconn->peer_mmap = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, msgs_fd, 0);
@@ -1115,8 +1592,72 @@ sm_map_conn(sm_ep_t *sep, sm_conn_t *sconn)
 		ret = CCI_ERROR;
 		goto out;
 	}
-	sconn->rx = sconn->peer_mmap;
+	sconn->peer_mmap_len = len;
+
+	lines = ((sm_conn_buffer_t *)sconn->peer_mmap)->lines;
+	if (lines < SM_MSG_BUF_MIN / SM_LINE || lines > SM_MSG_BUF_MAX / SM_LINE ||
+		(lines & (lines - 1)) ||
+		sm_conn_buffer_len(lines, 0, 0) > (size_t) len) {
+		debug(CCI_DB_CONN, "%s: %s's buffer exceeds its mmap buf",
+				__func__, sconn->conn->uri);
+		ret = EHOSTUNREACH;
+		goto out;
+	}
+	ring = sm_conn_ring(sconn->peer_mmap, lines);
+	slot = ring->shift < 31 ? 1U << ring->shift : 0;
+	if (slot < SM_RING_SLOT || slot > SM_RING_SLOT_MAX ||
+		sm_conn_buffer_len(lines, ring->num, slot) > (size_t) len) {
+		debug(CCI_DB_CONN, "%s: %s's ring exceeds its mmap buf",
+				__func__, sconn->conn->uri);
+		ret = EHOSTUNREACH;
+		goto out;
+	}
+	sconn->rx_lines = lines;
+	sconn->rx_buf = sm_conn_buf(sconn->peer_mmap, lines);
+	sconn->rx_freed = sm_conn_freed(sconn->peer_mmap);
+	sconn->rx_ring = sm_conn_ring(sconn->peer_mmap, lines);
+
+	/* One RECV per line, named by the line the MSG starts at */
+	sconn->rxs = calloc(lines, sizeof(*sconn->rxs));
+	if (!sconn->rxs) {
+		ret = CCI_ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < lines; i++) {
+		cci__evt_t *evt = &sconn->rxs[i];
+
+		evt->event.type = CCI_EVENT_RECV;
+		evt->event.recv.connection = &sconn->conn->connection;
+		evt->ep = ep;
+		evt->conn = sconn->conn;
+	}
+
+	/* The peer sends small MSGs in its ring slots */
+	if (slot > SM_INLINE_HDR) {
+		sconn->irx_len = slot - SM_INLINE_HDR;
+		sconn->irxs = calloc(SM_INLINE_RX_CNT, sizeof(*sconn->irxs));
+		sconn->irx_buf = malloc(SM_INLINE_RX_CNT * sconn->irx_len);
+		if (!sconn->irxs || !sconn->irx_buf) {
+			ret = CCI_ENOMEM;
+			goto out;
+		}
+
+		for (i = 0; i < SM_INLINE_RX_CNT; i++) {
+			cci__evt_t *evt = &sconn->irxs[i];
+
+			evt->event.type = CCI_EVENT_RECV;
+			evt->event.recv.ptr = &sconn->irx_buf[i * sconn->irx_len];
+			evt->event.recv.connection = &sconn->conn->connection;
+			evt->ep = ep;
+			evt->conn = sconn->conn;
+			evt->priv = SM_INLINE;
+		}
+		for (i = 0; i < SM_INLINE_RX_CNT / 64; i++)
+			sconn->irxs_avail[i] = ~(0ULL);
+	}
 
+    rma:
 #if HAVE_XPMEM_H
 	if (sep->segid != (xpmem_segid_t) -1 && sconn->segid != (xpmem_segid_t) -1) {
 		sconn->apid = xpmem_get(sconn->segid, XPMEM_RDWR, XPMEM_PERMIT_MODE,
@@ -1129,20 +1670,17 @@ sm_map_conn(sm_ep_t *sep, sm_conn_t *sconn)
 		}
 	} else
 #endif
-	{
-		snprintf(rma_name, sizeof(rma_name), "%s-rma", name);
-		ret = open(rma_name, O_RDWR, 0666);
-		if (ret == -1) {
-			debug(CCI_DB_CONN, "%s: unable to open %s's "
-				"RMA mmap buf %s (%s)", __func__,
-				sconn->conn->uri, rma_name, strerror(errno));
+	/* with a pool, RMA needs CMA */
+	if (!sep->pool) {
+		if (!rma_fd || fstat(rma_fd, &st) ||
+			st.st_size < (off_t) sm_rma_buffer_len(1)) {
+			debug(CCI_DB_CONN, "%s: %s did not pass a usable "
+				"RMA mmap buf", __func__, sconn->conn->uri);
 			ret = EHOSTUNREACH;
 			goto out;
 		}
-		rma_fd = ret;
-		ret = 0;
-
-		len = sizeof(*sconn->peer_rma);
+		/* huge page backed buffers are rounded up */
+		len = (int) st.st_size;
 
 		/* MMAP the buffer */
 		sconn->peer_rma_mmap = mmap(NULL, len, PROT_READ|PROT_WRITE,
@@ -1156,8 +1694,30 @@ sm_map_conn(sm_ep_t *sep, sm_conn_t *sconn)
 			goto out;
 		}
 		sconn->peer_rma = sconn->peer_rma_mmap;
+		sconn->peer_rma_mmap_len = len;
+
+		sconn->peer_rma_pages = sconn->peer_rma->pages;
+		if (!sconn->peer_rma_pages ||
+			sconn->peer_rma_pages > SM_RMA_BUF_MAX / SM_RMA_MTU ||
+			(sconn->peer_rma_pages & (sconn->peer_rma_pages - 1)) ||
+			sm_rma_buffer_len(sconn->peer_rma_pages) > (size_t) len) {
+			debug(CCI_DB_CONN, "%s: %s passed a RMA mmap buf "
+				"of %u pages in %d bytes", __func__,
+				sconn->conn->uri, sconn->peer_rma_pages, len);
+			ret = EHOSTUNREACH;
+			goto out;
+		}
 	}
 
+	/* Both sides must offer CMA */
+	if (!sconn->peer_pid)
+		sconn->cma = 0;
+
+	/* Progress takes a set rx as the sign the peer's rings are mapped */
+	mb();
+	if (!sep->pool)
+		sconn->rx = sconn->peer_mmap;
+
     out:
 	if (msgs_fd)
 		close(msgs_fd);
@@ -1166,6 +1726,59 @@ sm_map_conn(sm_ep_t *sep, sm_conn_t *sconn)
 	return ret;
 }
 
+/* Send a handshake message to the peer's socket. Our buffers' fds ride
+ * along until the peer has them. Returns as sendmsg(). */
+static int
+sm_sendmsg(sm_ep_t *sep, sm_conn_t *sconn, struct iovec *iov, int iovcnt)
+{
+	int ret = 0, fds[2], cnt = 0;
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	union {
+		struct cmsghdr	cmsg;
+		char		buf[CMSG_SPACE(sizeof(fds))];
+	} ctl;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, sconn->name, strlen(sconn->name));
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sun;
+	msg.msg_namelen = sizeof(sun);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	if (sconn->msgs_fd) {
+		fds[cnt++] = sconn->msgs_fd;
+		if (sconn->rma_fd)
+			fds[cnt++] = sconn->rma_fd;
+	}
+	if (cnt) {
+		struct cmsghdr *cmsg = NULL;
+
+		memset(&ctl, 0, sizeof(ctl));
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = CMSG_SPACE(cnt * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(cnt * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, cnt * sizeof(int));
+	}
+
+	ret = sendmsg(sep->sock, &msg, 0);
+	if (ret != -1 && cnt) {
+		/* the message holds its own references */
+		close(sconn->msgs_fd);
+		sconn->msgs_fd = 0;
+		if (sconn->rma_fd)
+			close(sconn->rma_fd);
+		sconn->rma_fd = 0;
+	}
+	return ret;
+}
+
 static int ctp_sm_accept(cci_event_t *event, const void *context)
 {
 	int ret = 0, len = 0;
@@ -1175,8 +1788,7 @@ static int ctp_sm_accept(cci_event_t *event, const void *context)
 	sm_ep_t *sep = NULL;
 	sm_conn_t *sconn = NULL;
 	sm_conn_hdr_t hdr;
-	struct sockaddr_un sun;
-	socklen_t slen = sizeof(sun);
+	struct iovec iov;
 
 	CCI_ENTER;
 
@@ -1211,15 +1823,16 @@ static int ctp_sm_accept(cci_event_t *event, const void *context)
 	hdr.reply.status = CCI_SUCCESS;
 	hdr.reply.server_id = sconn->peer_id;
 	hdr.reply.client_id = sconn->id;
+	hdr.reply.pid = sconn->cma ? (uint32_t) getpid() : 0;
+	hdr.reply.rndv = ((sm_dev_t *)ep->dev->priv)->rndv;
 #if HAVE_XPMEM_H
 	hdr.reply.segid = sep->segid;
 #endif
 
-	memset(&sun, 0, slen);
-	sun.sun_family = AF_UNIX;
-	memcpy(sun.sun_path, sconn->name, strlen(sconn->name));
+	iov.iov_base = &hdr;
+	iov.iov_len = len;
 
-	ret = sendto(sep->sock, &hdr, len, 0, (struct sockaddr*)&sun, slen);
+	ret = sm_sendmsg(sep, sconn, &iov, 1);
 	if (ret == -1) {
 		switch (errno) {
 		case EAGAIN:
@@ -1243,9 +1856,7 @@ static int ctp_sm_accept(cci_event_t *event, const void *context)
 
 	sconn->state = SM_CONN_READY;
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
-	pthread_mutex_unlock(&ep->lock);
+	sm_queue_evt(ep, evt);
 
     out:
 	if (ret) {
@@ -1289,8 +1900,42 @@ sm_free_conn(cci__conn_t *conn)
 			}
 			sm_put_conn_id(sconn);
 		}
+		if (sconn->peer_doorbell)
+			munmap(sconn->peer_doorbell, sizeof(*sconn->peer_doorbell));
+		if (sconn->msgs_fd)
+			close(sconn->msgs_fd);
+		if (sconn->rma_fd)
+			close(sconn->rma_fd);
+		if (sconn->peer_msgs_fd)
+			close(sconn->peer_msgs_fd);
+		if (sconn->peer_rma_fd)
+			close(sconn->peer_rma_fd);
+		/* the memory goes away with the last mapping */
+		if (sconn->mmap)
+			munmap(sconn->mmap, sconn->mmap_len);
+		if (sconn->rma_mmap)
+			munmap(sconn->rma_mmap, sconn->rma_mmap_len);
+		if (sconn->peer_mmap && sconn->peer_mmap != MAP_FAILED)
+			munmap(sconn->peer_mmap, sconn->peer_mmap_len);
+		if (sconn->peer_rma_mmap && sconn->peer_rma_mmap != MAP_FAILED)
+			munmap(sconn->peer_rma_mmap, sconn->peer_rma_mmap_len);
+		while (!TAILQ_EMPTY(&sconn->rndvs)) {
+			sm_rndv_t *rndv = TAILQ_FIRST(&sconn->rndvs);
+
+			TAILQ_REMOVE(&sconn->rndvs, rndv, entry);
+			free(rndv);
+		}
+		if (sconn->rndv_rx) {
+			free(sconn->rndv_rx->rndv);
+			free(sconn->rndv_rx);
+		}
+		free(sconn->tx_spare);
+		free(sconn->rx_spare);
+		free(sconn->irxs);
+		free(sconn->irx_buf);
 		free(sconn->rxs);
 		free(sconn->txs);
+		free(sconn->rma_freed);
 		free(sconn);
 	}
 	free((void*)conn->uri);
@@ -1404,11 +2049,154 @@ sm_parse_uri(const char *uri, int *pidp, int *idp)
 	return ret;
 }
 
+/* Create and map a conn buffer of *lenp bytes. The handshake passes its
+ * fd to the peer, so nothing is left behind if either side dies. Prefer
+ * a memfd, on huge pages if the device asks for them (rounding *lenp
+ * up), else an unlinked file in our conns directory. */
+static int
+sm_create_buffer(cci__ep_t *ep, const char *name, size_t *lenp, void **addrp,
+		int *fdp)
+{
+	int ret = 0, fd = -1;
+	sm_dev_t *sdev = ep->dev->priv;
+	sm_ep_t *sep = ep->priv;
+	size_t len = *lenp;
+	void *addr = MAP_FAILED;
+
+#if SM_HAVE_MEMFD
+#ifdef MFD_HUGETLB
+	if (sdev->huge) {
+		size_t huge = (len + sdev->huge - 1) & ~(sdev->huge - 1);
+
+		fd = memfd_create(name, MFD_CLOEXEC | MFD_HUGETLB);
+		if (fd != -1 && !ftruncate(fd, huge))
+			addr = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+		if (addr != MAP_FAILED) {
+			len = huge;
+		} else {
+			debug(CCI_DB_CONN, "%s: no huge pages for %s (%s), "
+				"using small pages", __func__, name,
+				strerror(errno));
+			if (fd != -1)
+				close(fd);
+			fd = -1;
+		}
+	}
+#endif
+	if (fd == -1 && sdev->memfd) {
+		fd = memfd_create(name, MFD_CLOEXEC);
+		if (fd == -1)
+			debug(CCI_DB_WARN, "%s: memfd_create(%s) failed with %s",
+				__func__, name, strerror(errno));
+	}
+#endif
+	if (fd == -1) {
+		char path[MAXPATHLEN];
+
+		snprintf(path, sizeof(path), "%s/%u/conns/%s", sdev->path,
+				sep->id, name);
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd == -1) {
+			debug(CCI_DB_WARN, "%s: open(%s) failed with %s",
+				__func__, path, strerror(errno));
+			return CCI_ERROR;
+		}
+		/* the peer gets the fd, not the name */
+		unlink(path);
+	}
+
+	if (addr == MAP_FAILED) {
+		ret = ftruncate(fd, len);
+		if (ret) {
+			debug(CCI_DB_WARN, "%s: ftruncate(%s, %zu) failed with %s",
+				__func__, name, len, strerror(errno));
+			ret = CCI_ERROR;
+			goto out;
+		}
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			debug(CCI_DB_WARN, "%s: mmap(%s) failed with %s",
+				__func__, name, strerror(errno));
+			ret = CCI_ERROR;
+			goto out;
+		}
+	}
+
+	*lenp = len;
+	*addrp = addr;
+	*fdp = fd;
+
+    out:
+	if (ret)
+		close(fd);
+	return ret;
+}
+
+/* Create our receive pool, all slots free. Each peer maps it once per
+ * conn, so the shared memory grows with the number of peers, not with
+ * the number of conns between them. */
+static int
+sm_create_pool(cci__ep_t *ep)
+{
+	int ret = 0, fd = 0;
+	sm_dev_t *sdev = ep->dev->priv;
+	sm_ep_t *sep = ep->priv;
+	uint32_t slots = sdev->pool, i = 0;
+	uint32_t slot_len = sm_pool_slot_len(ep->dev->device.max_send_size);
+	size_t len = sm_pool_len(slots, slot_len);
+	void *addr = NULL;
+	sm_pool_t *pool = NULL;
+
+	sep->prxs = calloc(slots, sizeof(*sep->prxs));
+	sep->ptxs = calloc(SM_EP_TX_CNT, sizeof(*sep->ptxs));
+	if (!sep->prxs || !sep->ptxs)
+		return CCI_ENOMEM;
+
+	ret = sm_create_buffer(ep, "pool", &len, &addr, &fd);
+	if (ret)
+		return ret;
+
+	pool = addr;
+	pool->slots = slots;
+	pool->slot_len = slot_len;
+	pool->credits = sdev->credits;
+	ring_init(sm_pool_inbox(pool), slots);
+	ring_init(sm_pool_free(pool), slots);
+	for (i = 0; i < slots; i++)
+		ring_insert(sm_pool_free(pool), i);
+
+	for (i = 0; i < slots; i++) {
+		cci__evt_t *evt = &sep->prxs[i];
+
+		evt->event.type = CCI_EVENT_RECV;
+		evt->event.recv.ptr = sm_pool_slot(pool, i) + SM_POOL_HDR;
+		evt->ep = ep;
+		evt->priv = SM_POOL;
+	}
+
+	for (i = 0; i < SM_EP_TX_CNT; i++) {
+		cci__evt_t *evt = &sep->ptxs[i];
+
+		evt->event.type = CCI_EVENT_SEND;
+		evt->ep = ep;
+		evt->priv = (void*)SM_SET_TX(i);
+	}
+	for (i = 0; i < SM_EP_TX_CNT / 64; i++)
+		sep->ptxs_avail[i] = ~(0ULL);
+
+	sep->pool = pool;
+	sep->pool_len = len;
+	sep->pool_fd = fd;
+
+	return CCI_SUCCESS;
+}
+
 static int
 sm_create_conn(cci__ep_t *ep, const char *uri, cci__conn_t **connp)
 {
-	int ret = 0, peer_pid = 0, peer_id = 0, len = 0, i = 0;
-	int msgs_fd = 0, rma_fd = 0;
+	int ret = 0, peer_pid = 0, peer_id = 0, i = 0;
+	size_t len = 0;
 	cci__conn_t *conn = NULL;
 	cci__dev_t *dev = ep->dev;
 	sm_dev_t *sdev = dev->priv;
@@ -1446,39 +2234,33 @@ sm_create_conn(cci__ep_t *ep, const char *uri, cci__conn_t **connp)
 
 	sconn->conn = conn;
 	sconn->id = -1;		/* for now, to aid in cleanup */
+	sconn->cma = sdev->cma;
+	TAILQ_INIT(&sconn->rndvs);
+	TAILQ_INIT(&sconn->rma_waits);
+	pthread_mutex_init(&sconn->tx_lock, NULL);
+	pthread_mutex_init(&sconn->rma_lock, NULL);
 	ret = sm_get_conn_id(sconn);
 	if (ret) goto out;
 
-	sconn->rxs = calloc(64, sizeof(*sconn->rxs));
-	if (!sconn->rxs) {
-		ret = CCI_ENOMEM;
-		goto out;
-	}
-
-	for (i = 0; i < 64; i++) {
-		cci__evt_t *evt = &sconn->rxs[i];
-
-		evt->event.type = CCI_EVENT_RECV;
-		evt->event.recv.connection = &conn->connection;
-		evt->ep = ep;
-		evt->conn = conn;
-	}
-
-	sconn->txs_avail = ~(0ULL);
+	/* with a pool, the SEND events are the endpoint's */
+	if (!sep->pool) {
+		for (i = 0; i < SM_CONN_TX_CNT / 64; i++)
+			sconn->txs_avail[i] = ~(0ULL);
 
-	sconn->txs = calloc(64, sizeof(*sconn->txs));
-	if (!sconn->txs) {
-		ret = CCI_ENOMEM;
-		goto out;
-	}
+		sconn->txs = calloc(SM_CONN_TX_CNT, sizeof(*sconn->txs));
+		if (!sconn->txs) {
+			ret = CCI_ENOMEM;
+			goto out;
+		}
 
-	for (i = 0; i < 64; i++) {
-		cci__evt_t *evt = &sconn->txs[i];
+		for (i = 0; i < SM_CONN_TX_CNT; i++) {
+			cci__evt_t *evt = &sconn->txs[i];
 
-		evt->event.type = CCI_EVENT_SEND;
-		evt->ep = ep;
-		evt->conn = conn;
-		evt->priv = (void*)SM_SET_TX(i);
+			evt->event.type = CCI_EVENT_SEND;
+			evt->ep = ep;
+			evt->conn = conn;
+			evt->priv = (void*)SM_SET_TX(i);
+		}
 	}
 
 	path = uri + 5; /* sm:// */
@@ -1500,91 +2282,92 @@ sm_create_conn(cci__ep_t *ep, const char *uri, cci__conn_t **connp)
 	}
 	sconn->fifo = ret;
 
-	/* Open our shared memory object for MSGs */
+	/* Map their doorbell */
 	memset(name, 0, sizeof(name));
-	snprintf(name, sizeof(name), "%s/%u/conns/%d", sdev->path, sep->id, sconn->id);
-	ret = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	snprintf(name, sizeof(name), "%s/doorbell", path);
+	ret = open(name, O_RDWR);
 	if (ret == -1) {
-		debug(CCI_DB_CONN, "%s: unable to open %s's mmap buf", __func__, uri);
+		debug(CCI_DB_CONN, "%s: unable to open %s's doorbell", __func__, uri);
 		ret = EHOSTUNREACH;
 		goto out;
 	}
-	msgs_fd = ret;
-
-	len = sizeof(*sconn->tx);
-
-	ret = ftruncate(msgs_fd, len);
-	if (ret) {
-		debug(CCI_DB_WARN, "%s: ftruncate(%s, %d) failed with %s", __func__,
-				name, len, strerror(errno));
-		ret = CCI_ERROR;
-		goto out;
-	}
-
-	/* MMAP the buffer */
-	sconn->mmap = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, msgs_fd, 0);
-	close(msgs_fd);
-	msgs_fd = 0;
-	if (sconn->mmap == MAP_FAILED) {
-		debug(CCI_DB_WARN, "%s: mmap() failed with %s", __func__,
+	sconn->peer_doorbell = mmap(NULL, sizeof(*sconn->peer_doorbell),
+			PROT_READ | PROT_WRITE, MAP_SHARED, ret, 0);
+	close(ret);
+	if (sconn->peer_doorbell == MAP_FAILED) {
+		debug(CCI_DB_WARN, "%s: mmap() doorbell failed with %s", __func__,
 				strerror(errno));
+		sconn->peer_doorbell = NULL;
 		ret = CCI_ERROR;
 		goto out;
 	}
 
-	sconn->tx = sconn->mmap;
-	/* We can just set this and rely on ring_init() to call
-	 * a memory barrier.
-	 */
-	sconn->tx->avail = ~(0ULL);
-	ring_init(&(sconn->tx->ring), 64); /* magic number */
-
-
-#if HAVE_XPMEM_H
-	if (sep->segid != -1) {
-	} else
-#endif /* HAVE_XPMEM_H */
-	{
-		/* Open our shared memory object for RMA */
-		memset(name, 0, sizeof(name));
-		snprintf(name, sizeof(name), "%s/%u/conns/%d-rma",
-				sdev->path, sep->id, sconn->id);
-		ret = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (sep->pool) {
+		/* the peer gets our pool instead */
+		ret = fcntl(sep->pool_fd, F_DUPFD_CLOEXEC, 0);
 		if (ret == -1) {
-			debug(CCI_DB_CONN, "%s: unable to open %s's RMA mmap buf",
-				__func__, uri);
-			ret = EHOSTUNREACH;
+			debug(CCI_DB_WARN, "%s: dup(pool) failed with %s",
+				__func__, strerror(errno));
+			ret = CCI_ERROR;
 			goto out;
 		}
-		rma_fd = ret;
+		sconn->msgs_fd = ret;
+	} else {
+		/* Create our shared memory object for MSGs */
+		memset(name, 0, sizeof(name));
+		snprintf(name, sizeof(name), "%d", sconn->id);
+		len = sm_conn_buffer_len(sdev->msg_lines, sdev->ring_depth,
+				sdev->ring_slot);
+		ret = sm_create_buffer(ep, name, &len, &sconn->mmap,
+				&sconn->msgs_fd);
+		if (ret)
+			goto out;
+		sconn->mmap_len = len;
+
+		sconn->tx = sconn->mmap;
+		sconn->tx_lines = sdev->msg_lines;
+		sconn->tx_buf = sm_conn_buf(sconn->tx, sconn->tx_lines);
+		sconn->tx_freed = sm_conn_freed(sconn->tx);
+		sconn->tx_ring = sm_conn_ring(sconn->tx, sconn->tx_lines);
+		/* We can just set this and rely on ring_spsc_init() to call
+		 * a memory barrier. The new buffer's bitmap is clear.
+		 */
+		sconn->tx->lines = sconn->tx_lines;
+		ring_spsc_wide_init(sconn->tx_ring, sdev->ring_depth,
+				sdev->ring_slot);
+		if (sdev->ring_slot > SM_INLINE_HDR)
+			sconn->tx_inline = sdev->ring_slot - SM_INLINE_HDR;
 
-		len = sizeof(*sconn->rma);
 
-		ret = ftruncate(rma_fd, len);
-		if (ret) {
-			debug(CCI_DB_WARN, "%s: ftruncate(%s, %d) failed with %s",
-				__func__, name, len, strerror(errno));
-			ret = CCI_ERROR;
-			goto out;
-		}
+#if HAVE_XPMEM_H
+		if (sep->segid != -1) {
+		} else
+#endif /* HAVE_XPMEM_H */
+		{
+			/* Create our shared memory object for RMA */
+			memset(name, 0, sizeof(name));
+			snprintf(name, sizeof(name), "%d-rma", sconn->id);
+			sconn->rma_mmap_len = sm_rma_buffer_len(sdev->rma_pages);
+			ret = sm_create_buffer(ep, name, &sconn->rma_mmap_len,
+					&sconn->rma_mmap, &sconn->rma_fd);
+			if (ret)
+				goto out;
 
-		/* MMAP the RMA buffer */
-		sconn->rma_mmap = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, rma_fd, 0);
-		close(rma_fd);
-		rma_fd = 0;
-		if (sconn->rma_mmap == MAP_FAILED) {
-			debug(CCI_DB_WARN, "%s: mmap() RMA failed with %s",
-				__func__, strerror(errno));
-			ret = CCI_ERROR;
-			goto out;
-		}
+			sconn->rma_freed = calloc((sdev->rma_pages + 63) / 64,
+					sizeof(*sconn->rma_freed));
+			if (!sconn->rma_freed) {
+				ret = CCI_ENOMEM;
+				goto out;
+			}
+			sconn->rma_pages = sdev->rma_pages;
 
-		sconn->rma = sconn->rma_mmap;
-		/* We can just set this and rely on ring_init() to call
-		 * a memory barrier.
-		 */
-		sconn->rma->avail = ~(0ULL);
-		ring_init(&(sconn->rma->ring), 64); /* magic number */
+			sconn->rma = sconn->rma_mmap;
+			/* We can just set this and rely on ring_spsc_init()
+			 * to call a memory barrier.
+			 */
+			sconn->rma->pages = sdev->rma_pages;
+			ring_spsc_init(sm_rma_ring(sconn->rma), SM_RMA_RING_DEPTH);
+		}
 	}
 
 	/* Add new conn to the conns tree */
@@ -1620,17 +2403,20 @@ sm_create_conn(cci__ep_t *ep, const char *uri, cci__conn_t **connp)
 
     out:
 	if (ret) {
-		if (msgs_fd)
-			close(msgs_fd);
-		if (rma_fd)
-			close(rma_fd);
 		if (sconn) {
+			if (sconn->msgs_fd)
+				close(sconn->msgs_fd);
+			if (sconn->rma_fd)
+				close(sconn->rma_fd);
 			if (sconn->mmap)
-				munmap(sconn->mmap, len);
+				munmap(sconn->mmap, sconn->mmap_len);
 			if (sconn->rma_mmap)
-				munmap(sconn->rma_mmap, len);
+				munmap(sconn->rma_mmap, sconn->rma_mmap_len);
 			if (sconn->fifo)
 				close(sconn->fifo);
+			if (sconn->peer_doorbell)
+				munmap(sconn->peer_doorbell,
+					sizeof(*sconn->peer_doorbell));
 			free(sconn->name);
 			sm_put_conn_id(sconn);
 			free(sconn);
@@ -1655,9 +2441,7 @@ static int ctp_sm_connect(cci_endpoint_t * endpoint, const char *server_uri,
 	sm_conn_t *sconn = NULL;
 	sm_conn_params_t *params = NULL;
 	sm_conn_hdr_t hdr;
-	struct sockaddr_un sun;
 	struct iovec iov[2];
-	struct msghdr msg;
 
 	CCI_ENTER;
 
@@ -1688,15 +2472,14 @@ static int ctp_sm_connect(cci_endpoint_t * endpoint, const char *server_uri,
 	}
 	params->flags = flags;
 
-	memset(&sun, 0, sizeof(sun));
-	sun.sun_family = AF_UNIX;
-	memcpy(sun.sun_path, sconn->name, strlen(sconn->name));
-
 	memset(&hdr, 0, sizeof(hdr.connect));
 	hdr.connect.type = SM_CMSG_CONNECT;
 	hdr.connect.version = 0;
 	hdr.connect.len = data_len;
 	hdr.connect.server_id = sconn->id;
+	hdr.connect.pool = sep->pool != NULL;
+	hdr.connect.pid = sconn->cma ? (uint32_t) getpid() : 0;
+	hdr.connect.rndv = ((sm_dev_t *)ep->dev->priv)->rndv;
 #if HAVE_XPMEM_H
 	hdr.connect.segid = sep->segid;
 #endif
@@ -1707,13 +2490,7 @@ static int ctp_sm_connect(cci_endpoint_t * endpoint, const char *server_uri,
 	iov[1].iov_base = params->data_ptr;
 	iov[1].iov_len = params->data_len;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name = &sun;
-	msg.msg_namelen = sizeof(sun);
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 2;
-
-	ret = sendmsg(sep->sock, &msg, 0);
+	ret = sm_sendmsg(sep, sconn, iov, 2);
 	if (ret == -1) {
 		switch (errno) {
 		case ENOENT:
@@ -1780,19 +2557,41 @@ static int ctp_sm_get_opt(cci_opt_handle_t * handle,
 
 static int ctp_sm_arm_os_handle(cci_endpoint_t * endpoint, int flags)
 {
+	int ret = CCI_SUCCESS;
+	cci__ep_t *ep = container_of(endpoint, cci__ep_t, endpoint);
+	sm_ep_t *sep = ep->priv;
+
 	CCI_ENTER;
 
-	debug(CCI_DB_INFO, "%s", "In sm_arm_os_handle\n");
+	/* the handle stays readable while events are queued, nothing to do */
+	if (!sep->pipe[0])
+		ret = CCI_EINVAL;
 
 	CCI_EXIT;
-	return CCI_ERR_NOT_IMPLEMENTED;
+	return ret;
+}
+
+/* MSGs beyond the MSS go by rendezvous, up to the smaller of the two
+ * peers' rndv settings */
+static void
+sm_set_max_send(cci__conn_t *conn, uint32_t peer_rndv)
+{
+	cci__ep_t *ep = container_of(conn->connection.endpoint, cci__ep_t, endpoint);
+	uint32_t rndv = ((sm_dev_t *)ep->dev->priv)->rndv;
+
+	if (peer_rndv < rndv)
+		rndv = peer_rndv;
+	if (rndv > conn->connection.max_send_size)
+		conn->connection.max_send_size = rndv;
 }
 
 static int
-sm_handle_connect(cci__ep_t *ep, const char *path, void *buffer, int len)
+sm_handle_connect(cci__ep_t *ep, const char *path, void *buffer, int len,
+		int *fds)
 {
 	int ret = 0;
 	cci__conn_t *conn = NULL;
+	sm_ep_t *sep = ep->priv;
 	sm_conn_t *sconn = NULL;
 	sm_conn_hdr_t *hdr = buffer;
 	cci__evt_t *rx = NULL;
@@ -1838,13 +2637,27 @@ sm_handle_connect(cci__ep_t *ep, const char *path, void *buffer, int len)
 	sconn = conn->priv;
 	sconn->state = SM_CONN_PASSIVE;
 	sconn->peer_id = hdr->connect.server_id;
+	sconn->peer_pid = (pid_t) hdr->connect.pid;
+	sconn->peer_msgs_fd = fds[0];
+	sconn->peer_rma_fd = fds[1];
+	fds[0] = fds[1] = 0;
+	sm_set_max_send(conn, hdr->connect.rndv);
 #if HAVE_XPMEM_H
 	sconn->segid = hdr->connect.segid;
 #endif
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_TAIL(&ep->evts, rx, entry);
-	pthread_mutex_unlock(&ep->lock);
+	/* Both sides use a receive pool, or neither */
+	if (hdr->connect.pool != (sep->pool != NULL)) {
+		debug(CCI_DB_CONN, "%s: %s %s a receive pool, rejecting",
+			__func__, uri, hdr->connect.pool ? "uses" :
+			"does not use");
+		ctp_sm_reject(&rx->event);
+		conn = NULL;
+		ret = CCI_ECONNREFUSED;
+		goto out;
+	}
+
+	sm_queue_evt(ep, rx);
 
     out:
 	if (ret) {
@@ -1899,7 +2712,7 @@ sm_find_conn(cci__ep_t *ep, int id, cci__conn_t **connp)
 }
 
 static int
-sm_handle_connect_reply(cci__ep_t *ep, void *buffer)
+sm_handle_connect_reply(cci__ep_t *ep, void *buffer, int *fds)
 {
 	int ret = 0, id = 0, len = 0;
 	cci__evt_t *evt = NULL;
@@ -1944,6 +2757,11 @@ sm_handle_connect_reply(cci__ep_t *ep, void *buffer)
 
 	if (hdr->reply.status == CCI_SUCCESS) {
 		sconn->peer_id = hdr->reply.client_id;
+		sconn->peer_pid = (pid_t) hdr->reply.pid;
+		sconn->peer_msgs_fd = fds[0];
+		sconn->peer_rma_fd = fds[1];
+		fds[0] = fds[1] = 0;
+		sm_set_max_send(conn, hdr->reply.rndv);
 #if HAVE_XPMEM_H
 		sconn->segid = hdr->reply.segid;
 #endif
@@ -1959,9 +2777,7 @@ sm_handle_connect_reply(cci__ep_t *ep, void *buffer)
 		sm_free_conn(conn);
 	}
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
-	pthread_mutex_unlock(&ep->lock);
+	sm_queue_evt(ep, evt);
 
 	hdr->ack.type = SM_CMSG_CONN_ACK;
 	hdr->ack.pad = 0;
@@ -2005,20 +2821,36 @@ sm_handle_connect_ack(cci__ep_t *ep, void *buffer)
 static int
 sm_progress_sock(cci__ep_t *ep)
 {
-	int ret = 0, len = 0;
+	int ret = 0, len = 0, fds[2] = { 0, 0 };
 	sm_ep_t *sep = ep->priv;
 	sm_conn_hdr_t *hdr = NULL;
 	struct sockaddr_un sun;
-	socklen_t slen = sizeof(sun);
 	char buffer[1024 + sizeof(*hdr)];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg = NULL;
+	union {
+		struct cmsghdr	cmsg;
+		char		buf[CMSG_SPACE(sizeof(fds))];
+	} ctl;
 
-	memset(&sun, 0, slen);
+	memset(&sun, 0, sizeof(sun));
+
+	iov.iov_base = buffer;
+	iov.iov_len = sizeof(buffer);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sun;
+	msg.msg_namelen = sizeof(sun);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
 
-	ret = recvfrom(sep->sock, buffer, sizeof(buffer), 0, (struct sockaddr*)&sun, &slen);
+	ret = recvmsg(sep->sock, &msg, MSG_CMSG_CLOEXEC);
 	if (ret == -1) {
 		ret = errno;
 		if (ret != EAGAIN)
-			debug(CCI_DB_CONN, "%s: recvfrom() failed with %s",
+			debug(CCI_DB_CONN, "%s: recvmsg() failed with %s",
 					__func__, strerror(ret));
 		goto out;
 	}
@@ -2026,16 +2858,27 @@ sm_progress_sock(cci__ep_t *ep)
 	hdr = (void*)buffer;
 	len = ret;
 
+	/* The peer's buffers, MSGs first, that the handlers take over */
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS) {
+			int cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+			memcpy(fds, CMSG_DATA(cmsg),
+				(cnt < 2 ? cnt : 2) * sizeof(int));
+		}
+	}
+
 	debug(CCI_DB_CONN, "%s: recv'd %s with %d bytes from sm://%s", __func__,
 		sm_conn_msg_str(hdr->generic.type), len, sun.sun_path);
 
 	switch (hdr->generic.type) {
 	case SM_CMSG_CONNECT:
 		len -= sizeof(hdr->connect);
-		ret = sm_handle_connect(ep, sun.sun_path, buffer, len);
+		ret = sm_handle_connect(ep, sun.sun_path, buffer, len, fds);
 		break;
 	case SM_CMSG_CONN_REPLY:
-		ret = sm_handle_connect_reply(ep, buffer);
+		ret = sm_handle_connect_reply(ep, buffer, fds);
 		break;
 	case SM_CMSG_CONN_ACK:
 		ret = sm_handle_connect_ack(ep, buffer);
@@ -2048,6 +2891,10 @@ sm_progress_sock(cci__ep_t *ep)
 	}
 
     out:
+	if (fds[0])
+		close(fds[0]);
+	if (fds[1])
+		close(fds[1]);
 	return ret;
 }
 
@@ -2084,22 +2931,120 @@ sm_write(cci__ep_t *ep, cci__conn_t *conn, void *buf, int len)
 	return ret;
 }
 
+/* Take the first set bit of a bitmap of words words, or return -1 */
+static int
+sm_get_bit(uint64_t *bitmap, int words)
+{
+	int idx = 0, i = 0;
+	uint64_t avail = 0, new = 0;
+
+	for (i = 0; i < words; i++) {
+    again:
+		avail = read_u64(&bitmap[i], __ATOMIC_RELAXED);
+		if (!avail)
+			continue;
+		idx = ffsll(avail) - 1; /* convert to 0-based index */
+		new = ~(1ULL << idx) & avail;
+		if (compare_and_swap_u64(&bitmap[i], avail, new,
+					__ATOMIC_SEQ_CST))
+			return (i * 64) + idx;
+		else
+			goto again;
+	}
+
+	return -1;
+}
+
+static void
+sm_put_bit(uint64_t *bitmap, int idx)
+{
+	uint64_t avail = 0, new = 0;
+
+    again:
+	avail = read_u64(&bitmap[idx / 64], __ATOMIC_RELAXED);
+	new = (1ULL << (idx % 64)) | avail;
+	if (!compare_and_swap_u64(&bitmap[idx / 64], avail, new,
+				__ATOMIC_SEQ_CST)) {
+		goto again;
+	}
+
+	return;
+}
+
+#if SM_HAVE_CMA
+/* Copy len bytes between our buffer and the peer's address with
+ * process_vm_writev() or process_vm_readv(), without the peer's help.
+ * Returns CCI_ERR_NOT_IMPLEMENTED if the kernel does not let us attach
+ * to the peer, in which case the conn falls back to the RMA buffers. */
+static int
+sm_cma_copy(sm_conn_t *sconn, void *local_addr, uint64_t remote_addr,
+		uint64_t len, int write)
+{
+	struct iovec local, remote;
+	ssize_t rc = 0;
+	int err = 0;
+
+	while (len) {
+		local.iov_base = local_addr;
+		local.iov_len = len;
+		remote.iov_base = (void *)((uintptr_t)remote_addr);
+		remote.iov_len = len;
+
+		if (write)
+			rc = process_vm_writev(sconn->peer_pid, &local, 1,
+					&remote, 1, 0);
+		else
+			rc = process_vm_readv(sconn->peer_pid, &local, 1,
+					&remote, 1, 0);
+		if (rc == -1) {
+			err = errno;
+			if (err == EINTR)
+				continue;
+			if (err == EPERM || err == ENOSYS) {
+				debug(CCI_DB_WARN, "%s: CMA to %s failed with %s, "
+					"using the RMA buffers", __func__,
+					sconn->conn->uri, strerror(err));
+				sconn->cma = 0;
+				return CCI_ERR_NOT_IMPLEMENTED;
+			}
+			debug(CCI_DB_MSG, "%s: CMA %s %s failed with %s",
+				__func__, write ? "write to" : "read from",
+				sconn->conn->uri, strerror(err));
+			return err == ESRCH ? CCI_ERR_DISCONNECTED :
+				CCI_ERR_RMA_HANDLE;
+		}
+		/* the kernel may stop early, e.g. at an unmapped page */
+		local_addr = (void *)((uintptr_t)local_addr + rc);
+		remote_addr += rc;
+		len -= rc;
+	}
+
+	return CCI_SUCCESS;
+}
+#endif /* SM_HAVE_CMA */
+
 static int
 sm_handle_send(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
 {
 	int ret = 0;
 	sm_conn_t *sconn = conn->priv;
-	cci__evt_t *evt = &sconn->rxs[hdr->send.offset];
+	cci__evt_t *evt = NULL;
+
+	if (hdr->send.offset + sm_msg_lines(hdr->send.len) > sconn->rx_lines) {
+		debug(CCI_DB_MSG, "%s: SEND from %s (offset %u len %u) exceeds "
+			"its buffer", __func__, conn->uri, hdr->send.offset,
+			hdr->send.len);
+		return CCI_ERROR;
+	}
 
+	evt = &sconn->rxs[hdr->send.offset];
 	/* evt->event.type = CCI_EVENT_RECV; */
-	evt->event.recv.ptr = &sconn->rx->buf[hdr->send.offset * SM_LINE];
+	evt->event.recv.ptr = &sconn->rx_buf[hdr->send.offset * SM_LINE];
 	evt->event.recv.len = hdr->send.len;
 	/* evt->event.recv.connection = &conn->connection; */
 	evt->priv = (void*)((uintptr_t) hdr->send.offset);
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
-	pthread_mutex_unlock(&ep->lock);
+	sm_queue_evt(ep, evt);
 
 	debug(CCI_DB_MSG, "%s: received SEND from %s (offset %u) len %u",
 		__func__, conn->uri, hdr->send.offset, hdr->send.len);
@@ -2108,81 +3053,302 @@ sm_handle_send(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
 }
 
 static int
-sm_handle_rma_write(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
+sm_progress_rma(sm_rma_t *rma);
+
+/* Each conn keeps the last freed rndv of each direction, a large
+ * malloc() is a fresh mmap() whose pages fault in again. Returns a
+ * cleared rndv with room for size bytes. */
+static sm_rndv_t *
+sm_get_rndv(sm_rndv_t **spare, uint32_t size)
 {
-	int ret = 0;
-	sm_conn_t *sconn = conn->priv;
-	sm_rma_hdr_t *rma_hdr = (void*) &sconn->peer_rma->hdr[hdr->rma.offset * SM_LINE];
-	void *src = NULL, *dst = NULL;
-	sm_rma_handle_t *h = (void*) ((uintptr_t)rma_hdr->remote_handle);
-	sm_hdr_t ack;
+	sm_rndv_t *rndv = __sync_lock_test_and_set(spare, NULL);
 
-	if (rma_hdr->remote_offset + rma_hdr->len > h->len) {
-		/* exceeds RMA registration length, return error */
-		ret = CCI_ERR_RMA_HANDLE;
-		goto out;
+	if (rndv && rndv->size < size) {
+		free(rndv);
+		rndv = NULL;
+	}
+	if (!rndv) {
+		rndv = malloc(sizeof(*rndv) + size);
+		if (!rndv)
+			return NULL;
+		rndv->size = size;
 	}
+	size = rndv->size;
+	memset(rndv, 0, sizeof(*rndv));
+	rndv->size = size;
 
-	src = (void*)&sconn->peer_rma->buf[hdr->rma.offset * SM_RMA_MTU];
-	dst = (void*)((uintptr_t)h->addr + (uintptr_t)rma_hdr->remote_offset);
-	memcpy(dst, src, rma_hdr->len);
+	return rndv;
+}
 
-    out:
-	ack.rma_ack.type = SM_MSG_RMA_ACK;
-	ack.rma_ack.offset = hdr->rma.offset;
-	ack.rma_ack.status = ret;
-	mb();
+static void
+sm_put_rndv(sm_rndv_t **spare, sm_rndv_t *rndv)
+{
+	free(__sync_lock_test_and_set(spare, rndv));
+}
 
-    again:
-	ret = ring_insert(&sconn->rma->ring, *((uint32_t*)&ack.u32));
-	if (ret)
-		goto again;
+/* Hand a pulled rendezvous MSG to the app, or drop it, and tell the
+ * sender it may release the descriptor and its payload. */
+static void
+sm_finish_rndv(cci__ep_t *ep, cci__conn_t *conn, uint32_t offset,
+		sm_rndv_t *rndv, int status)
+{
+	sm_conn_t *sconn = conn->priv;
+	sm_rndv_desc_t *desc = (void *)&sconn->rx_buf[offset * SM_LINE];
 
-	return ret;
+	if (status) {
+		debug(CCI_DB_MSG, "%s: dropping rendezvous SEND from %s (%s)",
+			__func__, conn->uri, cci_strerror(&ep->endpoint, status));
+		if (rndv)
+			sm_put_rndv(&sconn->rx_spare, rndv);
+	} else {
+		sm_queue_evt(ep, &rndv->evt);
+	}
+
+	desc->status = status;
+	store_release_u32(&desc->done, 1);
+	sm_ring_doorbell(sconn);
 }
 
+/* Pull a rendezvous MSG's payload into a buffer of our own, with CMA or
+ * else through the RMA buffers. The MSG ring stays paused until the
+ * read completes, so MSGs are still delivered in order. */
 static int
-sm_handle_rma_read(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
+sm_handle_rndv(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
 {
 	int ret = 0;
 	sm_conn_t *sconn = conn->priv;
-	sm_rma_hdr_t *rma_hdr = (void*) &sconn->peer_rma->hdr[hdr->rma.offset * SM_LINE];
-	void *src = NULL, *dst = NULL;
-	sm_rma_handle_t *h = (void*) ((uintptr_t)rma_hdr->remote_handle);
-	sm_hdr_t ack;
+	sm_rndv_desc_t *desc = NULL;
+	sm_rndv_t *rndv = NULL;
+	sm_rma_t *rma = NULL;
+	uint32_t len = 0;
 
-	if (rma_hdr->remote_offset + rma_hdr->len > h->len) {
-		/* exceeds RMA registration length, return error */
-		ret = CCI_ERR_RMA_HANDLE;
-		goto out;
+	if (hdr->send.offset >= sconn->rx_lines) {
+		debug(CCI_DB_MSG, "%s: rendezvous SEND from %s (offset %u) "
+			"exceeds its buffer", __func__, conn->uri,
+			hdr->send.offset);
+		return CCI_ERROR;
+	}
+
+	desc = (void *)&sconn->rx_buf[hdr->send.offset * SM_LINE];
+	len = desc->len;
+
+	debug(CCI_DB_MSG, "%s: received rendezvous SEND from %s (offset %u) "
+		"len %u", __func__, conn->uri, hdr->send.offset, len);
+
+	if (len > conn->connection.max_send_size) {
+		ret = CCI_EMSGSIZE;
+		goto out;
+	}
+
+	rndv = sm_get_rndv(&sconn->rx_spare, len);
+	if (!rndv) {
+		ret = CCI_ERR_RNR;
+		goto out;
+	}
+	rndv->evt.event.recv.type = CCI_EVENT_RECV;
+	rndv->evt.event.recv.ptr = rndv->buf;
+	rndv->evt.event.recv.len = len;
+	rndv->evt.event.recv.connection = &conn->connection;
+	rndv->evt.ep = ep;
+	rndv->evt.conn = conn;
+	rndv->evt.priv = SM_RNDV;
+	rndv->handle.ep = ep;
+	rndv->handle.addr = rndv->buf;
+	rndv->handle.len = len;
+	rndv->offset = hdr->send.offset;
+
+#if SM_HAVE_CMA
+	if (sconn->cma) {
+		ret = sm_cma_copy(sconn, rndv->buf, desc->addr, len, 0);
+		if (ret != CCI_ERR_NOT_IMPLEMENTED)
+			goto out;
+		ret = 0;
+	}
+#endif
+
+	rma = calloc(1, sizeof(*rma));
+	if (!rma) {
+		ret = CCI_ERR_RNR;
+		goto out;
+	}
+	rma->evt.event.send.type = CCI_EVENT_SEND;
+	rma->evt.event.send.status = CCI_SUCCESS;
+	rma->evt.event.send.connection = &conn->connection;
+	rma->evt.ep = ep;
+	rma->evt.conn = conn;
+	rma->evt.priv = rma;
+	rma->hdr.local_handle = (uintptr_t)&rndv->handle;
+	rma->hdr.remote_handle = desc->handle;
+	rma->hdr.len = len;
+	rma->hdr.rma = (uintptr_t)rma;
+	rma->flags = CCI_FLAG_READ | CCI_FLAG_SILENT;
+	rma->rndv = rndv;
+
+	/* with the RMA buffers full, progress tries again */
+	sconn->rndv_rx = rma;
+	sm_progress_rma(rma);
+
+	return CCI_SUCCESS;
+
+    out:
+	sm_finish_rndv(ep, conn, hdr->send.offset, rndv, ret);
+	return CCI_SUCCESS;
+}
+
+/* Copy a MSG out of the peer's ring slot into one of our inline RECVs.
+ * Returns CCI_EAGAIN while the app holds all of them. */
+static int
+sm_handle_inline(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
+{
+	sm_conn_t *sconn = conn->priv;
+	cci__evt_t *evt = NULL;
+	int idx = 0;
+
+	if (hdr->send.len > sconn->irx_len) {
+		debug(CCI_DB_MSG, "%s: inline SEND from %s (len %u) exceeds "
+			"its slot", __func__, conn->uri, hdr->send.len);
+		return CCI_ERROR;
+	}
+
+	idx = sm_get_bit(sconn->irxs_avail, SM_INLINE_RX_CNT / 64);
+	if (idx == -1) {
+		sconn->irx_starved = 1;
+		return CCI_EAGAIN;
+	}
+	sconn->irx_starved = 0;
+
+	evt = &sconn->irxs[idx];
+	memcpy(*((void **)&evt->event.recv.ptr),
+		(char *)hdr + SM_INLINE_HDR, hdr->send.len);
+	evt->event.recv.len = hdr->send.len;
+
+	sm_queue_evt(ep, evt);
+
+	debug(CCI_DB_MSG, "%s: received inline SEND from %s len %u",
+		__func__, conn->uri, hdr->send.len);
+
+	return CCI_SUCCESS;
+}
+
+/* Post a header to our RMA ring. Our fragments and our acks of the
+ * peer's fragments share it and the ring is deep enough for both, so
+ * it is only full while the peer catches up. */
+static void
+sm_post_rma_hdr(sm_conn_t *sconn, sm_hdr_t *hdr)
+{
+	pthread_mutex_lock(&sconn->rma_lock);
+	while (ring_spsc_insert(sm_rma_ring(sconn->rma), hdr->u32))
+		sched_yield();
+	pthread_mutex_unlock(&sconn->rma_lock);
+
+	sm_ring_doorbell(sconn);
+}
+
+/* Find the header of a fragment the peer posted. Returns NULL if it
+ * does not fit the peer's RMA buffer. */
+static sm_rma_hdr_t *
+sm_peer_frag_hdr(cci__conn_t *conn, sm_hdr_t *hdr)
+{
+	sm_conn_t *sconn = conn->priv;
+	uint32_t page = hdr->rma.offset;
+	sm_rma_hdr_t *rma_hdr = NULL;
+
+	if (page < sconn->peer_rma_pages) {
+		rma_hdr = sm_rma_frag_hdr(sconn->peer_rma, page);
+		if (rma_hdr->len <= (uint64_t)(sconn->peer_rma_pages - page) *
+				SM_RMA_MTU)
+			return rma_hdr;
+	}
+
+	debug(CCI_DB_MSG, "%s: RMA fragment from %s (page %u) exceeds its "
+		"buffer", __func__, conn->uri, page);
+	return NULL;
+}
+
+static int
+sm_handle_rma_write(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
+{
+	int ret = 0;
+	sm_conn_t *sconn = conn->priv;
+	sm_rma_hdr_t *rma_hdr = sm_peer_frag_hdr(conn, hdr);
+	void *src = NULL, *dst = NULL;
+	sm_rma_handle_t *h = NULL;
+	sm_hdr_t ack;
+
+	if (!rma_hdr)
+		return CCI_ERROR;
+	h = (void*) ((uintptr_t)rma_hdr->remote_handle);
+
+	if (rma_hdr->remote_offset + rma_hdr->len > h->len) {
+		/* exceeds RMA registration length, return error */
+		ret = CCI_ERR_RMA_HANDLE;
+		goto out;
+	}
+
+	src = sm_rma_page(sconn->peer_rma, hdr->rma.offset);
+	dst = (void*)((uintptr_t)h->addr + (uintptr_t)rma_hdr->remote_offset);
+	memcpy(dst, src, rma_hdr->len);
+
+    out:
+	ack.rma_ack.type = SM_MSG_RMA_ACK;
+	ack.rma_ack.offset = hdr->rma.offset;
+	ack.rma_ack.status = ret;
+
+	sm_post_rma_hdr(sconn, &ack);
+
+	return 0;
+}
+
+static int
+sm_handle_rma_read(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
+{
+	int ret = 0;
+	sm_conn_t *sconn = conn->priv;
+	sm_rma_hdr_t *rma_hdr = sm_peer_frag_hdr(conn, hdr);
+	void *src = NULL, *dst = NULL;
+	sm_rma_handle_t *h = NULL;
+	sm_hdr_t ack;
+
+	if (!rma_hdr)
+		return CCI_ERROR;
+	h = (void*) ((uintptr_t)rma_hdr->remote_handle);
+
+	if (rma_hdr->remote_offset + rma_hdr->len > h->len) {
+		/* exceeds RMA registration length, return error */
+		ret = CCI_ERR_RMA_HANDLE;
+		goto out;
 	}
 
 	src = (void*)((uintptr_t)h->addr + (uintptr_t)rma_hdr->remote_offset);
-	dst = (void*)&sconn->peer_rma->buf[hdr->rma.offset * SM_RMA_MTU];
+	dst = sm_rma_page(sconn->peer_rma, hdr->rma.offset);
 	memcpy(dst, src, rma_hdr->len);
 
     out:
 	ack.rma_ack.type = SM_MSG_RMA_ACK;
 	ack.rma_ack.offset = hdr->rma.offset;
 	ack.rma_ack.status = ret;
-	mb();
 
-    again:
-	ret = ring_insert(&sconn->rma->ring, *((uint32_t*)&ack.u32));
-	if (ret)
-		goto again;
+	sm_post_rma_hdr(sconn, &ack);
 
-	return ret;
+	return 0;
 }
 
 static inline void
 sm_complete_rma(cci__ep_t *ep, sm_rma_t *rma)
 {
-	if (!(rma->flags & CCI_FLAG_SILENT)) {
+	if (rma->rndv) {
+		cci__conn_t *conn = rma->evt.conn;
+		sm_conn_t *sconn = conn->priv;
+
+		sm_finish_rndv(ep, conn, rma->rndv->offset, rma->rndv,
+				rma->evt.event.send.status);
+		sconn->rndv_rx = NULL;
+		free(rma);
+		/* resume the MSG ring */
+		sm_ring_own_doorbell(ep->priv, sconn);
+	} else if (!(rma->flags & CCI_FLAG_SILENT)) {
 		debug(CCI_DB_MSG, "%s: queuing rma %p", __func__, (void*)rma);
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_TAIL(&ep->evts, &rma->evt, entry);
-		pthread_mutex_unlock(&ep->lock);
+		sm_queue_evt(ep, &rma->evt);
 	} else {
 		debug(CCI_DB_MSG, "%s: freeing rma %p", __func__, (void*)rma);
 		free(rma);
@@ -2191,20 +3357,26 @@ sm_complete_rma(cci__ep_t *ep, sm_rma_t *rma)
 }
 
 static void
-sm_release_rma_buffer(sm_rma_buffer_t *rb, uint32_t len, int index);
-
-static int
-sm_progress_rma(sm_rma_t *rma);
+sm_release_rma_buffer(sm_conn_t *sconn, uint32_t len, uint32_t page);
 
 static int
 sm_handle_rma_ack(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
 {
 	int ret = 0;
 	sm_conn_t *sconn = conn->priv;
-	sm_rma_hdr_t *rma_hdr = (void*) &sconn->rma->hdr[hdr->rma_ack.offset * SM_LINE];
+	sm_rma_hdr_t *rma_hdr = NULL;
 	void *src = NULL, *dst = NULL;
-	sm_rma_handle_t *h = (void*) ((uintptr_t)rma_hdr->local_handle);
-	sm_rma_t *rma = (void*)((uintptr_t)rma_hdr->rma);
+	sm_rma_handle_t *h = NULL;
+	sm_rma_t *rma = NULL;
+
+	if (hdr->rma_ack.offset >= sconn->rma_pages) {
+		debug(CCI_DB_MSG, "%s: RMA ack from %s names page %u",
+			__func__, conn->uri, hdr->rma_ack.offset);
+		return CCI_ERROR;
+	}
+	rma_hdr = sm_rma_frag_hdr(sconn->rma, hdr->rma_ack.offset);
+	h = (void*) ((uintptr_t)rma_hdr->local_handle);
+	rma = (void*)((uintptr_t)rma_hdr->rma);
 
 	rma->pending--;
 	rma->completed++;
@@ -2213,169 +3385,249 @@ sm_handle_rma_ack(cci__ep_t *ep, cci__conn_t *conn, sm_hdr_t *hdr)
 		rma->evt.event.send.status = hdr->rma_ack.status;
 
 	if (!hdr->rma_ack.status && (rma->flags & CCI_FLAG_READ)) {
-		src = (void*)((uintptr_t)&sconn->rma->buf[hdr->rma_ack.offset * SM_RMA_MTU]);
+		src = sm_rma_page(sconn->rma, hdr->rma_ack.offset);
 		dst = (void*)((uintptr_t)h->addr + (uintptr_t)rma_hdr->local_offset);
 		memcpy(dst, src, rma_hdr->len);
 	}
 
-	sm_release_rma_buffer(sconn->rma, rma_hdr->len, hdr->rma_ack.offset);
+	sm_release_rma_buffer(sconn, rma_hdr->len, hdr->rma_ack.offset);
 
 	sm_progress_rma(rma);
 
 	return ret;
 }
 
-static void
+static int
 sm_progress_conn(cci__ep_t *ep, cci__conn_t *conn);
 
-static int
+/* Drain the wakeups written to our FIFO. Its contents do not matter,
+ * the doorbell says which conns to visit. */
+static void
 sm_progress_fifo(cci__ep_t *ep)
 {
-	int ret = 0, id = 0, len = sizeof(id);
+	int ret = 0;
 	sm_ep_t *sep = ep->priv;
-	cci__conn_t *conn = NULL;
+	uint32_t ids[64];
 
-	return 0;
-
-	ret = read(sep->fifo, &id, len);
-	if (ret == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-		case ENOBUFS:
-		case ENOMEM:
-			break;
-		default:
-			debug(CCI_DB_WARN, "%s: read(fifo) failed with %s",
-					__func__, strerror(errno));
-			break;
-		}
-		ret = CCI_EAGAIN;
-		goto out;
-	} else if (ret != len) {
-		debug(CCI_DB_WARN, "%s: read(fifo) only returned %d of %d bytes requested",
-				__func__, ret, len);
-		ret = CCI_EAGAIN;
-		goto out;
-	}
-
-	ret = sm_find_conn(ep, id, &conn);
-	if (!ret)
-		sm_progress_conn(ep, conn);
+	do {
+		ret = read(sep->fifo, ids, sizeof(ids));
+	} while (ret == sizeof(ids));
 
-    out:
-	return ret;
+	if (ret == -1 && errno != EAGAIN && errno != EINTR)
+		debug(CCI_DB_WARN, "%s: read(fifo) failed with %s",
+			__func__, strerror(errno));
 }
 
-static void
-sm_progress_conn_tree(const void *nodep, const VISIT which, const int depth)
+/* Visit the conns whose bits are set in our doorbell. Returns the
+ * number of conns visited. */
+static int
+sm_progress_conns(cci__ep_t *ep)
 {
-	cci_connection_t *connection = NULL;
-	cci__ep_t *ep = NULL;
-	cci__conn_t *conn = NULL;
-	sm_conn_t *sconn = NULL;
+	int ret = 0, i = 0, locked = 0, cnt = 0;
+	sm_ep_t *sep = ep->priv;
+	sm_conn_t key, *sconn = NULL;
+	void *node = NULL;
 
-	switch (which) {
-		case preorder:
-			sconn = *(sm_conn_t**)nodep;
-			conn = sconn->conn;
-			connection = &conn->connection;
-			ep = container_of(connection->endpoint, cci__ep_t, endpoint);
-			sm_progress_conn(ep, conn);
-			break;
-		case postorder:
-			break;
-		case endorder:
-			break;
-		case leaf:
-			sconn = *(sm_conn_t**)nodep;
-			conn = sconn->conn;
-			connection = &conn->connection;
-			ep = container_of(connection->endpoint, cci__ep_t, endpoint);
-			sm_progress_conn(ep, conn);
-			break;
+	for (i = 0; i < SM_DB_WORDS; i++) {
+		uint64_t bits = 0;
+
+		/* plain read first, idle words stay shared in our cache */
+		if (!read_u64(&sep->doorbell->bits[i], __ATOMIC_RELAXED))
+			continue;
+		bits = fetch_clear_u64(&sep->doorbell->bits[i]);
+
+		if (!locked) {
+			ret = pthread_rwlock_rdlock(&sep->conns_lock);
+			if (ret) {
+				debug(CCI_DB_WARN, "%s: pthread_rwlock_rdlock() "
+					"failed with %s", __func__, strerror(ret));
+				fetch_or_u64(&sep->doorbell->bits[i], bits);
+				return 0;
+			}
+			locked = 1;
+		}
+
+		while (bits) {
+			key.id = (i << ID_SHIFT) + ffsll(bits) - 1;
+			bits &= bits - 1;
+
+			/* gone if not found */
+			node = tfind(&key, &sep->conns, sm_compare_conns);
+			if (!node)
+				continue;
+			sconn = *((sm_conn_t **)node);
+			if (sm_progress_conn(ep, sconn->conn))
+				sm_ring_own_doorbell(sep, sconn);
+			cnt++;
+		}
 	}
-	return;
+
+	if (locked)
+		pthread_rwlock_unlock(&sep->conns_lock);
+	return cnt;
 }
 
-static void
-sm_progress_conns(cci__ep_t *ep)
+/* Hand the MSGs in our pool's inbox to the app, up to
+ * SM_PROGRESS_BATCH. Returns the number of MSGs. */
+static int
+sm_progress_inbox(cci__ep_t *ep)
 {
-	int ret = 0;
+	int ret = 0, cnt = 0;
 	sm_ep_t *sep = ep->priv;
+	sm_pool_t *pool = sep->pool;
+	uint32_t elem = 0, slot = 0, len = 0;
+	sm_conn_t key, *sconn = NULL;
+	cci__evt_t *evt = NULL;
+	void *node = NULL;
 
-	if (!sep->conns)
-		return;
+	if (ring_empty(sm_pool_inbox(pool)))
+		return 0;
+
+	/* one thread at a time, to keep each conn's MSGs in order */
+	if (!compare_and_swap_u32(&sep->inbox_busy, 0, 1, __ATOMIC_ACQUIRE))
+		return 0;
 
 	ret = pthread_rwlock_rdlock(&sep->conns_lock);
 	if (ret) {
 		debug(CCI_DB_WARN, "%s: pthread_rwlock_rdlock() failed with %s",
-				__func__, strerror(ret));
+			__func__, strerror(ret));
 		goto out;
 	}
 
-	twalk(sep->conns, sm_progress_conn_tree);
+	for (cnt = 0; cnt < SM_PROGRESS_BATCH; cnt++) {
+		if (ring_remove(sm_pool_inbox(pool), &elem))
+			break;
+		slot = elem & 0xFFFF;
+		key.id = elem >> 16;
+		if (slot >= pool->slots) {
+			debug(CCI_DB_MSG, "%s: dropping MSG with slot %u",
+				__func__, slot);
+			continue;
+		}
+
+		/* gone if not found */
+		len = *((uint32_t *)sm_pool_slot(pool, slot));
+		node = tfind(&key, &sep->conns, sm_compare_conns);
+		if (!node || len > pool->slot_len - SM_POOL_HDR) {
+			debug(CCI_DB_MSG, "%s: dropping MSG from conn %d "
+				"(len %u)", __func__, key.id, len);
+			while (ring_insert(sm_pool_free(pool), slot))
+				;
+			continue;
+		}
+		sconn = *((sm_conn_t **)node);
+
+		evt = &sep->prxs[slot];
+		evt->event.recv.len = len;
+		evt->event.recv.connection = &sconn->conn->connection;
+		evt->conn = sconn->conn;
+
+		sm_queue_evt(ep, evt);
+
+		debug(CCI_DB_MSG, "%s: received SEND from %s (slot %u) len %u",
+			__func__, sconn->conn->uri, slot, len);
+	}
 
 	pthread_rwlock_unlock(&sep->conns_lock);
+
     out:
-	return;
+	store_release_u32(&sep->inbox_busy, 0);
+	return cnt;
 }
 
 static int
 sm_progress_ep(cci__ep_t *ep)
 {
-	static int cnt = 0;
+	sm_ep_t *sep = ep->priv;
+	int cnt = sm_progress_conns(ep);
+
+	if (sep->pool)
+		cnt += sm_progress_inbox(ep);
+
+	/* An idle poll is cheap, but a spinning caller may hold the core
+	 * the sender needs. Yield once polls keep coming up empty. */
+	if (cnt)
+		sep->idle = 0;
+	else if (++sep->idle > sep->spins)
+		sched_yield();
+
+	return 0;
+}
+
+/* With an OS handle, progress is ours. Spin like sm_progress_ep() while
+ * busy, then arm the doorbell and sleep on the FIFO. A sender that rang
+ * (or posted to our inbox) before seeing armed left a bit (or an entry)
+ * we see on the last look, one that rang after writes the FIFO. */
+static void *
+sm_progress_thread(void *arg)
+{
+	int i = 0;
+	cci__ep_t *ep = arg;
+	sm_ep_t *sep = ep->priv;
+	struct pollfd pfd;
+
+	pfd.fd = sep->fifo;
+	pfd.events = POLLIN;
+
+	while (!ep->closing) {
+		if (sm_progress_conns(ep) +
+			(sep->pool ? sm_progress_inbox(ep) : 0)) {
+			sep->idle = 0;
+			continue;
+		}
+		if (++sep->idle <= sep->spins)
+			continue;
+
+		store_u64(&sep->doorbell->armed, 1, 1);
+		for (i = 0; i < SM_DB_WORDS; i++) {
+			if (read_u64(&sep->doorbell->bits[i], 0))
+				break;
+		}
+		if (i == SM_DB_WORDS && !ep->closing &&
+			(!sep->pool || ring_empty(sm_pool_inbox(sep->pool))))
+			poll(&pfd, 1, SM_PROG_TIME_MS);
+		store_u64(&sep->doorbell->armed, 0, 0);
 
-	if (0 && (cnt++ & 0x1000000) == 0x1000000) {
-		sm_progress_sock(ep);
 		sm_progress_fifo(ep);
+		sep->idle = 0;
 	}
-	sm_progress_conns(ep);
 
-	return 0;
+	pthread_exit(NULL);
 }
 
 static cci__evt_t *
-sm_get_tx(sm_conn_t *sconn)
+sm_get_tx(sm_ep_t *sep, sm_conn_t *sconn)
 {
 	int idx = 0;
-	uint64_t avail = 0, new = 0;
-	cci__evt_t *tx = NULL;
 
-    again:
-	avail = read_u64(&sconn->txs_avail, __ATOMIC_RELAXED);
-	if (!avail) {
-		debug(CCI_DB_MSG, "%s: no available txs for %s", __func__,
-			sconn->conn->uri);
-		goto out;
-	}
-	idx = ffsll(avail) - 1; /* convert to 0-based index */
-	new = ~(1ULL << idx) & avail;
-	if (compare_and_swap_u64(&sconn->txs_avail, avail, new, __ATOMIC_SEQ_CST)) {
-		tx = &sconn->txs[idx];
+	/* with a pool, all conns share the endpoint's */
+	if (sep->ptxs) {
+		idx = sm_get_bit(sep->ptxs_avail, SM_EP_TX_CNT / 64);
+		if (idx != -1) {
+			sep->ptxs[idx].conn = sconn->conn;
+			return &sep->ptxs[idx];
+		}
 	} else {
-		goto again;
+		idx = sm_get_bit(sconn->txs_avail, SM_CONN_TX_CNT / 64);
+		if (idx != -1)
+			return &sconn->txs[idx];
 	}
 
-    out:
-	return tx;
+	debug(CCI_DB_MSG, "%s: no available txs for %s", __func__,
+		sconn->conn->uri);
+	return NULL;
 }
 
 static void
 sm_put_tx(cci__evt_t *tx)
 {
-	int idx = (int)SM_TX(tx->priv);
-	uint64_t avail = 0, new = 0;
+	sm_ep_t *sep = tx->ep->priv;
 	sm_conn_t *sconn = tx->conn->priv;
 
-    again:
-	avail = read_u64(&sconn->txs_avail, __ATOMIC_RELAXED);
-	new = (1ULL << idx) | avail;
-	if (!compare_and_swap_u64(&sconn->txs_avail, avail, new, __ATOMIC_SEQ_CST)) {
-		goto again;
-	}
-
-	return;
+	if (sep->ptxs)
+		sm_put_bit(sep->ptxs_avail, (int)SM_TX(tx->priv));
+	else
+		sm_put_bit(sconn->txs_avail, (int)SM_TX(tx->priv));
 }
 
 static int ctp_sm_get_event(cci_endpoint_t * endpoint,
@@ -2457,6 +3709,10 @@ sm_return_send(cci_event_t *event)
 	if (SM_IS_TX(evt->priv)) {
 		debug(CCI_DB_MSG, "%s: putting tx", __func__);
 		sm_put_tx(evt);
+	} else if (evt->priv == SM_RNDV) {
+		sm_conn_t *sconn = evt->conn->priv;
+
+		sm_put_rndv(&sconn->tx_spare, container_of(evt, sm_rndv_t, evt));
 	} else {
 		sm_rma_t *rma = container_of(evt, sm_rma_t, evt);
 		free(rma);
@@ -2465,128 +3721,143 @@ sm_return_send(cci_event_t *event)
 	return;
 }
 
-static int
-sm_reserve_conn_buffer(sm_conn_buffer_t *cb, uint32_t len, int *offset)
+/* Set the bits of cnt lines from line on, which do not wrap */
+static void
+sm_set_lines(uint64_t *bitmap, uint32_t line, uint32_t cnt)
 {
-	int ret = 0, cnt = (len & SM_MASK ? 1 : 0) + (len >> SM_SHIFT), i = 0;
-	uint64_t avail = 0, bits = ((uint64_t)1 << cnt) - 1, new = 0;
+	while (cnt) {
+		uint32_t bit = line & 63, n = 64 - bit;
+		uint64_t bits = 0;
+
+		if (n > cnt)
+			n = cnt;
+		bits = (n == 64 ? ~(0ULL) : ((1ULL << n) - 1)) << bit;
+		fetch_or_u64(&bitmap[line >> 6], bits);
+		line += n;
+		cnt -= n;
+	}
+}
 
-	debug(CCI_DB_MSG, "%s: requesting %d bytes (cnt %d bits 0x%"PRIx64")",
-		__func__, len, cnt, bits);
+/* Move the tail of a buffer handed out as a ring of lines (or pages)
+ * over the released ones, in order. */
+static void
+sm_reclaim_lines(uint64_t *freed, uint32_t lines, uint32_t head,
+		uint32_t *tail)
+{
+	uint32_t mask = lines - 1;
 
-	for (i = 0; i < (63 - cnt); i++) {
-    again:
-		avail = read_u64(&cb->avail, __ATOMIC_RELAXED);
-		if (!avail) {
-			debug(CCI_DB_MSG, "%s: avail 0x%"PRIx64, __func__, avail);
-			ret = ENOBUFS;
-			goto out;
-		}
-		if ((avail & bits) == bits) {
-			new = avail & ~bits;
-			if (compare_and_swap_u64(&cb->avail, avail, new,
-						__ATOMIC_SEQ_CST)) {
-				debug(CCI_DB_MSG, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64" "
-					"new 0x%"PRIx64" offset %u", __func__, bits,
-					avail, new, i);
-				*offset = i;
-				goto out;
-			} else {
-				goto again;
-			}
-		}
-		bits <<= 1;
-	}
+	while (*tail != head) {
+		uint32_t line = *tail & mask, bit = line & 63, cnt = 0;
+		uint64_t *word = &freed[line >> 6];
+		uint64_t run = read_u64(word, __ATOMIC_RELAXED) >> bit, bits = 0;
 
-	bits = ((uint64_t)1 << cnt) - 1;
-	debug(CCI_DB_MSG, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64, __func__, bits, avail);
+		if (!(run & 1))
+			break;
 
-	ret = CCI_ENOBUFS;
+		/* the released lines from bit up to the first busy one */
+		cnt = ~run ? (uint32_t) __builtin_ctzll(~run) : 64;
+		if (cnt > head - *tail)
+			cnt = head - *tail;
+		bits = (cnt == 64 ? ~(0ULL) : ((1ULL << cnt) - 1)) << bit;
 
-    out:
-	return ret;
+		/* also orders the peer's reads before we reuse the lines */
+		__sync_fetch_and_and(word, ~bits);
+		*tail += cnt;
+	}
 }
 
-static void
-sm_release_conn_buffer(sm_conn_buffer_t *cb, uint32_t len, int offset)
+/* Hand out cnt lines of such a buffer. A run never wraps: when it does
+ * not fit before the end, the lines up to the end are skipped by
+ * releasing them right away. */
+static int
+sm_reserve_lines(uint64_t *freed, uint32_t lines, uint32_t *head,
+		uint32_t *tail, uint32_t cnt, uint32_t *offset)
 {
-	int cnt = (len & SM_MASK ? 1 : 0) + (len >> SM_SHIFT);
-	uint64_t avail = 0, bits = (((uint64_t)1 << cnt) - 1) << offset;
+	uint32_t pos = *head & (lines - 1), pad = 0;
+
+	if (pos + cnt > lines)
+		pad = lines - pos;
+
+	if (lines - (*head - *tail) < pad + cnt) {
+		sm_reclaim_lines(freed, lines, *head, tail);
+		if (pad && *tail == *head) {
+			/* all free, start over at line 0 */
+			*head += pad;
+			*tail = *head;
+			pos = pad = 0;
+		}
+		if (lines - (*head - *tail) < pad + cnt)
+			return CCI_ENOBUFS;
+	}
 
-    again:
-	avail = read_u64(&cb->avail, __ATOMIC_RELAXED);
-	debug(CCI_DB_MSG, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64, __func__, bits, avail);
-	if (avail & bits)
-		debug(CCI_DB_WARN, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64,
-			__func__, bits, avail);
-	assert((avail & bits) == 0);
-
-	if (!compare_and_swap_u64(&cb->avail, avail, avail | bits, __ATOMIC_SEQ_CST))
-		goto again;
+	if (pad) {
+		sm_set_lines(freed, pos, pad);
+		*head += pad;
+		pos = 0;
+	}
 
-	return;
+	*offset = pos;
+	*head += cnt;
+
+	return CCI_SUCCESS;
 }
 
+/* Hand out the lines for a MSG of len bytes.
+ *
+ * NOTE: the caller holds tx_lock */
 static int
-sm_reserve_rma_buffer(sm_rma_buffer_t *rb, uint32_t len, int *index)
+sm_reserve_conn_buffer_locked(sm_conn_t *sconn, uint32_t len, uint32_t *offset)
 {
-	int ret = 0, cnt = (len & SM_RMA_MASK ? 1 : 0) + (len >> SM_RMA_SHIFT), i = 0;
-	uint64_t avail = 0, bits = ((uint64_t)1 << cnt) - 1, new = 0;
+	int ret = sm_reserve_lines(sconn->tx_freed, sconn->tx_lines,
+			&sconn->tx_head, &sconn->tx_tail, sm_msg_lines(len),
+			offset);
 
-	debug(CCI_DB_MSG, "%s: requesting %d bytes (cnt %d bits 0x%"PRIx64")",
-		__func__, len, cnt, bits);
+	if (ret)
+		debug(CCI_DB_MSG, "%s: no room for %u bytes to %s",
+			__func__, len, sconn->conn->uri);
+	return ret;
+}
 
-	for (i = 0; i < (63 - cnt); i++) {
-    again:
-		avail = read_u64(&rb->avail, __ATOMIC_RELAXED);
-		if (!avail) {
-			debug(CCI_DB_MSG, "%s: avail 0x%"PRIx64, __func__, avail);
-			ret = ENOBUFS;
-			goto out;
-		}
-		if ((avail & bits) == bits) {
-			new = avail & ~bits;
-			if (compare_and_swap_u64(&rb->avail, avail, new,
-						__ATOMIC_SEQ_CST)) {
-				debug(CCI_DB_MSG, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64" "
-					"new 0x%"PRIx64" index %u", __func__, bits,
-					avail, new, i);
-				*index = i;
-				goto out;
-			} else {
-				goto again;
-			}
-		}
-		bits <<= 1;
-	}
+/* Hand out the pages for a RMA fragment of up to *len bytes, fewer
+ * when the buffer is short. */
+static int
+sm_reserve_rma_buffer(sm_conn_t *sconn, uint32_t *len, uint32_t *page)
+{
+	int ret = CCI_ENOBUFS;
+	uint32_t cnt = sm_rma_pages(*len);
 
-	bits = ((uint64_t)1 << cnt) - 1;
-	debug(CCI_DB_MSG, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64, __func__, bits, avail);
+	pthread_mutex_lock(&sconn->rma_lock);
+	if (sconn->rma_frags == SM_RMA_DEPTH_MAX)
+		goto out;
 
-	ret = CCI_ENOBUFS;
+	for (;;) {
+		ret = sm_reserve_lines(sconn->rma_freed, sconn->rma_pages,
+				&sconn->rma_head, &sconn->rma_tail, cnt, page);
+		if (!ret || cnt == 1)
+			break;
+		cnt >>= 1;
+	}
+	if (!ret) {
+		sconn->rma_frags++;
+		if (*len > cnt * SM_RMA_MTU)
+			*len = cnt * SM_RMA_MTU;
+	}
 
     out:
+	pthread_mutex_unlock(&sconn->rma_lock);
+	if (ret)
+		debug(CCI_DB_MSG, "%s: no room for %u bytes to %s",
+			__func__, *len, sconn->conn->uri);
 	return ret;
 }
 
 static void
-sm_release_rma_buffer(sm_rma_buffer_t *rb, uint32_t len, int index)
+sm_release_rma_buffer(sm_conn_t *sconn, uint32_t len, uint32_t page)
 {
-	int cnt = (len & SM_RMA_MASK ? 1 : 0) + (len >> SM_RMA_SHIFT);
-	uint64_t avail = 0, bits = (((uint64_t)1 << cnt) - 1) << index;
-
-    again:
-	avail = read_u64(&rb->avail, __ATOMIC_RELAXED);
-	debug(CCI_DB_MSG, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64, __func__, bits, avail);
-	if (avail & bits)
-		debug(CCI_DB_WARN, "%s: bits 0x%"PRIx64" avail 0x%"PRIx64,
-			__func__, bits, avail);
-	assert((avail & bits) == 0);
-
-	if (!compare_and_swap_u64(&rb->avail, avail, avail | bits, __ATOMIC_SEQ_CST))
-		goto again;
-
-	return;
+	pthread_mutex_lock(&sconn->rma_lock);
+	sm_set_lines(sconn->rma_freed, page, sm_rma_pages(len));
+	sconn->rma_frags--;
+	pthread_mutex_unlock(&sconn->rma_lock);
 }
 
 static void
@@ -2596,7 +3867,26 @@ sm_return_recv(cci_event_t *event)
 	cci__conn_t *conn = evt->conn;
 	sm_conn_t *sconn = conn->priv;
 
-	sm_release_conn_buffer(sconn->rx, event->recv.len, (int)((uintptr_t)evt->priv));
+	if (evt->priv == SM_RNDV) {
+		sm_put_rndv(&sconn->rx_spare, container_of(evt, sm_rndv_t, evt));
+		return;
+	} else if (evt->priv == SM_INLINE) {
+		sm_put_bit(sconn->irxs_avail, (int)(evt - sconn->irxs));
+		return;
+	} else if (evt->priv == SM_POOL) {
+		sm_ep_t *sep = evt->ep->priv;
+
+		/* free the slot before the sender sees the credit */
+		while (ring_insert(sm_pool_free(sep->pool),
+				(uint32_t)(evt - sep->prxs)))
+			;
+		__sync_fetch_and_add(
+			&sconn->peer_pool->returned[sconn->peer_id], 1);
+		return;
+	}
+
+	sm_set_lines(sconn->rx_freed, (uint32_t)((uintptr_t)evt->priv),
+			sm_msg_lines(event->recv.len));
 
 	return;
 }
@@ -2638,38 +3928,70 @@ sm_progress_conn_ring(cci__ep_t *ep, cci__conn_t *conn)
 {
 	int ret = 0;
 	sm_conn_t *sconn = conn->priv;
-	uint32_t val = 0;
-	sm_hdr_t *hdr = (sm_hdr_t *)&val;
+	void *slot = NULL;
+	sm_hdr_t *hdr = NULL;
 
 	if (!sconn->rx)
 		return CCI_EAGAIN;
 
-	ret = ring_remove(&sconn->rx->ring, &val);
-	if (ret)
+	slot = ring_spsc_peek(sconn->rx_ring);
+	if (!slot) {
+		ret = CCI_EAGAIN;
 		goto out;
+	}
+	hdr = slot;
 
 	switch (hdr->generic.type) {
+	case SM_MSG_INLINE:
+		ret = sm_handle_inline(ep, conn, hdr);
+		/* out of events, leave it in the ring */
+		if (ret == CCI_EAGAIN)
+			goto out;
+		break;
 	case SM_MSG_SEND:
 		ret = sm_handle_send(ep, conn, hdr);
 		break;
+	case SM_MSG_RNDV:
+		ret = sm_handle_rndv(ep, conn, hdr);
+		break;
 	default:
 		debug(CCI_DB_MSG, "%s: unknown header type %d from %s", __func__,
 				hdr->generic.type, conn->uri);
 		ret = CCI_ERROR;
 	}
 
+	ring_spsc_release(sconn->rx_ring);
+
     out:
 	return ret;
 }
 
+/* Park a RMA until progress finds pages in our RMA buffer for it */
+static void
+sm_wait_rma(sm_conn_t *sconn, sm_rma_t *rma)
+{
+	cci__ep_t *ep = rma->evt.ep;
+
+	pthread_mutex_lock(&sconn->rma_lock);
+	TAILQ_INSERT_TAIL(&sconn->rma_waits, rma, entry);
+	pthread_mutex_unlock(&sconn->rma_lock);
+
+	sm_ring_own_doorbell(ep->priv, sconn);
+}
+
+/* Stream the RMA's next fragments through our RMA buffer, up to the
+ * device's rma_depth in flight. The peer copies each one as soon as it
+ * is posted, while we fill the next.
+ *
+ * NOTE: the caller holds sconn->rx_busy */
 static int
 sm_progress_rma(sm_rma_t *rma)
 {
 	int ret = CCI_SUCCESS;
-	uint64_t start = rma->offset;
 	cci__ep_t *ep = rma->evt.ep;
 	cci__conn_t *conn = rma->evt.conn;
 	sm_conn_t *sconn = conn->priv;
+	sm_dev_t *sdev = ep->dev->priv;
 
 	if (rma->evt.event.send.status) {
 		/* Failed RMA, ... */
@@ -2695,73 +4017,83 @@ sm_progress_rma(sm_rma_t *rma)
 					free(rma);
 				} else {
 					rma->evt.event.send.status = ret;
-					pthread_mutex_lock(&ep->lock);
-					TAILQ_INSERT_TAIL(&ep->evts, &rma->evt, entry);
-					pthread_mutex_unlock(&ep->lock);
+					sm_queue_evt(ep, &rma->evt);
+					ret = CCI_SUCCESS;
 				}
 			}
 		}
 		goto out;
 	}
 
-	if (rma->pending == SM_RMA_DEPTH)
-		goto out;
-
 	/* The RMA is not done, push more fragments */
-	do {
-		int index = 0;
-		uint32_t len = SM_RMA_FRAG_SIZE;
+	while (rma->pending < sdev->rma_depth && rma->offset < rma->hdr.len) {
+		uint32_t page = 0, len = sdev->rma_frag;
 		sm_rma_hdr_t *rma_hdr = NULL;
-		void *addr = NULL, *src = NULL;
+		void *src = NULL;
 		sm_rma_handle_t *lh = (void *)rma->hdr.local_handle;
 		sm_hdr_t hdr;
 
-		if ((rma->hdr.len - rma->offset) < (uint64_t)SM_RMA_FRAG_SIZE)
+		if ((rma->hdr.len - rma->offset) < (uint64_t)len)
 			len = (uint32_t)(rma->hdr.len - rma->offset);
 
-    reserve:
-		ret = sm_reserve_rma_buffer(sconn->rma, len, &index);
-		if (ret) {
-			if (len > SM_RMA_MTU) {
-				len >>= 1;
-				goto reserve;
-			}
+		if (sm_reserve_rma_buffer(sconn, &len, &page))
 			break;
-		}
 
 		/* we have a header cache line and payload page(s) */
-		rma_hdr = (void*) &sconn->rma->hdr[index * SM_LINE];
+		rma_hdr = sm_rma_frag_hdr(sconn->rma, page);
 		memcpy(rma_hdr, &rma->hdr, sizeof(*rma_hdr));
 		rma_hdr->len = len;
 		rma_hdr->local_offset += rma->offset;
 		rma_hdr->remote_offset += rma->offset;
 
 		if (rma->flags & CCI_FLAG_WRITE) {
-			addr = &sconn->rma->buf[index * SM_RMA_MTU];
-			src = (void *)((uintptr_t)lh->addr + (uintptr_t)rma->offset);
-			memcpy(addr, src, len);
+			src = (void *)((uintptr_t)lh->addr +
+				(uintptr_t)rma->hdr.local_offset +
+				(uintptr_t)rma->offset);
+			memcpy(sm_rma_page(sconn->rma, page), src, len);
 		}
 		rma->offset += len;
 		rma->pending++;
 
 		hdr.rma.type = rma->flags & CCI_FLAG_WRITE ?
 			SM_MSG_RMA_WRITE : SM_MSG_RMA_READ;
-		hdr.rma.offset = index;
+		hdr.rma.offset = page;
 		hdr.rma.seq = rma->seq++;
 
-    insert:
-		ret = ring_insert(&sconn->rma->ring, *((uint32_t*)&hdr.u32));
-		if (ret)
-			goto insert;
-	} while ((rma->pending < SM_RMA_DEPTH) && (rma->offset < rma->hdr.len));
+		sm_post_rma_hdr(sconn, &hdr);
+	}
 
-	if (rma->offset > start)
-		ret = 0;
+	/* no room and no ack of ours to come, wait for other RMAs' pages;
+	 * a rendezvous read is retried by progress */
+	if (!rma->pending && rma->offset < rma->hdr.len && !rma->rndv)
+		sm_wait_rma(sconn, rma);
 
     out:
 	return ret;
 }
 
+/* Retry the RMAs that found our RMA buffer full */
+static void
+sm_progress_rma_waits(sm_conn_t *sconn)
+{
+	sm_rma_t *rma = NULL;
+	TAILQ_HEAD(waits, sm_rma) waits = TAILQ_HEAD_INITIALIZER(waits);
+
+	pthread_mutex_lock(&sconn->rma_lock);
+	while (!TAILQ_EMPTY(&sconn->rma_waits)) {
+		rma = TAILQ_FIRST(&sconn->rma_waits);
+		TAILQ_REMOVE(&sconn->rma_waits, rma, entry);
+		TAILQ_INSERT_TAIL(&waits, rma, entry);
+	}
+	pthread_mutex_unlock(&sconn->rma_lock);
+
+	while (!TAILQ_EMPTY(&waits)) {
+		rma = TAILQ_FIRST(&waits);
+		TAILQ_REMOVE(&waits, rma, entry);
+		sm_progress_rma(rma);
+	}
+}
+
 static int
 sm_progress_rma_ring(cci__ep_t *ep, cci__conn_t *conn)
 {
@@ -2773,7 +4105,7 @@ sm_progress_rma_ring(cci__ep_t *ep, cci__conn_t *conn)
 	if (!sconn->peer_rma)
 		return CCI_EAGAIN;
 
-	ret = ring_remove(&sconn->peer_rma->ring, &val);
+	ret = ring_spsc_remove(sm_rma_ring(sconn->peer_rma), &val);
 	if (ret)
 		goto out;
 
@@ -2797,90 +4129,283 @@ sm_progress_rma_ring(cci__ep_t *ep, cci__conn_t *conn)
 	return ret;
 }
 
+/* Complete the rendezvous MSGs the peer is done with and release their
+ * descriptor lines */
 static void
+sm_progress_rndvs(cci__ep_t *ep, sm_conn_t *sconn)
+{
+	sm_rndv_t *rndv = NULL, *tmp = NULL;
+	TAILQ_HEAD(done, sm_rndv) done = TAILQ_HEAD_INITIALIZER(done);
+
+	pthread_mutex_lock(&sconn->tx_lock);
+	TAILQ_FOREACH_SAFE(rndv, &sconn->rndvs, entry, tmp) {
+		sm_rndv_desc_t *desc = (void *)&sconn->tx_buf[rndv->offset * SM_LINE];
+
+		if (!load_acquire_u32(&desc->done))
+			continue;
+		rndv->evt.event.send.status = desc->status;
+		sm_set_lines(sconn->tx_freed, rndv->offset, 1);
+		TAILQ_REMOVE(&sconn->rndvs, rndv, entry);
+		TAILQ_INSERT_TAIL(&done, rndv, entry);
+	}
+	pthread_mutex_unlock(&sconn->tx_lock);
+
+	while (!TAILQ_EMPTY(&done)) {
+		rndv = TAILQ_FIRST(&done);
+		TAILQ_REMOVE(&done, rndv, entry);
+		if (rndv->flags & CCI_FLAG_SILENT) {
+			sm_put_rndv(&sconn->tx_spare, rndv);
+		} else {
+			sm_queue_evt(ep, &rndv->evt);
+		}
+	}
+}
+
+/* Drain up to SM_PROGRESS_BATCH headers from each of the conn's rings.
+ * Returns 1 if the conn should be visited again. */
+static int
 sm_progress_conn(cci__ep_t *ep, cci__conn_t *conn)
 {
-	sm_progress_conn_ring(ep, conn);
-	sm_progress_rma_ring(ep, conn);
+	int i = 0, more = 0;
+	sm_conn_t *sconn = conn->priv;
 
-	return;
+	/* rung before we mapped the peer's buffers, keep it pending */
+	if (!sconn->rx)
+		return 1;
+
+	/* another thread is draining, it may have missed the new headers */
+	if (!compare_and_swap_u32(&sconn->rx_busy, 0, 1, __ATOMIC_ACQUIRE))
+		return 1;
+
+	/* unlocked peek, sends queue them before ringing the peer */
+	if (!TAILQ_EMPTY(&sconn->rndvs))
+		sm_progress_rndvs(ep, sconn);
+
+	for (i = 0; i < SM_PROGRESS_BATCH; i++) {
+		/* a rendezvous read is in flight, later MSGs wait for it */
+		if (sconn->rndv_rx)
+			break;
+		if (sm_progress_conn_ring(ep, conn) == EAGAIN)
+			break;
+	}
+	/* keep polling until the app returns inline RECVs */
+	if (i == SM_PROGRESS_BATCH || sconn->irx_starved)
+		more = 1;
+
+	for (i = 0; i < SM_PROGRESS_BATCH; i++) {
+		if (sm_progress_rma_ring(ep, conn) == EAGAIN)
+			break;
+	}
+	if (i == SM_PROGRESS_BATCH)
+		more = 1;
+
+	/* unlocked peek, sm_wait_rma() rings us after queueing */
+	if (!TAILQ_EMPTY(&sconn->rma_waits))
+		sm_progress_rma_waits(sconn);
+
+	/* the RMA buffers were full, try the rendezvous read again */
+	if (sconn->rndv_rx && !sconn->rndv_rx->pending) {
+		sm_progress_rma(sconn->rndv_rx);
+		more = 1;
+	}
+
+	store_release_u32(&sconn->rx_busy, 0);
+
+	return more;
 }
 
 static int ctp_sm_send(cci_connection_t * connection,
 			 const void *msg_ptr, uint32_t msg_len,
 			 const void *context, int flags)
 {
-	int ret = 0, offset = 0;
-	cci_endpoint_t *endpoint = connection->endpoint;
-	cci__ep_t *ep = container_of(endpoint, cci__ep_t, endpoint);
-	cci__conn_t *conn = container_of(connection, cci__conn_t, connection);
-	sm_conn_t *sconn = conn->priv;
-	cci__evt_t *evt = NULL;
-	sm_hdr_t hdr;
+	int ret = 0;
+	struct iovec iov;
 
 	CCI_ENTER;
 
-	if (!smglobals) {
-		CCI_EXIT;
-		return CCI_ENODEV;
+	iov.iov_base = (void *)msg_ptr;
+	iov.iov_len = msg_len;
+
+	ret = ctp_sm_sendv(connection, &iov, msg_len ? 1 : 0, context, flags);
+
+	CCI_EXIT;
+	return ret;
+}
+
+/* Post a small MSG in the ring slot, after its header */
+static int
+sm_send_inline(sm_conn_t *sconn, const struct iovec *data, uint32_t iovcnt,
+		uint32_t len)
+{
+	int i = 0;
+	char *slot = NULL, *addr = NULL;
+	sm_hdr_t hdr;
+
+	pthread_mutex_lock(&sconn->tx_lock);
+	slot = ring_spsc_claim(sconn->tx_ring);
+	if (!slot) {
+		pthread_mutex_unlock(&sconn->tx_lock);
+		debug(CCI_DB_MSG, "%s: header ring to %s is full", __func__,
+			sconn->conn->uri);
+		return CCI_ENOBUFS;
 	}
 
-	if (!(flags & CCI_FLAG_SILENT)) {
-		evt = sm_get_tx(sconn);
-		if (!evt) {
-			ret = CCI_ENOBUFS;
-			goto out;
-		}
+	hdr.send.type = SM_MSG_INLINE;
+	hdr.send.offset = 0;
+	hdr.send.len = len;
+	*((uint32_t *)slot) = hdr.u32;
 
-		evt->event.send.status = CCI_SUCCESS; /* for now */
-		evt->event.send.connection = connection;
-		evt->event.send.context = (void *)context;
+	addr = slot + SM_INLINE_HDR;
+	for (i = 0; i < (int) iovcnt; i++) {
+		memcpy(addr, data[i].iov_base, data[i].iov_len);
+		addr += data[i].iov_len;
 	}
 
-	if (msg_len) {
-		void *addr = NULL;
+	ring_spsc_commit(sconn->tx_ring);
+	pthread_mutex_unlock(&sconn->tx_lock);
 
-		ret = sm_reserve_conn_buffer(sconn->tx, msg_len, &offset);
-		if (ret)
-			goto out;
+	return CCI_SUCCESS;
+}
 
-		addr = &sconn->tx->buf[offset * SM_LINE];
-		memcpy(addr, msg_ptr, msg_len);
-		mb();
+/* Post a MSG to the peer's receive pool: take a credit and a free slot,
+ * fill the slot and name it in the peer's inbox. The inbox has room for
+ * every slot, so the insert only waits for other senders. */
+static int
+sm_send_pool(sm_ep_t *sep, sm_conn_t *sconn, const struct iovec *data,
+		uint32_t iovcnt, uint32_t len)
+{
+	int i = 0;
+	sm_pool_t *pool = sconn->peer_pool;
+	uint32_t slot = 0, held = 0;
+	char *addr = NULL;
+
+	pthread_mutex_lock(&sconn->tx_lock);
+	held = sconn->pool_sent - read_u32(&sep->pool->returned[sconn->id], 0);
+	if ((int32_t) held >= (int32_t) sconn->pool_credits) {
+		pthread_mutex_unlock(&sconn->tx_lock);
+		debug(CCI_DB_MSG, "%s: no credits for %s", __func__,
+			sconn->conn->uri);
+		return CCI_ENOBUFS;
+	}
+	if (ring_remove(sm_pool_free(pool), &slot) ||
+		slot >= sconn->pool_slots) {
+		pthread_mutex_unlock(&sconn->tx_lock);
+		debug(CCI_DB_MSG, "%s: %s's pool is full", __func__,
+			sconn->conn->uri);
+		return CCI_ENOBUFS;
 	}
 
-	hdr.send.type = SM_MSG_SEND;
-	hdr.send.offset = offset;
-	hdr.send.len = msg_len;
+	addr = sm_pool_slot(pool, slot);
+	*((uint32_t *)addr) = len;
+	addr += SM_POOL_HDR;
+	for (i = 0; i < (int) iovcnt; i++) {
+		memcpy(addr, data[i].iov_base, data[i].iov_len);
+		addr += data[i].iov_len;
+	}
+	sconn->pool_sent++;
 
-    again:
-	ret = ring_insert(&sconn->tx->ring, *((uint32_t*)&hdr.u32));
+	/* the insert publishes the payload */
+	while (ring_insert(sm_pool_inbox(pool),
+			((uint32_t)sconn->peer_id << 16) | slot))
+		;
+	pthread_mutex_unlock(&sconn->tx_lock);
+
+	/* order the insert before the look at armed, as the doorbell's
+	 * fetch_or() does */
+	mb();
+	sm_wake(sconn->peer_doorbell, sconn->fifo, sconn->peer_id);
+
+	return CCI_SUCCESS;
+}
+
+/* Post a MSG larger than the MSS as a descriptor, the peer pulls the
+ * payload. The payload is staged in a copy unless the app leaves its
+ * buffer to us until the SEND completes, which it does once the peer is
+ * done with the payload. */
+static int
+sm_send_rndv(cci__ep_t *ep, cci__conn_t *conn, const struct iovec *data,
+		uint32_t iovcnt, uint32_t len, const void *context, int flags)
+{
+	int ret = 0, i = 0, stage = 0;
+	sm_conn_t *sconn = conn->priv;
+	sm_rndv_t *rndv = NULL;
+	sm_rndv_desc_t *desc = NULL;
+	uint32_t offset = 0;
+	sm_hdr_t hdr;
+
+	stage = !(flags & CCI_FLAG_NO_COPY) || (flags & CCI_FLAG_SILENT) ||
+		iovcnt != 1;
+
+	rndv = sm_get_rndv(&sconn->tx_spare, stage ? len : 0);
+	if (!rndv)
+		return CCI_ENOMEM;
+	rndv->evt.event.send.type = CCI_EVENT_SEND;
+	rndv->evt.event.send.connection = &conn->connection;
+	rndv->evt.event.send.context = (void *)context;
+	rndv->evt.ep = ep;
+	rndv->evt.conn = conn;
+	rndv->evt.priv = SM_RNDV;
+	rndv->flags = flags;
+	rndv->handle.ep = ep;
+	rndv->handle.len = len;
+
+	if (stage) {
+		void *addr = rndv->buf;
+
+		for (i = 0; i < (int) iovcnt; i++) {
+			memcpy(addr, data[i].iov_base, data[i].iov_len);
+			addr = (void*)((uintptr_t)addr + data[i].iov_len);
+		}
+		rndv->handle.addr = rndv->buf;
+	} else {
+		rndv->handle.addr = data[0].iov_base;
+	}
+
+	pthread_mutex_lock(&sconn->tx_lock);
+	ret = sm_reserve_conn_buffer_locked(sconn, sizeof(*desc), &offset);
 	if (ret)
-		goto again;
+		goto unlock;
 
-	if (!(flags & CCI_FLAG_SILENT)) {
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
-		pthread_mutex_unlock(&ep->lock);
+	desc = (void *)&sconn->tx_buf[offset * SM_LINE];
+	desc->addr = (uintptr_t)rndv->handle.addr;
+	desc->handle = (uintptr_t)&rndv->handle;
+	desc->len = len;
+	desc->status = 0;
+	desc->done = 0;
+
+	hdr.send.type = SM_MSG_RNDV;
+	hdr.send.offset = offset;
+	hdr.send.len = sizeof(*desc);
+
+	ret = ring_spsc_insert(sconn->tx_ring, hdr.u32);
+	if (ret) {
+		sconn->tx_head -= sm_msg_lines(sizeof(*desc));
+		debug(CCI_DB_MSG, "%s: header ring to %s is full", __func__,
+			conn->uri);
+		ret = CCI_ENOBUFS;
+		goto unlock;
 	}
+	rndv->offset = offset;
+	TAILQ_INSERT_TAIL(&sconn->rndvs, rndv, entry);
 
-    out:
-	debug(CCI_DB_MSG, "%s: sending %u bytes to %s %s (%d)", __func__,
-		msg_len, conn->uri, ret ? "failed" : "succeeded", ret);
+    unlock:
+	pthread_mutex_unlock(&sconn->tx_lock);
+	if (ret) {
+		sm_put_rndv(&sconn->tx_spare, rndv);
+		return ret;
+	}
 
-	if (ret)
-		sm_put_tx(evt);
+	sm_ring_doorbell(sconn);
 
-	CCI_EXIT;
-	return ret;
+	return CCI_SUCCESS;
 }
 
 static int ctp_sm_sendv(cci_connection_t * connection,
 			  const struct iovec *data, uint32_t iovcnt,
 			  const void *context, int flags)
 {
-	int ret = 0, i = 0, offset = 0;
-	uint32_t len = 0;
+	int ret = 0, i = 0;
+	uint32_t len = 0, offset = 0;
 	cci_endpoint_t *endpoint = connection->endpoint;
 	cci__ep_t *ep = container_of(endpoint, cci__ep_t, endpoint);
 	cci__conn_t *conn = container_of(connection, cci__conn_t, connection);
@@ -2895,8 +4420,21 @@ static int ctp_sm_sendv(cci_connection_t * connection,
 		return CCI_ENODEV;
 	}
 
+	for (i = 0; i < (int) iovcnt; i++)
+		len += data[i].iov_len;
+
+	if (len > connection->max_send_size) {
+		ret = CCI_EMSGSIZE;
+		goto out;
+	}
+
+	if (len > endpoint->device->max_send_size) {
+		ret = sm_send_rndv(ep, conn, data, iovcnt, len, context, flags);
+		goto out;
+	}
+
 	if (!(flags & CCI_FLAG_SILENT)) {
-		evt = sm_get_tx(sconn);
+		evt = sm_get_tx(ep->priv, sconn);
 		if (!evt) {
 			ret = CCI_ENOBUFS;
 			goto out;
@@ -2907,44 +4445,66 @@ static int ctp_sm_sendv(cci_connection_t * connection,
 		evt->event.send.context = (void *)context;
 	}
 
-	if (iovcnt) {
-		void *addr = NULL;
-
-		for (i = 0; i < (int) iovcnt; i++)
-			len += data[i].iov_len;
+	if (sconn->peer_pool) {
+		ret = sm_send_pool(ep->priv, sconn, data, iovcnt, len);
+		if (ret)
+			goto out;
+		goto complete;
+	}
 
-		ret = sm_reserve_conn_buffer(sconn->tx, len, &offset);
+	if (sconn->tx_inline && len <= sconn->tx_inline) {
+		ret = sm_send_inline(sconn, data, iovcnt, len);
 		if (ret)
 			goto out;
+		goto queue;
+	}
+
+	pthread_mutex_lock(&sconn->tx_lock);
+	ret = sm_reserve_conn_buffer_locked(sconn, len, &offset);
+	if (ret) {
+		pthread_mutex_unlock(&sconn->tx_lock);
+		goto out;
+	}
+
+	if (len) {
+		void *addr = &sconn->tx_buf[offset * SM_LINE];
 
-		addr = &sconn->tx->buf[offset * SM_LINE];
 		for (i = 0; i < (int) iovcnt; i++) {
 			memcpy(addr, data[i].iov_base, data[i].iov_len);
 			addr = (void*)((uintptr_t)addr + data[i].iov_len);
 		}
-		mb();
 	}
 
 	hdr.send.type = SM_MSG_SEND;
 	hdr.send.offset = offset;
 	hdr.send.len = len;
 
-    again:
-	ret = ring_insert(&sconn->tx->ring, *((uint32_t*)&hdr.u32));
+	/* the insert publishes the payload */
+	ret = ring_spsc_insert(sconn->tx_ring, hdr.u32);
+	if (ret) {
+		/* nothing was handed out since, take the lines back */
+		sconn->tx_head -= sm_msg_lines(len);
+		debug(CCI_DB_MSG, "%s: header ring to %s is full", __func__,
+			conn->uri);
+		ret = CCI_ENOBUFS;
+	}
+	pthread_mutex_unlock(&sconn->tx_lock);
 	if (ret)
-		goto again;
+		goto out;
+
+    queue:
+	sm_ring_doorbell(sconn);
 
+    complete:
 	if (!(flags & CCI_FLAG_SILENT)) {
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
-		pthread_mutex_unlock(&ep->lock);
+		sm_queue_evt(ep, evt);
 	}
 
     out:
 	debug(CCI_DB_MSG, "%s: sending %u bytes to %s %s (%d)", __func__,
 		len, conn->uri, ret ? "failed" : "succeeded", ret);
 
-	if (ret)
+	if (ret && evt)
 		sm_put_tx(evt);
 
 	CCI_EXIT;
@@ -3009,6 +4569,26 @@ static int ctp_sm_rma_deregister(cci_endpoint_t * endpoint, cci_rma_handle_t * r
 	return ret;
 }
 
+#if SM_HAVE_CMA
+/* Single-copy RMA. The outcome is left in the RMA's event. */
+static int
+sm_rma_cma(sm_conn_t *sconn, sm_rma_t *rma, sm_rma_handle_t *sh,
+		uint64_t local_offset, struct cci_rma_handle *rh,
+		uint64_t remote_offset, uint64_t len, int flags)
+{
+	int ret = 0;
+
+	ret = sm_cma_copy(sconn, (void *)((uintptr_t)sh->addr + local_offset),
+			rh->stuff[1] + remote_offset, len,
+			flags & CCI_FLAG_WRITE);
+	if (ret == CCI_ERR_NOT_IMPLEMENTED)
+		return ret;
+
+	rma->evt.event.send.status = ret;
+	return CCI_SUCCESS;
+}
+#endif /* SM_HAVE_CMA */
+
 static int ctp_sm_rma(cci_connection_t * connection,
 			const void *msg_ptr, uint32_t msg_len,
 			cci_rma_handle_t * local_handle, uint64_t local_offset,
@@ -3092,13 +4672,35 @@ static int ctp_sm_rma(cci_connection_t * connection,
 			free(rma);
 			rma = NULL;
 		} else {
-			pthread_mutex_lock(&ep->lock);
-			TAILQ_INSERT_TAIL(&ep->evts, &rma->evt, entry);
-			pthread_mutex_unlock(&ep->lock);
+			sm_queue_evt(ep, &rma->evt);
+		}
+	} else
+#endif
+#if SM_HAVE_CMA
+	if (((sm_conn_t *)conn->priv)->cma &&
+		sm_rma_cma(conn->priv, rma, sh, local_offset,
+			(void *)remote_handle, remote_offset, data_len,
+			flags) == CCI_SUCCESS) {
+		if (msg_ptr && rma->evt.event.send.status == CCI_SUCCESS) {
+			ret = ctp_sm_send(connection, msg_ptr, msg_len, context, flags);
+			free(rma);
+			rma = NULL;
+		} else {
+			sm_queue_evt(ep, &rma->evt);
 		}
 	} else
 #endif
 	{
+		sm_conn_t *sconn = conn->priv;
+
+		/* pool conns have no RMA buffers */
+		if (!sconn->rma) {
+			debug(CCI_DB_MSG, "%s: RMA to %s needs CMA with a pool",
+				__func__, conn->uri);
+			ret = CCI_ERR_NOT_IMPLEMENTED;
+			goto out;
+		}
+
 		rma->msg_ptr = (void*) msg_ptr;
 
 		rma->hdr.local_handle = (uintptr_t)sh;
@@ -3111,7 +4713,15 @@ static int ctp_sm_rma(cci_connection_t * connection,
 		rma->msg_len = msg_len;
 		rma->flags = flags;
 
-		ret = sm_progress_rma(rma);
+		/* RMA progress is serialized by the conn's rx_busy, else
+		 * progress picks it up */
+		if (compare_and_swap_u32(&sconn->rx_busy, 0, 1,
+					__ATOMIC_ACQUIRE)) {
+			ret = sm_progress_rma(rma);
+			store_release_u32(&sconn->rx_busy, 0);
+		} else {
+			sm_wait_rma(sconn, rma);
+		}
 	}
     out:
 	if (ret)
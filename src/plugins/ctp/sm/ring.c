@@ -61,8 +61,7 @@ int ring_remove(ring_t *r, uint32_t *elemp)
 		t = read_u32(&r->tail, __ATOMIC_SEQ_CST);
 		h = read_u32(&r->head, __ATOMIC_SEQ_CST);
 		if ((h & ~1) == t) {
-			/* Empty... */
-			sched_yield();
+			/* Empty, the caller decides whether to back off */
 			return EAGAIN;
 		}
 		elem = read_u32(&r->elems[(t/2) % num], __ATOMIC_SEQ_CST);
@@ -71,3 +70,108 @@ int ring_remove(ring_t *r, uint32_t *elemp)
 	*elemp = elem;
 	return 0;
 }
+
+bool ring_empty(ring_t *r)
+{
+	uint32_t t = read_u32(&r->tail, __ATOMIC_SEQ_CST);
+	uint32_t h = read_u32(&r->head, __ATOMIC_SEQ_CST);
+
+	return (h & ~1) == t;
+}
+
+uint32_t ring_spsc_size(uint32_t num)
+{
+	return ring_spsc_wide_size(num, sizeof(uint32_t));
+}
+
+uint32_t ring_spsc_wide_size(uint32_t num, uint32_t slot)
+{
+	return sizeof(ring_spsc_t) + num * slot;
+}
+
+void ring_spsc_init(ring_spsc_t *r, uint32_t num)
+{
+	ring_spsc_wide_init(r, num, sizeof(uint32_t));
+}
+
+void ring_spsc_wide_init(ring_spsc_t *r, uint32_t num, uint32_t slot)
+{
+	assert(num && !(num & (num - 1)));
+	assert(slot >= sizeof(uint32_t) && !(slot & (slot - 1)));
+
+	r->num = num;
+	r->mask = num - 1;
+	r->shift = __builtin_ctz(slot);
+	memset(r->elems, 0, num * slot);
+	r->tail = r->head_cache = 0;
+	r->tail_cache = 0;
+	/* We need at least one barrier here. */
+	store_u32(&r->head, 0, __ATOMIC_SEQ_CST);
+}
+
+static inline void *ring_spsc_slot(ring_spsc_t *r, uint32_t i)
+{
+	return (char *)r->elems + ((i & r->mask) << r->shift);
+}
+
+void *ring_spsc_claim(ring_spsc_t *r)
+{
+	uint32_t h = r->head;
+
+	if (h - r->tail_cache == r->num) {
+		r->tail_cache = load_acquire_u32(&r->tail);
+		if (h - r->tail_cache == r->num)
+			return NULL;
+	}
+
+	return ring_spsc_slot(r, h);
+}
+
+void ring_spsc_commit(ring_spsc_t *r)
+{
+	store_release_u32(&r->head, r->head + 1);
+}
+
+void *ring_spsc_peek(ring_spsc_t *r)
+{
+	uint32_t t = r->tail;
+
+	if (t == r->head_cache) {
+		r->head_cache = load_acquire_u32(&r->head);
+		if (t == r->head_cache)
+			return NULL;
+	}
+
+	return ring_spsc_slot(r, t);
+}
+
+void ring_spsc_release(ring_spsc_t *r)
+{
+	store_release_u32(&r->tail, r->tail + 1);
+}
+
+int ring_spsc_insert(ring_spsc_t *r, uint32_t elem)
+{
+	uint32_t *slot = ring_spsc_claim(r);
+
+	if (!slot)
+		return ENOBUFS;
+
+	*slot = elem;
+	ring_spsc_commit(r);
+
+	return 0;
+}
+
+int ring_spsc_remove(ring_spsc_t *r, uint32_t *elemp)
+{
+	uint32_t *slot = ring_spsc_peek(r);
+
+	if (!slot)
+		return EAGAIN;
+
+	*elemp = *slot;
+	ring_spsc_release(r);
+
+	return 0;
+}
@@ -40,6 +40,26 @@ typedef struct ring {
 	uint32_t elems[RING_NUM_ELEMS];
 } ring_t;
 
+/* Single producer, single consumer ring. Each side keeps a cached copy
+ * of the other's index on its own cache line and only reads the shared
+ * one when the cached value says the ring is full (or empty). Callers
+ * serialize their producers and their consumers. Slots are 4 bytes
+ * unless the ring is created wide, the element then being the first
+ * 4 bytes of the slot and the rest free for the caller. */
+typedef struct ring_spsc {
+	uint32_t num;		/* number of elements, a power of two */
+	uint32_t mask;		/* num - 1 */
+	uint32_t shift;		/* log2 of the slot size */
+	char pad0[RING_CACHE_LINE - (sizeof(uint32_t) * 3)];
+	uint32_t head;		/* next slot to fill, producer */
+	uint32_t tail_cache;	/* producer's copy of tail */
+	char pad1[RING_CACHE_LINE - (sizeof(uint32_t) * 2)];
+	uint32_t tail;		/* next slot to empty, consumer */
+	uint32_t head_cache;	/* consumer's copy of head */
+	char pad2[RING_CACHE_LINE - (sizeof(uint32_t) * 2)];
+	uint32_t elems[];
+} ring_spsc_t;
+
 /**
  * ring_size - get ring size in bytes for given number of elements.
  * @num: number of elements.
@@ -65,4 +85,88 @@ int ring_insert(ring_t *r, uint32_t elem);
  */
 int ring_remove(ring_t *r, uint32_t *elem);
 
+/**
+ * ring_empty - check whether the ring is empty
+ * @r: the ring
+ *
+ * An element being inserted is not counted yet.
+ */
+bool ring_empty(ring_t *r);
+
+/**
+ * ring_spsc_size - get SPSC ring size in bytes for given number of elements.
+ * @num: number of elements, a power of two.
+ */
+uint32_t ring_spsc_size(uint32_t num);
+
+/**
+ * ring_spsc_init - initialize SPSC ring in memory
+ * @r: the memory.
+ * @num: number of elements, a power of two.
+ */
+void ring_spsc_init(ring_spsc_t *r, uint32_t num);
+
+/**
+ * ring_spsc_wide_size - get SPSC ring size in bytes with wider slots.
+ * @num: number of elements, a power of two.
+ * @slot: slot size in bytes, a power of two of at least 4.
+ */
+uint32_t ring_spsc_wide_size(uint32_t num, uint32_t slot);
+
+/**
+ * ring_spsc_wide_init - initialize SPSC ring with wider slots in memory
+ * @r: the memory.
+ * @num: number of elements, a power of two.
+ * @slot: slot size in bytes, a power of two of at least 4.
+ */
+void ring_spsc_wide_init(ring_spsc_t *r, uint32_t num, uint32_t slot);
+
+/**
+ * ring_spsc_insert - add an element to the ring, single producer
+ * @r: the ring
+ * @elem: the element to add
+ *
+ * Returns 0 or ENOBUFS if full.
+ */
+int ring_spsc_insert(ring_spsc_t *r, uint32_t elem);
+
+/**
+ * ring_spsc_remove - remove an element from the ring, single consumer
+ * @r: the ring
+ * @elem: the removed element
+ *
+ * Returns 0 or EAGAIN if empty.
+ */
+int ring_spsc_remove(ring_spsc_t *r, uint32_t *elem);
+
+/**
+ * ring_spsc_claim - get the next slot to fill, single producer
+ * @r: the ring
+ *
+ * Returns the slot or NULL if full. The slot is only published by
+ * ring_spsc_commit().
+ */
+void *ring_spsc_claim(ring_spsc_t *r);
+
+/**
+ * ring_spsc_commit - publish the slot returned by ring_spsc_claim()
+ * @r: the ring
+ */
+void ring_spsc_commit(ring_spsc_t *r);
+
+/**
+ * ring_spsc_peek - get the oldest slot, single consumer
+ * @r: the ring
+ *
+ * Returns the slot or NULL if empty. The slot stays in the ring until
+ * ring_spsc_release().
+ */
+void *ring_spsc_peek(ring_spsc_t *r);
+
+/**
+ * ring_spsc_release - hand the slot returned by ring_spsc_peek() back
+ * @r: the ring
+ */
+void ring_spsc_release(ring_spsc_t *r);
+
 #endif /* RING_H */
@@ -27,7 +27,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#ifndef __ATOMIC_RELAXED
+#ifdef __ATOMIC_RELAXED
+#define SM_HAVE_ATOMIC_BUILTINS 1
+#else
 /* If non-zero, issue full memory barrier - use clang's values */
 #define __ATOMIC_RELAXED 0
 #define __ATOMIC_ACQUIRE 2
@@ -68,6 +70,37 @@ static inline void store_u32(uint32_t *ptr, uint32_t val, bool barrier)
 		mb();
 }
 
+/**
+ * load_acquire_u32 - load, later loads and stores stay after it
+ * @ptr: memory location
+ */
+static inline uint32_t load_acquire_u32(uint32_t *ptr)
+{
+#ifdef SM_HAVE_ATOMIC_BUILTINS
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#else
+	uint32_t val = *(volatile uint32_t *)ptr;
+
+	mb();
+	return val;
+#endif
+}
+
+/**
+ * store_release_u32 - store, earlier loads and stores stay before it
+ * @ptr: memory location
+ * @val: value to store
+ */
+static inline void store_release_u32(uint32_t *ptr, uint32_t val)
+{
+#ifdef SM_HAVE_ATOMIC_BUILTINS
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+#else
+	mb();
+	*(volatile uint32_t *)ptr = val;
+#endif
+}
+
 /**
  * compare_and_swap_u32 - store with barrier
  * @ptr: memory location
@@ -135,4 +168,27 @@ static inline bool compare_and_swap_u64(uint64_t *ptr, uint64_t old, uint64_t ne
 	return __sync_bool_compare_and_swap(ptr, old, new);
 }
 
+/**
+ * fetch_or_u64 - atomically set bits, with full barrier
+ * @ptr: memory location
+ * @bits: bits to set
+ *
+ * Returns the previous value.
+ */
+static inline uint64_t fetch_or_u64(uint64_t *ptr, uint64_t bits)
+{
+	return __sync_fetch_and_or(ptr, bits);
+}
+
+/**
+ * fetch_clear_u64 - atomically read and clear, with full barrier
+ * @ptr: memory location
+ *
+ * Returns the previous value.
+ */
+static inline uint64_t fetch_clear_u64(uint64_t *ptr)
+{
+	return __sync_fetch_and_and(ptr, 0);
+}
+
 #endif /* SM_ATOMICS_H */
@@ -34,8 +34,14 @@ BEGIN_C_DECLS
 #define SOCK_MAX_SACK           (4)	/* pairs of start/end acks */
 #define SOCK_ACK_DELAY          (1)	/* send an ack after every Nth send */
 #define SOCK_EP_TX_TIMEOUT_SEC  (64)	/* seconds for now */
-#define SOCK_EP_TX_CNT          (16*1024)	/* number of tx active messages */
-#define SOCK_EP_RX_CNT          (2*SOCK_EP_TX_CNT)      /* number of rx active messages */
+#define SOCK_EP_TX_CNT          (16*1024)	/* max number of tx active messages */
+#define SOCK_EP_RX_CNT          (2*SOCK_EP_TX_CNT)      /* max number of rx active messages */
+#define SOCK_EP_TX_INIT         (64)	/* txs allocated when creating the ep */
+#define SOCK_EP_RX_INIT         (128)	/* rxs allocated when creating the ep */
+#define SOCK_POOL_GROW          (32)	/* buffers added when a pool runs dry */
+#define SOCK_EP_RX_RESERVED     (8)	/* rxs kept to resume from RNR mode */
+#define SOCK_POOL_IDLE_SEC      (2)	/* free buffers left unused this long */
+#define SOCK_SMALL_BUF_LEN      (1024)	/* small buffer class, headers included */
 #define SOCK_EP_HASH_SIZE       (256)	/* nice round number */
 #define SOCK_MAX_EPS            (256)	/* max sock fd value - 1 */
 #define SOCK_BLOCK_SIZE         (64)	/* use 64b blocks for id storage */
@@ -60,6 +66,12 @@ BEGIN_C_DECLS
 #define SOCK_SNDBUF_SIZE        (0) 
 #define SOCK_RCVBUF_SIZE        (0)
 
+/* On Linux, MSG_PEEK|MSG_TRUNC returns the real length of the datagram so we
+   can pick a receive buffer of the right size before reading it */
+#ifdef __linux__
+#define SOCK_PEEK_TRUNC         (1)
+#endif
+
 /* Macro used to avoid warnings from compilers when a parameter is not used */
 #define UNUSED_PARAM(p) do {	\
 	(void)(p);					\
@@ -846,6 +858,37 @@ typedef enum sock_ctx {
 /*! Send active message context.
 *
 * \ingroup messages */
+/*! Buffer size classes. Small messages use small buffers so that they do
+ *  not pin a full MTU-sized buffer while queued or loaned to the app.
+ *
+ * \ingroup messages */
+typedef enum sock_buf_class {
+	/*! SOCK_SMALL_BUF_LEN bytes */
+	SOCK_BUF_SMALL = 0,
+
+	/*! ep->buffer_len bytes */
+	SOCK_BUF_LARGE,
+
+	SOCK_BUF_CLASSES
+} sock_buf_class_t;
+
+/*! Accounting of one size class of the tx or rx pool, protected by ep->lock.
+ *
+ * \ingroup messages */
+typedef struct sock_pool {
+	/*! Number of buffers allocated */
+	uint32_t cnt;
+
+	/*! Number of buffers on the idle list */
+	uint32_t idle;
+
+	/*! Lowest idle count since the last trim */
+	uint32_t idle_low;
+
+	/*! Number of buffers never trimmed */
+	uint32_t min;
+} sock_pool_t;
+
 typedef struct sock_tx {
 	/*! Must be SOCK_CTX_TX */
 	sock_ctx_t ctx;
@@ -874,6 +917,12 @@ typedef struct sock_tx {
 	/*! Entry for hanging on ep->idle_txs, dev->queued, dev->pending */
 	 TAILQ_ENTRY(sock_tx) dentry;
 
+	/*! Entry for hanging on ep->all_txs */
+	 TAILQ_ENTRY(sock_tx) pentry;
+
+	/*! Size class of buffer */
+	sock_buf_class_t buf_class;
+
 	/*! Entry for sconn->tx_seqs */
 	 TAILQ_ENTRY(sock_tx) tx_seq;
 
@@ -899,6 +948,9 @@ typedef struct sock_tx {
 
 	/*! Peer address if connect reject message (i.e. no conn) */
 	struct sockaddr_in sin;
+
+	/*! Signalled, under ep->lock, when a CCI_FLAG_BLOCKING send completes */
+	pthread_cond_t done;
 } sock_tx_t;
 
 /*! Receive active message context.
@@ -917,9 +969,18 @@ typedef struct sock_rx {
 	/*! Buffer length */
 	uint16_t len;
 
-	/*! Entry for hanging on ep->idle_rxs, ep->loaned */
+	/*! Entry for hanging on ep->idle_rxs, ep->reserved_rxs, ep->loaned */
 	TAILQ_ENTRY(sock_rx) entry;
 
+	/*! Entry for hanging on ep->all_rxs */
+	TAILQ_ENTRY(sock_rx) pentry;
+
+	/*! Size class of buffer */
+	sock_buf_class_t buf_class;
+
+	/*! Set aside to resume from RNR mode, returns to ep->reserved_rxs */
+	int reserved;
+
 	/*! Peer's sockaddr_in for connection requests */
 	struct sockaddr_in sin;
 } sock_rx_t;
@@ -1007,6 +1068,18 @@ typedef struct sock_ep {
 	pthread_mutex_t progress_mutex;
 	pthread_cond_t  wait_condition;
 
+	/*! Progress requested, protected by progress_mutex */
+	int progress_kick;
+
+	/*! Protects ep->evts */
+	pthread_mutex_t evt_lock;
+
+	/*! No progress threads, cci_get_event() drives progress */
+	int poll;
+
+	/*! Serializes inline progress when poll is set */
+	pthread_mutex_t poll_lock;
+
 	/* Our IP and port */
 	struct sockaddr_in sin;
 
@@ -1019,23 +1092,35 @@ typedef struct sock_ep {
 	/*! Array of conn lists hased over IP/port */
 	TAILQ_HEAD(s_conns, sock_conn) conn_hash[SOCK_EP_HASH_SIZE];
 
-	/*! TX common buffer */
-	void *tx_buf;
-
 	/*! List of all txs */
-	sock_tx_t *txs;
+	TAILQ_HEAD(s_txs, sock_tx) all_txs;
 
-	/*! List of idle txs */
-	TAILQ_HEAD(s_txsi, sock_tx) idle_txs;
+	/*! Lists of idle txs, per size class */
+	TAILQ_HEAD(s_txsi, sock_tx) idle_txs[SOCK_BUF_CLASSES];
 
-	/*! RX common buffer */
-	void *rx_buf;
+	/*! Accounting of txs, per size class */
+	sock_pool_t tx_pool[SOCK_BUF_CLASSES];
+
+	/*! Number of txs allocated, up to ep->tx_buf_cnt */
+	uint32_t tx_cnt;
 
 	/*! List of all rxs */
-	sock_rx_t *rxs;
+	TAILQ_HEAD(s_rxs, sock_rx) all_rxs;
+
+	/*! Lists of idle rxs, per size class */
+	TAILQ_HEAD(s_rxsi, sock_rx) idle_rxs[SOCK_BUF_CLASSES];
 
-	/*! List of idle rxs */
-	TAILQ_HEAD(s_rxsi, sock_rx) idle_rxs;
+	/*! Accounting of rxs, per size class */
+	sock_pool_t rx_pool[SOCK_BUF_CLASSES];
+
+	/*! Number of rxs allocated, up to ep->rx_buf_cnt */
+	uint32_t rx_cnt;
+
+	/*! Large rxs only used to resume from RNR mode, not in the pool */
+	TAILQ_HEAD(s_rxsr, sock_rx) reserved_rxs;
+
+	/*! Last time idle buffers were freed */
+	uint64_t last_trim_us;
 
 	/*! Connection id blocks */
 	uint64_t *ids;
@@ -1098,10 +1183,33 @@ typedef struct sock_ack {
 	 TAILQ_ENTRY(sock_ack) entry;
 } sock_ack_t;
 
+/* Locking
+ *
+ * ep->lock protects the endpoint-wide lists: idle_txs, idle_rxs, queued,
+ * pending, the tx/rx pools, the conn/active hashes, handles and rma_ops.
+ *
+ * sep->evt_lock protects ep->evts, so that cci_get_event() does not
+ * contend with progress for ep->lock. It is taken last and nothing is
+ * taken under it.
+ *
+ * sconn->lock protects the per-connection send/ack state: seq, seq_pending,
+ * pending, cwnd, ssthresh, acked, last_ack_ts, tx_seqs, acks, rma_id, rmas,
+ * the pending/status fields of the rma_ops hanging on rmas and the state of
+ * a tx once it is on tx_seqs.
+ *
+ * The receive-side fields (last_recvd_seq, ts, rnr) are only touched by the
+ * receive thread and are not locked.
+ *
+ * When both are needed, take ep->lock first, then sconn->lock. Never take
+ * ep->lock while holding a sconn->lock and never hold two sconn->locks.
+ */
 typedef struct sock_conn {
 	/*! Owning conn */
 	cci__conn_t *conn;
 
+	/*! Lock for the send/ack state, see above */
+	pthread_mutex_t lock;
+
 	/*! Status */
 	sock_conn_status_t status;
 
@@ -1171,7 +1279,7 @@ typedef struct sock_conn {
 } sock_conn_t;
 
 /*
- * Only call if holding the ep->lock and sconn->acks is not empty
+ * Only call if holding the sconn->lock and sconn->acks is not empty
  *
  * For ordered connections:
  * - If only one item, return 0
@@ -1213,6 +1321,18 @@ typedef struct sock_dev {
 
 	/*! Set socket buffers sizes */
 	uint32_t bufsize;
+
+	/*! Max number of txs per endpoint, 0 for SOCK_EP_TX_CNT */
+	uint32_t tx_buf_cnt;
+
+	/*! Max number of rxs per endpoint, 0 for SOCK_EP_RX_CNT */
+	uint32_t rx_buf_cnt;
+
+	/*! Progress from cci_get_event() instead of progress threads */
+	int poll;
+
+	/*! SO_BUSY_POLL value in microseconds, 0 to leave it unset */
+	int busy_poll;
 } sock_dev_t;
 
 typedef enum sock_fd_type {
@@ -33,6 +33,10 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #ifdef HAVE_IFADDRS_H
 #include <ifaddrs.h>
 #include <net/if.h>
@@ -125,14 +129,17 @@ static int ctp_sock_rma(cci_connection_t * connection,
                         const void *context,
                         int flags);
 static uint8_t sock_ip_hash(in_addr_t ip, uint16_t port);
-static void sock_progress_sends(cci__ep_t * ep);
+static int sock_progress_sends(cci__ep_t * ep);
 static void *sock_progress_thread(void *arg);
 static void *sock_recv_thread(void *arg);
-static void sock_ack_conns(cci__ep_t * ep);
+static int sock_ack_conns(cci__ep_t * ep);
 static inline int pack_piggyback_ack(cci__ep_t *ep,
                                      sock_conn_t *sconn, sock_tx_t *tx);
 static inline int sock_ack_sconn(sock_ep_t *sep, sock_conn_t *sconn);
 static int sock_recvfrom_ep(cci__ep_t * ep);
+static void sock_keepalive(cci__ep_t *ep);
+static void sock_trim_pools(cci__ep_t *ep);
+static void sock_flush_acks(cci__ep_t *ep);
 int progress_recv (cci__ep_t *ep);
 
 /*
@@ -318,9 +325,7 @@ static inline int sock_terminate_threads (sock_ep_t *sep)
 
 	assert (sep);
 
-	pthread_mutex_lock(&sep->progress_mutex);
-	pthread_cond_signal(&sep->wait_condition);
-	pthread_mutex_unlock(&sep->progress_mutex);
+	sock_wake_progress(sep);
 
 	pthread_join(sep->progress_tid, NULL);
 	pthread_join(sep->recv_tid, NULL);
@@ -330,6 +335,27 @@ static inline int sock_terminate_threads (sock_ep_t *sep)
 	return CCI_SUCCESS;
 }
 
+/*
+ * With progress=poll, the application thread does the work of both the
+ * recv and the progress threads. Concurrent callers do not wait for each
+ * other: whoever holds poll_lock makes progress for everybody.
+ */
+static void sock_progress_inline(cci__ep_t *ep)
+{
+	sock_ep_t *sep = ep->priv;
+
+	if (pthread_mutex_trylock(&sep->poll_lock))
+		return;
+
+	while (sock_recvfrom_ep(ep) == 1)
+		;
+	sock_keepalive(ep);
+	sock_progress_sends(ep);
+	sock_trim_pools(ep);
+
+	pthread_mutex_unlock(&sep->poll_lock);
+}
+
 static int ctp_sock_init(cci_plugin_ctp_t *plugin,
 			uint32_t abi_ver, uint32_t flags, uint32_t * caps)
 {
@@ -505,6 +531,26 @@ static int ctp_sock_init(cci_plugin_ctp_t *plugin,
 					const char *size_str = *arg + 8;
 					sdev->bufsize = strtol(size_str,
 					                       NULL, 0);
+				} else if (0 == strncmp("tx_buf_cnt=", *arg, 11)) {
+					const char *cnt_str = *arg + 11;
+					sdev->tx_buf_cnt = strtol(cnt_str,
+					                          NULL, 0);
+				} else if (0 == strncmp("rx_buf_cnt=", *arg, 11)) {
+					const char *cnt_str = *arg + 11;
+					sdev->rx_buf_cnt = strtol(cnt_str,
+					                          NULL, 0);
+				} else if (0 == strncmp("progress=", *arg, 9)) {
+					const char *mode = *arg + 9;
+					if (0 == strcmp("poll", mode))
+						sdev->poll = 1;
+					else if (0 != strcmp("thread", mode))
+						debug(CCI_DB_WARN,
+						      "%s: unknown progress mode %s",
+						      __func__, mode);
+				} else if (0 == strncmp("busy_poll=", *arg, 10)) {
+					const char *us_str = *arg + 10;
+					sdev->busy_poll = strtol(us_str,
+					                         NULL, 0);
 				} else if (0 == strncmp("interface=",
 				                        *arg, 10))
 				{
@@ -711,9 +757,10 @@ static int ctp_sock_create_endpoint(cci_device_t * device,
 		ret = CCI_ENOMEM;
 		goto out;
 	}
+	sdev = dev->priv;
 
-	ep->rx_buf_cnt = SOCK_EP_RX_CNT;
-	ep->tx_buf_cnt = SOCK_EP_TX_CNT;
+	ep->rx_buf_cnt = sdev->rx_buf_cnt ? sdev->rx_buf_cnt : SOCK_EP_RX_CNT;
+	ep->tx_buf_cnt = sdev->tx_buf_cnt ? sdev->tx_buf_cnt : SOCK_EP_TX_CNT;
 	ep->buffer_len = dev->device.max_send_size + SOCK_MAX_HDRS;
 	ep->tx_timeout = SOCK_EP_TX_TIMEOUT_SEC * 1000000;
 
@@ -726,6 +773,18 @@ static int ctp_sock_create_endpoint(cci_device_t * device,
 	sep->closing = 0;
 	pthread_mutex_init (&sep->progress_mutex, NULL);
 	pthread_cond_init (&sep->wait_condition, NULL);
+	pthread_mutex_init (&sep->poll_lock, NULL);
+	pthread_mutex_init (&sep->evt_lock, NULL);
+
+	/* Without progress threads, nothing would wake up an application
+	   blocking on the OS handle */
+	sep->poll = sdev->poll;
+	if (sep->poll && fd) {
+		debug(CCI_DB_WARN, "%s: OS handles are not supported with "
+		      "progress=poll", __func__);
+		ret = CCI_EINVAL;
+		goto out;
+	}
 
 	sep->sock = socket(PF_INET, SOCK_DGRAM, 0);
 	if (sep->sock == -1) {
@@ -733,8 +792,6 @@ static int ctp_sock_create_endpoint(cci_device_t * device,
 		goto out;
 	}
 
-	sdev = dev->priv;
-
 	if (sndbuf_size < sdev->bufsize)
 		sndbuf_size = sdev->bufsize;
 	if (rcvbuf_size < sdev->bufsize)
@@ -756,6 +813,16 @@ static int ctp_sock_create_endpoint(cci_device_t * device,
 			       __func__);
 	}
 
+#ifdef SO_BUSY_POLL
+	if (sdev->busy_poll > 0) {
+		ret = setsockopt (sep->sock, SOL_SOCKET, SO_BUSY_POLL,
+		                  &sdev->busy_poll, sizeof (sdev->busy_poll));
+		if (ret == -1)
+			debug (CCI_DB_WARN, "%s: Cannot set busy poll (%s)",
+			       __func__, strerror (errno));
+	}
+#endif
+
 #if CCI_DEBUG
 	{
 		socklen_t optlen;
@@ -813,61 +880,63 @@ static int ctp_sock_create_endpoint(cci_device_t * device,
 		TAILQ_INIT(&sep->active_hash[i]);
 	}
 
-	TAILQ_INIT(&sep->idle_txs);
-	TAILQ_INIT(&sep->idle_rxs);
+	TAILQ_INIT(&sep->all_txs);
+	TAILQ_INIT(&sep->all_rxs);
+	TAILQ_INIT(&sep->reserved_rxs);
+	for (i = 0; i < SOCK_BUF_CLASSES; i++) {
+		TAILQ_INIT(&sep->idle_txs[i]);
+		TAILQ_INIT(&sep->idle_rxs[i]);
+	}
 	TAILQ_INIT(&sep->handles);
 	TAILQ_INIT(&sep->rma_ops);
 	TAILQ_INIT(&sep->queued);
 	TAILQ_INIT(&sep->pending);
 
-	sep->tx_buf = calloc (1, ep->tx_buf_cnt * ep->buffer_len);
-	if (!sep->tx_buf) {
-		ret = CCI_ENOMEM;
-		goto out;
-	}
+	/* Start with a few buffers, mostly small ones; the pools grow on
+	   demand up to ep->tx_buf_cnt and ep->rx_buf_cnt */
+	for (i = 0; i < SOCK_BUF_CLASSES; i++) {
+		uint32_t n, tx_init, rx_init;
 
-	sep->txs = calloc (1, ep->tx_buf_cnt * sizeof (sock_tx_t));
-	if (!sep->txs) {
-		ret = CCI_ENOMEM;
-		goto out;
-	}
-
-	/* alloc txs */
-	for (i = 0; i < ep->tx_buf_cnt; i++) {
-		sock_tx_t *tx = &sep->txs[i];
+		tx_init = i == SOCK_BUF_SMALL ? SOCK_EP_TX_INIT
+		                              : SOCK_EP_TX_INIT / 8;
+		rx_init = i == SOCK_BUF_SMALL ? SOCK_EP_RX_INIT
+		                              : SOCK_EP_RX_INIT / 8;
 
-		tx->ctx = SOCK_CTX_TX;
-		tx->evt.event.type = CCI_EVENT_SEND;
-		tx->evt.ep = ep;
-		tx->buffer = (void*)((uintptr_t)sep->tx_buf
-		                     + (i * ep->buffer_len));
-		tx->len = 0;
-		TAILQ_INSERT_TAIL(&sep->idle_txs, tx, dentry);
-	}
-
-	sep->rx_buf = calloc (1, ep->rx_buf_cnt * ep->buffer_len);
-	if (!sep->rx_buf) {
-		ret = CCI_ENOMEM;
-		goto out;
-	}
+		for (n = 0; n < tx_init && sep->tx_cnt < ep->tx_buf_cnt; n++) {
+			sock_tx_t *tx = sock_alloc_tx(ep, i);
+			if (!tx) {
+				ret = CCI_ENOMEM;
+				goto out;
+			}
+			sock_put_tx_locked(sep, tx);
+		}
+		sep->tx_pool[i].min = n;
+		sep->tx_pool[i].idle_low = n;
 
-	sep->rxs = calloc (1, ep->rx_buf_cnt * sizeof (sock_rx_t));
-	if (!sep->rx_buf) {
-		ret = CCI_ENOMEM;
-		goto out;
+		for (n = 0; n < rx_init && sep->rx_cnt < ep->rx_buf_cnt; n++) {
+			sock_rx_t *rx = sock_alloc_rx(ep, i);
+			if (!rx) {
+				ret = CCI_ENOMEM;
+				goto out;
+			}
+			sock_put_rx_locked(sep, rx);
+		}
+		sep->rx_pool[i].min = n;
+		sep->rx_pool[i].idle_low = n;
 	}
+	sep->last_trim_us = sock_get_usecs();
 
-	/* alloc rxs */
-	for (i = 0; i < ep->rx_buf_cnt; i++) {
-		sock_rx_t *rx = &sep->rxs[i];
-
-		rx->ctx = SOCK_CTX_RX;
-		rx->evt.event.type = CCI_EVENT_RECV;
-		rx->evt.ep = ep;
-		rx->buffer = (void*)((uintptr_t)sep->rx_buf
-		                     + (i * ep->buffer_len));
-		rx->len = 0;
-		TAILQ_INSERT_TAIL(&sep->idle_rxs, rx, entry);
+	/* RX buffers set aside to resume from RNR mode, outside of the pool */
+	for (i = 0; i < SOCK_EP_RX_RESERVED; i++) {
+		sock_rx_t *rx = sock_alloc_rx(ep, SOCK_BUF_LARGE);
+		if (!rx) {
+			ret = CCI_ENOMEM;
+			goto out;
+		}
+		rx->reserved = 1;
+		sep->rx_pool[SOCK_BUF_LARGE].cnt--;
+		sep->rx_cnt--;
+		TAILQ_INSERT_TAIL(&sep->reserved_rxs, rx, entry);
 	}
 
 	ret = sock_set_nonblocking(sep->sock, SOCK_FD_EP, ep);
@@ -928,9 +997,11 @@ static int ctp_sock_create_endpoint(cci_device_t * device,
 	}
 #endif /* HAVE_SYS_EPOLL_H */
 
-	ret = sock_create_threads (ep);
-	if (ret)
-		goto out;
+	if (!sep->poll) {
+		ret = sock_create_threads (ep);
+		if (ret)
+			goto out;
+	}
 
 	CCI_EXIT;
 	return CCI_SUCCESS;
@@ -940,15 +1011,10 @@ out:
 	   a failure because the ep is added to the list of active endpoints
 	   by cci_create_endpoint(), AFTER the call to this function. */
 	if (sep) {
-		if (sep->txs)
-			free (sep->txs);
-		if (sep->tx_buf)
-			free (sep->tx_buf);
-
-		if (sep->rxs)
-			free (sep->rxs);
-		if (sep->rx_buf)
-			free (sep->rx_buf);
+		while (!TAILQ_EMPTY(&sep->all_txs))
+			sock_free_tx(ep, TAILQ_FIRST(&sep->all_txs));
+		while (!TAILQ_EMPTY(&sep->all_rxs))
+			sock_free_rx(ep, TAILQ_FIRST(&sep->all_rxs));
 
 		if (sep->ids)
 			free(sep->ids);
@@ -994,7 +1060,10 @@ static int ctp_sock_destroy_endpoint(cci_endpoint_t * endpoint)
 
 		pthread_mutex_unlock(&dev->lock);
 		pthread_mutex_unlock(&ep->lock);
-		sock_terminate_threads (sep);
+		if (sep->poll)
+			sock_flush_acks (ep);
+		else
+			sock_terminate_threads (sep);
 		pthread_mutex_lock(&dev->lock);
 		pthread_mutex_lock(&ep->lock);
 
@@ -1011,6 +1080,7 @@ static int ctp_sock_destroy_endpoint(cci_endpoint_t * endpoint)
 				sconn = TAILQ_FIRST(&sep->conn_hash[i]);
 				TAILQ_REMOVE(&sep->conn_hash[i], sconn, entry);
 				conn = sconn->conn;
+				pthread_mutex_destroy(&sconn->lock);
 				free(conn);
 				free(sconn);
 			}
@@ -1018,16 +1088,16 @@ static int ctp_sock_destroy_endpoint(cci_endpoint_t * endpoint)
 				sconn = TAILQ_FIRST(&sep->active_hash[i]);
 				TAILQ_REMOVE(&sep->active_hash[i], sconn, entry);
 				conn = sconn->conn;
+				pthread_mutex_destroy(&sconn->lock);
 				free(conn);
 				free(sconn);
 			}
 		}
 
-		free (sep->txs);
-		free (sep->tx_buf);
-
-		free (sep->rxs);
-		free (sep->rx_buf);
+		while (!TAILQ_EMPTY(&sep->all_txs))
+			sock_free_tx(ep, TAILQ_FIRST(&sep->all_txs));
+		while (!TAILQ_EMPTY(&sep->all_rxs))
+			sock_free_rx(ep, TAILQ_FIRST(&sep->all_rxs));
 
 		while (!TAILQ_EMPTY(&sep->rma_ops)) {
 			sock_rma_op_t *rma_op = TAILQ_FIRST(&sep->rma_ops);
@@ -1160,7 +1230,8 @@ static int ctp_sock_accept(cci_event_t *event, const void *context)
 	}
 
 	/* get a tx */
-	tx = sock_get_tx (ep);
+	tx = sock_get_tx (ep, sizeof(sock_header_r_t)
+	                      + sizeof(sock_handshake_t));
 	if (!tx) {
 		free(conn->priv);
 		free(conn);
@@ -1194,6 +1265,7 @@ static int ctp_sock_accept(cci_event_t *event, const void *context)
 		conn->connection.max_send_size = mss;
 
 	sconn = conn->priv;
+	pthread_mutex_init(&sconn->lock, NULL);
 	TAILQ_INIT(&sconn->tx_seqs);
 	TAILQ_INIT(&sconn->acks);
 	TAILQ_INIT(&sconn->rmas);
@@ -1266,9 +1338,7 @@ static int ctp_sock_accept(cci_event_t *event, const void *context)
 	pthread_mutex_unlock(&ep->lock);
 
 	/* try to progress txs */
-	pthread_mutex_lock(&sep->progress_mutex);
-	pthread_cond_signal(&sep->wait_condition);
-	pthread_mutex_unlock(&sep->progress_mutex);
+	sock_wake_progress(sep);
 	
 	CCI_EXIT;
 
@@ -1312,7 +1382,7 @@ static int ctp_sock_reject(cci_event_t *event)
 	sock_parse_seq_ts(&hdr_r->seq_ts, &peer_seq, &peer_ts);
 
 	/* get a tx */
-	tx = sock_get_tx (ep);
+	tx = sock_get_tx (ep, sizeof(sock_header_r_t));
 	if (!tx) {
 		ret = CCI_ENOBUFS;
 		goto out;
@@ -1353,9 +1423,7 @@ static int ctp_sock_reject(cci_event_t *event)
 	pthread_mutex_unlock(&ep->lock);
 
 	/* try to progress txs */
-	pthread_mutex_lock(&sep->progress_mutex);
-	pthread_cond_signal(&sep->wait_condition);
-	pthread_mutex_unlock(&sep->progress_mutex);
+	sock_wake_progress(sep);
 	
 #if CCI_DEBUG
 	{
@@ -1528,6 +1596,7 @@ static int ctp_sock_connect(cci_endpoint_t * endpoint,
 	}
 	sconn = conn->priv;
 	sconn->conn = conn;
+	pthread_mutex_init(&sconn->lock, NULL);
 	TAILQ_INIT(&sconn->tx_seqs);
 	TAILQ_INIT(&sconn->acks);
 	TAILQ_INIT(&sconn->rmas);
@@ -1579,7 +1648,8 @@ static int ctp_sock_connect(cci_endpoint_t * endpoint,
 	pthread_mutex_unlock(&ep->lock);
 
 	/* get a tx */
-	tx = sock_get_tx (ep);
+	tx = sock_get_tx (ep, sizeof(sock_header_r_t)
+	                      + sizeof(sock_handshake_t) + data_len);
 	if (!tx) {
 		/* FIXME leak */
 		CCI_EXIT;
@@ -1650,9 +1720,7 @@ static int ctp_sock_connect(cci_endpoint_t * endpoint,
 	pthread_mutex_unlock(&ep->lock);
 
 	/* try to progress txs */
-	pthread_mutex_lock(&sep->progress_mutex);
-	pthread_cond_signal(&sep->wait_condition);
-	pthread_mutex_unlock(&sep->progress_mutex);
+	sock_wake_progress(sep);
 
 	CCI_EXIT;
 	return CCI_SUCCESS;
@@ -1661,8 +1729,11 @@ out:
 	if (conn) {
 		if (conn->uri)
 			free((char *)conn->uri);
-		if (conn->priv)
-			free(conn->priv);
+		if (conn->priv) {
+			sconn = conn->priv;
+			pthread_mutex_destroy(&sconn->lock);
+			free(sconn);
+		}
 		free(conn);
 	}
 	CCI_EXIT;
@@ -1705,6 +1776,7 @@ static int ctp_sock_disconnect(cci_connection_t * connection)
 	TAILQ_REMOVE(&sep->conn_hash[i], sconn, entry);
 	pthread_mutex_unlock(&ep->lock);
 
+	pthread_mutex_destroy(&sconn->lock);
 	free(sconn);
 	free(conn);
 
@@ -1821,10 +1893,10 @@ static int ctp_sock_arm_os_handle(cci_endpoint_t * endpoint, int flags)
 static int
 ctp_sock_get_event(cci_endpoint_t * endpoint, cci_event_t ** const event)
 {
-	int ret = CCI_SUCCESS;
+	int ret = CCI_SUCCESS, empty = 0;
 	cci__ep_t *ep;
 	sock_ep_t *sep;
-	cci__evt_t *ev = NULL, *e;
+	cci__evt_t *ev = NULL;
 
 	CCI_ENTER;
 
@@ -1836,51 +1908,45 @@ ctp_sock_get_event(cci_endpoint_t * endpoint, cci_event_t ** const event)
 	ep = container_of(endpoint, cci__ep_t, endpoint);
 	sep = ep->priv;
 
-	/* try to progress sends... */
+	/* try to progress sends... This wake publishes no new work, so
+	   skip progress_mutex while a request is already latched */
 	if (!sep->closing) {
-		pthread_mutex_lock(&sep->progress_mutex);
-		pthread_cond_signal(&sep->wait_condition);
-		pthread_mutex_unlock(&sep->progress_mutex);
+		if (sep->poll)
+			sock_progress_inline(ep);
+		else if (!sep->progress_kick)
+			sock_wake_progress(sep);
 	}
 
-	pthread_mutex_lock(&ep->lock);
-
-	/* give the user the first event */
-	TAILQ_FOREACH(e, &ep->evts, entry) {
-		if (e->event.type == CCI_EVENT_SEND) {
-			/* NOTE: if it is blocking, skip it since sock_sendv()
-			* is waiting on it
-			*/
-			sock_tx_t *tx = container_of(e, sock_tx_t, evt);
-			if (tx->flags & CCI_FLAG_BLOCKING) {
-				continue;
-			} else {
-				ev = e;
-				break;
-			}
-		} else {
-			ev = e;
-			break;
-		}
+	/* give the user the first event; blocking sends never get here,
+	   sock_sendv() is woken up directly on completion. Most polls find
+	   nothing, so peek before taking the lock; an event that is just
+	   being queued is returned by the next call. */
+	if (!TAILQ_EMPTY(&ep->evts)) {
+		pthread_mutex_lock(&sep->evt_lock);
+		ev = TAILQ_FIRST(&ep->evts);
+		if (ev)
+			TAILQ_REMOVE(&ep->evts, ev, entry);
+		empty = TAILQ_EMPTY(&ep->evts);
+		pthread_mutex_unlock(&sep->evt_lock);
 	}
 
 	if (ev) {
-		TAILQ_REMOVE(&ep->evts, ev, entry);
 		*event = &ev->event;
 	} else {
 		*event = NULL;
 		/* No event is available and there are no available
 		   receive buffers. The application must return events
-		   before any more messages can be received. */
-                if (TAILQ_EMPTY(&sep->idle_rxs)) {
-                        ret = CCI_ENOBUFS;
-                } else {
-			ret = CCI_EAGAIN;
+		   before any more messages can be received. Peek first,
+		   ep->lock is only needed to confirm it. */
+		ret = CCI_EAGAIN;
+		if (sock_rxs_exhausted_locked(ep)) {
+			pthread_mutex_lock(&ep->lock);
+			if (sock_rxs_exhausted_locked(ep))
+				ret = CCI_ENOBUFS;
+			pthread_mutex_unlock(&ep->lock);
 		}
 	}
 
-	pthread_mutex_unlock(&ep->lock);
-
 	/* We read on the fd to block again */
 	if (ev && sep->event_fd) {
 		char a[1];
@@ -1888,7 +1954,7 @@ ctp_sock_get_event(cci_endpoint_t * endpoint, cci_event_t ** const event)
 
 		/* We bock again only and only if there is no more
 		   pending events */
-		if (event_queue_is_empty (ep)) {
+		if (empty) {
 			/* Draining events so the app thread can block */
 			rc = read (sep->fd[0], a, sizeof (a));
 			if (rc != sizeof (a)) {
@@ -1934,28 +2000,22 @@ static int ctp_sock_return_event(cci_event_t * event)
 	case CCI_EVENT_ACCEPT:
 		tx = container_of(evt, sock_tx_t, evt);
 		pthread_mutex_lock(&ep->lock);
-		/* insert at head to keep it in cache */
-		TAILQ_INSERT_HEAD(&sep->idle_txs, tx, dentry);
+		sock_put_tx_locked(sep, tx);
 		pthread_mutex_unlock(&ep->lock);
 		break;
 	case CCI_EVENT_RECV:
 	case CCI_EVENT_CONNECT_REQUEST:
 		rx = container_of(evt, sock_rx_t, evt);
-		pthread_mutex_lock(&ep->lock);
-		/* insert at head to keep it in cache */
-		TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-		pthread_mutex_unlock(&ep->lock);
+		sock_put_rx(ep, rx);
 		break;
 	case CCI_EVENT_CONNECT:
 		rx = container_of (evt, sock_rx_t, evt);
 		if (rx->ctx == SOCK_CTX_RX) {
-			pthread_mutex_lock(&ep->lock);
-			TAILQ_INSERT_HEAD (&sep->idle_rxs, rx, entry);
-			pthread_mutex_unlock(&ep->lock);
+			sock_put_rx(ep, rx);
 		} else {
 			tx = (sock_tx_t*)rx;
 			pthread_mutex_lock(&ep->lock);
-			TAILQ_INSERT_HEAD (&sep->idle_txs, tx, dentry);
+			sock_put_tx_locked(sep, tx);
 			pthread_mutex_unlock(&ep->lock);
 		}
 		break;
@@ -1977,7 +2037,7 @@ static void sock_progress_pending(cci__ep_t * ep)
 	int ret;
 	uint64_t now;
 	sock_tx_t *tx;
-	cci__evt_t *evt, *tmp, *my_temp_evt;
+	cci__evt_t *evt, *tmp;
 	union cci_event *event;	/* generic CCI event */
 	cci__conn_t *conn;
 	sock_conn_t *sconn 	= NULL;
@@ -2002,10 +2062,19 @@ static void sock_progress_pending(cci__ep_t * ep)
 		sock_tx_t *tx = container_of (evt, sock_tx_t, evt);
 
 		conn = evt->conn;
-		if (conn)
-			sconn = conn->priv;
+		sconn = conn ? conn->priv : NULL;
 		event = &evt->event;
 
+		if (sconn)
+			pthread_mutex_lock(&sconn->lock);
+
+		/* Acked meanwhile, sock_handle_ack() dequeues it */
+		if (tx->state != SOCK_TX_PENDING) {
+			if (sconn)
+				pthread_mutex_unlock(&sconn->lock);
+			continue;
+		}
+
 		assert(tx->last_attempt_us != 0ULL);
 
 		/* has it timed out? */
@@ -2021,11 +2090,10 @@ static void sock_progress_pending(cci__ep_t * ep)
 
 			/* set status and add to completed events */
 
-			if (tx->msg_type == SOCK_MSG_SEND)
-				sconn->pending--;
-
 			switch (tx->msg_type) {
 			case SOCK_MSG_SEND:
+				sconn->pending--;
+				TAILQ_REMOVE(&sconn->tx_seqs, tx, tx_seq);
 				event->send.status = CCI_ETIMEDOUT;
 				if (tx->rnr != 0) {
 					event->send.status = CCI_ERR_RNR;
@@ -2035,12 +2103,10 @@ static void sock_progress_pending(cci__ep_t * ep)
 					   following messages as RNR */
 					if (conn->connection.attribute == CCI_CONN_ATTR_RO) {
 						sock_tx_t *my_temp_tx;
-						TAILQ_FOREACH_SAFE(my_temp_evt,
-						                   &sep->pending,
-						                   entry,
-						                   tmp)
+						TAILQ_FOREACH(my_temp_tx,
+						              &sconn->tx_seqs,
+						              tx_seq)
 						{
-							my_temp_tx = container_of (my_temp_evt, sock_tx_t, evt);
 							if (my_temp_tx->seq > tx->seq)
 								my_temp_tx->rnr = 1;
 						}
@@ -2049,10 +2115,9 @@ static void sock_progress_pending(cci__ep_t * ep)
 				break;
 			case SOCK_MSG_RMA_READ_REQUEST:
 			case SOCK_MSG_RMA_WRITE:
-				pthread_mutex_lock(&ep->lock);
+				TAILQ_REMOVE(&sconn->tx_seqs, tx, tx_seq);
 				tx->rma_op->pending--;
 				tx->rma_op->status = CCI_ETIMEDOUT;
-				pthread_mutex_unlock(&ep->lock);
 				break;
 			case SOCK_MSG_CONN_REQUEST: {
 				int i;
@@ -2066,9 +2131,9 @@ static void sock_progress_pending(cci__ep_t * ep)
 				i = sock_ip_hash(sconn->sin.sin_addr.s_addr,
 				                 0);
 				active_list = &sep->active_hash[i];
-				pthread_mutex_lock(&ep->lock);
 				TAILQ_REMOVE(active_list, sconn, entry);
-				pthread_mutex_unlock(&ep->lock);
+				pthread_mutex_unlock(&sconn->lock);
+				pthread_mutex_destroy(&sconn->lock);
 				free(sconn);
 				free(conn);
 				sconn = NULL;
@@ -2086,7 +2151,7 @@ static void sock_progress_pending(cci__ep_t * ep)
 				    == CCI_ECONNREFUSED)
 				{
 					/* store locally until we can drop the
-					   dev->lock */
+					   ep->lock */
 					debug_ep (ep, CCI_DB_CONN,
 					          "%s: No ACK of the reject, "
 					          "dropping pending msg",
@@ -2100,9 +2165,14 @@ static void sock_progress_pending(cci__ep_t * ep)
 			case SOCK_MSG_CONN_ACK:
 			default:
 				/* TODO */
+				if (sconn)
+					pthread_mutex_unlock(&sconn->lock);
+				pthread_mutex_unlock(&ep->lock);
 				CCI_EXIT;
 				return;
 			}
+			if (sconn)
+				pthread_mutex_unlock(&sconn->lock);
 			/* if SILENT, put idle tx */
 			if (tx->flags & CCI_FLAG_SILENT &&
 				(tx->msg_type == SOCK_MSG_SEND ||
@@ -2110,12 +2180,12 @@ static void sock_progress_pending(cci__ep_t * ep)
 
 				tx->state = SOCK_TX_IDLE;
 				/* store locally until we can drop the
-				   dev->lock */
+				   ep->lock */
 				TAILQ_INSERT_HEAD(&idle_txs, tx, dentry);
 			} else {
-				tx->state = SOCK_TX_COMPLETED;
 				/* store locally until we can drop the
-				   dev->lock */
+				   ep->lock; it is marked completed when
+				   handed to the application */
 				TAILQ_INSERT_TAIL(&evts, evt, entry);
 			}
 			continue;
@@ -2126,6 +2196,8 @@ static void sock_progress_pending(cci__ep_t * ep)
 		if ((tx->last_attempt_us +
 		    ((1 << tx->send_count) * SOCK_RESEND_TIME_SEC * 1000000)) >
 		     now) {
+			if (sconn)
+				pthread_mutex_unlock(&sconn->lock);
 			continue;
 		}
 
@@ -2153,6 +2225,7 @@ static void sock_progress_pending(cci__ep_t * ep)
 		         __func__, sock_msg_type(tx->msg_type), tx->seq,
 		         tx->send_count);
 		pack_piggyback_ack (ep, sconn, tx);
+		pthread_mutex_unlock(&sconn->lock);
 		ret = sock_sendto(sep->sock, tx->buffer, tx->len, tx->rma_ptr,
 		                  tx->rma_len, sconn->sin);
 		if (tx->rma_ptr == NULL && ret != tx->len) {
@@ -2180,17 +2253,22 @@ static void sock_progress_pending(cci__ep_t * ep)
 		ep = tx->evt.ep;
 		sep = ep->priv;
 		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_HEAD(&sep->idle_txs, tx, dentry);
+		sock_put_tx_locked(sep, tx);
 		pthread_mutex_unlock(&ep->lock);
 	}
 
 	/* transfer evts to the ep's list */
 	while (!TAILQ_EMPTY(&evts)) {
+		int queued;
+
 		evt = TAILQ_FIRST(&evts);
 		TAILQ_REMOVE(&evts, evt, entry);
 		ep = evt->ep;
-		sock_queue_event (ep, evt);
-		if (sep->event_fd) {
+		pthread_mutex_lock(&ep->lock);
+		queued = sock_complete_tx_locked(ep,
+				container_of(evt, sock_tx_t, evt));
+		pthread_mutex_unlock(&ep->lock);
+		if (queued && sep->event_fd) {
 			int rc;
 			rc = write (sep->fd[1], "a", 1);
 			if (rc != 1) {
@@ -2205,6 +2283,7 @@ static void sock_progress_pending(cci__ep_t * ep)
 	return;
 }
 
+/* Caller must hold sconn->lock */
 static inline int 
 pack_piggyback_ack (cci__ep_t *ep, sock_conn_t *sconn, sock_tx_t *tx)
 {
@@ -2224,6 +2303,7 @@ pack_piggyback_ack (cci__ep_t *ep, sock_conn_t *sconn, sock_tx_t *tx)
 			sock_header_r_t *hdr_r = tx->buffer;
 			hdr_r->pb_ack = ack->start;
 			TAILQ_REMOVE(&sconn->acks, ack, entry);
+			free(ack);
 			ack = TAILQ_FIRST(&sconn->acks);
 			/* We could get now from the caller if we wanted to */
 			now = sock_get_usecs();
@@ -2281,6 +2361,11 @@ static void sock_progress_queued(cci__ep_t * ep)
 			is_reliable = cci_conn_is_reliable(conn);
 		}
 
+		/* Held until the tx is on sep->pending so that an early ack
+		   cannot miss it */
+		if (sconn)
+			pthread_mutex_lock(&sconn->lock);
+
 		/* try to send it */
 
 		/*
@@ -2333,10 +2418,14 @@ static void sock_progress_queued(cci__ep_t * ep)
 					      "%s: timeout of %s msg",
 					      __func__,
 					      sock_msg_type(tx->msg_type));
-					pthread_mutex_lock(&ep->lock);
+					if (sconn)
+						pthread_mutex_unlock(&sconn->lock);
+					pthread_mutex_unlock(&ep->lock);
 					CCI_EXIT;
 					return;
 				}
+				if (sconn)
+					pthread_mutex_unlock(&sconn->lock);
 				TAILQ_REMOVE(&sep->queued, evt, entry);
 
 				/* if SILENT, put idle tx */
@@ -2350,9 +2439,9 @@ static void sock_progress_queued(cci__ep_t * ep)
 					TAILQ_INSERT_HEAD(&idle_txs,
 					                  tx, dentry);
 				} else {
-					tx->state = SOCK_TX_COMPLETED;
 					/* store locally until we can drop the
-					 * dev->lock */
+					 * ep->lock; it is marked completed
+					 * when handed to the application */
 					TAILQ_INSERT_TAIL(&evts, evt, entry);
 				}
 				continue;
@@ -2361,6 +2450,8 @@ static void sock_progress_queued(cci__ep_t * ep)
 			if (tx->last_attempt_us
 			    + (SOCK_RESEND_TIME_SEC * 1000000) > now)
 			{
+				if (sconn)
+					pthread_mutex_unlock(&sconn->lock);
 				continue;
 			}
 		}
@@ -2372,6 +2463,18 @@ static void sock_progress_queued(cci__ep_t * ep)
 		}
 #endif
 
+		/* For RMA Writes and RMA read request, we only allow a given
+		   number of messages to be in fly */
+		if (tx->msg_type == SOCK_MSG_RMA_WRITE ||
+		    tx->msg_type == SOCK_MSG_RMA_READ_REQUEST)
+		{
+			if (tx->rma_op->pending >= SOCK_RMA_DEPTH) {
+				if (sconn)
+					pthread_mutex_unlock(&sconn->lock);
+				continue;
+			}
+		}
+
 		tx->last_attempt_us = now;
 		tx->send_count = 1;
 
@@ -2394,16 +2497,6 @@ static void sock_progress_queued(cci__ep_t * ep)
 		}
 #endif
 
-		/* For RMA Writes and RMA read request, we only allow a given
-		   number of messages to be in fly */
-		if (tx->msg_type == SOCK_MSG_RMA_WRITE ||
-		    tx->msg_type == SOCK_MSG_RMA_READ_REQUEST)
-		{
-			if (tx->rma_op->pending >= SOCK_RMA_DEPTH) {
-				continue;
-			}
-		}
-
 		/* need to send it */
 
 		debug_ep(ep, CCI_DB_MSG, "%s: sending %s msg seq %u",
@@ -2449,6 +2542,8 @@ static void sock_progress_queued(cci__ep_t * ep)
 					TAILQ_REMOVE(&sconn->tx_seqs,
 					             tx, tx_seq);
 				}
+				if (sconn)
+					pthread_mutex_unlock(&sconn->lock);
 				continue;
 			}
 		} else {
@@ -2480,11 +2575,16 @@ static void sock_progress_queued(cci__ep_t * ep)
 				if (tx->msg_type == SOCK_MSG_RMA_WRITE ||
 				    tx->msg_type == SOCK_MSG_RMA_READ_REQUEST)
 					tx->rma_op->pending++;
+			} else if (tx->flags & CCI_FLAG_BLOCKING) {
+				/* the sender reclaims the tx */
+				sock_complete_tx_locked(ep, tx);
 			} else {
 				tx->state = SOCK_TX_COMPLETED;
 				TAILQ_INSERT_TAIL(&idle_txs, tx, dentry);
 			}
 		}
+		if (sconn)
+			pthread_mutex_unlock(&sconn->lock);
 	}
 	pthread_mutex_unlock(&ep->lock);
 
@@ -2495,16 +2595,21 @@ static void sock_progress_queued(cci__ep_t * ep)
 		ep = tx->evt.ep;
 		sep = ep->priv;
 		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_HEAD(&sep->idle_txs, tx, dentry);
+		sock_put_tx_locked(sep, tx);
 		pthread_mutex_unlock(&ep->lock);
 	}
 
 	/* transfer evts to the ep's list */
 	while (!TAILQ_EMPTY(&evts)) {
+		int queued;
+
 		evt = TAILQ_FIRST(&evts);
 		TAILQ_REMOVE(&evts, evt, entry);
-		sock_queue_event (evt->ep, evt);
-		if (sep->event_fd) {
+		pthread_mutex_lock(&evt->ep->lock);
+		queued = sock_complete_tx_locked(evt->ep,
+				container_of(evt, sock_tx_t, evt));
+		pthread_mutex_unlock(&evt->ep->lock);
+		if (queued && sep->event_fd) {
 			int rc;
 			rc = write (sep->fd[1], "a", 1);
 			if (rc != 1) {
@@ -2519,15 +2624,25 @@ static void sock_progress_queued(cci__ep_t * ep)
 	return;
 }
 
-static void sock_progress_sends(cci__ep_t * ep)
+/* Returns non-zero if some work (delayed ACKs, unacked or queued sends)
+   is left and the progress thread should come back to it later */
+static int sock_progress_sends(cci__ep_t * ep)
 {
+	sock_ep_t *sep = ep->priv;
+	int deferred;
+
 	CCI_ENTER;
 	sock_progress_pending (ep);
-	sock_ack_conns(ep);
+	deferred = sock_ack_conns(ep);
 	sock_progress_queued (ep);
+
+	pthread_mutex_lock(&ep->lock);
+	if (!TAILQ_EMPTY(&sep->pending) || !TAILQ_EMPTY(&sep->queued))
+		deferred++;
+	pthread_mutex_unlock(&ep->lock);
 	CCI_EXIT;
 
-	return;
+	return deferred;
 }
 
 static int ctp_sock_send(cci_connection_t * connection,
@@ -2586,7 +2701,7 @@ static int ctp_sock_sendv(cci_connection_t * connection,
 	is_reliable = cci_conn_is_reliable(conn);
 
 	/* get a tx */
-	tx = sock_get_tx (ep);
+	tx = sock_get_tx (ep, sizeof(sock_header_r_t) + data_len);
 	if (!tx) {
 		CCI_EXIT;
 		return CCI_ENOBUFS;
@@ -2626,19 +2741,10 @@ static int ctp_sock_sendv(cci_connection_t * connection,
 	sock_pack_send(hdr, data_len, sconn->peer_id);
 	tx->len = sizeof(*hdr);
 
-	/* if reliable, add seq and ack */
-
-	if (is_reliable) {
-		sock_header_r_t *hdr_r = tx->buffer;
-		uint32_t ts = 0;
-
-		pthread_mutex_lock(&ep->lock);
-		tx->seq = ++(sconn->seq);
-		pthread_mutex_unlock(&ep->lock);
-
-		sock_pack_seq_ts(&hdr_r->seq_ts, tx->seq, ts);
-		tx->len = sizeof(*hdr_r);
-	}
+	/* if reliable, make room for seq and ack; the seq is assigned when
+	   queuing so that the wire order matches the seq order */
+	if (is_reliable)
+		tx->len = sizeof(sock_header_r_t);
 	ptr = (void*)((uintptr_t)tx->buffer + tx->len);
 
 	/* copy user data to buffer
@@ -2670,13 +2776,21 @@ static int ctp_sock_sendv(cci_connection_t * connection,
 		                   tx->rma_len,
 		                   sconn->sin);
 		if (ret == tx->len) {
-			/* queue event on enpoint's completed queue */
-			tx->state = SOCK_TX_COMPLETED;
-			sock_queue_event (ep, evt);
+			int queued;
+
 			debug(CCI_DB_MSG, "%s: sent UU msg with %d bytes",
 			      __func__, tx->len - (int)sizeof(sock_header_t));
+
+			/* a blocking UU send is complete once it is on the
+			   wire, hand the tx straight back */
+			pthread_mutex_lock(&ep->lock);
+			queued = sock_complete_tx_locked(ep, tx);
+			if (!queued)
+				sock_put_tx_locked(sep, tx);
+			pthread_mutex_unlock(&ep->lock);
+
 			/* waking up the app thread if it is blocking on a OS handle */
-			if (sep->event_fd) {
+			if (queued && sep->event_fd) {
 				int rc;
 				rc = write (sep->fd[1], "a", 1);
 				if (rc != 1) {
@@ -2686,9 +2800,7 @@ static int ctp_sock_sendv(cci_connection_t * connection,
 			}
 
 			if (!sep->closing) {
-				pthread_mutex_lock(&sep->progress_mutex);
-				pthread_cond_signal(&sep->wait_condition);
-				pthread_mutex_unlock(&sep->progress_mutex);
+				sock_wake_progress(sep);
 			}
 
 			CCI_EXIT;
@@ -2711,41 +2823,45 @@ static int ctp_sock_sendv(cci_connection_t * connection,
 	/* insert at tail of sock device's queued list */
 	tx->state = SOCK_TX_QUEUED;
 	pthread_mutex_lock(&ep->lock);
+	if (is_reliable) {
+		sock_header_r_t *hdr_r = tx->buffer;
+
+		pthread_mutex_lock(&sconn->lock);
+		tx->seq = ++(sconn->seq);
+		pthread_mutex_unlock(&sconn->lock);
+		sock_pack_seq_ts(&hdr_r->seq_ts, tx->seq, 0);
+	}
 	TAILQ_INSERT_TAIL(&sep->queued, evt, entry);
 	pthread_mutex_unlock(&ep->lock);
 
 	/* try to progress txs */
 	if (!sep->closing) {
-		pthread_mutex_lock(&sep->progress_mutex);
-		pthread_cond_signal(&sep->wait_condition);
-		pthread_mutex_unlock(&sep->progress_mutex);
+		if (sep->poll)
+			sock_progress_inline(ep);
+		else
+			sock_wake_progress(sep);
 	}
 
 	ret = CCI_SUCCESS;
 
-	/* if blocking, wait for completion */
+	/* if blocking, sleep until the ACK (or a timeout) completes the tx;
+	   the completion never reaches ep->evts, so we reclaim the tx here.
+	   Without progress threads, we have to get the ACK ourselves. */
 	if (tx->flags & CCI_FLAG_BLOCKING) {
-		struct timeval tv = { 0, SOCK_PROG_TIME_US / 2 };
-
-		while (tx->state != SOCK_TX_COMPLETED)
-			select(0, NULL, NULL, NULL, &tv);
-
-		/* get status and cleanup */
-		ret = event->send.status;
-
 		pthread_mutex_lock(&ep->lock);
-		TAILQ_REMOVE(&ep->evts, evt, entry);
-		pthread_mutex_unlock(&ep->lock);
-		/* waking up the app thread if it is blocking on a OS handle */
-		if (sep->event_fd) {
-			int rc;
-			rc = write (sep->fd[1], "a", 1);
-			if (rc != 1)
-				ret = CCI_ERROR;
+		while (tx->state != SOCK_TX_COMPLETED) {
+			if (sep->poll) {
+				pthread_mutex_unlock(&ep->lock);
+				sock_progress_inline(ep);
+				pthread_mutex_lock(&ep->lock);
+			} else {
+				pthread_cond_wait(&tx->done, &ep->lock);
+			}
 		}
 
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_HEAD(&sep->idle_txs, tx, dentry);
+		/* get status and cleanup */
+		ret = event->send.status;
+		sock_put_tx_locked(sep, tx);
 		pthread_mutex_unlock(&ep->lock);
 	}
 
@@ -2925,7 +3041,6 @@ static int ctp_sock_rma(cci_connection_t * connection,
 	rma_op->local_offset = local_offset;
 	rma_op->remote_handle = remote_handle;
 	rma_op->remote_offset = remote_offset;
-	rma_op->id = ++(sconn->rma_id);
 	RMA_PAYLOAD_SIZE (connection, max_send_size);
 	rma_op->num_msgs = data_len / max_send_size;
 	if (data_len % max_send_size)
@@ -2933,6 +3048,8 @@ static int ctp_sock_rma(cci_connection_t * connection,
 	rma_op->completed = 0;
 	rma_op->status = CCI_SUCCESS;	/* for now */
 	rma_op->context = (void *)context;
+	/* RMA does not block, always complete with an event */
+	flags &= ~CCI_FLAG_BLOCKING;
 	rma_op->flags = flags;
 	rma_op->msg_len = (uint16_t) msg_len;
 	rma_op->tx = NULL;
@@ -2946,7 +3063,6 @@ static int ctp_sock_rma(cci_connection_t * connection,
 		uint32_t i, cnt;
 		int err = 0;
 		sock_tx_t **txs = NULL;
-		uint64_t old_seq = 0ULL;
 
 		debug(CCI_DB_MSG,
 		      "%s: starting RMA %s (start: %p, len: %"PRIu64") ***",
@@ -2967,25 +3083,28 @@ static int ctp_sock_rma(cci_connection_t * connection,
 			return CCI_ENOMEM;
 		}
 
+		/* fragments only carry the RMA header, but the last one
+		   acked is reused for the remote completion */
 		pthread_mutex_lock(&ep->lock);
-		old_seq = sconn->seq;
 		for (i = 0; i < cnt; i++) {
-			if (!TAILQ_EMPTY(&sep->idle_txs)) {
-				txs[i] = TAILQ_FIRST(&sep->idle_txs);
-				TAILQ_REMOVE(&sep->idle_txs, txs[i], dentry);
-				INIT_TX (txs[i]);
-				txs[i]->seq = ++(sconn->seq);
-			} else
+			txs[i] = sock_get_tx_locked(ep,
+			                            sizeof(sock_rma_header_t)
+			                            + sizeof(uint32_t) + msg_len);
+			if (!txs[i])
 				err++;
 		}
 		if (err) {
 			for (i = 0; i < cnt; i++) {
 				if (txs[i])
-					TAILQ_INSERT_HEAD(&sep->idle_txs,
-							txs[i], dentry);
+					sock_put_tx_locked(sep, txs[i]);
 			}
 			local->refcnt--;
-			sconn->seq = old_seq;
+		} else {
+			pthread_mutex_lock(&sconn->lock);
+			rma_op->id = ++(sconn->rma_id);
+			for (i = 0; i < cnt; i++)
+				txs[i]->seq = ++(sconn->seq);
+			pthread_mutex_unlock(&sconn->lock);
 		}
 		pthread_mutex_unlock(&ep->lock);
 
@@ -3072,7 +3191,9 @@ static int ctp_sock_rma(cci_connection_t * connection,
 		pthread_mutex_lock(&ep->lock);
 		for (i = 0; i < cnt; i++)
 			TAILQ_INSERT_TAIL(&sep->queued, &(txs[i])->evt, entry);
+		pthread_mutex_lock(&sconn->lock);
 		TAILQ_INSERT_TAIL(&sconn->rmas, rma_op, rmas);
+		pthread_mutex_unlock(&sconn->lock);
 		TAILQ_INSERT_TAIL(&sep->rma_ops, rma_op, entry);
 		pthread_mutex_unlock(&ep->lock);
 
@@ -3105,7 +3226,7 @@ Walk sconn->acks:
 */
 static inline void sock_handle_seq(sock_conn_t * sconn, uint32_t seq)
 {
-	int done = 0;
+	int done = 0, force = 0;
 	sock_ack_t *ack = NULL;
 	sock_ack_t *last = NULL;
 	sock_ack_t *tmp = NULL;
@@ -3114,13 +3235,14 @@ static inline void sock_handle_seq(sock_conn_t * sconn, uint32_t seq)
 	cci_endpoint_t *endpoint = connection->endpoint;
 	cci__ep_t *ep = container_of(endpoint, cci__ep_t, endpoint);
 
+	pthread_mutex_lock(&sconn->lock);
 	if (SOCK_SEQ_LTE(seq, sconn->acked)) {
 		debug(CCI_DB_MSG, "%s: ignoring seq %u (acked %u) ***",
 		      __func__, seq, sconn->acked);
+		pthread_mutex_unlock(&sconn->lock);
 		return;
 	}
 
-	pthread_mutex_lock(&ep->lock);
 	TAILQ_FOREACH_SAFE(ack, &sconn->acks, entry, tmp) {
 		if (SOCK_SEQ_GTE(seq, ack->start) &&
 			SOCK_SEQ_LTE(seq, ack->end)) {
@@ -3155,14 +3277,13 @@ static inline void sock_handle_seq(sock_conn_t * sconn, uint32_t seq)
 				next->start = ack->start;
 				TAILQ_REMOVE(&sconn->acks, ack, entry);
 				free(ack);
+				ack = next;
 			}
 
 			/* Forcing ACK */
 			if (ack->end - ack->start >= PENDING_ACK_THRESHOLD) {
 				debug(CCI_DB_MSG, "%s: Forcing ACK", __func__);
-				pthread_mutex_unlock(&ep->lock);
-				sock_ack_conns (ep);
-				pthread_mutex_lock(&ep->lock);
+				force = 1;
 			}
 
 			done = 1;
@@ -3196,7 +3317,9 @@ static inline void sock_handle_seq(sock_conn_t * sconn, uint32_t seq)
 			      seq);
 		}
 	}
-	pthread_mutex_unlock(&ep->lock);
+	if (force)
+		sock_ack_sconn(ep->priv, sconn);
+	pthread_mutex_unlock(&sconn->lock);
 
 	return;
 }
@@ -3270,6 +3393,7 @@ static void sock_handle_rnr(sock_conn_t * sconn, uint32_t seq, uint32_t ts)
 	UNUSED_PARAM (ts);
 
 	/* Find the corresponding SEQ/TS */
+	pthread_mutex_lock(&sconn->lock);
 	TAILQ_FOREACH_SAFE(tx, &sconn->tx_seqs, tx_seq, tmp) {
 		if (tx->seq == seq) {
 			debug(CCI_DB_MSG,
@@ -3279,6 +3403,7 @@ static void sock_handle_rnr(sock_conn_t * sconn, uint32_t seq, uint32_t ts)
 			found = 1;
 		}
 	}
+	pthread_mutex_unlock(&sconn->lock);
 
 	/* We also mark the conn as RNR */
 	if (sconn->rnr == 0)
@@ -3311,6 +3436,7 @@ sock_handle_nack (sock_conn_t * sconn,
 	/* If the message is still in the pending queue, we resend it,
 	   otherwise it means the message has been acked meanwhile and
 	   therefore we can ignore the NACK */
+	pthread_mutex_lock(&sconn->lock);
 	TAILQ_FOREACH_SAFE (tx, &sconn->tx_seqs, tx_seq, tmp) {
 		if (tx->seq == seq) {
 			/* Resend and return */
@@ -3324,19 +3450,55 @@ sock_handle_nack (sock_conn_t * sconn,
 			             tx->rma_ptr,
 			             tx->rma_len,
 			             sconn->sin);
-			return;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&sconn->lock);
 
 	return;
 }
 
+/* Acked txs waiting for the ep->lock, linked by dentry */
+TAILQ_HEAD(s_acked_txs, sock_tx);
+
+/*
+ * Take an acked tx off sconn->tx_seqs. Caller must hold sconn->lock.
+ * The tx stays on sep->pending until the caller gets the ep->lock but,
+ * since it is no longer SOCK_TX_PENDING, sock_progress_pending() will
+ * not touch it meanwhile.
+ */
+static inline void
+sock_ack_tx(sock_conn_t *sconn, sock_tx_t *tx, struct s_acked_txs *acked)
+{
+	TAILQ_REMOVE(&sconn->tx_seqs, tx, tx_seq);
+	if (tx->msg_type == SOCK_MSG_RMA_WRITE
+	    || tx->msg_type == SOCK_MSG_RMA_READ_REQUEST)
+		tx->rma_op->pending--;
+	if (tx->msg_type == SOCK_MSG_SEND) {
+		sconn->pending--;
+#if 0
+		if (sconn->pending <= sconn->ssthresh) {
+			sconn->cwnd++;
+			debug(CCI_DB_INFO, "%s increase cwnd from %d to %d",
+			      __func__, sconn->cwnd - 1, sconn->cwnd);
+		} else {
+			sconn->cwnd++;
+		}
+#endif
+	}
+	tx->state = SOCK_TX_IDLE;
+	TAILQ_INSERT_TAIL(acked, tx, dentry);
+}
+
 /*!
 Handle incoming ack
 
-Check the device pending list for the matching tx
-	if found, remove it and hang it on the completion list
+Check the connection's tx_seqs for the matching txs
+	if found, remove them and hang them on the completion list
 	if not found, ignore (it is a duplicate)
+
+Only sconn->lock is held while walking tx_seqs; ep->lock is taken afterwards
+to move the acked txs off sep->pending.
 */
 static void
 sock_handle_ack(sock_conn_t * sconn,
@@ -3351,20 +3513,16 @@ sock_handle_ack(sock_conn_t * sconn,
 	cci_connection_t *connection = &conn->connection;
 	cci_endpoint_t *endpoint = connection->endpoint;
 	cci__ep_t *ep = container_of(endpoint, cci__ep_t, endpoint);
-	cci__dev_t *dev = ep->dev;
 	sock_ep_t *sep = ep->priv;
 	sock_tx_t *tx = NULL;
 	sock_tx_t *tmp = NULL;
 	sock_header_r_t *hdr_r = rx->buffer;
 	uint32_t acks[SOCK_MAX_SACK * 2];
 
-	TAILQ_HEAD(s_idle_txs, sock_tx) idle_txs
-		= TAILQ_HEAD_INITIALIZER(idle_txs);
+	struct s_acked_txs acked = TAILQ_HEAD_INITIALIZER(acked);
 	TAILQ_HEAD(s_evts, cci__evt) evts = TAILQ_HEAD_INITIALIZER(evts);
-	TAILQ_HEAD(s_queued, sock_tx) queued = TAILQ_HEAD_INITIALIZER(queued);
-	TAILQ_INIT(&idle_txs);                                                  
+	TAILQ_INIT(&acked);
 	TAILQ_INIT(&evts);
-	TAILQ_INIT(&queued);
 
 	assert(id == sconn->id);
 	assert(count > 0);
@@ -3380,23 +3538,16 @@ sock_handle_ack(sock_conn_t * sconn,
 	}
 	sock_parse_ack(hdr_r, type, acks, count);
 
-	if (type == SOCK_MSG_ACK_ONLY) {
-		if (sconn->seq_pending == acks[0] - 1)
-			sconn->seq_pending = acks[0];
-	} else if (type == SOCK_MSG_ACK_UP_TO) {
-		sconn->seq_pending = acks[0];
-	} else if (type == SOCK_MSG_SEND
-	           || type == SOCK_MSG_RMA_WRITE
-	           || type == SOCK_MSG_RMA_WRITE_DONE
-	           || type == SOCK_MSG_RMA_READ_REQUEST
-	           || type == SOCK_MSG_RMA_READ_REPLY)
+	if (type == SOCK_MSG_SEND
+	    || type == SOCK_MSG_RMA_WRITE
+	    || type == SOCK_MSG_RMA_WRITE_DONE
+	    || type == SOCK_MSG_RMA_READ_REQUEST
+	    || type == SOCK_MSG_RMA_READ_REPLY)
 	{
 		/* Piggybacked ACK */
 		acks[0] = hdr_r->pb_ack;
 		/* Reset hdr_r->pb_ack so we cannot do this again later */
 		hdr_r->pb_ack = 0;
-		if (sconn->seq_pending == acks[0] - 1)
-			sconn->seq_pending = acks[0];
 	}
 
 	/*
@@ -3408,13 +3559,17 @@ sock_handle_ack(sock_conn_t * sconn,
 	if (type == SOCK_MSG_ACK_ONLY || type == SOCK_MSG_ACK_UP_TO
 	                              || type == SOCK_MSG_SACK)
 	{
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-		pthread_mutex_unlock(&ep->lock);
+		sock_put_rx(ep, rx);
+	}
+
+	pthread_mutex_lock(&sconn->lock);
+	if (type == SOCK_MSG_ACK_UP_TO) {
+		sconn->seq_pending = acks[0];
+	} else if (type != SOCK_MSG_SACK) {
+		if (sconn->seq_pending == acks[0] - 1)
+			sconn->seq_pending = acks[0];
 	}
 
-	pthread_mutex_lock(&dev->lock);
-	pthread_mutex_lock(&ep->lock);
 	TAILQ_FOREACH_SAFE(tx, &sconn->tx_seqs, tx_seq, tmp) {
 		/* Note that type of msgs can include a piggybacked ACK */
 		if (type == SOCK_MSG_ACK_ONLY
@@ -3429,39 +3584,7 @@ sock_handle_ack(sock_conn_t * sconn,
 					debug(CCI_DB_MSG,
 						"%s: acking only seq %u", __func__,
 						acks[0]);
-					TAILQ_REMOVE(&sep->pending, &tx->evt, entry);
-					TAILQ_REMOVE(&sconn->tx_seqs, tx, tx_seq);
-					if (tx->msg_type == SOCK_MSG_RMA_WRITE
-					    || tx->msg_type == SOCK_MSG_RMA_READ_REQUEST)
-						tx->rma_op->pending--;
-					if (tx->msg_type == SOCK_MSG_SEND) {
-						sconn->pending--;
-#if 0
-						if (sconn->pending <=
-							sconn->ssthresh) {
-							sconn->cwnd++;
-							debug(CCI_DB_INFO,
-								"%s increase cwnd from %d to %d",
-								__func__,
-								sconn->cwnd - 1,
-								sconn->cwnd);
-						} else {
-							sconn->cwnd++;
-						}
-#endif
-					}
-					/* if SILENT, put idle tx */
-					if (tx->flags & CCI_FLAG_SILENT) {
-						tx->state = SOCK_TX_IDLE;
-						/* store locally until we can drop the locks */
-						TAILQ_INSERT_HEAD(&idle_txs, tx,
-						                  dentry);
-					} else {
-						tx->state = SOCK_TX_COMPLETED;
-						tx->evt.event.send.status = CCI_SUCCESS;
-						/* store locally until we can drop the locks */
-						TAILQ_INSERT_TAIL(&evts, &tx->evt, entry);
-					}
+					sock_ack_tx(sconn, tx, &acked);
 				}
 				found = 1;
 				break;
@@ -3472,38 +3595,7 @@ sock_handle_ack(sock_conn_t * sconn,
 					debug(CCI_DB_MSG,
 						"%s: acking tx seq %u (up to seq %u)",
 						__func__, tx->seq, acks[0]);
-					TAILQ_REMOVE(&sep->pending, &tx->evt, entry);
-					TAILQ_REMOVE(&sconn->tx_seqs, tx, tx_seq);
-					if (tx->msg_type == SOCK_MSG_RMA_WRITE)
-						tx->rma_op->pending--;
-					if (tx->msg_type == SOCK_MSG_SEND) {
-						sconn->pending--;
-#if 0
-						if (sconn->pending <=
-							sconn->ssthresh) {
-							sconn->cwnd++;
-							debug(CCI_DB_INFO,
-								"%s increase cwnd from %d to %d",
-								__func__,
-								sconn->cwnd - 1,
-								sconn->cwnd);
-						} else {
-							sconn->cwnd++;
-						}
-#endif
-					}
-					/* if SILENT, put idle tx */
-					if (tx->flags & CCI_FLAG_SILENT) {
-						tx->state = SOCK_TX_IDLE;
-						/* store locally until we can drop the locks */
-						TAILQ_INSERT_HEAD(&idle_txs, tx,
-								dentry);
-					} else {
-						tx->state = SOCK_TX_COMPLETED;
-						tx->evt.event.send.status = CCI_SUCCESS;
-						/* store locally until we can drop the locks */
-						TAILQ_INSERT_TAIL(&evts, &tx->evt, entry);
-					}
+					sock_ack_tx(sconn, tx, &acked);
 					found++;
 				}
 			} else {
@@ -3521,62 +3613,40 @@ sock_handle_ack(sock_conn_t * sconn,
 						      "%s: sacking seq %u",
 						      __func__, tx->seq);
 						found++;
-						TAILQ_REMOVE(&sep->pending, &tx->evt, entry);
-						TAILQ_REMOVE(&sconn->tx_seqs, tx, tx_seq);
-						if (tx->msg_type == SOCK_MSG_RMA_WRITE ||
-							tx->msg_type == SOCK_MSG_RMA_READ_REPLY)
-						{
-							tx->rma_op->pending--;
-						}
-						if (tx->msg_type == SOCK_MSG_SEND) {
-							sconn->pending--;
-#if 0
-							if (sconn->pending <=
-								sconn->ssthresh) {
-								sconn->cwnd++;
-								debug
-									(CCI_DB_INFO,
-									"%s increase cwnd from %d to %d",
-									__func__,
-									sconn->cwnd
-									- 1,
-									sconn->cwnd);
-							} else {
-								sconn->cwnd++;
-							}
-#endif
-						}
-						/* if SILENT, put idle tx */
-						if (tx->flags & CCI_FLAG_SILENT) {
-							tx->state = SOCK_TX_IDLE;
-							/* store locally until we can drop the dev->lock */
-							TAILQ_INSERT_HEAD (&idle_txs, tx, dentry);
-						} else {
-							tx->state = SOCK_TX_COMPLETED;
-							tx->evt.event.send.status = CCI_SUCCESS;
-							/* store locally until we can drop the dev->lock */
-							TAILQ_INSERT_TAIL(&evts, &tx->evt, entry);
-						}
+						sock_ack_tx(sconn, tx, &acked);
 					}
+					break;
 				}
 			}
 		}
 	}
-	pthread_mutex_unlock(&ep->lock);
-	pthread_mutex_unlock(&dev->lock);
+	pthread_mutex_unlock(&sconn->lock);
 
 	debug(CCI_DB_MSG, "%s: acked %d msgs (%s %u)", __func__, found,
 	      sock_msg_type(type), acks[0]);
 
+	if (TAILQ_EMPTY(&acked)) {
+		CCI_EXIT;
+		return;
+	}
+
 	pthread_mutex_lock(&ep->lock);
-	/* transfer txs to sock ep's list */
-	while (!TAILQ_EMPTY(&idle_txs)) {
+	while (!TAILQ_EMPTY(&acked)) {
 		sock_rma_op_t *rma_op = NULL;
 
-		tx = TAILQ_FIRST(&idle_txs);
-		TAILQ_REMOVE(&idle_txs, tx, dentry);
+		tx = TAILQ_FIRST(&acked);
+		TAILQ_REMOVE(&acked, tx, dentry);
+		TAILQ_REMOVE(&sep->pending, &tx->evt, entry);
+
+		if (!(tx->flags & CCI_FLAG_SILENT)) {
+			tx->evt.event.send.status = CCI_SUCCESS;
+			TAILQ_INSERT_TAIL(&evts, &tx->evt, entry);
+			continue;
+		}
 
+		/* SILENT, put idle tx unless it carries on an RMA */
 		rma_op = tx->rma_op;
+		pthread_mutex_lock(&sconn->lock);
 		if (rma_op && rma_op->status == CCI_SUCCESS) {
 			sock_rma_handle_t *local = NULL;
 
@@ -3593,6 +3663,7 @@ sock_handle_ack(sock_conn_t * sconn,
 				/* they acked our remote completion */
 				TAILQ_REMOVE(&sep->rma_ops, rma_op, entry);
 				TAILQ_REMOVE(&sconn->rmas, rma_op, rmas);
+				pthread_mutex_unlock(&sconn->lock);
 
 				free(rma_op);
 				if (!(flags & CCI_FLAG_SILENT)) {
@@ -3602,6 +3673,8 @@ sock_handle_ack(sock_conn_t * sconn,
 							entry);
 					continue;
 				}
+				sock_put_tx_locked(sep, tx);
+				continue;
 			}
 			/* they acked a data segment, do we need to send more
 			 * or send the remote completion? */
@@ -3632,6 +3705,7 @@ sock_handle_ack(sock_conn_t * sconn,
 					tx->rma_len = (uint16_t)max_send_size;
 				}
 				tx->seq = ++(sconn->seq);
+				pthread_mutex_unlock(&sconn->lock);
 				tx->len = sizeof(sock_rma_header_t);
 
 				offset = (uint64_t) i * (uint64_t) max_send_size;
@@ -3670,7 +3744,7 @@ sock_handle_ack(sock_conn_t * sconn,
 				}
 
 				/* now include the header */
-				TAILQ_INSERT_TAIL(&queued, tx, dentry);
+				TAILQ_INSERT_TAIL(&sep->queued, &tx->evt, entry);
 				continue;
 			} else if (rma_op->completed == rma_op->num_msgs) {
 				/* send remote completion? */
@@ -3690,6 +3764,7 @@ sock_handle_ack(sock_conn_t * sconn,
 					tx->timeout_us = 0ULL;
 					tx->rma_op = rma_op;
 					tx->seq = ++(sconn->seq);
+					pthread_mutex_unlock(&sconn->lock);
 
 					tx->evt.event.type = CCI_EVENT_SEND;
 					tx->evt.event.send.connection = connection;
@@ -3723,7 +3798,7 @@ sock_handle_ack(sock_conn_t * sconn,
 					tx->len = sizeof (sock_rma_header_t)
 					          + sizeof(uint32_t)
 					          + rma_op->msg_len;
-					TAILQ_INSERT_TAIL(&queued, tx, dentry);
+					TAILQ_INSERT_TAIL(&sep->queued, &tx->evt, entry);
 					continue;
 				} else {
 					int flags = rma_op->flags;
@@ -3732,6 +3807,7 @@ sock_handle_ack(sock_conn_t * sconn,
 					/* complete now */
 					TAILQ_REMOVE(&sep->rma_ops, rma_op, entry);
 					TAILQ_REMOVE(&sconn->rmas, rma_op, rmas);
+					pthread_mutex_unlock(&sconn->lock);
 					local->refcnt--;
 					free(rma_op);
 
@@ -3745,11 +3821,14 @@ sock_handle_ack(sock_conn_t * sconn,
 								entry);
 						continue;
 					}
+					sock_put_tx_locked(sep, tx);
+					continue;
 				}
 			}
 		}
+		pthread_mutex_unlock(&sconn->lock);
 
-		TAILQ_INSERT_HEAD(&sep->idle_txs, tx, dentry);
+		sock_put_tx_locked(sep, tx);
 	}
 
 	/* transfer evts to the ep's list */
@@ -3757,36 +3836,21 @@ sock_handle_ack(sock_conn_t * sconn,
 		cci__evt_t *evt;
 		evt = TAILQ_FIRST(&evts);
 		TAILQ_REMOVE(&evts, evt, entry);
-		TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
 		/* waking up the app thread if it is blocking on a OS handle */
-		if (sep->event_fd) {
+		if (sock_complete_tx_locked(ep, container_of(evt, sock_tx_t, evt))
+		    && sep->event_fd) {
 			int rc;
 			rc = write (sep->fd[1], "a", 1);
 			if (rc != 1) {
 				debug (CCI_DB_WARN, "%s: Write failed", __func__);
-				CCI_EXIT;
-				return;
 			}
 		}
 	}
 	pthread_mutex_unlock(&ep->lock);
 
-	pthread_mutex_lock(&dev->lock);
-	pthread_mutex_lock(&ep->lock);
-	while (!TAILQ_EMPTY(&queued)) {
-		sock_tx_t *my_tx;
-		my_tx = TAILQ_FIRST(&queued);
-		TAILQ_REMOVE(&queued, my_tx, dentry);
-		TAILQ_INSERT_TAIL(&sep->queued, &my_tx->evt, entry);
-	}
-	pthread_mutex_unlock(&ep->lock);
-	pthread_mutex_unlock(&dev->lock);
-
 	/* We received a ACK so we wake up the send thread */
 	if (!sep->closing) {
-		pthread_mutex_lock(&sep->progress_mutex);
-		pthread_cond_signal(&sep->wait_condition);
-		pthread_mutex_unlock(&sep->progress_mutex);
+		sock_wake_progress(sep);
 	}
 
 	CCI_EXIT;
@@ -3915,9 +3979,7 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 				                      (enum cci_status)ret));
 			}
 
-			pthread_mutex_lock(&ep->lock);
-			TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-			pthread_mutex_unlock(&ep->lock);
+			sock_put_rx(ep, rx);
 
 			/* We only did a peek of the header so far and we got enough
 			   data to move on so we drop the msg */
@@ -3999,8 +4061,10 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 			pthread_mutex_unlock(&ep->lock);
 			/* Since we remove the pending tx, update the
 			   pending_seq for that given connection */
+			pthread_mutex_lock(&sconn->lock);
 			if (sconn->seq_pending == ack - 1)
 				sconn->seq_pending = ack;
+			pthread_mutex_unlock(&sconn->lock);
 
 			if (!tx) {
 				char from[32];
@@ -4065,11 +4129,6 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 			assert (recv_len == total_size);
 #endif
 
-			free(sconn);
-			if (conn->uri)
-				free((char *)conn->uri);
-			free(conn);
-
 			/* send unreliable conn_ack */
 			memset(name, 0, sizeof(name));
 			sock_sin_to_name(sin, name, sizeof(name));
@@ -4095,10 +4154,6 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 				}
 			}
 			pthread_mutex_unlock(&ep->lock);
-			/* Since we remove the pending tx, update the
-			   pending_seq for that given connection */
-			if (sconn->seq_pending == seq - 1)
-				sconn->seq_pending = seq;
 
 			/* simply ack this msg and cleanup */
 			memset(&hdr, 0, sizeof(hdr));
@@ -4111,6 +4166,12 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 				         cci_strerror(&ep->endpoint,
 				                      (enum cci_status)ret));
 			}
+
+			pthread_mutex_destroy(&sconn->lock);
+			free(sconn);
+			if (conn->uri)
+				free((char *)conn->uri);
+			free(conn);
 		}
 		/* add rx->evt to ep->evts */
 		sock_queue_event (ep, &rx->evt);
@@ -4131,7 +4192,8 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 			return;
 		}
 	} else if (sconn->status == SOCK_CONN_READY) {
-		tx = sock_get_tx (ep);
+		tx = sock_get_tx (ep, sizeof(sock_header_r_t)
+		                      + sizeof(sock_handshake_t));
 		if (!tx) {
 			char to[32];
 
@@ -4142,9 +4204,7 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 			debug_ep(ep, (CCI_DB_CONN | CCI_DB_MSG),
 			         "%s: no tx buff to send a conn_ack to %s",
 			         __func__, to);
-			pthread_mutex_lock(&ep->lock);
-			TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-			pthread_mutex_unlock(&ep->lock);
+			sock_put_rx(ep, rx);
 
 			CCI_EXIT;
 			return;
@@ -4156,7 +4216,10 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 	tx->rma_ptr = NULL;
 	tx->rma_len = 0;
 
+	pthread_mutex_lock(&sconn->lock);
 	tx->seq = ++(sconn->seq);
+	sconn->last_ack_ts = sock_get_usecs();
+	pthread_mutex_unlock(&sconn->lock);
 
 	tx->flags = CCI_FLAG_SILENT;
 	tx->msg_type = SOCK_MSG_CONN_ACK;
@@ -4171,7 +4234,6 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 
 	hdr_r = tx->buffer;
 	sock_pack_conn_ack(&hdr_r->header, sconn->peer_id);
-	sconn->last_ack_ts = sock_get_usecs();
 	/* the conn_ack acks the server's seq in the timestamp */
 	sock_pack_seq_ts(&hdr_r->seq_ts, tx->seq, seq);
 	tx->len = sizeof (sock_header_r_t);
@@ -4189,9 +4251,7 @@ static void sock_handle_conn_reply(sock_conn_t * sconn,
 #endif
 
 	/* try to progress txs */
-	pthread_mutex_lock(&sep->progress_mutex);
-	pthread_cond_signal(&sep->wait_condition);
-	pthread_mutex_unlock(&sep->progress_mutex);
+	sock_wake_progress(sep);
 
 	CCI_EXIT;
 
@@ -4297,9 +4357,7 @@ again:
                sizeof (sock_rma_header_t) + len);
 out:
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-	pthread_mutex_unlock(&ep->lock);
+	sock_put_rx(ep, rx);
 
 	CCI_EXIT;
 return;
@@ -4395,7 +4453,9 @@ sock_handle_conn_ack(sock_conn_t * sconn,
 				debug(CCI_DB_CONN,
                                       "%s: Generate the connect accept event",
 				      __func__);
+				pthread_mutex_lock(&sep->evt_lock);
 				TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
+				pthread_mutex_unlock(&sep->evt_lock);
 				/* waking up the app thread if it is blocking
 				   on a OS handle */
 				if (sep->event_fd) {
@@ -4410,18 +4470,14 @@ sock_handle_conn_ack(sock_conn_t * sconn,
 					}
 				}
 			} else {
-				TAILQ_INSERT_HEAD(&sep->idle_txs, tx, dentry);
+				sock_put_tx_locked(sep, tx);
 			}
 			pthread_mutex_unlock(&ep->lock);
 		}
 
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-		pthread_mutex_unlock(&ep->lock);
+		sock_put_rx(ep, rx);
 	
-		pthread_mutex_lock(&sep->progress_mutex);
-		pthread_cond_signal(&sep->wait_condition);
-		pthread_mutex_unlock(&sep->progress_mutex);
+		sock_wake_progress(sep);
 	}
 
 	CCI_EXIT;
@@ -4457,7 +4513,7 @@ sock_handle_rma_read_request(sock_conn_t * sconn, sock_rx_t * rx,
 	sep = ep->priv;
 
         /* Get a TX buffer */
-        tx = sock_get_tx (ep);
+        tx = sock_get_tx (ep, sizeof(sock_rma_header_t) + len);
         if (tx == NULL) {
                 send_nack (sconn, sep, seq, ts);
                 goto out;
@@ -4549,17 +4605,13 @@ sock_handle_rma_read_request(sock_conn_t * sconn, sock_rx_t * rx,
 	   right away. No need to generate a SEND event, this is only a
 	   fragment of the RMA READ operation */
 	pthread_mutex_lock (&ep->lock);
-	TAILQ_INSERT_TAIL(&sep->idle_txs, tx, dentry);
+	sock_put_tx_locked(sep, tx);
 	pthread_mutex_unlock (&ep->lock);
 
 out:
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-	pthread_mutex_unlock(&ep->lock);
+	sock_put_rx(ep, rx);
 
-	pthread_mutex_lock(&sep->progress_mutex);
-	pthread_cond_signal(&sep->wait_condition);
-	pthread_mutex_unlock(&sep->progress_mutex);
+	sock_wake_progress(sep);
 
 	return (ret);
 }
@@ -4679,11 +4731,11 @@ sock_handle_rma_write(sock_conn_t * sconn, sock_rx_t * rx, uint16_t len)
 
 out:
 	/* We force the ACK */
-	pthread_mutex_lock(&ep->lock);
+	pthread_mutex_lock(&sconn->lock);
 	sock_ack_sconn (sep, sconn);
-	
-	TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-	pthread_mutex_unlock(&ep->lock);
+	pthread_mutex_unlock(&sconn->lock);
+
+	sock_put_rx(ep, rx);
 
 	return;
 }
@@ -4762,6 +4814,7 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 	int ret = 0, drop_msg = 0, q_rx = 0, reply = 0, request = 0, again = 0;
 	int ka = 0;
 	size_t recv_len = 0;
+	uint32_t msg_len;
 	uint8_t a;
 	uint16_t b;
 	uint32_t id;
@@ -4781,15 +4834,31 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 	if (!sep)
 		return 0;
 
-	pthread_mutex_lock(&ep->lock);
-	if (!TAILQ_EMPTY(&sep->idle_rxs)) {
-		rx = TAILQ_FIRST(&sep->idle_rxs);
-		TAILQ_REMOVE(&sep->idle_rxs, rx, entry);
+	/* Peek at the datagram to know the size of RX buffer it needs */
+#ifdef SOCK_PEEK_TRUNC
+	{
+		sock_header_t hdr;
+
+		ret = recv(sep->sock, &hdr, sizeof(hdr), MSG_PEEK | MSG_TRUNC);
+		if (ret < (int)sizeof(hdr)) {
+			/* Nothing to receive, or a runt we cannot parse */
+			if (ret >= 0)
+				sock_drop_msg(sep->sock);
+			CCI_EXIT;
+			return 0;
+		}
+		msg_len = ret;
 	}
+#else
+	msg_len = ep->buffer_len;
+#endif
+
+	pthread_mutex_lock(&ep->lock);
+	rx = sock_get_rx_locked(ep, msg_len);
 	pthread_mutex_unlock(&ep->lock);
 
-	/* If we run out of RX, we fall down to a special case: we have to use a
-	special buffer to receive the message, parse it. Ultimately, we need
+	/* If we run out of RX, we fall down to a special case: we peek at the
+	header of the message, without receiving it. Ultimately, we need
 	the TS and the SEQ (so we can send the RNR msg), as well as the entire
 	header so we can know if we are in the context of a reliable connection
 	(otherwise RNR does not apply). */
@@ -4800,6 +4869,8 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 		int n = (int)(4.0 * rand() / (RAND_MAX + 1.0));
 		if (n == 0) {
 			fprintf(stderr, "Simulating lack of RX buffer...\n");
+			if (rx)
+				sock_put_rx(ep, rx);
 			rx = NULL;
 		}
 	}
@@ -4811,22 +4882,23 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 	 *    and just handle the message.
 	 * 2) We are out of RX buffers; two cases again:
 	 *    a. The connection is reliable and in this case we fall into a RNR
-	 *       mode, which may lead to dropping the message and/or creating
-	 *       an extra RX buffer. See the semantic of RNR for more details.
+	 *       mode, which may lead to dropping the message and/or using one
+	 *       of the reserved RX buffers. See the semantic of RNR for more
+	 *       details.
 	 *    b. The connection is unreliable, we just drop the message.
 	 */
 	if (!rx) {
-		char tmp_buff[SOCK_UDP_MAX];
-		sock_header_t *hdr = NULL;
+		sock_header_r_t header_r;
 
 		debug(CCI_DB_INFO,
 		      "%s: no rx buffers available on endpoint %d",
 		      __func__, sep->sock);
 
-		/* We do the receive using a temporary buffer so we can get
-		   enough data to send a RNR NACK */
-		ret = recvfrom(sep->sock, (void *)tmp_buff, SOCK_UDP_MAX,
-				0, (struct sockaddr *)&sin, &sin_len);
+		/* We only peek at the header: it is enough to send a RNR NACK
+		   and the msg stays queued in the socket, so that resuming
+		   does not need a copy */
+		ret = recvfrom(sep->sock, (void *)&header_r, sizeof(header_r),
+		               MSG_PEEK, (struct sockaddr *)&sin, &sin_len);
 		if (ret == -1) {
 			debug (CCI_DB_INFO,
 			       "%s: No RX buffer + cannot recv data: %s",
@@ -4838,61 +4910,72 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 			debug(CCI_DB_INFO,
 			      "%s: Not enough data (%d/%d) to get the header",
 			      __func__, ret, (int)sizeof(sock_header_t));
+			sock_drop_msg(sep->sock);
 			CCI_EXIT;
 			return 0;
 		}
 
-		/* Now we get the header and parse it so we can know if we are
-		   in the context of a reliable connection */
-		hdr = (sock_header_t *) tmp_buff;
-		sock_parse_header(hdr, &type, &a, &b, &id);
+		/* Now we parse the header so we can know if we are in the
+		   context of a reliable connection */
+		sock_parse_header(&header_r.header, &type, &a, &b, &id);
 		sconn = sock_find_conn(sep, sin.sin_addr.s_addr, sin.sin_port,
 		                       id, type);
-		conn = sconn->conn;
 		if (sconn == NULL) {
 			/* If the connection is not already established, we
 			   just drop the message */
 			debug(CCI_DB_INFO,
 			      "%s: Connection not established, dropping msg",
 			      __func__);
+			sock_drop_msg(sep->sock);
 			CCI_EXIT;
 			return 0;
 		}
+		conn = sconn->conn;
 
 		/* If this is a reliable connection, we typically fall into a
 		   RNR mode */
-		if (cci_conn_is_reliable(conn)) {
-			sock_header_r_t *header_r = NULL;
-
-			/* We do the receive using a temporary buffer so we can
-			   get enough data to send a RNR NACK */
-
-			/* From the buffer, we get the TS and SEQ from the
-			   header (this is the only we need to deal with RNR)
-			   and will be used later on */
-			header_r = (sock_header_r_t *) tmp_buff;
-			sock_parse_seq_ts(&header_r->seq_ts, &seq, &ts);
+		if (cci_conn_is_reliable(conn)
+		    && ret >= (int)sizeof(header_r)) {
+			/* From the header, we get the TS and SEQ (this is the
+			   only we need to deal with RNR) and will be used
+			   later on */
+			sock_parse_seq_ts(&header_r.seq_ts, &seq, &ts);
 
 			ret = update_rnr_mode (sconn, seq);
 			if (ret == CCI_SOCK_RESUME_RNR) {
 				/* In case we receive the message we were
 				   waiting for to resume normal execution,
-				   we make sure we have a proper RX buffer and
-				   move on. This new buffer will be added to
-				   the list of available RX buffers later on */
-				rx = alloc_rx_buffer (ep);
+				   we use one of the RX buffers set aside for
+				   that and move on. It goes back to the
+				   reserve once the app returns it */
+				pthread_mutex_lock(&ep->lock);
+				rx = TAILQ_FIRST(&sep->reserved_rxs);
+				if (rx)
+					TAILQ_REMOVE(&sep->reserved_rxs, rx,
+					             entry);
+				pthread_mutex_unlock(&ep->lock);
 				if (rx == NULL) {
+					/* Still not ready, stay in RNR mode
+					   and NACK it again */
+					sconn->rnr = seq;
 					drop_msg = 1;
 					goto out;
 				}
-				memcpy (rx->buffer, tmp_buff, ep->buffer_len);
+				ret = sock_recv_msg (sep->sock,
+				                     rx->buffer,
+				                     sizeof(sock_header_t),
+				                     MSG_PEEK,
+				                     &sin);
+				recv_len = ret;
 			} else {
 				/* Otherwise we drop the msg */
 				drop_msg = 1;
 				goto out;
 			}
 		} else {
-			/* If the connection is unreliable, we simply exit */
+			/* If the connection is unreliable, we simply drop
+			   the msg */
+			sock_drop_msg(sep->sock);
 			CCI_EXIT;
 			return 0;
 		}
@@ -4982,9 +5065,8 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 			   call the sock_handle_conn_ack() but we need to
 			   explicitely return the rx */
 			sock_handle_conn_ack(NULL, rx, a, b, id, sin);
-			/* Return the RX */
-			TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
 		}
+		/* Return the RX */
 		q_rx = 1;
 		goto out;
 	}
@@ -5224,9 +5306,7 @@ static int sock_recvfrom_ep(cci__ep_t * ep)
 
 out:
 	if (q_rx) {
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_HEAD(&sep->idle_rxs, rx, entry);
-		pthread_mutex_unlock(&ep->lock);
+		sock_put_rx(ep, rx);
 	}
 
 	if (drop_msg) {
@@ -5360,6 +5440,7 @@ static void sock_keepalive(cci__ep_t *ep)
 	return;
 }
 
+/* Caller must hold sconn->lock */
 static inline int sock_ack_sconn (sock_ep_t *sep, sock_conn_t *sconn)
 {
 	uint64_t now = 0ULL;
@@ -5446,9 +5527,11 @@ static inline int sock_ack_sconn (sock_ep_t *sep, sock_conn_t *sconn)
 	return count;
 }
 
-static void sock_ack_conns(cci__ep_t * ep)
+/* Returns the number of connections that still have delayed ACKs */
+static int sock_ack_conns(cci__ep_t * ep)
 {
 	int i;
+	int delayed = 0;
 	sock_ep_t *sep = ep->priv;
 	sock_conn_t *sconn = NULL;
 	uint64_t now = 0ULL;
@@ -5459,7 +5542,11 @@ static void sock_ack_conns(cci__ep_t * ep)
 	for (i = 0; i < SOCK_EP_HASH_SIZE; i++) {
 		if (!TAILQ_EMPTY(&sep->conn_hash[i])) {
 			TAILQ_FOREACH(sconn, &sep->conn_hash[i], entry) {
+				pthread_mutex_lock(&sconn->lock);
 				sock_ack_sconn (sep, sconn);
+				if (!TAILQ_EMPTY(&sconn->acks))
+					delayed++;
+				pthread_mutex_unlock(&sconn->lock);
 			}
 		}
 	}
@@ -5470,15 +5557,34 @@ static void sock_ack_conns(cci__ep_t * ep)
 		sock_recvfrom_ep (ep);
 
 	CCI_EXIT;
-	return;
+	return delayed;
+}
+
+/* Send all the ACKs we delayed, regardless of ACK_TIMEOUT */
+static void sock_flush_acks(cci__ep_t *ep)
+{
+	sock_ep_t *sep = ep->priv;
+	sock_conn_t *sconn = NULL;
+	int i;
+
+	for (i = 0; i < SOCK_EP_HASH_SIZE; i++) {
+		if (!TAILQ_EMPTY(&sep->conn_hash[i])) {
+			TAILQ_FOREACH(sconn, &sep->conn_hash[i], entry) {
+				/* We trick the timeout value to ensure the ACK
+				   will be sent */
+				sconn->last_ack_ts 
+					= sconn->last_ack_ts - 2 * ACK_TIMEOUT;
+			}
+		}
+	}
+	sock_ack_conns (ep);
 }
 
 static void *sock_progress_thread(void *arg)
 {
 	cci__ep_t *ep = (cci__ep_t *) arg;
 	sock_ep_t *sep;
-	int i;
-	sock_conn_t *sconn = NULL;
+	int deferred;
 
 	assert (ep);
 	sep = ep->priv;
@@ -5489,14 +5595,33 @@ static void *sock_progress_thread(void *arg)
 		pthread_mutex_unlock(&ep->lock);
 
 		sock_keepalive (ep);
-		sock_progress_sends (ep);
+		deferred = sock_progress_sends (ep);
 
 		/* If the endpoint is in the process of closing, we just move
-		   on, otherwise, we wait for a signal to wake up and do progress */
+		   on, otherwise, we wait for a signal to wake up and do progress.
+		   Delayed ACKs and unacked sends must go out even if nobody
+		   signals us, so only sleep for a progress period then. */
 		if (!sep->closing) {
 			pthread_mutex_lock(&sep->progress_mutex);
-			pthread_cond_wait(&sep->wait_condition,
-			                  &sep->progress_mutex);
+			if (!sep->progress_kick) {
+				if (deferred) {
+					struct timespec ts;
+					uint64_t wake;
+
+					clock_gettime(CLOCK_REALTIME, &ts);
+					wake = (uint64_t) ts.tv_nsec
+					       + SOCK_PROG_TIME_US * 1000ULL;
+					ts.tv_sec += wake / 1000000000ULL;
+					ts.tv_nsec = wake % 1000000000ULL;
+					pthread_cond_timedwait(&sep->wait_condition,
+					                       &sep->progress_mutex,
+					                       &ts);
+				} else {
+					pthread_cond_wait(&sep->wait_condition,
+					                  &sep->progress_mutex);
+				}
+			}
+			sep->progress_kick = 0;
 			pthread_mutex_unlock(&sep->progress_mutex);
 		}
 
@@ -5506,17 +5631,7 @@ static void *sock_progress_thread(void *arg)
 
 	/* Because we may have delayed some ACKs for optimization,
 	   we drain all pending ACKs before ending the progress thread */
-	for (i = 0; i < SOCK_EP_HASH_SIZE; i++) {
-		if (!TAILQ_EMPTY(&sep->conn_hash[i])) {
-			TAILQ_FOREACH(sconn, &sep->conn_hash[i], entry) {
-				/* We trick the timeout value to ensure the ACK
-				   will be sent */
-				sconn->last_ack_ts 
-					= sconn->last_ack_ts - 2 * ACK_TIMEOUT;
-			}
-		}
-	}
-	sock_ack_conns (ep);
+	sock_flush_acks (ep);
 
 	pthread_exit(NULL);
 	return (NULL);		/* make pgcc happy */
@@ -5588,9 +5703,7 @@ int progress_recv (cci__ep_t *ep)
 		if (!TAILQ_EMPTY (&sep->queued) || !TAILQ_EMPTY (&sep->pending)) {
 			/* If the send queue is not empty, wake up the send
 			   thread */
-			pthread_mutex_lock(&sep->progress_mutex);
-			pthread_cond_signal(&sep->wait_condition);
-			pthread_mutex_unlock(&sep->progress_mutex);
+			sock_wake_progress(sep);
 		}
 		pthread_mutex_unlock(&ep->lock);
 
@@ -5623,6 +5736,64 @@ int progress_recv (cci__ep_t *ep)
 	return CCI_SUCCESS;
 }
 
+/*
+ * Free the txs and rxs that were not needed during the last
+ * SOCK_POOL_IDLE_SEC, i.e. the lowest idle count seen over that period,
+ * without going below what was allocated when creating the endpoint.
+ */
+static void sock_trim_pools(cci__ep_t *ep)
+{
+	sock_ep_t *sep = ep->priv;
+	uint64_t now = sock_get_usecs();
+	uint32_t freed = 0;
+	int i;
+
+	if (now - sep->last_trim_us < SOCK_POOL_IDLE_SEC * 1000000ULL)
+		return;
+	sep->last_trim_us = now;
+
+	pthread_mutex_lock(&ep->lock);
+	for (i = 0; i < SOCK_BUF_CLASSES; i++) {
+		sock_pool_t *pool = &sep->tx_pool[i];
+		uint32_t n = pool->idle_low;
+
+		if (pool->cnt - n < pool->min)
+			n = pool->cnt > pool->min ? pool->cnt - pool->min : 0;
+		for (freed += n; n > 0; n--) {
+			/* the tail is the coldest */
+			sock_tx_t *tx = TAILQ_LAST(&sep->idle_txs[i], s_txsi);
+			TAILQ_REMOVE(&sep->idle_txs[i], tx, dentry);
+			pool->idle--;
+			sock_free_tx(ep, tx);
+		}
+		pool->idle_low = pool->idle;
+
+		pool = &sep->rx_pool[i];
+		n = pool->idle_low;
+		if (pool->cnt - n < pool->min)
+			n = pool->cnt > pool->min ? pool->cnt - pool->min : 0;
+		for (freed += n; n > 0; n--) {
+			sock_rx_t *rx = TAILQ_LAST(&sep->idle_rxs[i], s_rxsi);
+			TAILQ_REMOVE(&sep->idle_rxs[i], rx, entry);
+			pool->idle--;
+			sock_free_rx(ep, rx);
+		}
+		pool->idle_low = pool->idle;
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	if (freed) {
+		debug(CCI_DB_INFO, "%s: freed %u idle buffers (%u txs, %u rxs "
+		      "left)", __func__, freed, sep->tx_cnt, sep->rx_cnt);
+#ifdef __GLIBC__
+		/* give the pages back to the system */
+		malloc_trim(0);
+#endif
+	}
+
+	return;
+}
+
 static void *sock_recv_thread(void *arg)
 {
 	cci__ep_t *ep = (cci__ep_t *)arg;
@@ -5632,6 +5803,7 @@ static void *sock_recv_thread(void *arg)
 	sep = ep->priv;
 	while (!sep->closing) {
 		progress_recv (ep);
+		sock_trim_pools (ep);
 	}
 
 	pthread_exit(NULL);
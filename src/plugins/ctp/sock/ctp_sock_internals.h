@@ -90,35 +90,256 @@ sock_sendto(cci_os_handle_t sock, void *buf, int len,
 }
 
 
+/*
+ * Buffer pools
+ *
+ * txs and rxs are allocated on demand, SOCK_POOL_GROW at a time, up to
+ * ep->tx_buf_cnt and ep->rx_buf_cnt. Each one comes with a small or a large
+ * buffer (see sock_buf_class_t). Buffers that stayed idle for
+ * SOCK_POOL_IDLE_SEC are freed by sock_trim_pools(), down to the number
+ * allocated when the endpoint was created.
+ *
+ * Unless noted, the caller must hold ep->lock.
+ */
+
+static inline uint32_t
+sock_buf_len (cci__ep_t *ep, sock_buf_class_t buf_class)
+{
+	if (buf_class == SOCK_BUF_SMALL && ep->buffer_len > SOCK_SMALL_BUF_LEN)
+		return SOCK_SMALL_BUF_LEN;
+	return ep->buffer_len;
+}
+
+static inline sock_buf_class_t
+sock_buf_class (cci__ep_t *ep, uint32_t len)
+{
+	return len <= sock_buf_len (ep, SOCK_BUF_SMALL) ?
+		SOCK_BUF_SMALL : SOCK_BUF_LARGE;
+}
+
 /**
- * Allocate and initialize a single RX buffer.
+ * Allocate a single TX and its buffer. The TX is not put on an idle list.
+ */
+static inline sock_tx_t *
+sock_alloc_tx (cci__ep_t *ep, sock_buf_class_t buf_class)
+{
+	sock_ep_t *sep = ep->priv;
+	sock_tx_t *tx;
+
+	/* the buffer is not zeroed so that its pages are only touched once
+	   used */
+	tx = malloc (sizeof (*tx) + sock_buf_len (ep, buf_class));
+	if (tx == NULL)
+		return NULL;
+	memset (tx, 0, sizeof (*tx));
+	tx->ctx = SOCK_CTX_TX;
+	tx->evt.event.type = CCI_EVENT_SEND;
+	tx->evt.ep = ep;
+	tx->buffer = (void*)(tx + 1);
+	tx->buf_class = buf_class;
+	pthread_cond_init (&tx->done, NULL);
+
+	TAILQ_INSERT_TAIL (&sep->all_txs, tx, pentry);
+	sep->tx_pool[buf_class].cnt++;
+	sep->tx_cnt++;
+
+	return tx;
+}
+
+static inline void
+sock_free_tx (cci__ep_t *ep, sock_tx_t *tx)
+{
+	sock_ep_t *sep = ep->priv;
+
+	TAILQ_REMOVE (&sep->all_txs, tx, pentry);
+	sep->tx_pool[tx->buf_class].cnt--;
+	sep->tx_cnt--;
+	pthread_cond_destroy (&tx->done);
+	free (tx);
+}
+
+/**
+ * Allocate a single RX and its buffer. The RX is not put on an idle list.
  */
 static inline sock_rx_t *
-alloc_rx_buffer (cci__ep_t *ep)
+sock_alloc_rx (cci__ep_t *ep, sock_buf_class_t buf_class)
 {
-	sock_rx_t *rx = NULL;
+	sock_ep_t *sep = ep->priv;
+	sock_rx_t *rx;
 
-	rx = calloc (1, sizeof (sock_rx_t));
+	rx = malloc (sizeof (*rx) + sock_buf_len (ep, buf_class));
 	if (rx == NULL)
-		goto free_and_exit;
-	rx->buffer = calloc (1, ep->buffer_len);
-	if (rx->buffer == NULL)
-		goto free_and_exit;
+		return NULL;
+	memset (rx, 0, sizeof (*rx));
 	rx->ctx = SOCK_CTX_RX;
 	rx->evt.event.type = CCI_EVENT_RECV;
 	rx->evt.ep = ep;
-	ep->rx_buf_cnt++;
+	rx->buffer = (void*)(rx + 1);
+	rx->buf_class = buf_class;
+
+	TAILQ_INSERT_TAIL (&sep->all_rxs, rx, pentry);
+	sep->rx_pool[buf_class].cnt++;
+	sep->rx_cnt++;
 
 	return rx;
+}
+
+static inline void
+sock_free_rx (cci__ep_t *ep, sock_rx_t *rx)
+{
+	sock_ep_t *sep = ep->priv;
+
+	TAILQ_REMOVE (&sep->all_rxs, rx, pentry);
+	if (!rx->reserved) {
+		sep->rx_pool[rx->buf_class].cnt--;
+		sep->rx_cnt--;
+	}
+	free (rx);
+}
+
+static inline void
+sock_put_tx_locked (sock_ep_t *sep, sock_tx_t *tx)
+{
+	/* insert at head to keep it in cache */
+	TAILQ_INSERT_HEAD (&sep->idle_txs[tx->buf_class], tx, dentry);
+	sep->tx_pool[tx->buf_class].idle++;
+}
+
+static inline void
+sock_put_rx_locked (sock_ep_t *sep, sock_rx_t *rx)
+{
+	if (rx->reserved) {
+		TAILQ_INSERT_HEAD (&sep->reserved_rxs, rx, entry);
+		return;
+	}
+	/* insert at head to keep it in cache */
+	TAILQ_INSERT_HEAD (&sep->idle_rxs[rx->buf_class], rx, entry);
+	sep->rx_pool[rx->buf_class].idle++;
+}
+
+static inline void
+sock_put_rx (cci__ep_t *ep, sock_rx_t *rx)
+{
+	pthread_mutex_lock (&ep->lock);
+	sock_put_rx_locked (ep->priv, rx);
+	pthread_mutex_unlock (&ep->lock);
+}
+
+/**
+ * Add up to SOCK_POOL_GROW idle TXs of the given class without going over
+ * ep->tx_buf_cnt. When at the limit, an idle small TX is given up to make
+ * room for a large one.
+ * @return	Number of TXs added
+ */
+static inline int
+sock_grow_txs_locked (cci__ep_t *ep, sock_buf_class_t buf_class)
+{
+	sock_ep_t *sep = ep->priv;
+	uint32_t n = 0, i;
+
+	if (sep->tx_cnt < ep->tx_buf_cnt)
+		n = ep->tx_buf_cnt - sep->tx_cnt;
+	if (n > SOCK_POOL_GROW)
+		n = SOCK_POOL_GROW;
+	if (n == 0 && buf_class == SOCK_BUF_LARGE
+	    && !TAILQ_EMPTY (&sep->idle_txs[SOCK_BUF_SMALL]))
+	{
+		sock_tx_t *tx = TAILQ_LAST (&sep->idle_txs[SOCK_BUF_SMALL],
+		                            s_txsi);
+		TAILQ_REMOVE (&sep->idle_txs[SOCK_BUF_SMALL], tx, dentry);
+		sep->tx_pool[SOCK_BUF_SMALL].idle--;
+		sock_free_tx (ep, tx);
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		sock_tx_t *tx = sock_alloc_tx (ep, buf_class);
+		if (tx == NULL)
+			break;
+		sock_put_tx_locked (sep, tx);
+	}
+	if (i)
+		debug (CCI_DB_INFO, "%s: %u %s txs (%u total)", __func__, i,
+		       buf_class == SOCK_BUF_SMALL ? "small" : "large",
+		       sep->tx_cnt);
+
+	return i;
+}
+
+/**
+ * Same as sock_grow_txs_locked() for RXs and ep->rx_buf_cnt.
+ */
+static inline int
+sock_grow_rxs_locked (cci__ep_t *ep, sock_buf_class_t buf_class)
+{
+	sock_ep_t *sep = ep->priv;
+	uint32_t n = 0, i;
+
+	if (sep->rx_cnt < ep->rx_buf_cnt)
+		n = ep->rx_buf_cnt - sep->rx_cnt;
+	if (n > SOCK_POOL_GROW)
+		n = SOCK_POOL_GROW;
+	if (n == 0 && buf_class == SOCK_BUF_LARGE
+	    && !TAILQ_EMPTY (&sep->idle_rxs[SOCK_BUF_SMALL]))
+	{
+		sock_rx_t *rx = TAILQ_LAST (&sep->idle_rxs[SOCK_BUF_SMALL],
+		                            s_rxsi);
+		TAILQ_REMOVE (&sep->idle_rxs[SOCK_BUF_SMALL], rx, entry);
+		sep->rx_pool[SOCK_BUF_SMALL].idle--;
+		sock_free_rx (ep, rx);
+		n = 1;
+	}
 
-free_and_exit:
-	if (rx != NULL) {
-		if (rx->buffer != NULL)
-			free (rx->buffer);
-		free (rx);
+	for (i = 0; i < n; i++) {
+		sock_rx_t *rx = sock_alloc_rx (ep, buf_class);
+		if (rx == NULL)
+			break;
+		sock_put_rx_locked (sep, rx);
 	}
+	if (i)
+		debug (CCI_DB_INFO, "%s: %u %s rxs (%u total)", __func__, i,
+		       buf_class == SOCK_BUF_SMALL ? "small" : "large",
+		       sep->rx_cnt);
 
-	return NULL;
+	return i;
+}
+
+/**
+ * Get an idle RX whose buffer can hold len bytes, growing the pool if
+ * needed. A small message may get a large buffer if no small one is left.
+ */
+static inline sock_rx_t *
+sock_get_rx_locked (cci__ep_t *ep, uint32_t len)
+{
+	sock_ep_t *sep = ep->priv;
+	sock_buf_class_t c = sock_buf_class (ep, len);
+	sock_rx_t *rx;
+
+	if (TAILQ_EMPTY (&sep->idle_rxs[c]) && !sock_grow_rxs_locked (ep, c)) {
+		if (c == SOCK_BUF_LARGE
+		    || TAILQ_EMPTY (&sep->idle_rxs[SOCK_BUF_LARGE]))
+			return NULL;
+		c = SOCK_BUF_LARGE;
+	}
+	rx = TAILQ_FIRST (&sep->idle_rxs[c]);
+	TAILQ_REMOVE (&sep->idle_rxs[c], rx, entry);
+	if (--sep->rx_pool[c].idle < sep->rx_pool[c].idle_low)
+		sep->rx_pool[c].idle_low = sep->rx_pool[c].idle;
+
+	return rx;
+}
+
+/**
+ * No RX is left and none can be allocated: the app must return events.
+ */
+static inline int
+sock_rxs_exhausted_locked (cci__ep_t *ep)
+{
+	sock_ep_t *sep = ep->priv;
+
+	return TAILQ_EMPTY (&sep->idle_rxs[SOCK_BUF_SMALL])
+	       && TAILQ_EMPTY (&sep->idle_rxs[SOCK_BUF_LARGE])
+	       && sep->rx_cnt >= ep->rx_buf_cnt;
 }
 
 /**
@@ -169,26 +390,47 @@ update_rnr_mode (sock_conn_t *sconn, uint32_t seq)
 	return CCI_SOCK_SUCCESS;
 }
 
-static inline int
-event_queue_is_empty (cci__ep_t *ep)
+static inline void
+sock_queue_event (cci__ep_t *ep, cci__evt_t *evt)
 {
-	int ret;
-	pthread_mutex_lock(&ep->lock);
-	if (TAILQ_EMPTY (&ep->evts))
-		ret = 1;
-	else
-		ret = 0;
-	pthread_mutex_unlock(&ep->lock);
+	sock_ep_t *sep = ep->priv;
 
-	return ret;
+	pthread_mutex_lock(&sep->evt_lock);
+	TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
+	pthread_mutex_unlock(&sep->evt_lock);
 }
 
+/**
+ * Complete a send. A CCI_FLAG_BLOCKING sender sleeps on tx->done and
+ * reclaims the tx itself, so it is woken up instead of getting an event.
+ * Caller must hold ep->lock.
+ * @return	1 if an event was queued on ep->evts, 0 otherwise.
+ */
+static inline int
+sock_complete_tx_locked (cci__ep_t *ep, sock_tx_t *tx)
+{
+	tx->state = SOCK_TX_COMPLETED;
+	if (tx->flags & CCI_FLAG_BLOCKING) {
+		pthread_cond_signal(&tx->done);
+		return 0;
+	}
+	sock_queue_event(ep, &tx->evt);
+	return 1;
+}
+
+/**
+ * Ask the progress thread to run. The request is latched so that it is not
+ * lost if the thread is busy when we signal. No-op with progress=poll.
+ */
 static inline void
-sock_queue_event (cci__ep_t *ep, cci__evt_t *evt)
+sock_wake_progress (sock_ep_t *sep)
 {
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
-	pthread_mutex_unlock(&ep->lock);
+	if (sep->poll)
+		return;
+	pthread_mutex_lock(&sep->progress_mutex);
+	sep->progress_kick = 1;
+	pthread_cond_signal(&sep->wait_condition);
+	pthread_mutex_unlock(&sep->progress_mutex);
 }
 
 #define INIT_TX(tx) do { \
@@ -199,26 +441,45 @@ sock_queue_event (cci__ep_t *ep, cci__evt_t *evt)
 	}				\
 } while(0)
 
+/**
+ * Get an idle TX whose buffer can hold len bytes (headers included),
+ * growing the pool if needed. Caller must hold ep->lock.
+ */
+static inline sock_tx_t*
+sock_get_tx_locked (cci__ep_t *ep, uint32_t len)
+{
+	sock_ep_t *sep = ep->priv;
+	sock_buf_class_t c = sock_buf_class (ep, len);
+	sock_tx_t *tx;
+
+	if (TAILQ_EMPTY (&sep->idle_txs[c]) && !sock_grow_txs_locked (ep, c)) {
+		if (c == SOCK_BUF_LARGE
+		    || TAILQ_EMPTY (&sep->idle_txs[SOCK_BUF_LARGE]))
+			return NULL;
+		c = SOCK_BUF_LARGE;
+	}
+	tx = TAILQ_FIRST (&sep->idle_txs[c]);
+	TAILQ_REMOVE (&sep->idle_txs[c], tx, dentry);
+	if (--sep->tx_pool[c].idle < sep->tx_pool[c].idle_low)
+		sep->tx_pool[c].idle_low = sep->tx_pool[c].idle;
+
+	INIT_TX (tx);
+
+	return tx;
+}
+
 static inline sock_tx_t*
-sock_get_tx (cci__ep_t *ep)
+sock_get_tx (cci__ep_t *ep, uint32_t len)
 {
-	sock_ep_t *sep	= NULL;
 	sock_tx_t *tx 	= NULL;
 
 #if CCI_DEBUG
 	assert (ep);
 #endif
 
-	sep = ep->priv;
-
 	pthread_mutex_lock(&ep->lock);
-        if (!TAILQ_EMPTY(&sep->idle_txs)) {
-                tx = TAILQ_FIRST(&sep->idle_txs);
-                TAILQ_REMOVE(&sep->idle_txs, tx, dentry);
-        }
-        pthread_mutex_unlock(&ep->lock);
-
-	INIT_TX (tx);
+	tx = sock_get_tx_locked (ep, len);
+	pthread_mutex_unlock(&ep->lock);
 
 	return tx;
 }
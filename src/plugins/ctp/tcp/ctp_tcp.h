@@ -29,18 +29,28 @@ BEGIN_C_DECLS
 #define TCP_DEFAULT_MSS        (1024)
 #define TCP_MIN_MSS            (128)
 #define TCP_MAX_MSS            (9000)
+#define TCP_MAX_EAGER          (16*1024*1024)	/* largest eager= msg */
 
 #define TCP_EP_RX_CNT          (16*1024)	/* number of rx messages */
 #define TCP_EP_TX_CNT          (16*1024)	/* number of tx messages */
+#define TCP_EP_BIG_CNT         (8)	/* idle large msg buffers kept */
 #define TCP_PROG_TIME_MS       (10)	/* try to progress every N milliseconds */
 
 #define TCP_HDR_LEN            (8)	/* common header size */
 
-#define TCP_RMA_DEPTH          (16)	/* how many in-flight msgs per RMA */
+#define TCP_RMA_DEPTH          (16)	/* txs (fragments in flight) per RMA */
 #define TCP_RMA_FRAG_SIZE      (1024*1024)
 #define TCP_RMA_FRAG_MAX       (1024*1024)
 
 #define TCP_EP_MAX_CONNS       (1024)
+#define TCP_EP_NUM_EVTS        (64)	/* epoll events per progress pass */
+#define TCP_RECV_BATCH         (16)	/* msgs read from a conn per pass */
+#define TCP_ACCEPT_BATCH       (64)	/* conns accepted per pass */
+#define TCP_TX_IOV_MAX         (8)	/* NO_COPY iovecs held by a tx */
+#define TCP_SEND_IOV_MAX       (64)	/* iovecs per coalesced sendmsg() */
+#define TCP_MAX_STREAMS        (8)	/* sockets per conn, incl. control */
+#define TCP_KA_KERNEL_MIN      (1000000)	/* usecs, shorter ones timed here */
+#define TCP_KA_EXPIRE_MAX      (64)	/* keepalives handled per pass */
 
 static inline uint64_t tcp_tv_to_usecs(struct timeval tv)
 {
@@ -98,6 +108,7 @@ typedef enum tcp_msg_type {
 	TCP_MSG_RMA_READ_REQUEST,
 	TCP_MSG_RMA_READ_REPLY,
 	TCP_MSG_RMA_INVALID,	/* invalid handle */
+	TCP_MSG_CONN_LANE,	/* first msg on an extra socket of a conn */
 	TCP_MSG_TYPE_MAX
 } tcp_msg_type_t;
 
@@ -185,7 +196,7 @@ tcp_pack_handshake(tcp_handshake_t * hs,
 		    uint32_t max_recv_buffer_count, uint32_t mss,
 		    uint32_t keepalive, uint32_t server_tx_id)
 {
-	assert(mss <= (TCP_MAX_MSS));
+	assert(mss <= (TCP_MAX_EAGER));
 	assert(mss >= TCP_MIN_MSS);
 
 	hs->max_recv_buffer_count = htonl(max_recv_buffer_count);
@@ -210,7 +221,7 @@ tcp_parse_handshake(tcp_handshake_t * hs,
     <------------ 32 bits ------------>
     <- 8b -> <----- 16b- --->  4b   4b
    +--------+----------------+----+----+
-   |  rsvd  |    data len    |attr|type|
+   |streams |    data len    |attr|type|
    +--------+----------------+----+----+
    |               tx id               |
    +-----------------------------------+
@@ -230,6 +241,7 @@ tcp_parse_handshake(tcp_handshake_t * hs,
 
    attr: CCI_CONN_ATTR_[UU|RU|RO]
    data len: amount of user data following header
+   streams: sockets the client wants for this conn (0 and 1 mean one)
    tx id: tx used for message
    max_recv_buffer_count: number of msgs we can receive
    mss: max send size
@@ -239,19 +251,20 @@ tcp_parse_handshake(tcp_handshake_t * hs,
 
 static inline void
 tcp_pack_conn_request(tcp_header_t * header, cci_conn_attribute_t attr,
-		       uint16_t data_len, uint32_t client_tx_id)
+		       uint16_t data_len, uint32_t streams,
+		       uint32_t client_tx_id)
 {
-	uint32_t a = attr | (data_len << 4);
+	uint32_t a = attr | (data_len << 4) | ((streams & 0xFF) << 20);
 	tcp_pack_header(header, TCP_MSG_CONN_REQUEST, a, client_tx_id);
 }
 
 /* connection reply header:
 
     <------------ 32 bits ------------>
-    <------- 20b ------> <- 8b ->  4b
-   +--------------------+--------+----+
-   |        rsvd        |  reply |type|
-   +--------------------+--------+----+
+    <---- 16b ----> 4b  <- 8b ->  4b
+   +---------------+---+--------+----+
+   |   lane key    |str|  reply |type|
+   +---------------+---+--------+----+
    |          client tx id            |
    +----------------------------------+
 
@@ -269,14 +282,18 @@ tcp_pack_conn_request(tcp_header_t * header, cci_conn_attribute_t attr,
    The tx id is from the active client (to lookup its tx)
 
    reply: CCI_EVENT_CONNECT_[ACCEPTED|REJECTED]
+   str: sockets granted, the client opens str - 1 lanes
+   lane key: names this conn in the lanes' TCP_MSG_CONN_LANE
    mss: max app payload (user header and user data)
    server tx_id: set by server, client will return in conn_ack
  */
 
 static inline void
-tcp_pack_conn_reply(tcp_header_t * header, uint8_t reply, uint32_t client_tx_id)
+tcp_pack_conn_reply(tcp_header_t * header, uint8_t reply, uint32_t streams,
+		    uint32_t key, uint32_t client_tx_id)
 {
-	tcp_pack_header(header, TCP_MSG_CONN_REPLY, reply, client_tx_id);
+	uint32_t a = reply | ((streams & 0xF) << 8) | ((key & 0xFFFF) << 12);
+	tcp_pack_header(header, TCP_MSG_CONN_REPLY, a, client_tx_id);
 }
 
 /* connection ack header:
@@ -296,23 +313,47 @@ static inline void tcp_pack_conn_ack(tcp_header_t * header, uint32_t server_tx_i
 	tcp_pack_header(header, TCP_MSG_CONN_ACK, 0, server_tx_id);
 }
 
+/* connection lane header:
+
+    <----------- 32 bits ---------->
+    <---------- 28b ---------->  4b
+   +----------------------------+----+
+   |            lane            |type|
+   +----------------------------+----+
+   |             lane key            |
+   +---------------------------------+
+
+   Sent by the client as the only handshake of an extra socket (lane) of
+   an accepted conn. Lanes carry RMA fragments, the conn's own socket
+   stays free for MSGs and acks.
+
+ */
+
+static inline void
+tcp_pack_conn_lane(tcp_header_t * header, uint32_t lane, uint32_t key)
+{
+	tcp_pack_header(header, TCP_MSG_CONN_LANE, lane, key);
+}
+
 /* send header:
 
     <----------- 32 bits ---------->
-    <--- 12b --> <---- 16b ----->  4b
-   +------------+----------------+----+
-   |    rsvd    |       len      |type|
-   +------------+----------------+----+
+    <---------- 28b ---------->  4b
+   +----------------------------+----+
+   |             len            |type|
+   +----------------------------+----+
    |               tx_id              |
    +----------------------------------+
 
-   length of payload
+   length of payload, beyond the peer's mss only if both ends set eager=
    tx_id for reliable connections
 
  */
 
+#define TCP_SEND_LEN_MASK      (0x0FFFFFFF)
+
 static inline void
-tcp_pack_send(tcp_header_t * header, uint16_t len, uint32_t tx_id)
+tcp_pack_send(tcp_header_t * header, uint32_t len, uint32_t tx_id)
 {
 	tcp_pack_header(header, TCP_MSG_SEND, len, tx_id);
 }
@@ -320,18 +361,20 @@ tcp_pack_send(tcp_header_t * header, uint16_t len, uint32_t tx_id)
 /* keepalive header:
 
     <----------- 32 bits ---------->
-    <---------- 28b ---------->  4b
-   +---------------------------+----+
-   |         reserved          |type|
-   +---------------------------+----+
+    <--------- 27b ---------> 1b 4b
+   +-------------------------+-+----+
+   |        reserved         |R|type|
+   +-------------------------+-+----+
    |           reserved             |
    +--------------------------------+
 
+   R: set on the reply to a keepalive, which is not answered again
+
  */
 
-static inline void tcp_pack_keepalive(tcp_header_t * header)
+static inline void tcp_pack_keepalive(tcp_header_t * header, int reply)
 {
-	tcp_pack_header(header, TCP_MSG_KEEPALIVE, 0, 0);
+	tcp_pack_header(header, TCP_MSG_KEEPALIVE, !!reply, 0);
 }
 
 /* ack header:
@@ -347,7 +390,15 @@ static inline void tcp_pack_keepalive(tcp_header_t * header)
    type: TCP_MSG_ACK
    stat: CCI_SUCCESS, CCI_ERR_RNR, CCI_ERR_RMA_HANDLE
 
+   An RMA write is acked once, when its last fragment lands, with
+   TCP_ACK_RMA_DONE set in the reserved bits. An earlier fragment is only
+   acked (without it) when it fails.
+
  */
+
+#define TCP_ACK_STATUS_MASK    (0xFF)
+#define TCP_ACK_RMA_DONE       (1 << 8)
+
 static inline void
 tcp_pack_ack(tcp_header_t * header, uint32_t tx_id, uint32_t status)
 {
@@ -444,12 +495,16 @@ typedef struct tcp_rma_header {
    |             data              |
 
    length of payload
+   tx_id: the RMA's anchor tx, or'ed with TCP_RMA_WRITE_ACK on the last
+          fragment when no completion msg follows it
    local handle: cci_rma() caller's handle (stays same for each packet)
    local offset: offset into the local handle (changes for each packet)
    remote handle: passive peer's handle (stays same for each packet)
    remote offset: offset into the remote handle (changes for each packet)
  */
 
+#define TCP_RMA_WRITE_ACK      (1U << 31)
+
 static inline void
 tcp_pack_rma_write(tcp_rma_header_t * write, uint32_t data_len, uint32_t tx_id,
 		   uint64_t local_handle, uint64_t local_offset,
@@ -578,6 +633,16 @@ struct tcp_tx {
 	void *rma_ptr;
 	uint32_t rma_len;
 
+	/*! Caller's buffers of a CCI_FLAG_NO_COPY send, sent after buffer */
+	struct iovec iov[TCP_TX_IOV_MAX];
+	uint32_t iovcnt;
+
+	/*! Total length of iov */
+	uint32_t iov_len;
+
+	/*! Large buffer holding a payload that does not fit in buffer */
+	void *big;
+
 	/*! Timeout in microseconds */
 	uint64_t timeout_us;
 
@@ -587,11 +652,17 @@ struct tcp_tx {
 	/*! RMA fragment ID */
 	uint32_t rma_id;
 
+	/*! Index of the lane an RMA fragment is sent on */
+	uint32_t lane;
+
 	/*! Number of RNR nacks received */
 	uint32_t rnr;
 
 	/*! Peer address if connect reject message (i.e. no conn) */
 	struct sockaddr_in sin;
+
+	/*! Signalled, under ep->lock, when a CCI_FLAG_BLOCKING send completes */
+	pthread_cond_t done;
 };
 
 /*! Receive message context.
@@ -612,6 +683,9 @@ struct tcp_rx {
 
 	/*! Amount read (header + payload (including RMA) */
 	uintptr_t offset;
+
+	/*! Large buffer holding a payload that does not fit in buffer */
+	void *big;
 };
 
 typedef struct tcp_rma_handle {
@@ -657,15 +731,21 @@ typedef struct tcp_rma_op {
 	/*! Number of fragments for data transfer (excluding remote completion msg) */
 	uint32_t num_msgs;
 
-	/*! Next segment to send */
-	uint32_t next;
+	/*! Lanes the fragments are striped over, fragment i goes on lane
+	 * i % nlanes */
+	uint32_t nlanes;
 
-	/*! Last fragment acked */
-	int32_t acked;
+	/*! Next segment to send, per lane */
+	uint32_t next[TCP_MAX_STREAMS];
 
-	/*! Number of fragments pending */
+	/*! Number of read requests waiting for a reply, or of lanes whose
+	 * writes are not yet acked when striped */
 	uint32_t pending;
 
+	/*! Write fragments name their lane's anchor so acks find the op.
+	 * It is held until the lane's writes are acked. */
+	tcp_tx_t *anchor[TCP_MAX_STREAMS];
+
 	/*! Status of the RMA op */
 	cci_status_t status;
 
@@ -675,13 +755,17 @@ typedef struct tcp_rma_op {
 	/*! Flags */
 	int flags;
 
-	/*! Pointer to tx for remote completion if needed */
+	/*! Remote completion msg, packed as a SEND, if needed */
 	tcp_tx_t *tx;
 
+	/*! With CCI_FLAG_BLOCKING, the tx the caller sleeps on until the RMA
+	 * completes. Under the conn's lock, NULL once the caller gave up. */
+	tcp_tx_t *waiter;
+
 	/*! Application completion msg len */
-	uint16_t msg_len;
+	uint32_t msg_len;
 
-	/*! Application completion msg ptr if provided */
+	/*! Application completion msg ptr (in tx's buffer) if provided */
 	char *msg_ptr;
 } tcp_rma_op_t;
 
@@ -722,10 +806,14 @@ struct tcp_ep {
 	/* Our IP and port */
 	struct sockaddr_in sin;
 
-	/*! List of all connections with keepalive enabled */
-	/* FIXME: revisit the code to use this
-	TAILQ_HEAD(s_ka, tcp_conn) ka_conns;
-	*/
+	/*! Conns whose keepalive is timed here rather than by the kernel,
+	 *  a min-heap on ka_deadline, under ep->lock */
+	struct tcp_conn **ka_heap;
+	uint32_t ka_cnt;
+	uint32_t ka_max;
+
+	/*! Start of the current progress pass (usecs) */
+	uint64_t now;
 
 	/*! List of RMA registrations */
 	TAILQ_HEAD(s_handles, tcp_rma_handle) handles;
@@ -735,6 +823,25 @@ struct tcp_ep {
 
 	/*! ID of the recv thread for the endpoint */
 	pthread_t tid;
+
+	/*! epoll set of the listening socket and all conns */
+	int epfd;
+
+	/*! Conns with events left to handle, under ep->lock */
+	TAILQ_HEAD(s_ready, tcp_conn) ready;
+
+	/*! Deleted conns, freed once no epoll event can refer to them */
+	TAILQ_HEAD(s_zombies, tcp_conn) zombies;
+
+	/*! Only one thread makes progress at a time */
+	pthread_mutex_t progress_lock;
+
+	/*! Last lane key handed out, under lock */
+	uint32_t lane_key;
+
+	/*! Idle large buffers, under lock */
+	void *bigs[TCP_EP_BIG_CNT];
+	uint32_t nbigs;
 };
 
 /* Connection info */
@@ -765,6 +872,20 @@ typedef enum tcp_conn_status {
 	TCP_CONN_READY
 } tcp_conn_status_t;
 
+/* Stages of an incoming message. Each stage may take several progress
+ * passes, partial reads are parked on the conn. */
+
+typedef enum tcp_recv_stage {
+	/*! Reading the tcp_header_t */
+	TCP_RECV_HEADER = 0,
+
+	/*! Reading the handshake, MSG data or RMA handles into the rx */
+	TCP_RECV_DATA,
+
+	/*! Reading an RMA payload into the target buffer */
+	TCP_RECV_PAYLOAD
+} tcp_recv_stage_t;
+
 static inline char *
 tcp_conn_status_str(tcp_conn_status_t status)
 {
@@ -807,6 +928,26 @@ struct tcp_conn {
 	/*! partial receive */
 	tcp_rx_t *rx;
 
+	/*! Receive stage of rx */
+	tcp_recv_stage_t rstage;
+
+	/*! Where the current stage lands, NULL to drop it */
+	void *rptr;
+
+	/*! Length of the current stage */
+	uint32_t rlen;
+
+	/*! Bytes of the current stage received so far */
+	uint32_t roff;
+
+	/*! Header fields of rx */
+	tcp_msg_type_t rtype;
+	uint32_t ra;
+	uint32_t rb;
+
+	/*! Status of an RMA payload, reported in its ACK */
+	int rstatus;
+
 	/*! Lock */
 	pthread_mutex_t lock;
 
@@ -816,9 +957,34 @@ struct tcp_conn {
 	/*! Entry to hang on tcp_ep->conns */
 	 TAILQ_ENTRY(tcp_conn) entry;
 
+	/*! Events left to handle, under ep->lock */
+	uint32_t revents;
+
+	/*! Is this conn on tcp_ep->ready? */
+	int ready;
+
+	/*! Entry to hang on tcp_ep->ready */
+	TAILQ_ENTRY(tcp_conn) rentry;
+
+	/*! Is EPOLLOUT armed? Only while sends are queued, under lock */
+	int pollout;
+
+	/*! Keepalive left to the kernel (TCP_KEEPIDLE, TCP_USER_TIMEOUT) */
+	int ka_kernel;
+
+	/*! Index in tcp_ep->ka_heap plus one, 0 if not in it, under ep->lock */
+	uint32_t ka_idx;
+
+	/*! Next keepalive check, and when the peer was last heard (usecs) */
+	uint64_t ka_deadline;
+	uint64_t last_rx;
+
 	/*! Queued sends */
 	TAILQ_HEAD(s_queued, cci__evt) queued;
 
+	/*! Bytes on queued not yet written, under lock */
+	uint32_t qbytes;
+
 	/*! Pending (in-flight) sends */
 	TAILQ_HEAD(s_pending, cci__evt) pending;
 
@@ -833,6 +999,19 @@ struct tcp_conn {
 
 	/*! Flag to know if the receiver is ready or not */
 	uint32_t rnr;
+
+	/*! Sockets asked for (client) or granted (server) */
+	uint32_t streams;
+
+	/*! Key the peer's lanes name this conn with */
+	uint32_t lane_key;
+
+	/*! Connected lanes, under lock */
+	cci__conn_t *lanes[TCP_MAX_STREAMS - 1];
+	uint32_t nlanes;
+
+	/*! Owning conn if this is a lane, else NULL */
+	cci__conn_t *parent;
 };
 
 struct tcp_dev {
@@ -844,6 +1023,33 @@ struct tcp_dev {
 
 	/*! Set socket buffers sizes */
 	uint32_t bufsize;
+
+	/*! Set TCP_NODELAY (default on) */
+	int nodelay;
+
+	/*! Cork the socket while flushing more than one write */
+	int cork;
+
+	/*! Re-arm TCP_QUICKACK after each read */
+	int quickack;
+
+	/*! Defer non-blocking sends until this many bytes are queued */
+	uint32_t coalesce;
+
+	/*! Sockets per reliable conn, the extra ones carry RMA */
+	uint32_t streams;
+
+	/*! Size of the fixed tx and rx buffers (without header) */
+	uint32_t mss;
+
+	/*! Largest msg, sent from large buffers beyond mss */
+	uint32_t eager;
+
+	/*! Listen backlog, SOMAXCONN if 0 */
+	int backlog;
+
+	/*! Send the first msg in the SYN, accept such SYNs */
+	int fastopen;
 };
 
 typedef enum tcp_fd_type {
@@ -10,6 +10,7 @@
  *
  */
 
+#define _GNU_SOURCE	/* accept4() */
 #include "cci/private_config.h"
 
 #include <stdio.h>
@@ -29,6 +30,9 @@
 #include <net/if.h>
 #include <ifaddrs.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "cci.h"
 #include "cci_lib_types.h"
@@ -89,9 +93,11 @@ static int ctp_tcp_rma(cci_connection_t * connection,
 
 static void *tcp_progress_thread(void *arg);
 static int tcp_progress_ep(cci__ep_t *ep);
-static int tcp_poll_events(cci__ep_t *ep);
-static int tcp_sendto(cci_os_handle_t sock, void *buf, int len,
-			void *rma_ptr, uint32_t rma_len, uintptr_t *offset);
+static int tcp_poll_events(cci__ep_t *ep, int timeout);
+static int tcp_sendto(cci_os_handle_t sock, void *buf, uint32_t len,
+			const struct iovec *tail, uint32_t tailcnt,
+			uintptr_t *offset);
+static int tcp_send_tx(cci_os_handle_t sock, tcp_tx_t *tx);
 static inline void tcp_progress_conn_sends(cci__conn_t *conn);
 
 
@@ -179,6 +185,8 @@ static inline const char *tcp_msg_type(tcp_msg_type_t type)
 		return "RMA read reply";
 	case TCP_MSG_RMA_INVALID:
 		return "invalid RMA handle";
+	case TCP_MSG_CONN_LANE:
+		return "connection lane";
 	case TCP_MSG_INVALID:
 		assert(0);
 		return "invalid";
@@ -309,6 +317,7 @@ static int ctp_tcp_init(cci_plugin_ctp_t *plugin,
 					assert(mtu >= TCP_MIN_MSS); /* FIXME rather ignore the device? */
 					device->max_send_size = mtu;
 				}
+				tdev->mss = device->max_send_size;
 
 				cci__add_dev(dev);
 				devices[tglobals->count] = device;
@@ -355,6 +364,8 @@ static int ctp_tcp_init(cci_plugin_ctp_t *plugin,
 			device->pci.bus = -1;	/* per CCI spec */
 			device->pci.dev = -1;	/* per CCI spec */
 			device->pci.func = -1;	/* per CCI spec */
+			tdev->nodelay = 1;
+			tdev->streams = 1;
 
 			/* parse conf_argv */
 			for (arg = device->conf_argv; *arg != NULL; arg++) {
@@ -373,6 +384,28 @@ static int ctp_tcp_init(cci_plugin_ctp_t *plugin,
 				} else if (0 == strncmp("bufsize=", *arg, 8)) {
 					const char *size_str = *arg + 8;
 					tdev->bufsize = strtol(size_str, NULL, 0);
+				} else if (0 == strncmp("nodelay=", *arg, 8)) {
+					tdev->nodelay = strtol(*arg + 8, NULL, 0);
+				} else if (0 == strncmp("cork=", *arg, 5)) {
+					tdev->cork = strtol(*arg + 5, NULL, 0);
+				} else if (0 == strncmp("quickack=", *arg, 9)) {
+					tdev->quickack = strtol(*arg + 9, NULL, 0);
+				} else if (0 == strncmp("coalesce=", *arg, 9)) {
+					tdev->coalesce = strtol(*arg + 9, NULL, 0);
+				} else if (0 == strncmp("eager=", *arg, 6)) {
+					tdev->eager = strtol(*arg + 6, NULL, 0);
+					if (tdev->eager > TCP_MAX_EAGER)
+						tdev->eager = TCP_MAX_EAGER;
+				} else if (0 == strncmp("streams=", *arg, 8)) {
+					tdev->streams = strtol(*arg + 8, NULL, 0);
+					if (tdev->streams < 1)
+						tdev->streams = 1;
+					else if (tdev->streams > TCP_MAX_STREAMS)
+						tdev->streams = TCP_MAX_STREAMS;
+				} else if (0 == strncmp("backlog=", *arg, 8)) {
+					tdev->backlog = strtol(*arg + 8, NULL, 0);
+				} else if (0 == strncmp("fastopen=", *arg, 9)) {
+					tdev->fastopen = strtol(*arg + 9, NULL, 0);
 				} else if (0 == strncmp("interface=", *arg, 10)) {
 					interface = *arg + 10;
 				}
@@ -417,6 +450,10 @@ static int ctp_tcp_init(cci_plugin_ctp_t *plugin,
 					assert(mtu >= TCP_MIN_MSS); /* FIXME rather ignore the device? */
 					device->max_send_size = mtu;
 				}
+				/* larger msgs go out of large buffers */
+				tdev->mss = device->max_send_size;
+				if (tdev->eager > device->max_send_size)
+					device->max_send_size = tdev->eager;
 				/* queue to the main device list now */
 				TAILQ_REMOVE(&globals->configfile_devs, dev, entry);
 				cci__add_dev(dev);
@@ -499,6 +536,14 @@ static int ctp_tcp_finalize(cci_plugin_ctp_t * plugin)
 	return CCI_SUCCESS;
 }
 
+/* New sockets are non-blocking from the start where the OS allows,
+ * saving the fcntl() calls of tcp_set_nonblocking() per conn. */
+#ifdef SOCK_NONBLOCK
+#define TCP_SOCK_FLAGS	(SOCK_NONBLOCK | SOCK_CLOEXEC)
+#else
+#define TCP_SOCK_FLAGS	(0)
+#endif
+
 static inline int
 tcp_set_nonblocking(cci_os_handle_t sock)
 {
@@ -514,18 +559,295 @@ tcp_set_nonblocking(cci_os_handle_t sock)
 	return 0;
 }
 
+/* connect() returns at once and the first write, our CONN_REQUEST or
+ * CONN_LANE, goes out in the SYN once the server has handed us a Fast
+ * Open cookie. Until then, this is a normal handshake. */
+static inline void
+tcp_set_fastopen_connect(cci_os_handle_t sock)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+	int one = 1;
+
+	if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one,
+			sizeof(one)))
+		debug(CCI_DB_CONN, "%s: unable to set TCP_FASTOPEN_CONNECT (%s)",
+			__func__, strerror(errno));
+#endif
+}
+
+/* Linux clears TCP_QUICKACK whenever it falls back to delayed ACKs,
+ * so this is set again after each read. */
+static inline void
+tcp_set_quickack(cci_os_handle_t sock)
+{
+#ifdef TCP_QUICKACK
+	int one = 1;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#endif
+	return;
+}
+
+static inline void
+tcp_set_cork(cci_os_handle_t sock, int cork)
+{
+#ifdef TCP_CORK
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+#endif
+	return;
+}
+
+/* Let the kernel probe an idle conn after half the keepalive timeout
+ * and fail the socket once the peer has not acked anything, probe or
+ * data, for the whole timeout (usecs). 0 turns it off again.
+ *
+ * Returns 0 on success. */
+static int
+tcp_set_kernel_keepalive(cci_os_handle_t sock, uint32_t ka)
+{
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && \
+	defined(TCP_KEEPCNT) && defined(TCP_USER_TIMEOUT)
+	int on = ka != 0, cnt = 3, idle, intvl;
+	unsigned int ms = ka / 1000;
+
+	idle = ka / 2000000;
+	if (idle < 1)
+		idle = 1;
+	intvl = ((int)(ka / 1000000) - idle) / cnt;
+	if (intvl < 1)
+		intvl = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) ||
+	    setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms)))
+		return errno;
+	if (!on)
+		return 0;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) ||
+	    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) ||
+	    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)))
+		return errno;
+	return 0;
+#else
+	return CCI_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+/* Wire length of a tx */
+static inline uintptr_t
+tcp_tx_total(tcp_tx_t *tx)
+{
+	return (uintptr_t) tx->len + tx->rma_len + tx->iov_len;
+}
+
+/* Account for len bytes of the queued list reaching the socket */
+static inline void
+tcp_conn_sent_locked(tcp_conn_t *tconn, uintptr_t len)
+{
+	tconn->qbytes = len < tconn->qbytes ? tconn->qbytes - len : 0;
+}
+
 static inline void tcp_close_socket(cci_os_handle_t sock)
 {
 	close(sock);
 	return;
 }
 
+/* Close the conn's socket, removing it from the epoll set first so that
+ * a recycled fd number is never confused with this conn. */
+static inline void
+tcp_close_conn_fd(cci__ep_t *ep, tcp_conn_t *tconn)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	tcp_ep_t *tep = ep->priv;
+	struct epoll_event ev;
+#endif
+
+	if (!tconn->pfd.fd)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(tep->epfd, EPOLL_CTL_DEL, tconn->pfd.fd, &ev);
+#endif
+	close(tconn->pfd.fd);
+	tconn->pfd.fd = 0;
+	return;
+}
+
+/* Keepalive
+ *
+ * A conn's keepalive timeout of a second or more is left to the kernel,
+ * which then fails the socket and we report CCI_EVENT_KEEPALIVE_TIMEDOUT
+ * along with the POLLHUP. Shorter ones are timed here on a min-heap of
+ * deadlines, so a progress pass only touches the conns that are due: a
+ * conn not heard from for half its timeout is sent a KEEPALIVE, which
+ * the peer answers, and one not heard from for the whole timeout has
+ * timed out.
+ */
+
+static void
+tcp_ka_swap(tcp_ep_t *tep, uint32_t i, uint32_t j)
+{
+	tcp_conn_t *tconn = tep->ka_heap[i];
+
+	tep->ka_heap[i] = tep->ka_heap[j];
+	tep->ka_heap[j] = tconn;
+	tep->ka_heap[i]->ka_idx = i + 1;
+	tep->ka_heap[j]->ka_idx = j + 1;
+}
+
+static void
+tcp_ka_sift_up(tcp_ep_t *tep, uint32_t i)
+{
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+
+		if (tep->ka_heap[parent]->ka_deadline <=
+		    tep->ka_heap[i]->ka_deadline)
+			break;
+		tcp_ka_swap(tep, i, parent);
+		i = parent;
+	}
+}
+
+static void
+tcp_ka_sift_down(tcp_ep_t *tep, uint32_t i)
+{
+	for (;;) {
+		uint32_t l = 2 * i + 1, r = l + 1, min = i;
+
+		if (l < tep->ka_cnt && tep->ka_heap[l]->ka_deadline <
+		    tep->ka_heap[min]->ka_deadline)
+			min = l;
+		if (r < tep->ka_cnt && tep->ka_heap[r]->ka_deadline <
+		    tep->ka_heap[min]->ka_deadline)
+			min = r;
+		if (min == i)
+			break;
+		tcp_ka_swap(tep, i, min);
+		i = min;
+	}
+}
+
+/* NOTE: the caller holds ep->lock */
+static int
+tcp_ka_insert_locked(tcp_ep_t *tep, tcp_conn_t *tconn)
+{
+	if (tep->ka_cnt == tep->ka_max) {
+		uint32_t max = tep->ka_max ? tep->ka_max * 2 : 64;
+		tcp_conn_t **heap = realloc(tep->ka_heap, max * sizeof(*heap));
+
+		if (!heap)
+			return CCI_ENOMEM;
+		tep->ka_heap = heap;
+		tep->ka_max = max;
+	}
+	tep->ka_heap[tep->ka_cnt] = tconn;
+	tconn->ka_idx = ++tep->ka_cnt;
+	tcp_ka_sift_up(tep, tep->ka_cnt - 1);
+	return CCI_SUCCESS;
+}
+
+/* NOTE: the caller holds ep->lock */
+static void
+tcp_ka_remove_locked(tcp_ep_t *tep, tcp_conn_t *tconn)
+{
+	uint32_t i = tconn->ka_idx - 1;
+
+	if (!tconn->ka_idx)
+		return;
+	tconn->ka_idx = 0;
+	if (i != --tep->ka_cnt) {
+		tep->ka_heap[i] = tep->ka_heap[tep->ka_cnt];
+		tep->ka_heap[i]->ka_idx = i + 1;
+		tcp_ka_sift_down(tep, i);
+		tcp_ka_sift_up(tep, i);
+	}
+}
+
+/* (Re)arm a ready conn's keepalive from conn->keepalive_timeout, or
+ * disarm it if 0.
+ *
+ * NOTE: the caller holds ep->lock
+ */
+static void
+tcp_keepalive_arm_locked(cci__ep_t *ep, cci__conn_t *conn)
+{
+	tcp_ep_t *tep = ep->priv;
+	tcp_conn_t *tconn = conn->priv;
+	uint32_t ka = conn->keepalive_timeout;
+
+	tcp_ka_remove_locked(tep, tconn);
+	if (tconn->status != TCP_CONN_READY || tconn->parent)
+		return;
+
+	if (ka >= TCP_KA_KERNEL_MIN &&
+	    !tcp_set_kernel_keepalive(tconn->pfd.fd, ka)) {
+		tconn->ka_kernel = 1;
+		return;
+	}
+	if (tconn->ka_kernel) {
+		tcp_set_kernel_keepalive(tconn->pfd.fd, 0);
+		tconn->ka_kernel = 0;
+	}
+	if (!ka)
+		return;
+
+	tconn->last_rx = tcp_get_usecs();
+	tconn->ka_deadline = tconn->last_rx + ka / 2;
+	if (tcp_ka_insert_locked(tep, tconn))
+		debug(CCI_DB_WARN, "%s: no memory to time the keepalive "
+			"of conn %p", __func__, (void*)conn);
+}
+
+/* Release a conn's memory. With epoll, the progress thread may still
+ * hold an event that points at it, so park it on tep->zombies until the
+ * next pass of tcp_poll_events().
+ *
+ * NOTE: the caller holds ep->lock
+ */
+static void
+tcp_free_conn_locked(cci__ep_t *ep, cci__conn_t *conn)
+{
+	tcp_conn_t *tconn = conn->priv;
+#ifdef HAVE_SYS_EPOLL_H
+	tcp_ep_t *tep = ep->priv;
+#endif
+
+	free((char *)conn->uri);
+	conn->uri = NULL;
+
+	tcp_ka_remove_locked(ep->priv, tconn);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (tconn->ready) {
+		TAILQ_REMOVE(&tep->ready, tconn, rentry);
+		tconn->ready = 0;
+	}
+	tconn->status = TCP_CONN_CLOSED;
+	TAILQ_INSERT_TAIL(&tep->zombies, tconn, entry);
+#else
+#if CCI_DEBUG
+	memset(tconn, 0xFF, sizeof(*tconn));
+	memset(conn, 0xFF, sizeof(*conn));
+#endif
+	free(tconn);
+	free(conn);
+#endif
+	return;
+}
+
 static inline int
 tcp_new_conn(cci__ep_t *ep, struct sockaddr_in sin, int fd, cci__conn_t **connp);
 
 static void
 queue_conn(cci__ep_t *ep, cci__conn_t *conn);
 
+#ifdef HAVE_SYS_EPOLL_H
+static int
+tcp_epoll_add(cci__ep_t *ep, tcp_conn_t *tconn, int pollout);
+#endif
+
 static void
 conn_decref(cci__ep_t *ep, cci__conn_t *conn);
 
@@ -535,7 +857,7 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 				cci_os_handle_t * fd)
 {
 	int i, ret, one = 1;
-	cci_os_handle_t sock;
+	cci_os_handle_t sock = -1;
 	cci__dev_t *dev = NULL;
 	cci__ep_t *ep = NULL;
 	cci__conn_t *conn = NULL;
@@ -570,6 +892,7 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 		ret = CCI_EINVAL;
 		goto out;
 	}
+	tdev = dev->priv;
 
 	ep = container_of(endpoint, cci__ep_t, endpoint);
 	ep->priv = calloc(1, sizeof(*tep));
@@ -580,7 +903,7 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 
 	ep->rx_buf_cnt = TCP_EP_RX_CNT;
 	ep->tx_buf_cnt = TCP_EP_TX_CNT;
-	ep->buffer_len = dev->device.max_send_size + TCP_HDR_LEN;
+	ep->buffer_len = tdev->mss + TCP_HDR_LEN;
 	ep->tx_timeout = 0;
 
 	tep = ep->priv;
@@ -591,6 +914,18 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 	TAILQ_INIT(&tep->idle_rxs);
 	TAILQ_INIT(&tep->handles);
 	TAILQ_INIT(&tep->rma_ops);
+	TAILQ_INIT(&tep->ready);
+	TAILQ_INIT(&tep->zombies);
+	pthread_mutex_init(&tep->progress_lock, NULL);
+
+#ifdef HAVE_SYS_EPOLL_H
+	tep->epfd = epoll_create(TCP_EP_NUM_EVTS);
+	if (tep->epfd == -1) {
+		ret = errno;
+		tep->epfd = 0;
+		goto out;
+	}
+#endif
 
 	sock = socket(PF_INET, SOCK_STREAM, 0);
 	if (sock == -1) {
@@ -606,7 +941,6 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 	}
 
 	/* bind socket to device */
-	tdev = dev->priv;
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = tdev->ip;
@@ -665,6 +999,7 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 		tx->evt.ep = ep;
 		tx->buffer = (void*)((uintptr_t)tep->tx_buf + (i * ep->buffer_len));
 		tx->len = 0;
+		pthread_cond_init(&tx->done, NULL);
 		TAILQ_INSERT_TAIL(&tep->idle_txs, &tx->evt, entry);
 	}
 
@@ -697,12 +1032,30 @@ static int ctp_tcp_create_endpoint(cci_device_t * device,
 	if (ret)
 		goto out;
 
-	ret = listen(sock, SOMAXCONN);
+	ret = listen(sock, tdev->backlog > 0 ? tdev->backlog : SOMAXCONN);
 	if (ret) {
 		ret = errno;
 		goto out;
 	}
 
+#ifdef TCP_FASTOPEN
+	if (tdev->fastopen) {
+		/* queue of SYNs with data awaiting the handshake */
+		int qlen = tdev->backlog > 0 ? tdev->backlog : SOMAXCONN;
+
+		if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+				sizeof(qlen)))
+			debug(CCI_DB_WARN, "%s: unable to set TCP_FASTOPEN (%s)",
+				__func__, strerror(errno));
+	}
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+	ret = tcp_epoll_add(ep, tconn, 0);
+	if (ret)
+		goto out;
+#endif
+
 	if (fd) {
 		ret = pipe(tep->pipe);
 		if (ret) {
@@ -744,8 +1097,10 @@ out:
 		free(tep->rxs);
 		free(tep->rx_buf);
 
-		if (sock)
+		if (sock >= 0)
 			tcp_close_socket(sock);
+		if (tep->epfd)
+			close(tep->epfd);
 		free(tep);
 		ep->priv = NULL;
 	}
@@ -757,6 +1112,56 @@ out:
 	return ret;
 }
 
+/* Wake any CCI_FLAG_BLOCKING sender or RMA caller still waiting on this
+ * conn so that it can notice the status change.
+ *
+ * NOTE: the caller holds ep->lock and tconn->lock
+ */
+static void
+tcp_wake_blocked_sends_locked(tcp_conn_t *tconn)
+{
+	cci__evt_t *evt = NULL;
+	tcp_rma_op_t *rma_op = NULL;
+
+	TAILQ_FOREACH(evt, &tconn->queued, entry) {
+		tcp_tx_t *tx = container_of(evt, tcp_tx_t, evt);
+		if (tx->flags & CCI_FLAG_BLOCKING)
+			pthread_cond_signal(&tx->done);
+	}
+	TAILQ_FOREACH(evt, &tconn->pending, entry) {
+		tcp_tx_t *tx = container_of(evt, tcp_tx_t, evt);
+		if (tx->flags & CCI_FLAG_BLOCKING)
+			pthread_cond_signal(&tx->done);
+	}
+	TAILQ_FOREACH(rma_op, &tconn->rmas, rmas) {
+		if (rma_op->waiter)
+			pthread_cond_signal(&rma_op->waiter->done);
+	}
+	return;
+}
+
+static void
+tcp_conn_set_closing_locked(cci__ep_t *ep, cci__conn_t *conn);
+
+/* Close the lanes of a closing conn
+ *
+ * NOTE: the caller holds ep->lock and tconn->lock
+ */
+static void
+tcp_close_lanes_locked(cci__ep_t *ep, tcp_conn_t *tconn)
+{
+	uint32_t i;
+
+	for (i = 0; i < tconn->nlanes; i++) {
+		tcp_conn_t *ltconn = tconn->lanes[i]->priv;
+
+		pthread_mutex_lock(&ltconn->lock);
+		tcp_conn_set_closing_locked(ep, tconn->lanes[i]);
+		pthread_mutex_unlock(&ltconn->lock);
+	}
+	tconn->nlanes = 0;
+}
+
 static inline void
 tcp_conn_set_closed(cci__ep_t *ep, cci__conn_t *conn)
 {
@@ -770,13 +1175,12 @@ tcp_conn_set_closed(cci__ep_t *ep, cci__conn_t *conn)
 	if (tconn->status == TCP_CONN_READY) {
 		if (tep->poll_conn == tconn)
 			tep->poll_conn = NULL;
-		if (tconn->pfd.fd) {
-			close(tconn->pfd.fd);
-			tconn->pfd.fd = 0;
-		}
+		tcp_close_conn_fd(ep, tconn);
 		/* TODO complete queued and pending sends */
 	}
 	tconn->status = TCP_CONN_CLOSED;
+	tcp_wake_blocked_sends_locked(tconn);
+	tcp_close_lanes_locked(ep, tconn);
 	pthread_mutex_unlock(&tconn->lock);
 	pthread_mutex_unlock(&ep->lock);
 
@@ -792,12 +1196,11 @@ tcp_conn_set_closing_locked(cci__ep_t *ep, cci__conn_t *conn)
 	tcp_conn_t *tconn = conn->priv;
 
 	if (tconn->status > TCP_CONN_INIT) {
-		if (tconn->pfd.fd) {
-			close(tconn->pfd.fd);
-			tconn->pfd.fd = 0;
-		}
+		tcp_close_conn_fd(ep, tconn);
 		tconn->status = TCP_CONN_CLOSING;
 		/* TODO complete queued and pending sends */
+		tcp_wake_blocked_sends_locked(tconn);
+		tcp_close_lanes_locked(ep, tconn);
 
 		if (tep->poll_conn == tconn)
 			tep->poll_conn = NULL;
@@ -846,6 +1249,7 @@ static int ctp_tcp_destroy_endpoint(cci_endpoint_t * endpoint)
 	pthread_mutex_lock(&ep->lock);
 
 	if (tep) {
+		int i;
 		cci__conn_t *conn;
 		tcp_conn_t *tconn;
 
@@ -865,12 +1269,30 @@ static int ctp_tcp_destroy_endpoint(cci_endpoint_t * endpoint)
 			free(tconn);
 			free(conn);
 		}
+		while (!TAILQ_EMPTY(&tep->zombies)) {
+			tconn = TAILQ_FIRST(&tep->zombies);
+			TAILQ_REMOVE(&tep->zombies, tconn, entry);
+			free(tconn->conn);
+			free(tconn);
+		}
+		if (tep->epfd)
+			close(tep->epfd);
+		for (i = 0; i < (int) ep->tx_buf_cnt; i++) {
+			pthread_cond_destroy(&tep->txs[i].done);
+			free(tep->txs[i].big);
+		}
 		free(tep->txs);
 		free(tep->tx_buf);
 
+		for (i = 0; i < (int) ep->rx_buf_cnt; i++)
+			free(tep->rxs[i].big);
 		free(tep->rxs);
 		free(tep->rx_buf);
 
+		while (tep->nbigs)
+			free(tep->bigs[--tep->nbigs]);
+		free(tep->ka_heap);
+
 		while (!TAILQ_EMPTY(&tep->rma_ops)) {
 			tcp_rma_op_t *rma_op = TAILQ_FIRST(&tep->rma_ops);
 			TAILQ_REMOVE(&tep->rma_ops, rma_op, entry);
@@ -904,6 +1326,8 @@ tcp_get_tx_locked(tcp_ep_t *tep)
 		tx->offset = 0;
 		tx->rma_ptr = NULL;
 		tx->rma_len = 0;
+		tx->iovcnt = 0;
+		tx->iov_len = 0;
 		tx->rma_op = NULL;
 		tx->rma_id = 0;
 		tx->flags = 0;
@@ -937,11 +1361,43 @@ tcp_get_tx(cci__ep_t *ep, int allocate)
 	return tx;
 }
 
+/* Get a buffer for a msg larger than the mss. Idle ones are kept on
+ * the endpoint, so steady traffic does not hit malloc(). */
+static void *
+tcp_get_big(cci__ep_t *ep)
+{
+	tcp_ep_t *tep = ep->priv;
+	void *buf = NULL;
+
+	pthread_mutex_lock(&ep->lock);
+	if (tep->nbigs)
+		buf = tep->bigs[--tep->nbigs];
+	pthread_mutex_unlock(&ep->lock);
+
+	if (!buf)
+		buf = malloc(ep->dev->device.max_send_size);
+	return buf;
+}
+
+/* NOTE: the caller holds ep->lock */
+static inline void
+tcp_put_big_locked(tcp_ep_t *tep, void *buf)
+{
+	if (tep->nbigs < TCP_EP_BIG_CNT)
+		tep->bigs[tep->nbigs++] = buf;
+	else
+		free(buf);
+}
+
 static inline void
 tcp_put_tx_locked(tcp_ep_t *tep, tcp_tx_t *tx)
 {
 	assert(tx->ctx == TCP_CTX_TX);
 	tx->state = TCP_TX_IDLE;
+	if (tx->big) {
+		tcp_put_big_locked(tep, tx->big);
+		tx->big = NULL;
+	}
 	debug(CCI_DB_MSG, "%s: putting tx %p buffer %p id %u",
 		__func__, (void*)tx, (void*)tx->buffer, tx->id);
 	TAILQ_INSERT_HEAD(&tep->idle_txs, &tx->evt, entry);
@@ -949,6 +1405,22 @@ tcp_put_tx_locked(tcp_ep_t *tep, tcp_tx_t *tx)
 	return;
 }
 
+/* Complete a send. A CCI_FLAG_BLOCKING sender sleeps on tx->done and
+ * reclaims the tx itself, so it is woken up instead of getting an event.
+ *
+ * NOTE: the caller holds ep->lock
+ */
+static inline void
+tcp_complete_tx_locked(cci__ep_t *ep, tcp_tx_t *tx)
+{
+	tx->state = TCP_TX_COMPLETED;
+	if (tx->flags & CCI_FLAG_BLOCKING)
+		pthread_cond_signal(&tx->done);
+	else
+		TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
+	return;
+}
+
 static inline void
 tcp_put_tx(tcp_tx_t *tx)
 {
@@ -992,6 +1464,10 @@ static inline void
 tcp_put_rx_locked(tcp_ep_t *tep, tcp_rx_t *rx)
 {
 	assert(rx->ctx == TCP_CTX_RX);
+	if (rx->big) {
+		tcp_put_big_locked(tep, rx->big);
+		rx->big = NULL;
+	}
 	TAILQ_INSERT_HEAD(&tep->idle_rxs, &rx->evt, entry);
 
 	return;
@@ -1017,6 +1493,7 @@ static int ctp_tcp_accept(cci_event_t *event, const void *context)
 	cci__conn_t *conn = NULL;
 	cci__evt_t *evt = NULL;
 	tcp_ep_t *tep = NULL;
+	tcp_dev_t *tdev = NULL;
 	tcp_conn_t *tconn = NULL;
 	tcp_header_t *hdr = NULL, *request_hdr = NULL;
 	tcp_tx_t *tx = NULL;
@@ -1037,6 +1514,7 @@ static int ctp_tcp_accept(cci_event_t *event, const void *context)
 	ep = evt->ep;
 	endpoint = &ep->endpoint;
 	tep = ep->priv;
+	tdev = ep->dev->priv;
 
 	request_hdr = rx->buffer;
 	client_tx_id = ntohl(request_hdr->b);
@@ -1050,20 +1528,15 @@ static int ctp_tcp_accept(cci_event_t *event, const void *context)
 		/* TODO send reject */
 		/* TODO tep->nfds-- */
 
-		if (tconn->pfd.fd) {
-			close(tconn->pfd.fd);
-			tconn->pfd.fd = 0;
-		}
+		tcp_close_conn_fd(ep, tconn);
 
 		pthread_mutex_lock(&ep->lock);
 		if (tep->poll_conn == tconn)
 			tep->poll_conn = TAILQ_NEXT(tconn, entry);
 		TAILQ_REMOVE(&tep->conns, tconn, entry);
+		tcp_free_conn_locked(ep, conn);
 		pthread_mutex_unlock(&ep->lock);
 
-		free((char*)conn->uri);
-		free(conn->priv);
-		free(conn);
 		CCI_EXIT;
 		return CCI_ENOBUFS;
 	}
@@ -1089,23 +1562,37 @@ static int ctp_tcp_accept(cci_event_t *event, const void *context)
 
 	/* pack the msg */
 
+	/* grant up to as many lanes as we would open ourselves */
+	if (tconn->streams > tdev->streams)
+		tconn->streams = tdev->streams;
+	if (tconn->streams > 1) {
+		pthread_mutex_lock(&ep->lock);
+		if (!++tep->lane_key)
+			tep->lane_key++;
+		tconn->lane_key = tep->lane_key & 0xFFFF;
+		pthread_mutex_unlock(&ep->lock);
+	}
+
 	hdr = (tcp_header_t *) tx->buffer;
-	tcp_pack_conn_reply(hdr, CCI_SUCCESS, client_tx_id);
+	tcp_pack_conn_reply(hdr, CCI_SUCCESS, tconn->streams, tconn->lane_key,
+				client_tx_id);
 	hs = (tcp_handshake_t *) ((uintptr_t)tx->buffer + sizeof(*hdr));
 	tcp_pack_handshake(hs, ep->rx_buf_cnt,
 			   conn->connection.max_send_size, 0, tx->id);
 
 	tx->len = sizeof(*hdr) + sizeof(*hs);
 
+	/* pend it first, the progress thread may see the CONN_ACK before
+	 * tcp_sendto() returns */
 	tx->state = TCP_TX_PENDING;
-	tcp_sendto(tconn->pfd.fd, tx->buffer, tx->len, NULL, 0, &offset);
-
-	assert((uint32_t)offset == tx->len);
-
 	pthread_mutex_lock(&tconn->lock);
 	TAILQ_INSERT_HEAD(&tconn->pending, &tx->evt, entry);
 	pthread_mutex_unlock(&tconn->lock);
 
+	tcp_sendto(tconn->pfd.fd, tx->buffer, tx->len, NULL, 0, &offset);
+
+	assert((uint32_t)offset == tx->len);
+
 	CCI_EXIT;
 
 	return CCI_SUCCESS;
@@ -1152,7 +1639,7 @@ static int ctp_tcp_reject(cci_event_t *event)
 	/* prepare conn_reply */
 
 	memset(&reject, 0, sizeof(reject));
-	tcp_pack_conn_reply(&reject, CCI_ECONNREFUSED, b);
+	tcp_pack_conn_reply(&reject, CCI_ECONNREFUSED, 0, 0, b);
 
 	tcp_sendto(tconn->pfd.fd, &reject, sizeof(reject),
 			NULL, 0, &offset);
@@ -1277,19 +1764,26 @@ out_with_conn:
 static inline int
 tcp_monitor_fd(cci__ep_t *ep, cci__conn_t *conn, int events)
 {
-	int ret = CCI_SUCCESS, one = 1;
+	int ret = CCI_SUCCESS;
 	cci__dev_t *dev = ep->dev;
 	tcp_dev_t *tdev = dev->priv;
 	tcp_conn_t *tconn = conn->priv;
+	int nodelay = !!tdev->nodelay;
 
-	ret = tcp_set_nonblocking(tconn->pfd.fd);
-	if (ret)
-		goto out;
+	if (!TCP_SOCK_FLAGS) {
+		ret = tcp_set_nonblocking(tconn->pfd.fd);
+		if (ret)
+			goto out;
+	}
 
-	ret = setsockopt(tconn->pfd.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	ret = setsockopt(tconn->pfd.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+			sizeof(nodelay));
 	if (ret)
 		goto out;
 
+	if (tdev->quickack)
+		tcp_set_quickack(tconn->pfd.fd);
+
 	if (tdev->bufsize) {
 		uint32_t bufsize = tdev->bufsize;
 		socklen_t opt_len = sizeof(bufsize);
@@ -1329,6 +1823,59 @@ queue_conn(cci__ep_t *ep, cci__conn_t *conn)
 	return;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/* Add the conn's socket to the endpoint's epoll set. All sockets are
+ * edge-triggered; EPOLLOUT is only armed while sends are queued. */
+static int
+tcp_epoll_add(cci__ep_t *ep, tcp_conn_t *tconn, int pollout)
+{
+	int ret = CCI_SUCCESS;
+	tcp_ep_t *tep = ep->priv;
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	if (pollout)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = tconn;
+
+	tconn->pollout = pollout;
+
+	ret = epoll_ctl(tep->epfd, EPOLL_CTL_ADD, tconn->pfd.fd, &ev);
+	if (ret) {
+		ret = errno;
+		debug(CCI_DB_WARN, "%s: epoll_ctl(ADD) returned %s",
+			__func__, strerror(ret));
+	}
+
+	return ret;
+}
+
+/* Arm or disarm EPOLLOUT. Re-arming with EPOLL_CTL_MOD also re-reports
+ * a writable socket, so a send queued after the edge is not lost.
+ *
+ * NOTE: the caller holds tconn->lock
+ */
+static void
+tcp_epoll_pollout_locked(cci__ep_t *ep, tcp_conn_t *tconn, int pollout)
+{
+	tcp_ep_t *tep = ep->priv;
+	struct epoll_event ev;
+
+	if (tconn->pollout == pollout || tconn->is_listener || tconn->pfd.fd <= 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	if (pollout)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = tconn;
+
+	if (!epoll_ctl(tep->epfd, EPOLL_CTL_MOD, tconn->pfd.fd, &ev))
+		tconn->pollout = pollout;
+}
+#endif
+
 static int ctp_tcp_connect(cci_endpoint_t * endpoint, const char *server_uri,
 			const void *data_ptr, uint32_t data_len,
 			cci_conn_attribute_t attribute,
@@ -1374,7 +1921,7 @@ static int ctp_tcp_connect(cci_endpoint_t * endpoint, const char *server_uri,
 	sin.sin_addr.s_addr = ip;	/* already in network order */
 	sin.sin_port = port;	/* already in network order */
 
-	ret = socket(PF_INET, SOCK_STREAM, 0);
+	ret = socket(PF_INET, SOCK_STREAM | TCP_SOCK_FLAGS, 0);
 	if (ret == -1) {
 		ret = errno;
 		debug(CCI_DB_CONN, "%s: socket returned %s", __func__, strerror(ret));
@@ -1424,8 +1971,13 @@ static int ctp_tcp_connect(cci_endpoint_t * endpoint, const char *server_uri,
 
 	/* pack the msg */
 
+	/* ask for lanes to stripe RMA over */
+	if (attribute != CCI_CONN_ATTR_UU)
+		tconn->streams = tdev->streams;
+
 	hdr = (tcp_header_t *) tx->buffer;
-	tcp_pack_conn_request(hdr, attribute, data_len, tx->id);
+	tcp_pack_conn_request(hdr, attribute, data_len, tconn->streams,
+				tx->id);
 	tx->len = sizeof(*hdr);
 
 	/* add handshake */
@@ -1446,15 +1998,6 @@ static int ctp_tcp_connect(cci_endpoint_t * endpoint, const char *server_uri,
 	tx->len += data_len;
 	assert(tx->len <= ep->buffer_len);
 
-	/* start connect now */
-	ret = socket(PF_INET, SOCK_STREAM, 0);
-	if (ret == -1) {
-		ret = errno;
-		debug(CCI_DB_CONN, "%s: socket returned %s", __func__, strerror(ret));
-		goto out;
-	}
-	tconn->pfd.fd = ret;
-
 	/* we will have to check for POLLOUT to determine when
 	 * the connect completed
 	 */
@@ -1467,10 +2010,14 @@ static int ctp_tcp_connect(cci_endpoint_t * endpoint, const char *server_uri,
 	/* insert at tail of conn's queued list */
 	pthread_mutex_lock(&tconn->lock);
 	TAILQ_INSERT_TAIL(&tconn->queued, &tx->evt, entry);
+	tconn->qbytes += tcp_tx_total(tx);
 	pthread_mutex_unlock(&tconn->lock);
 
 	queue_conn(ep, conn);
 
+	if (tdev->fastopen)
+		tcp_set_fastopen_connect(tconn->pfd.fd);
+
 again:
 	/* ok, initiate connect()... */
 	ret = connect(tconn->pfd.fd, (struct sockaddr *)&sin, slen);
@@ -1493,7 +2040,15 @@ again:
 		tconn->pfd.events = POLLIN | POLLOUT;
 	}
 
-	conn_decref(ep, conn); /* drop our reference */
+#ifdef HAVE_SYS_EPOLL_H
+	/* register only once connect() is underway, otherwise the
+	 * unconnected socket reports EPOLLHUP */
+	ret = tcp_epoll_add(ep, tconn, 1);
+	if (ret)
+		goto out;
+#endif
+
+	conn_decref(ep, conn); /* drop our reference */
 
 	CCI_EXIT;
 	return CCI_SUCCESS;
@@ -1514,6 +2069,8 @@ out:
 		free(conn->priv);
 		free(conn);
 	}
+	if (fd != -1)
+		close(fd);
 	if (tx)
 		tcp_put_tx(tx);
 	CCI_EXIT;
@@ -1545,6 +2102,106 @@ static int ctp_tcp_disconnect(cci_connection_t * connection)
 	return CCI_SUCCESS;
 }
 
+/* Make a connected lane usable by its conn. Lanes stay on tep->conns,
+ * with a ref held for the conn, until the endpoint is destroyed. */
+static void
+tcp_lane_attach(cci__ep_t *ep, cci__conn_t *lane)
+{
+	tcp_conn_t *ltconn = lane->priv;
+	tcp_conn_t *tconn = ltconn->parent->priv;
+
+	pthread_mutex_lock(&ep->lock);
+	pthread_mutex_lock(&tconn->lock);
+	pthread_mutex_lock(&ltconn->lock);
+	if (tconn->status > TCP_CONN_INIT &&
+		tconn->nlanes < TCP_MAX_STREAMS - 1) {
+		ltconn->status = TCP_CONN_READY;
+		ltconn->pfd.events = POLLIN | POLLOUT;
+		ltconn->refcnt++; /* for the parent */
+		tconn->lanes[tconn->nlanes++] = lane;
+		debug(CCI_DB_CONN, "%s: conn %p lane %u is %p", __func__,
+			(void*)ltconn->parent, tconn->nlanes, (void*)lane);
+	} else {
+		tcp_conn_set_closing_locked(ep, lane);
+	}
+	pthread_mutex_unlock(&ltconn->lock);
+	pthread_mutex_unlock(&tconn->lock);
+	pthread_mutex_unlock(&ep->lock);
+}
+
+/* Open lane i of an accepted conn. Its CONN_LANE is sent once connect()
+ * completes. A lane that fails to open leaves the conn with fewer. */
+static int
+tcp_connect_lane(cci__ep_t *ep, cci__conn_t *conn, uint32_t i)
+{
+	int ret, fd;
+	tcp_dev_t *tdev = ep->dev->priv;
+	tcp_conn_t *tconn = conn->priv, *ltconn = NULL;
+	cci__conn_t *lane = NULL;
+	tcp_tx_t *tx = NULL;
+
+	fd = socket(PF_INET, SOCK_STREAM | TCP_SOCK_FLAGS, 0);
+	if (fd == -1)
+		return errno;
+
+	ret = tcp_new_conn(ep, tconn->sin, fd, &lane); /* gives us a ref */
+	if (ret) {
+		close(fd);
+		return ret;
+	}
+	ltconn = lane->priv;
+	ltconn->parent = conn;
+	lane->connection.attribute = conn->connection.attribute;
+
+	tx = tcp_get_tx(ep, 0);
+	if (!tx) {
+		ret = CCI_ENOBUFS;
+		goto out;
+	}
+	tx->msg_type = TCP_MSG_CONN_LANE;
+	tx->evt.conn = lane;
+	tx->evt.event.type = CCI_EVENT_NONE;
+	tcp_pack_conn_lane(tx->buffer, i, tconn->lane_key);
+	tx->len = sizeof(tcp_header_t);
+	tx->state = TCP_TX_QUEUED;
+
+	ret = tcp_monitor_fd(ep, lane, POLLOUT);
+	if (ret)
+		goto out;
+
+	if (tdev->fastopen)
+		tcp_set_fastopen_connect(fd);
+
+	ret = connect(fd, (struct sockaddr *)&tconn->sin, sizeof(tconn->sin));
+	if (ret && errno != EINPROGRESS && errno != EINTR) {
+		ret = errno;
+		debug(CCI_DB_CONN, "%s: connect() returned %s",
+			__func__, strerror(ret));
+		goto out;
+	}
+
+	pthread_mutex_lock(&ltconn->lock);
+	TAILQ_INSERT_TAIL(&ltconn->queued, &tx->evt, entry);
+	ltconn->qbytes += tcp_tx_total(tx);
+	pthread_mutex_unlock(&ltconn->lock);
+
+	queue_conn(ep, lane);
+#ifdef HAVE_SYS_EPOLL_H
+	if (tcp_epoll_add(ep, ltconn, 1))
+		tcp_conn_set_closing(ep, lane);
+#endif
+	conn_decref(ep, lane); /* drop our reference */
+	return CCI_SUCCESS;
+
+out:
+	if (tx)
+		tcp_put_tx(tx);
+	close(fd);
+	free(ltconn);
+	free(lane);
+	return ret;
+}
+
 static int ctp_tcp_set_opt(cci_opt_handle_t * handle,
 			cci_opt_name_t name, const void *val)
 {
@@ -1571,13 +2228,36 @@ static int ctp_tcp_set_opt(cci_opt_handle_t * handle,
 		ret = CCI_ERR_NOT_IMPLEMENTED;
 		break;
 	case CCI_OPT_ENDPT_KEEPALIVE_TIMEOUT:
+	{
+		tcp_ep_t *tep;
+		tcp_conn_t *tconn;
+
 		ep = container_of(handle, cci__ep_t, endpoint);
+		tep = ep->priv;
+		pthread_mutex_lock(&ep->lock);
 		ep->keepalive_timeout = *((uint32_t*) val);
+		/* the open conns as well as the future ones */
+		TAILQ_FOREACH(tconn, &tep->conns, entry) {
+			if (tconn->status != TCP_CONN_READY || tconn->parent)
+				continue;
+			tconn->conn->keepalive_timeout = ep->keepalive_timeout;
+			tcp_keepalive_arm_locked(ep, tconn->conn);
+		}
+		pthread_mutex_unlock(&ep->lock);
 		break;
+	}
 	case CCI_OPT_CONN_SEND_TIMEOUT:
 		conn = container_of(handle, cci__conn_t, connection);
 		conn->tx_timeout = *((uint32_t*) val);
 		break;
+	case CCI_OPT_CONN_KEEPALIVE_TIMEOUT:
+		conn = container_of(handle, cci__conn_t, connection);
+		ep = container_of(conn->connection.endpoint, cci__ep_t, endpoint);
+		pthread_mutex_lock(&ep->lock);
+		conn->keepalive_timeout = *((uint32_t*) val);
+		tcp_keepalive_arm_locked(ep, conn);
+		pthread_mutex_unlock(&ep->lock);
+		break;
 	default:
 		debug(CCI_DB_INFO, "unknown option %u", name);
 		ret = CCI_EINVAL;
@@ -1620,7 +2300,7 @@ static int ctp_tcp_get_event(cci_endpoint_t * endpoint, cci_event_t ** const eve
 {
 	int ret = CCI_SUCCESS;
 	cci__ep_t *ep;
-	cci__evt_t *ev = NULL, *e;
+	cci__evt_t *ev = NULL;
 	tcp_ep_t *tep;
 
 	CCI_ENTER;
@@ -1638,24 +2318,9 @@ static int ctp_tcp_get_event(cci_endpoint_t * endpoint, cci_event_t ** const eve
 
 	pthread_mutex_lock(&ep->lock);
 
-	/* give the user the first event */
-	TAILQ_FOREACH(e, &ep->evts, entry) {
-		if (e->event.type == CCI_EVENT_SEND) {
-			/* NOTE: if it is blocking, skip it since tcp_sendv()
-			 * is waiting on it
-			 */
-			tcp_tx_t *tx = container_of(e, tcp_tx_t, evt);
-			if (tx->flags & CCI_FLAG_BLOCKING) {
-				continue;
-			} else {
-				ev = e;
-				break;
-			}
-		} else {
-			ev = e;
-			break;
-		}
-	}
+	/* give the user the first event; blocking sends never get here,
+	 * tcp_send_common() is woken up directly on completion */
+	ev = TAILQ_FIRST(&ep->evts);
 
 	if (ev) {
 		TAILQ_REMOVE(&ep->evts, ev, entry);
@@ -1710,6 +2375,7 @@ static int ctp_tcp_return_event(cci_event_t * event)
 	switch (event->type) {
 	case CCI_EVENT_SEND:
 	case CCI_EVENT_ACCEPT:
+	case CCI_EVENT_KEEPALIVE_TIMEDOUT:
 		tx = container_of(evt, tcp_tx_t, evt);
 		tcp_put_tx(tx);
 		break;
@@ -1738,129 +2404,345 @@ static int ctp_tcp_return_event(cci_event_t * event)
 	return CCI_SUCCESS;
 }
 
-static int tcp_sendto(cci_os_handle_t sock, void *buf, int len,
-			void *rma_ptr, uint32_t rma_len, uintptr_t *offset)
+/* Describe what is left of buf[0, len) followed by the tail iovecs,
+ * skipping the first off bytes. Returns the number of iovecs filled, or
+ * -1 if more than max are needed. */
+static int
+tcp_fill_iov(void *buf, uint32_t len, const struct iovec *tail,
+		uint32_t tailcnt, uintptr_t off, struct iovec *iov, int max)
 {
-	int ret = CCI_SUCCESS;
-	uintptr_t off = *offset;
+	int cnt = 0;
+	uint32_t i;
+
+	if (max < (int) tailcnt + 1)
+		return -1;
 
 	if (off < (uintptr_t) len) {
-		ret = send(sock, (void*)((uintptr_t)buf + off), (int)((uintptr_t)len - off), 0);
-		if (ret != -1) {
-			off += ret;
-			*offset += ret;
-			ret = CCI_SUCCESS;
-		} else {
-			ret = errno;
-			goto out;
-		}
-	}
-	if (rma_ptr && (off >= (uintptr_t)len)) {
+		iov[cnt].iov_base = (void*)((uintptr_t)buf + off);
+		iov[cnt].iov_len = len - off;
+		cnt++;
+		off = 0;
+	} else {
 		off -= len;
-		ret = send(sock, (void*)((uintptr_t)rma_ptr + off), rma_len - off, 0);
-		if (ret != -1) {
-			*offset += ret;
-			ret = CCI_SUCCESS;
-		} else {
-			ret = errno;
-			goto out;
+	}
+	for (i = 0; i < tailcnt; i++) {
+		if (off >= tail[i].iov_len) {
+			off -= tail[i].iov_len;
+			continue;
 		}
+		iov[cnt].iov_base = (void*)((uintptr_t)tail[i].iov_base + off);
+		iov[cnt].iov_len = tail[i].iov_len - off;
+		cnt++;
+		off = 0;
+	}
+
+	return cnt;
+}
+
+/* Send what is left of a message, buf[0, len) followed by the tail
+ * iovecs, with a single gather write. *offset counts what was already
+ * sent across all of them. */
+static int tcp_sendto(cci_os_handle_t sock, void *buf, uint32_t len,
+			const struct iovec *tail, uint32_t tailcnt,
+			uintptr_t *offset)
+{
+	int ret = CCI_SUCCESS, cnt;
+	struct iovec iov[TCP_TX_IOV_MAX + 1];
+	struct msghdr msg;
+
+	assert(tailcnt <= TCP_TX_IOV_MAX);
+
+	cnt = tcp_fill_iov(buf, len, tail, tailcnt, *offset, iov,
+			TCP_TX_IOV_MAX + 1);
+	if (!cnt)
+		goto out;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+
+	ret = sendmsg(sock, &msg, 0);
+	if (ret != -1) {
+		*offset += ret;
+		ret = CCI_SUCCESS;
+	} else {
+		ret = errno;
 	}
 out:
 	return ret;
 }
 
+/* Describe what is left of tx: its buffer, then the caller's NO_COPY
+ * data or the RMA payload. */
+static int
+tcp_tx_fill_iov(tcp_tx_t *tx, struct iovec *iov, int max)
+{
+	struct iovec rma;
+
+	if (tx->iovcnt)
+		return tcp_fill_iov(tx->buffer, tx->len, tx->iov, tx->iovcnt,
+				tx->offset, iov, max);
+
+	rma.iov_base = tx->rma_ptr;
+	rma.iov_len = tx->rma_len;
+
+	return tcp_fill_iov(tx->buffer, tx->len, &rma, tx->rma_ptr ? 1 : 0,
+			tx->offset, iov, max);
+}
+
+/* Send what is left of tx: its buffer, then the caller's NO_COPY data
+ * or the RMA payload in the same write. */
+static int tcp_send_tx(cci_os_handle_t sock, tcp_tx_t *tx)
+{
+	struct iovec rma;
+
+	if (tx->iovcnt)
+		return tcp_sendto(sock, tx->buffer, tx->len, tx->iov,
+				tx->iovcnt, &tx->offset);
+
+	rma.iov_base = tx->rma_ptr;
+	rma.iov_len = tx->rma_len;
+
+	return tcp_sendto(sock, tx->buffer, tx->len, &rma,
+			tx->rma_ptr ? 1 : 0, &tx->offset);
+}
+
+/* Pack the next fragment of tx's lane of an RMA (or its read request)
+ * into tx */
+static void
+tcp_rma_pack_frag(tcp_rma_op_t *rma_op, tcp_tx_t *tx)
+{
+	int i = rma_op->next[tx->lane];
+	int last = i == (int)(rma_op->num_msgs - 1);
+	uint64_t offset = (uint64_t) i * (uint64_t) TCP_RMA_FRAG_SIZE;
+	tcp_rma_header_t *rma_hdr = (tcp_rma_header_t *) tx->buffer;
+	const struct cci_rma_handle *lh = rma_op->local_handle;
+	tcp_rma_handle_t *local = (void*)((uintptr_t)lh->stuff[0]);
+
+	rma_op->next[tx->lane] += rma_op->nlanes;
+	tx->state = TCP_TX_QUEUED;
+	tx->len = sizeof(*rma_hdr);
+	tx->offset = 0;
+	tx->rma_len = TCP_RMA_FRAG_SIZE;
+	tx->rma_id = i;
+
+	if (last && rma_op->data_len % TCP_RMA_FRAG_SIZE)
+		tx->rma_len = rma_op->data_len % TCP_RMA_FRAG_SIZE;
+
+	tx->rma_ptr = (void*)((uintptr_t)local->start + rma_op->local_offset + offset);
+
+	debug(CCI_DB_MSG, "%s: %s fragment %d local offset %"PRIu64" "
+		"remote offset %"PRIu64" length %u", __func__,
+		tcp_msg_type(tx->msg_type), i,
+		rma_op->local_offset + offset,
+		rma_op->remote_offset + offset, tx->rma_len);
+
+	if (tx->msg_type == TCP_MSG_RMA_WRITE) {
+		uint32_t id = rma_op->anchor[tx->lane]->id;
+
+		/* without a completion msg, the last fragment's ack
+		 * completes the write. Striped, each lane's last fragment
+		 * is acked since the lanes are not ordered. */
+		if (rma_op->nlanes > 1) {
+			if (i + rma_op->nlanes >= rma_op->num_msgs)
+				id |= TCP_RMA_WRITE_ACK;
+		} else if (last && !rma_op->tx) {
+			id |= TCP_RMA_WRITE_ACK;
+		}
+		tcp_pack_rma_write(rma_hdr, tx->rma_len, id,
+				rma_op->local_handle->stuff[0],
+				rma_op->local_offset + offset,
+				rma_op->remote_handle->stuff[0],
+				rma_op->remote_offset + offset);
+	} else {
+		tcp_pack_rma_read_request(rma_hdr, tx->rma_len, tx->id,
+				rma_op->local_handle->stuff[0],
+				rma_op->local_offset + offset,
+				rma_op->remote_handle->stuff[0],
+				rma_op->remote_offset + offset);
+		tx->rma_ptr = NULL;
+		tx->rma_len = 0;
+	}
+}
+
+/* Queue a packed fragment on its lane. The completion msg of an
+ * unstriped write goes right behind its last fragment: TCP keeps them in
+ * order, so the peer sees the msg only once the data has landed.
+ *
+ * NOTE: the caller holds tconn->lock
+ */
+static void
+tcp_rma_queue_frag_locked(tcp_conn_t *tconn, tcp_tx_t *tx)
+{
+	tcp_rma_op_t *rma_op = tx->rma_op;
+
+	TAILQ_INSERT_TAIL(&tconn->queued, &tx->evt, entry);
+	tconn->qbytes += tcp_tx_total(tx);
+
+	if (tx->msg_type == TCP_MSG_RMA_WRITE && rma_op->tx &&
+		rma_op->nlanes == 1 && tx->rma_id == rma_op->num_msgs - 1) {
+		rma_op->tx->state = TCP_TX_QUEUED;
+		TAILQ_INSERT_TAIL(&tconn->queued, &rma_op->tx->evt, entry);
+		tconn->qbytes += tcp_tx_total(rma_op->tx);
+	}
+}
+
 static inline void
 tcp_progress_conn_sends(cci__conn_t *conn)
 {
-	int ret, is_reliable = 0;
-	tcp_conn_t *tconn = conn->priv;
-	tcp_tx_t *put_tx = NULL;
+	int ret, corked = 0;
+	tcp_conn_t *tconn = NULL;
+	tcp_dev_t *tdev = NULL;
+	TAILQ_HEAD(s_put, cci__evt) put_txs = TAILQ_HEAD_INITIALIZER(put_txs);
 
 	if (!conn || !conn->priv)
 		return;
 
 	tconn = conn->priv;
-
-	is_reliable = cci_conn_is_reliable(conn);
-	tconn = conn->priv;
+	tdev = container_of(conn->connection.endpoint, cci__ep_t,
+			endpoint)->dev->priv;
 
 	pthread_mutex_lock(&tconn->lock);
 	while (!TAILQ_EMPTY(&tconn->queued)) {
-		cci__evt_t *evt = TAILQ_FIRST(&tconn->queued);
-		tcp_tx_t *tx = container_of(evt, tcp_tx_t, evt);
-		int off = tx->offset;
+		cci__evt_t *evt = NULL, *last = NULL;
+		tcp_tx_t *tx = NULL;
+		struct iovec iov[TCP_SEND_IOV_MAX];
+		struct msghdr msg;
+		ssize_t sent;
+		int cnt = 0, n, done = 0;
 
-		if (tx->msg_type == TCP_MSG_CONN_REQUEST &&
-			tconn->status == TCP_CONN_ACTIVE1)
-			break;
+		/* gather as much of the queue as fits into one write */
+		TAILQ_FOREACH(evt, &tconn->queued, entry) {
+			tx = container_of(evt, tcp_tx_t, evt);
+
+			if ((tx->msg_type == TCP_MSG_CONN_REQUEST ||
+				tx->msg_type == TCP_MSG_CONN_LANE) &&
+				tconn->status == TCP_CONN_ACTIVE1)
+				break;
 
-		if (tx->msg_type == TCP_MSG_RMA_WRITE ||
-			tx->msg_type == TCP_MSG_RMA_READ_REQUEST) {
-			if (tx->rma_op->pending >= TCP_RMA_DEPTH &&
-					tx->offset == 0)
-				/* don't start this RMA fragment yet */
+			n = tcp_tx_fill_iov(tx, &iov[cnt], TCP_SEND_IOV_MAX - cnt);
+			if (n < 0)
 				break;
+
+			debug(CCI_DB_MSG, "%s: sending %s to conn %p (tx %u "
+				"len %u rma_len %u iovcnt %u offset %"PRIuPTR")",
+				__func__, tcp_msg_type(tx->msg_type),
+				(void*)conn, tx->id, tx->len, tx->rma_len,
+				tx->iovcnt, tx->offset);
+
+			cnt += n;
+			last = evt;
 		}
+		if (!last)
+			break;
 
-		debug(CCI_DB_MSG, "%s: sending %s to conn %p",
-			__func__, tcp_msg_type(tx->msg_type), (void*)conn);
+		/* more than one write needed, hold partial segments back */
+		if (tdev->cork && !corked && TAILQ_NEXT(last, entry)) {
+			tcp_set_cork(tconn->pfd.fd, 1);
+			corked = 1;
+		}
 
-		debug(CCI_DB_MSG, "%s: buffer %p len %u rma_ptr %p rma_len %u "
-			"offset %"PRIuPTR" tx %u", __func__, (void*)tx->buffer,
-			tx->len, (void*)tx->rma_ptr, tx->rma_len, tx->offset, tx->id);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = cnt;
 
-		ret = tcp_sendto(tconn->pfd.fd, tx->buffer, tx->len,
-				tx->rma_ptr, tx->rma_len, &tx->offset);
-		if (ret) {
+		sent = sendmsg(tconn->pfd.fd, &msg, 0);
+		if (sent == -1) {
+			ret = errno;
 			if (ret == EAGAIN || ret == EINTR) {
-				debug(CCI_DB_MSG, "%s: sending %s returned %s",
-					__func__, tcp_msg_type(tx->msg_type),
-					strerror(ret));
-				break;
+				debug(CCI_DB_MSG, "%s: sendmsg() returned %s",
+					__func__, strerror(ret));
 			} else {
 				/* close connection? */
-				debug(CCI_DB_CONN, "%s: send() returned %s (%d) - "
+				debug(CCI_DB_CONN, "%s: sendmsg() returned %s (%d) - "
 					"do we need to close the connection?",
 					__func__, strerror(ret), ret);
 			}
-		} else {
-			debug(CCI_DB_MSG, "%s: sent %u bytes to conn %p (offset %u off %u)",
-				__func__, (int) tx->offset - off, (void*)conn, (int) tx->offset, off);
-			if (tx->offset == (tx->len + tx->rma_len)) {
-				debug(CCI_DB_MSG, "%s: completed %s send to conn %p",
-					__func__, tcp_msg_type(tx->msg_type), (void*)conn);
-				TAILQ_REMOVE(&tconn->queued, evt, entry);
-				switch (tx->msg_type) {
-				default:
+			break;
+		}
+
+		debug(CCI_DB_MSG, "%s: sent %zd bytes in %d iovecs to conn %p",
+			__func__, sent, cnt, (void*)conn);
+
+		tcp_conn_sent_locked(tconn, sent);
+
+		/* hand the written bytes to the txs in queue order */
+		while (!done) {
+			uintptr_t left;
+
+			evt = TAILQ_FIRST(&tconn->queued);
+			tx = container_of(evt, tcp_tx_t, evt);
+			left = tcp_tx_total(tx) - tx->offset;
+
+			if ((uintptr_t) sent < left) {
+				tx->offset += sent;
+				break;
+			}
+			tx->offset += left;
+			sent -= left;
+			done = evt == last;
+
+			debug(CCI_DB_MSG, "%s: completed %s send to conn %p",
+				__func__, tcp_msg_type(tx->msg_type), (void*)conn);
+			TAILQ_REMOVE(&tconn->queued, evt, entry);
+			switch (tx->msg_type) {
+			default:
+				tx->state = TCP_TX_PENDING;
+				TAILQ_INSERT_TAIL(&tconn->pending, evt, entry);
+				break;
+			case TCP_MSG_RMA_WRITE:
+				/* fragments are not acked, reuse the tx for
+				 * the next one as soon as it is written */
+				if (tx->rma_op->next[tx->lane] <
+					tx->rma_op->num_msgs) {
+					tcp_rma_pack_frag(tx->rma_op, tx);
+					tcp_rma_queue_frag_locked(tconn, tx);
+				} else if (tx == tx->rma_op->anchor[tx->lane]) {
+					tx->state = TCP_TX_PENDING;
 					TAILQ_INSERT_TAIL(&tconn->pending, evt, entry);
-					break;
-				case TCP_MSG_RMA_READ_REPLY:
-					put_tx = tx;
-					break;
-				case TCP_MSG_CONN_ACK:
-					put_tx = tx;
-					break;
-				case TCP_MSG_ACK:
-					if (!tx->evt.ep) {
-						debug(CCI_DB_MSG, "%s: freeing "
-							"tx %p", __func__, (void*)tx);
-						free(tx->buffer);
-						free(tx);
-					} else {
-						put_tx = tx;
-					}
-					break;
+				} else {
+					TAILQ_INSERT_TAIL(&put_txs, evt, entry);
+				}
+				break;
+			case TCP_MSG_RMA_READ_REPLY:
+				TAILQ_INSERT_TAIL(&put_txs, evt, entry);
+				break;
+			case TCP_MSG_CONN_ACK:
+			case TCP_MSG_CONN_LANE:
+			case TCP_MSG_KEEPALIVE:
+				TAILQ_INSERT_TAIL(&put_txs, evt, entry);
+				break;
+			case TCP_MSG_ACK:
+				if (!tx->evt.ep) {
+					debug(CCI_DB_MSG, "%s: freeing "
+						"tx %p", __func__, (void*)tx);
+					free(tx->buffer);
+					free(tx);
+				} else {
+					TAILQ_INSERT_TAIL(&put_txs, evt, entry);
 				}
-			} else {
 				break;
 			}
 		}
+		if (!done)
+			/* the socket is full */
+			break;
 	}
+	if (corked)
+		tcp_set_cork(tconn->pfd.fd, 0);
+#ifdef HAVE_SYS_EPOLL_H
+	tcp_epoll_pollout_locked(container_of(conn->connection.endpoint,
+				cci__ep_t, endpoint), tconn,
+				!TAILQ_EMPTY(&tconn->queued));
+#endif
 	pthread_mutex_unlock(&tconn->lock);
 
-	if (put_tx) {
-		tcp_put_tx(put_tx);
+	/* several may complete per call now that ACKs are batched */
+	while (!TAILQ_EMPTY(&put_txs)) {
+		cci__evt_t *evt = TAILQ_FIRST(&put_txs);
+
+		TAILQ_REMOVE(&put_txs, evt, entry);
+		tcp_put_tx(container_of(evt, tcp_tx_t, evt));
 	}
 
 	return;
@@ -1871,7 +2753,7 @@ tcp_progress_ep(cci__ep_t *ep)
 {
 	int ret = CCI_EAGAIN;
 
-	tcp_poll_events(ep);
+	tcp_poll_events(ep, 0);
 
 	return ret;
 }
@@ -1881,6 +2763,7 @@ tcp_queue_tx(tcp_ep_t *tep, tcp_conn_t *tconn, cci__evt_t *evt)
 {
 	pthread_mutex_lock(&tconn->lock);
 	TAILQ_INSERT_TAIL(&tconn->queued, evt, entry);
+	tconn->qbytes += tcp_tx_total(container_of(evt, tcp_tx_t, evt));
 	tconn->pfd.events = POLLIN | POLLOUT;
 	pthread_mutex_unlock(&tconn->lock);
 }
@@ -1896,12 +2779,14 @@ static int tcp_send_common(cci_connection_t * connection,
 	cci__ep_t *ep;
 	cci__conn_t *conn;
 	tcp_ep_t *tep;
+	tcp_dev_t *tdev;
 	tcp_conn_t *tconn;
 	tcp_tx_t *tx = NULL;
 	tcp_header_t *hdr;
 	void *ptr;
 	cci__evt_t *evt;
 	union cci_event *event;	/* generic CCI event */
+	int coalesce = 0;
 
 	debug(CCI_DB_FUNC, "entering %s", func);
 
@@ -1922,6 +2807,7 @@ static int tcp_send_common(cci_connection_t * connection,
 
 	ep = container_of(endpoint, cci__ep_t, endpoint);
 	tep = ep->priv;
+	tdev = ep->dev->priv;
 	conn = container_of(connection, cci__conn_t, connection);
 	tconn = conn->priv;
 
@@ -1966,10 +2852,14 @@ static int tcp_send_common(cci_connection_t * connection,
 	if (tconn->status < TCP_CONN_INIT) {
 		debug(CCI_DB_CONN, "%s: trying to send on conn %p in state %s ***",
 			__func__, (void*)conn, tcp_conn_status_str(tconn->status));
-		tx->state = TCP_TX_COMPLETED;
 		event->send.status = CCI_ERR_DISCONNECTED;
 		pthread_mutex_lock(&ep->lock);
-		TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
+		if (tx->flags & CCI_FLAG_BLOCKING) {
+			tcp_put_tx_locked(tep, tx);
+			ret = CCI_ERR_DISCONNECTED;
+		} else {
+			tcp_complete_tx_locked(ep, tx);
+		}
 		pthread_mutex_unlock(&ep->lock);
 		goto out;
 	}
@@ -1981,33 +2871,59 @@ static int tcp_send_common(cci_connection_t * connection,
 
 	ptr = (void*)((uintptr_t)tx->buffer + tx->len);
 
-	/* copy user data to buffer
-	 * NOTE: ignore CCI_FLAG_NO_COPY because we need to
-	 send the entire packet in one shot. We could
-	 use sendmsg() with an iovec. */
-
-	for (i = 0; i < (int) iovcnt; i++) {
-		if (!(rma_op && rma_op->tx)) {
-			/* don't copy - the data is already in place
-			 * from the rma() call */
+	/* With CCI_FLAG_NO_COPY, the caller's buffers go out behind the
+	 * header in the same gather write and are held until completion.
+	 * Otherwise (or with too many iovecs) copy them to the buffer, or
+	 * to a large buffer sent the same way if they do not fit. */
+	if ((flags & CCI_FLAG_NO_COPY) && !(rma_op && rma_op->tx) &&
+		iovcnt <= TCP_TX_IOV_MAX) {
+		for (i = 0; i < (int) iovcnt; i++) {
+			if (!data[i].iov_len)
+				continue;
+			tx->iov[tx->iovcnt++] = data[i];
+			tx->iov_len += data[i].iov_len;
+		}
+	} else if (tx->len + data_len > ep->buffer_len) {
+		tx->big = tcp_get_big(ep);
+		if (!tx->big) {
+			tcp_put_tx(tx);
+			debug(CCI_DB_FUNC, "exiting %s", func);
+			return CCI_ENOMEM;
+		}
+		for (ptr = tx->big, i = 0; i < (int) iovcnt; i++) {
 			memcpy(ptr, data[i].iov_base, data[i].iov_len);
+			ptr = (void*)((uintptr_t)ptr + data[i].iov_len);
+		}
+		tx->iov[0].iov_base = tx->big;
+		tx->iov[0].iov_len = data_len;
+		tx->iovcnt = 1;
+		tx->iov_len = data_len;
+	} else {
+		for (i = 0; i < (int) iovcnt; i++) {
+			if (!(rma_op && rma_op->tx)) {
+				/* don't copy - the data is already in place
+				 * from the rma() call */
+				memcpy(ptr, data[i].iov_base, data[i].iov_len);
+			}
+			ptr = (void*)((uintptr_t)ptr + data[i].iov_len);
+			tx->len += data[i].iov_len;
 		}
-		ptr = (void*)((uintptr_t)ptr + data[i].iov_len);
-		tx->len += data[i].iov_len;
 	}
 
 	/* if unreliable, try to send */
 	if (!is_reliable) {
     again:
-		ret = tcp_sendto(tconn->pfd.fd, tx->buffer, tx->len, tx->rma_ptr,
-				tx->rma_len, &tx->offset);
+		ret = tcp_send_tx(tconn->pfd.fd, tx);
 		if (ret == CCI_SUCCESS) {
-			if (tx->offset < tx->len)
+			if (tx->offset < tcp_tx_total(tx))
 				goto again;
-			/* queue event on enpoint's completed queue */
-			tx->state = TCP_TX_COMPLETED;
+			/* queue event on enpoint's completed queue, a
+			 * blocking UU send is done once it is on the wire */
 			pthread_mutex_lock(&ep->lock);
-			TAILQ_INSERT_TAIL(&ep->evts, evt, entry);
+			if (tx->flags & CCI_FLAG_BLOCKING)
+				tcp_put_tx_locked(tep, tx);
+			else
+				tcp_complete_tx_locked(ep, tx);
 			pthread_mutex_unlock(&ep->lock);
 			debug(CCI_DB_MSG, "sent UU msg with %d bytes",
 			      tx->len - (int)sizeof(tcp_header_t));
@@ -2028,9 +2944,20 @@ static int tcp_send_common(cci_connection_t * connection,
 	tx->state = TCP_TX_QUEUED;
 	tcp_queue_tx(tep, tconn, evt);
 
-	/* try to progress txs */
+	/* try to progress txs, unless we are coalescing small sends in
+	 * which case progress flushes them once the socket is writable */
 
-	tcp_progress_conn_sends(conn);
+	if (tdev->coalesce && !(flags & CCI_FLAG_BLOCKING)) {
+		pthread_mutex_lock(&tconn->lock);
+		coalesce = tconn->qbytes < tdev->coalesce;
+#ifdef HAVE_SYS_EPOLL_H
+		if (coalesce)
+			tcp_epoll_pollout_locked(ep, tconn, 1);
+#endif
+		pthread_mutex_unlock(&tconn->lock);
+	}
+	if (!coalesce)
+		tcp_progress_conn_sends(conn);
 
 	/* if unreliable, we are done since it is buffered internally */
 	if (!is_reliable) {
@@ -2040,23 +2967,56 @@ static int tcp_send_common(cci_connection_t * connection,
 
 	ret = CCI_SUCCESS;
 
-	/* if blocking, wait for completion */
+	/* if blocking, wait for completion
+	 *
+	 * With a progress thread, sleep until the ACK completes the tx (or
+	 * the conn goes away). Otherwise nobody else will progress the
+	 * endpoint, so drive it from here. Either way, the completion never
+	 * reaches ep->evts and we reclaim the tx ourselves. */
 
 	if (tx->flags & CCI_FLAG_BLOCKING) {
-		while (tx->state != TCP_TX_COMPLETED && tconn->status == TCP_CONN_READY)
-			tcp_progress_ep(ep);
+		pthread_mutex_lock(&ep->lock);
+		while (tx->state != TCP_TX_COMPLETED && tconn->status == TCP_CONN_READY) {
+			if (tep->pipe[0]) {
+				pthread_cond_wait(&tx->done, &ep->lock);
+			} else {
+				pthread_mutex_unlock(&ep->lock);
+				tcp_progress_ep(ep);
+				pthread_mutex_lock(&ep->lock);
+			}
+		}
 
-		/* get status and cleanup */
-		ret = event->send.status;
-		if (ret == CCI_SUCCESS && tconn->status != TCP_CONN_READY)
-			ret = CCI_ERR_DISCONNECTED;
+		if (tx->state != TCP_TX_COMPLETED) {
+			/* the conn went away, pull the tx back unless an
+			 * ACK handler already owns it */
+			cci__evt_t *e = NULL;
+
+			pthread_mutex_lock(&tconn->lock);
+			TAILQ_FOREACH(e, &tconn->queued, entry)
+				if (e == evt)
+					break;
+			if (e) {
+				TAILQ_REMOVE(&tconn->queued, evt, entry);
+				tcp_conn_sent_locked(tconn,
+						tcp_tx_total(tx) - tx->offset);
+			} else {
+				TAILQ_FOREACH(e, &tconn->pending, entry)
+					if (e == evt)
+						break;
+				if (e)
+					TAILQ_REMOVE(&tconn->pending, evt, entry);
+			}
+			pthread_mutex_unlock(&tconn->lock);
 
-		/* NOTE race with get_event()
-		 *      get_event() must ignore sends with
-		 *      flags & CCI_FLAG_BLOCKING */
+			if (e)
+				event->send.status = CCI_ERR_DISCONNECTED;
+			else
+				while (tx->state != TCP_TX_COMPLETED)
+					pthread_cond_wait(&tx->done, &ep->lock);
+		}
 
-		pthread_mutex_lock(&ep->lock);
-		TAILQ_REMOVE(&ep->evts, evt, entry);
+		/* get status and cleanup */
+		ret = event->send.status;
 		tcp_put_tx_locked(tep, tx);
 		pthread_mutex_unlock(&ep->lock);
 	}
@@ -2186,30 +3146,87 @@ static int ctp_tcp_rma_deregister(cci_endpoint_t * endpoint, cci_rma_handle_t *
 	return ret;
 }
 
-static int ctp_tcp_rma(cci_connection_t * connection,
-		    const void *msg_ptr, uint32_t msg_len,
-		    cci_rma_handle_t * local_handle, uint64_t local_offset,
-		    cci_rma_handle_t * remote_handle, uint64_t remote_offset,
-		    uint64_t data_len, const void *context, int flags)
+/* Wait for a CCI_FLAG_BLOCKING RMA, as tcp_send_common() waits for a
+ * blocking send: sleep on the waiter with a progress thread, otherwise
+ * drive the endpoint. The tx that finishes the RMA completes the waiter
+ * with its status and raises no event.
+ *
+ * Returns the RMA's status, CCI_ERR_DISCONNECTED if the conn went away
+ * first. */
+static int
+tcp_rma_wait(cci__ep_t *ep, cci__conn_t *conn, tcp_rma_op_t *rma_op,
+		tcp_tx_t *waiter)
 {
-	int ret = CCI_SUCCESS, i, cnt, err = 0;
-	cci__ep_t *ep = NULL;
-	cci__conn_t *conn = NULL;
-	tcp_ep_t *tep = NULL;
-	tcp_conn_t *tconn = NULL;
-	const struct cci_rma_handle *lh = local_handle;
-	tcp_rma_handle_t *local = (tcp_rma_handle_t *)((uintptr_t)lh->stuff[0]);
-	tcp_rma_handle_t *h = NULL;
-	tcp_rma_op_t *rma_op = NULL;
-	tcp_tx_t **txs = NULL;
-	tcp_msg_type_t msg_type = flags & CCI_FLAG_WRITE ?
-		TCP_MSG_RMA_WRITE : TCP_MSG_RMA_READ_REQUEST;
-
-	CCI_ENTER;
+	int ret;
+	tcp_ep_t *tep = ep->priv;
+	tcp_conn_t *tconn = conn->priv;
 
-	if (!tglobals) {
-		CCI_EXIT;
-		return CCI_ENODEV;
+	pthread_mutex_lock(&ep->lock);
+	while (waiter->state != TCP_TX_COMPLETED &&
+		tconn->status == TCP_CONN_READY) {
+		if (tep->pipe[0]) {
+			pthread_cond_wait(&waiter->done, &ep->lock);
+		} else {
+			pthread_mutex_unlock(&ep->lock);
+			tcp_progress_ep(ep);
+			pthread_mutex_lock(&ep->lock);
+		}
+	}
+
+	if (waiter->state != TCP_TX_COMPLETED) {
+		/* the conn went away, give up on the RMA unless the handler
+		 * of its last tx already owns it */
+		tcp_rma_op_t *r = NULL;
+
+		pthread_mutex_lock(&tconn->lock);
+		TAILQ_FOREACH(r, &tconn->rmas, rmas)
+			if (r == rma_op)
+				break;
+		if (r)
+			rma_op->waiter = NULL;
+		pthread_mutex_unlock(&tconn->lock);
+
+		if (r)
+			waiter->evt.event.send.status = CCI_ERR_DISCONNECTED;
+		else
+			while (waiter->state != TCP_TX_COMPLETED)
+				pthread_cond_wait(&waiter->done, &ep->lock);
+	}
+
+	ret = waiter->evt.event.send.status;
+	tcp_put_tx_locked(tep, waiter);
+	pthread_mutex_unlock(&ep->lock);
+
+	return ret;
+}
+
+static int ctp_tcp_rma(cci_connection_t * connection,
+		    const void *msg_ptr, uint32_t msg_len,
+		    cci_rma_handle_t * local_handle, uint64_t local_offset,
+		    cci_rma_handle_t * remote_handle, uint64_t remote_offset,
+		    uint64_t data_len, const void *context, int flags)
+{
+	int ret = CCI_SUCCESS, i, cnt, err = 0;
+	uint32_t j, nlanes = 0;
+	cci__ep_t *ep = NULL;
+	cci__conn_t *conn = NULL;
+	cci__conn_t *lanes[TCP_MAX_STREAMS];
+	tcp_ep_t *tep = NULL;
+	tcp_conn_t *tconn = NULL;
+	const struct cci_rma_handle *lh = local_handle;
+	tcp_rma_handle_t *local = (tcp_rma_handle_t *)((uintptr_t)lh->stuff[0]);
+	tcp_rma_handle_t *h = NULL;
+	tcp_rma_op_t *rma_op = NULL;
+	tcp_tx_t **txs = NULL;
+	tcp_tx_t *waiter = NULL;
+	tcp_msg_type_t msg_type = flags & CCI_FLAG_WRITE ?
+		TCP_MSG_RMA_WRITE : TCP_MSG_RMA_READ_REQUEST;
+
+	CCI_ENTER;
+
+	if (!tglobals) {
+		CCI_EXIT;
+		return CCI_ENODEV;
 	}
 
 	if ((data_len + local_offset) > local->length) {
@@ -2221,6 +3238,14 @@ static int ctp_tcp_rma(cci_connection_t * connection,
 		return CCI_EINVAL;
 	}
 
+	if (msg_len > connection->max_send_size) {
+		debug(CCI_DB_MSG, "%s: completion msg length (%u) larger than "
+			"max_send_size (%u)", __func__, msg_len,
+			connection->max_send_size);
+		CCI_EXIT;
+		return CCI_EMSGSIZE;
+	}
+
 	conn = container_of(connection, cci__conn_t, connection);
 	tconn = conn->priv;
 	ep = container_of(connection->endpoint, cci__ep_t, endpoint);
@@ -2260,40 +3285,98 @@ static int ctp_tcp_rma(cci_connection_t * connection,
 	rma_op->num_msgs = data_len / TCP_RMA_FRAG_SIZE;
 	if ((rma_op->num_msgs * TCP_RMA_FRAG_SIZE) < data_len)
 		rma_op->num_msgs++;
-	rma_op->acked = -1;
 	rma_op->status = CCI_SUCCESS;	/* for now */
 	rma_op->context = (void *)context;
 	rma_op->flags = flags;
-	rma_op->msg_len = (uint16_t) msg_len;
+	rma_op->msg_len = msg_len;
 	rma_op->tx = NULL;
 
+	/* a blocking RMA sleeps on a tx of its own, whichever tx finishes
+	 * the RMA hands it the status instead of raising an event */
+	if (flags & CCI_FLAG_BLOCKING) {
+		waiter = tcp_get_tx(ep, 0);
+		if (!waiter) {
+			ret = CCI_ENOBUFS;
+			goto out;
+		}
+		waiter->flags = CCI_FLAG_BLOCKING;
+		waiter->state = TCP_TX_PENDING;
+		waiter->evt.event.send.status = CCI_SUCCESS;
+		rma_op->waiter = waiter;
+	}
+	flags &= ~CCI_FLAG_BLOCKING;
+
 	if (msg_len) {
-		rma_op->tx = tcp_get_tx(ep, 0);
-		if (!rma_op->tx) {
+		/* pack the completion msg now, it is queued as is */
+		tcp_tx_t *tx = tcp_get_tx(ep, 0);
+		tcp_header_t *hdr;
+
+		if (!tx) {
 			ret = CCI_ENOBUFS;
 			goto out;
 		}
-		rma_op->msg_ptr = rma_op->tx->buffer;
-		rma_op->msg_len = msg_len;
+		rma_op->tx = tx;
+		tx->evt.ep = ep;
+		hdr = tx->buffer;
+		tx->len = sizeof(*hdr);
+		if (tx->len + msg_len > ep->buffer_len) {
+			tx->big = tcp_get_big(ep);
+			if (!tx->big) {
+				ret = CCI_ENOMEM;
+				goto out;
+			}
+			rma_op->msg_ptr = tx->big;
+			tx->iov[0].iov_base = tx->big;
+			tx->iov[0].iov_len = msg_len;
+			tx->iovcnt = 1;
+			tx->iov_len = msg_len;
+		} else {
+			rma_op->msg_ptr = (char *)tx->buffer + sizeof(*hdr);
+			tx->len += msg_len;
+		}
 		memcpy(rma_op->msg_ptr, msg_ptr, msg_len);
+		tcp_pack_send(hdr, msg_len, tx->id);
+
+		tx->msg_type = TCP_MSG_SEND;
+		tx->flags = flags;
+		tx->rma_op = rma_op;
+
+		tx->evt.conn = conn;
+		tx->evt.event.type = CCI_EVENT_SEND;
+		tx->evt.event.send.status = CCI_SUCCESS; /* for now */
+		tx->evt.event.send.context = (void *)context;
+		tx->evt.event.send.connection = connection;
 	} else {
 		rma_op->msg_ptr = NULL;
 	}
 
-	debug(CCI_DB_MSG, "%s: starting RMA %s ***", __func__,
-		flags & CCI_FLAG_WRITE ? "Write" : "Read");
+	/* stripe the fragments over the conn's lanes, if it has any */
+	pthread_mutex_lock(&tconn->lock);
+	for (j = 0; j < tconn->nlanes; j++) {
+		tcp_conn_t *ltconn = tconn->lanes[j]->priv;
+
+		pthread_mutex_lock(&ltconn->lock);
+		if (ltconn->status == TCP_CONN_READY)
+			lanes[nlanes++] = tconn->lanes[j];
+		pthread_mutex_unlock(&ltconn->lock);
+	}
+	pthread_mutex_unlock(&tconn->lock);
+	if (!nlanes)
+		lanes[nlanes++] = conn;
+	if (rma_op->num_msgs && nlanes > rma_op->num_msgs)
+		nlanes = rma_op->num_msgs;
+	rma_op->nlanes = nlanes;
+
+	debug(CCI_DB_MSG, "%s: starting RMA %s over %u lane(s) ***", __func__,
+		flags & CCI_FLAG_WRITE ? "Write" : "Read", nlanes);
 
 	cnt = rma_op->num_msgs < TCP_RMA_DEPTH ?
 	    rma_op->num_msgs : TCP_RMA_DEPTH;
 
 	txs = calloc(cnt, sizeof(*txs));
 	if (!txs) {
-		pthread_mutex_lock(&ep->lock);
-		local->refcnt--;
-		pthread_mutex_unlock(&ep->lock);
-		free(rma_op);
-		CCI_EXIT;
-		return CCI_ENOMEM;
+		ret = CCI_ENOMEM;
+		goto out;
 	}
 
 	pthread_mutex_lock(&ep->lock);
@@ -2307,33 +3390,35 @@ static int ctp_tcp_rma(cci_connection_t * connection,
 			if (txs[i])
 				tcp_put_tx_locked(tep, txs[i]);
 		}
-		local->refcnt--;
 	}
 	pthread_mutex_unlock(&ep->lock);
 
 	if (err) {
 		free(txs);
-		free(rma_op);
-		CCI_EXIT;
-		return CCI_ENOBUFS;
+		ret = CCI_ENOBUFS;
+		goto out;
 	}
 
-	/* we have all the txs we need, pack them and queue them */
+	/* we have all the txs we need, pack them and queue them. Writes
+	 * stream their fragments back to back and each tx is reused for
+	 * the next fragment of its lane once it is written. */
+	for (j = 0; j < nlanes; j++) {
+		rma_op->next[j] = j;
+		rma_op->anchor[j] = txs[j];
+	}
+	/* count what completes the op up front, a lane may finish before
+	 * the next one is queued */
+	if (msg_type == TCP_MSG_RMA_READ_REQUEST)
+		rma_op->pending = cnt;
+	else if (nlanes > 1)
+		rma_op->pending = nlanes;
 	for (i = 0; i < cnt; i++) {
 		tcp_tx_t *tx = txs[i];
-		uint64_t offset =
-		    (uint64_t) i * (uint64_t) TCP_RMA_FRAG_SIZE;
-		tcp_rma_header_t *rma_hdr =
-		    (tcp_rma_header_t *) tx->buffer;
 
-		rma_op->next = i + 1;
+		tx->lane = i % nlanes;
 		tx->msg_type = msg_type;
 		tx->flags = flags | CCI_FLAG_SILENT;
-		tx->state = TCP_TX_QUEUED;
-		tx->len = sizeof(*rma_hdr);
-		tx->rma_len = TCP_RMA_FRAG_SIZE; /* for now */
 		tx->rma_op = rma_op;
-		tx->rma_id = i;
 
 		tx->evt.event.type = CCI_EVENT_SEND;
 		tx->evt.event.send.status = CCI_SUCCESS; /* for now */
@@ -2341,44 +3426,24 @@ static int ctp_tcp_rma(cci_connection_t * connection,
 		tx->evt.event.send.connection = connection;
 		tx->evt.conn = conn;
 
-		if (i == (int)(rma_op->num_msgs - 1)) {
-			if (data_len % TCP_RMA_FRAG_SIZE)
-				tx->rma_len = data_len % TCP_RMA_FRAG_SIZE;
-		}
-
-		tx->rma_ptr = (void*)((uintptr_t)local->start + local_offset + offset);
-
-		debug(CCI_DB_MSG, "%s: %s local offset %"PRIu64" "
-			"remote offset %"PRIu64" length %u", __func__,
-			tcp_msg_type(msg_type),
-			local_offset + offset, remote_offset + offset,
-			tx->rma_len);
-
-		if (msg_type == TCP_MSG_RMA_WRITE) {
-			tcp_pack_rma_write(rma_hdr, tx->rma_len, tx->id,
-						local_handle->stuff[0],
-						local_offset + offset,
-						remote_handle->stuff[0],
-						remote_offset + offset);
-		} else {
-			tcp_pack_rma_read_request(rma_hdr, tx->rma_len, tx->id,
-						local_handle->stuff[0],
-						local_offset + offset,
-						remote_handle->stuff[0],
-						remote_offset + offset);
-			tx->rma_ptr = NULL;
-			tx->rma_len = 0;
-		}
+		tcp_rma_pack_frag(rma_op, tx);
 	}
 	pthread_mutex_lock(&ep->lock);
 	pthread_mutex_lock(&tconn->lock);
-	for (i = 0; i < cnt; i++)
-		TAILQ_INSERT_TAIL(&tconn->queued, &(txs[i])->evt, entry);
 	TAILQ_INSERT_TAIL(&tconn->rmas, rma_op, rmas);
-	tconn->pfd.events = POLLIN | POLLOUT;
 	pthread_mutex_unlock(&tconn->lock);
 
 	TAILQ_INSERT_TAIL(&tep->rma_ops, rma_op, entry);
+
+	for (j = 0; j < nlanes; j++) {
+		tcp_conn_t *ltconn = lanes[j]->priv;
+
+		pthread_mutex_lock(&ltconn->lock);
+		for (i = j; i < cnt; i += nlanes)
+			tcp_rma_queue_frag_locked(ltconn, txs[i]);
+		ltconn->pfd.events = POLLIN | POLLOUT;
+		pthread_mutex_unlock(&ltconn->lock);
+	}
 	pthread_mutex_unlock(&ep->lock);
 
 	/* it is no longer needed */
@@ -2386,25 +3451,38 @@ static int ctp_tcp_rma(cci_connection_t * connection,
 
 	ret = CCI_SUCCESS;
 
-	tcp_progress_conn_sends(conn);
+	for (j = 0; j < nlanes; j++)
+		tcp_progress_conn_sends(lanes[j]);
+
+	/* if blocking, wait for completion */
+	if (waiter)
+		ret = tcp_rma_wait(ep, conn, rma_op, waiter);
+
+	CCI_EXIT;
+	return ret;
 
 out:
-	if (ret) {
-		pthread_mutex_lock(&ep->lock);
-		local->refcnt--;
-		pthread_mutex_unlock(&ep->lock);
-		free(rma_op);
-	}
+	pthread_mutex_lock(&ep->lock);
+	local->refcnt--;
+	if (rma_op->tx)
+		tcp_put_tx_locked(tep, rma_op->tx);
+	if (waiter)
+		tcp_put_tx_locked(tep, waiter);
+	pthread_mutex_unlock(&ep->lock);
+	free(rma_op);
 	CCI_EXIT;
 	return ret;
 }
 
 
-/* Caller has a reference on listen_conn */
-static void
+/* Caller has a reference on listen_conn
+ *
+ * Returns EAGAIN once the accept queue is empty.
+ */
+static int
 tcp_handle_listen_socket(cci__ep_t *ep, cci__conn_t *listen_conn)
 {
-	int ret;
+	int ret, fd;
 	cci__conn_t *conn = NULL;
 	tcp_conn_t *listen_tconn = listen_conn->priv, *tconn = NULL;
 	struct sockaddr_in sin;
@@ -2413,20 +3491,30 @@ tcp_handle_listen_socket(cci__ep_t *ep, cci__conn_t *listen_conn)
 
 	CCI_ENTER;
 
-	ret = tcp_new_conn(ep, sin, -1, &conn);
-	if (ret)
-		return;
-
-	tconn = conn->priv;
-
-	ret = accept(listen_tconn->pfd.fd, (struct sockaddr *)&sin, &slen);
-	if (ret == -1) {
+#ifdef SOCK_NONBLOCK
+	fd = accept4(listen_tconn->pfd.fd, (struct sockaddr *)&sin, &slen,
+			TCP_SOCK_FLAGS);
+#else
+	fd = accept(listen_tconn->pfd.fd, (struct sockaddr *)&sin, &slen);
+#endif
+	if (fd == -1) {
 		ret = errno;
-		debug(CCI_DB_CONN, "%s: accept() failed with %s (%d)",
-			__func__, strerror(ret), ret);
-		goto out;
+		if (ret != EAGAIN && ret != EWOULDBLOCK)
+			debug(CCI_DB_CONN, "%s: accept() failed with %s (%d)",
+				__func__, strerror(ret), ret);
+		CCI_EXIT;
+		return ret;
 	}
-	tconn->pfd.fd = ret;
+
+	ret = tcp_new_conn(ep, sin, fd, &conn);
+	if (ret) {
+		close(fd);
+		CCI_EXIT;
+		return ret;
+	}
+
+	tconn = conn->priv;
+	tconn->status = TCP_CONN_PASSIVE1;
 
 	ret = tcp_monitor_fd(ep, conn, POLLIN);
 	if (ret)
@@ -2438,74 +3526,116 @@ tcp_handle_listen_socket(cci__ep_t *ep, cci__conn_t *listen_conn)
 
 	queue_conn(ep, conn);
 
+#ifdef HAVE_SYS_EPOLL_H
+	if (tcp_epoll_add(ep, tconn, 0))
+		tcp_conn_set_closing(ep, conn);
+#endif
+
 	conn_decref(ep, conn); /* drop our ref */
 
 	CCI_EXIT;
-	return;
+	return CCI_SUCCESS;
 
 out:
-	tcp_conn_set_closing(ep, conn);
-	conn_decref(ep, conn); /* drop our ref */
+	close(fd);
+	free(conn->priv);
+	free(conn);
 
-	return;
+	CCI_EXIT;
+	return ret;
 }
 
+/* Read what is available of the conn's current receive stage. A NULL
+ * tconn->rptr drops the bytes (e.g. an RMA payload for a bad handle).
+ *
+ * Returns CCI_SUCCESS once the stage is complete, CCI_EAGAIN if the
+ * socket ran dry first, else an error.
+ */
 static inline int
-tcp_recv_msg(int fd, void *ptr, uint32_t len)
+tcp_recv_some(tcp_conn_t *tconn)
 {
 	int ret = CCI_SUCCESS;
-	uint32_t offset = 0;
-	static int count = 0;
+	char sink[1024];
 
-	if (!len || !fd)
-		goto out;
+	if (!tconn->pfd.fd)
+		return CCI_ERROR;
 
-again:
-	do {
-		ret = recv(fd, (void*)((uintptr_t)ptr + offset), len - offset, 0);
+	while (tconn->roff < tconn->rlen) {
+		void *ptr = sink;
+		uint32_t len = tconn->rlen - tconn->roff;
+
+		if (tconn->rptr)
+			ptr = (void*)((uintptr_t)tconn->rptr + tconn->roff);
+		else if (len > sizeof(sink))
+			len = sizeof(sink);
+
+		ret = recv(tconn->pfd.fd, ptr, len, 0);
 		if (ret < 0) {
 			ret = errno;
-			if ((count++ & 0xFFFF) == 0xFFFF)
-				debug(CCI_DB_MSG, "%s: recv() failed with %s (%u of %u bytes) "
-					"ptr=%p", __func__, strerror(ret), offset, len,
-					(void*)ptr);
-			if (ret == EAGAIN)
-				goto again;
-			goto out;
+			if (ret == EINTR)
+				continue;
+			if (ret == EAGAIN || ret == EWOULDBLOCK)
+				return CCI_EAGAIN;
+			debug(CCI_DB_MSG, "%s: recv() failed with %s (%u of %u "
+				"bytes)", __func__, strerror(ret), tconn->roff,
+				tconn->rlen);
+			return ret;
 		} else if (ret == 0) {
 			debug(CCI_DB_MSG, "%s: recv() failed - peer closed "
 				"connection", __func__);
-			ret = CCI_ERROR;
-			goto out;
+			return CCI_ERROR;
 		}
-		offset += ret;
-	} while (offset < len);
+		tconn->roff += ret;
+	}
 
-	ret = CCI_SUCCESS;
-out:
-	return ret;
+	return CCI_SUCCESS;
+}
+
+/* Set up the next receive stage */
+static inline void
+tcp_recv_stage(tcp_conn_t *tconn, tcp_recv_stage_t stage, void *ptr,
+		uint32_t len)
+{
+	tconn->rstage = stage;
+	tconn->rptr = ptr;
+	tconn->rlen = len;
+	tconn->roff = 0;
+}
+
+/* Bytes following the header that belong in the rx buffer */
+static inline uint32_t
+tcp_recv_data_len(tcp_msg_type_t type, uint32_t a)
+{
+	switch (type) {
+	case TCP_MSG_CONN_REQUEST:
+		return ((a >> 4) & 0xFFFF) + sizeof(tcp_handshake_t);
+	case TCP_MSG_CONN_REPLY:
+		return (a & 0xFF) == CCI_SUCCESS ? sizeof(tcp_handshake_t) : 0;
+	case TCP_MSG_SEND:
+		return a & TCP_SEND_LEN_MASK;
+	case TCP_MSG_RMA_WRITE:
+	case TCP_MSG_RMA_READ_REQUEST:
+	case TCP_MSG_RMA_READ_REPLY:
+		return sizeof(tcp_rma_header_t) - sizeof(tcp_header_t);
+	default:
+		return 0;
+	}
 }
 
 /* Caller has ref on conn and will release it */
 static void
 tcp_handle_conn_request(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx, uint32_t a)
 {
-	int ret;
 	tcp_conn_t *tconn = conn->priv;
 	tcp_header_t *hdr = rx->buffer;
 	tcp_handshake_t *hs = (void*)((uintptr_t)rx->buffer + sizeof(*hdr));
 	cci_conn_attribute_t attr = a & 0xF;
 	uint32_t len = (a >> 4) & 0xFFFF;
-	uint32_t total = len + sizeof(*hs);
 	uint32_t rx_cnt, mss, ka, ignore;
 
-	ret = tcp_recv_msg(tconn->pfd.fd, hdr->data, total);
-	if (ret) {
-		/* TODO handle error */
-		goto out;
-	}
-
 	tconn->status = TCP_CONN_PASSIVE2;
+	if (attr != CCI_CONN_ATTR_UU)
+		tconn->streams = (a >> 20) & 0xFF;
 
 	tcp_parse_handshake(hs, &rx_cnt, &mss, &ka, &ignore);
 
@@ -2536,12 +3666,6 @@ tcp_handle_conn_request(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx, uint32_t
 	TAILQ_INSERT_TAIL(&ep->evts, &rx->evt, entry);
 	pthread_mutex_unlock(&ep->lock);
 
-	return;
-out:
-	tcp_conn_set_closing(ep, conn);
-
-	tcp_put_rx(rx);
-
 	return;
 }
 
@@ -2556,8 +3680,8 @@ tcp_handle_conn_reply(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 	tcp_header_t *hdr = rx->buffer;
 	tcp_handshake_t *hs = (void*)((uintptr_t)rx->buffer + sizeof(*hdr));
 	int reply = a & 0xFF, accepted = 0;
-	uint32_t total = sizeof(*hs);
-	uint32_t rx_cnt, mss, ka, server_tx_id;
+	uint32_t rx_cnt, mss, ka, server_tx_id, i;
+	uint32_t streams = (a >> 8) & 0xF;
 	tcp_tx_t *tx = &tep->txs[tx_id];
 
 	accepted = reply == CCI_SUCCESS ? 1 : 0;
@@ -2574,15 +3698,6 @@ tcp_handle_conn_reply(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 		rx->evt.event.connect.connection = NULL;
 
 	if (accepted) {
-		ret = tcp_recv_msg(tconn->pfd.fd, hdr->data, total);
-		if (ret) {
-			/* TODO handle error */
-			tcp_conn_set_closing(ep, conn);
-			rx->evt.event.connect.status = CCI_ERROR;
-			rx->evt.event.connect.connection = NULL;
-			goto out;
-		}
-
 		tcp_parse_handshake(hs, &rx_cnt, &mss, &ka, &server_tx_id);
 
 		if (mss < conn->connection.max_send_size)
@@ -2618,13 +3733,29 @@ tcp_handle_conn_reply(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 	pthread_mutex_lock(&tconn->lock);
 	TAILQ_REMOVE(&tconn->pending, &tx->evt, entry);
 	TAILQ_INSERT_TAIL(&tconn->queued, &tx->evt, entry);
+	tconn->qbytes += tcp_tx_total(tx);
 	tconn->status = TCP_CONN_READY;
 	tconn->refcnt++; /* for the calling application */
 	pthread_mutex_unlock(&tconn->lock);
 
+	if (conn->keepalive_timeout) {
+		pthread_mutex_lock(&ep->lock);
+		tcp_keepalive_arm_locked(ep, conn);
+		pthread_mutex_unlock(&ep->lock);
+	}
+
 	/* try to progress txs */
 	tcp_progress_conn_sends(conn);
 
+	/* open the lanes the server granted */
+	if (streams > tconn->streams)
+		streams = tconn->streams;
+	tconn->lane_key = (a >> 12) & 0xFFFF;
+	for (i = 1; i < streams; i++) {
+		if (tcp_connect_lane(ep, conn, i))
+			break;
+	}
+
 out:
 	pthread_mutex_lock(&ep->lock);
 	TAILQ_INSERT_TAIL(&ep->evts, &rx->evt, entry);
@@ -2660,6 +3791,8 @@ tcp_handle_conn_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx, uint32_t tx_
 
 	pthread_mutex_lock(&ep->lock);
 	tconn->status = TCP_CONN_READY;
+	if (conn->keepalive_timeout)
+		tcp_keepalive_arm_locked(ep, conn);
 	tconn->refcnt++; /* for calling the application */
 	/* passive's refcnt goes to conns */
 	TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
@@ -2670,6 +3803,41 @@ tcp_handle_conn_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx, uint32_t tx_
 	return;
 }
 
+/* The first msg on an accepted socket names the conn it is a lane of */
+static void
+tcp_handle_conn_lane(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
+			uint32_t lane, uint32_t key)
+{
+	tcp_ep_t *tep = ep->priv;
+	tcp_conn_t *tconn = conn->priv, *p = NULL;
+
+	tcp_put_rx(rx);
+
+	pthread_mutex_lock(&ep->lock);
+	if (key) {
+		TAILQ_FOREACH(p, &tep->conns, entry) {
+			if (p->lane_key == key && !p->parent &&
+				p->status > TCP_CONN_INIT)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	if (!p || tconn->status != TCP_CONN_PASSIVE1 ||
+		!lane || lane >= p->streams) {
+		debug(CCI_DB_CONN, "%s: no conn for lane %u key %u on conn %p",
+			__func__, lane, key, (void*)conn);
+		tcp_conn_set_closing(ep, conn);
+		return;
+	}
+
+	tconn->parent = p->conn;
+	conn->connection.attribute = p->conn->connection.attribute;
+	tcp_lane_attach(ep, conn);
+
+	return;
+}
+
 static void
 tcp_handle_send(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 		uint32_t a, uint32_t tx_id)
@@ -2677,34 +3845,40 @@ tcp_handle_send(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 	int ret;
 	tcp_conn_t *tconn = conn->priv;
 	tcp_header_t *hdr = rx->buffer;
-	uint32_t len = a & 0xFFFF;
-	uint32_t total = len;
+	uint32_t len = a & TCP_SEND_LEN_MASK;
 
 	debug(CCI_DB_MSG, "%s: recv'd MSG from conn %p with len %u",
 		__func__, (void*)conn, len);
 
-	ret = tcp_recv_msg(tconn->pfd.fd, hdr->data, total);
-	if (ret) {
-		/* TODO handle error */
-		goto out;
-	}
+	/* an RMA's completion msg may arrive on a lane */
+	if (tconn->parent)
+		rx->evt.conn = tconn->parent;
 
-	rx->evt.event.type = CCI_EVENT_RECV;
-	if (len)
-		rx->evt.event.recv.ptr = hdr->data;
-	else
-		rx->evt.event.recv.ptr = NULL;
-	rx->evt.event.recv.len = len;
-	rx->evt.event.recv.connection = &conn->connection;
+	if (len > ep->buffer_len - sizeof(*hdr) && !rx->big) {
+		/* there was no large buffer, the payload was dropped */
+		debug(CCI_DB_MSG, "%s: dropped MSG of %u bytes", __func__, len);
+		tcp_put_rx(rx);
+		ret = CCI_ERR_RNR;
+	} else {
+		rx->evt.event.type = CCI_EVENT_RECV;
+		if (rx->big)
+			rx->evt.event.recv.ptr = rx->big;
+		else if (len)
+			rx->evt.event.recv.ptr = hdr->data;
+		else
+			rx->evt.event.recv.ptr = NULL;
+		rx->evt.event.recv.len = len;
+		rx->evt.event.recv.connection = &rx->evt.conn->connection;
 
-	/* queue event on endpoint's completed event queue */
+		/* queue event on endpoint's completed event queue */
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_INSERT_TAIL(&ep->evts, &rx->evt, entry);
-	pthread_mutex_unlock(&ep->lock);
+		pthread_mutex_lock(&ep->lock);
+		TAILQ_INSERT_TAIL(&ep->evts, &rx->evt, entry);
+		pthread_mutex_unlock(&ep->lock);
+
+		ret = CCI_SUCCESS;
+	}
 
-	ret = CCI_SUCCESS;
-out:
 	if (cci_conn_is_reliable(conn)) {
 		tcp_ep_t *tep = ep->priv;
 		tcp_tx_t *tx = NULL;
@@ -2728,94 +3902,87 @@ out:
 	return;
 }
 
-static void
-tcp_handle_rma_write(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
-			uint32_t len, uint32_t tx_id)
+/* Find where an RMA_WRITE or RMA_READ_REPLY payload goes
+ *
+ * Returns NULL and sets *status if the handle is not (or no longer)
+ * valid, in which case the payload is read and dropped.
+ */
+static void *
+tcp_rma_payload_target(cci__ep_t *ep, tcp_rx_t *rx, tcp_msg_type_t type,
+			uint32_t len, int *status)
 {
-	int ret = 0, valid = 1;
 	tcp_ep_t *tep = ep->priv;
-	tcp_conn_t *tconn = conn->priv;
-	tcp_tx_t *tx = NULL;
-	tcp_header_t *ack;
-	tcp_rma_header_t *rma_header = rx->buffer; /* need to read more */
-	uint32_t handle_len = 2 * sizeof(rma_header->local);
-	uint64_t remote_handle, remote_offset;
-	tcp_rma_handle_t *remote, *h = NULL;
-	void *ptr = NULL;
-
-	debug(CCI_DB_MSG, "%s: recv'ing RMA_WRITE on conn %p with len %u",
-		__func__, (void*)conn, len);
-
-	ret = tcp_recv_msg(tconn->pfd.fd, rma_header->header.data, handle_len);
-	if (ret) {
-		/* TODO handle error */
-		goto out;
-	}
-
-	tcp_parse_rma_handle_offset(&rma_header->remote, &remote_handle,
-				     &remote_offset);
-	remote = (tcp_rma_handle_t *) (uintptr_t) remote_handle;
+	tcp_rma_header_t *rma_header = rx->buffer;
+	uint64_t handle, offset;
+	tcp_rma_handle_t *target, *h = NULL;
+
+	/* a write targets the peer's remote handle, a read reply our own */
+	if (type == TCP_MSG_RMA_WRITE)
+		tcp_parse_rma_handle_offset(&rma_header->remote, &handle,
+					     &offset);
+	else
+		tcp_parse_rma_handle_offset(&rma_header->local, &handle,
+					     &offset);
+	target = (tcp_rma_handle_t *) (uintptr_t) handle;
 
 	pthread_mutex_lock(&ep->lock);
 	TAILQ_FOREACH(h, &tep->handles, entry) {
-		if (h == remote) {
+		if (h == target) {
 			break;
 		}
 	}
 	pthread_mutex_unlock(&ep->lock);
 
-	if (h != remote) {
-		/* remote is no longer valid, send CCI_ERR_RMA_HANDLE */
-		ret = CCI_ERR_RMA_HANDLE;
-		debug(CCI_DB_MSG, "%s: remote handle not valid", __func__);
-		valid = 0;
-	} else if (remote_offset > remote->length) {
-		/* offset exceeds remote handle's range, send nak */
-		ret = CCI_ERR_RMA_HANDLE;
-		debug(CCI_DB_MSG, "%s: remote offset not valid", __func__);
-		valid = 0;
-	} else if ((remote_offset + len) > remote->length) {
-		/* length exceeds remote handle's range, send nak */
-		ret = CCI_ERR_RMA_HANDLE;
-		debug(CCI_DB_MSG, "%s: remote length not valid", __func__);
-		valid = 0;
+	*status = CCI_ERR_RMA_HANDLE;
+
+	if (h != target) {
+		debug(CCI_DB_MSG, "%s: %s handle not valid", __func__,
+			tcp_msg_type(type));
+		return NULL;
+	} else if (offset > target->length) {
+		debug(CCI_DB_MSG, "%s: %s offset not valid", __func__,
+			tcp_msg_type(type));
+		return NULL;
+	} else if ((offset + len) > target->length) {
+		debug(CCI_DB_MSG, "%s: %s length not valid", __func__,
+			tcp_msg_type(type));
+		return NULL;
 	}
 
-	if (valid) {
-		/* valid remote handle, copy the data */
-		debug(CCI_DB_INFO, "%s: recv'ing data into target buffer", __func__);
-		ptr = (void*)((uintptr_t)remote->start + (uintptr_t) remote_offset);
-		ret = tcp_recv_msg(tconn->pfd.fd, ptr, len);
-		debug(CCI_DB_MSG, "%s: recv'd data into target buffer", __func__);
-		if (ret)
-			debug(CCI_DB_MSG, "%s: recv'ing RMA WRITE payload failed with %s",
-				__func__, strerror(ret));
-	} else {
-		int l = 0;
-		uint32_t offset = 0;
-		char tmp[32];
+	*status = CCI_SUCCESS;
+	return (void*)((uintptr_t)target->start + (uintptr_t) offset);
+}
 
-		debug(CCI_DB_INFO, "%s: dumping %u bytes", __func__, len);
-		do {
-			l = sizeof(tmp);
-			if (l > (int) (len - offset))
-				l = len - offset;
+/* The payload has landed (or was dropped). Only the last fragment of
+ * a write asks for an ack, a failed one is always reported. */
+static void
+tcp_handle_rma_write(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
+			uint32_t len, uint32_t tx_id, int status)
+{
+	tcp_ep_t *tep = ep->priv;
+	tcp_conn_t *tconn = conn->priv;
+	tcp_tx_t *tx = NULL;
+	tcp_header_t *ack;
+	uint32_t a = status;
+
+	debug(CCI_DB_MSG, "%s: recv'd RMA_WRITE on conn %p with len %u "
+		"status %d", __func__, (void*)conn, len, status);
+
+	if (tx_id & TCP_RMA_WRITE_ACK)
+		a |= TCP_ACK_RMA_DONE;
+	else if (status == CCI_SUCCESS)
+		goto out;
 
-			tcp_recv_msg(tconn->pfd.fd, tmp, l);
-			offset += l;
-		} while (offset < len);
-	}
-out:
 	tx = tcp_get_tx(ep, 1);
 
 	tx->msg_type = TCP_MSG_ACK;
 	tx->len = sizeof(*ack);
 
 	ack = tx->buffer;
-	tcp_pack_ack(ack, tx_id, ret);
+	tcp_pack_ack(ack, tx_id & ~TCP_RMA_WRITE_ACK, a);
 
 	tcp_queue_tx(tep, tconn, &tx->evt);
-
+out:
 	tcp_put_rx(rx);
 
 	return;
@@ -2829,20 +3996,15 @@ tcp_handle_rma_read_request(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 	tcp_ep_t *tep = ep->priv;
 	tcp_conn_t *tconn = conn->priv;
 	tcp_tx_t *tx = NULL;
-	tcp_rma_header_t *read_request = rx->buffer; /* need to read more */
+	tcp_rma_header_t *read_request = rx->buffer;
 	tcp_rma_header_t *read_reply = NULL;
-	uint32_t handle_len = 2 * sizeof(read_request->local);
 	uint64_t local_handle, local_offset, remote_handle, remote_offset;
 	tcp_rma_handle_t *remote, *h = NULL;
 
-	debug(CCI_DB_MSG, "%s: recv'ing RMA_READ_REQUEST on conn %p with len %u",
+	debug(CCI_DB_MSG, "%s: recv'd RMA_READ_REQUEST on conn %p with len %u",
 		__func__, (void*)conn, len);
 
-	ret = tcp_recv_msg(tconn->pfd.fd, read_request->header.data, handle_len);
-	if (ret) {
-		/* TODO handle error */
-		goto out;
-	}
+	ret = CCI_SUCCESS;
 
 	tcp_parse_rma_handle_offset(&read_request->local, &local_handle,
 				     &local_offset);
@@ -2923,205 +4085,197 @@ out:
 	return;
 }
 
-static void
-tcp_progress_rma(cci__ep_t *ep, cci__conn_t *conn,
-			tcp_rx_t *rx, uint32_t status, tcp_tx_t *tx)
+/* Take a finished RMA off its conn (not a lane's) and the endpoint and
+ * drop its reference on the local handle
+ *
+ * Returns the tx a blocking caller still waits on, if any. */
+static tcp_tx_t *
+tcp_rma_release(cci__ep_t *ep, cci__conn_t *conn, tcp_rma_op_t *rma_op)
 {
-	int done = 0;
 	tcp_ep_t *tep = ep->priv;
 	tcp_conn_t *tconn = conn->priv;
-	tcp_rma_op_t *rma_op = tx->rma_op;
-	tcp_msg_type_t msg_type = tx->msg_type;
-
-	rma_op->acked = tx->rma_id;
-
-	if (status && (rma_op->status == CCI_SUCCESS))
-		rma_op->status = status;
+	const struct cci_rma_handle *lh = rma_op->local_handle;
+	tcp_rma_handle_t *local = (void*)((uintptr_t)lh->stuff[0]);
+	tcp_tx_t *waiter = NULL;
+	int last_ref = 0;
 
 	pthread_mutex_lock(&tconn->lock);
-	TAILQ_REMOVE(&tconn->pending, &tx->evt, entry);
-	if (rma_op->status && rma_op->pending == 0)
-		done = 1;
+	TAILQ_REMOVE(&tconn->rmas, rma_op, rmas);
+	waiter = rma_op->waiter;
 	pthread_mutex_unlock(&tconn->lock);
 
-	if ((tx->rma_id == (rma_op->num_msgs - 1)) || done) {
-		int ret;
-
-		/* last segment - complete rma */
-		tx->evt.event.send.status = rma_op->status;
-		if (rma_op->status || !rma_op->msg_ptr) {
-			pthread_mutex_lock(&tconn->lock);
-			TAILQ_REMOVE(&tconn->rmas, rma_op, rmas);
-			pthread_mutex_unlock(&tconn->lock);
-			pthread_mutex_lock(&ep->lock);
-			TAILQ_REMOVE(&tep->rma_ops, rma_op, entry);
-			TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
-			pthread_mutex_unlock(&ep->lock);
-			debug(CCI_DB_MSG, "%s: completed %s ***",
-				__func__, tcp_msg_type(msg_type));
-		} else {
-			/* FIXME: This sends the completion MSG after the last
-			 * RMA fragment is acked which adds a MSG latency
-			 * on top of the RMA latency. Ideally, we would
-			 * send the MSG just after sending the last
-			 * RMA fragment which would knock off most of
-			 * the MSG latency.
-			 */
-			struct iovec iov;
+	pthread_mutex_lock(&ep->lock);
+	TAILQ_REMOVE(&tep->rma_ops, rma_op, entry);
+	local->refcnt--;
+	if (local->refcnt == 0) {
+		/* deregistered while in use */
+		TAILQ_REMOVE(&tep->handles, local, entry);
+		last_ref = 1;
+	}
+	pthread_mutex_unlock(&ep->lock);
 
-			iov.iov_base = rma_op->msg_ptr;
-			iov.iov_len = rma_op->msg_len;
+	if (last_ref) {
+		memset(local, 0, sizeof(*local));
+		free(local);
+	}
+	free(rma_op);
+	return waiter;
+}
 
-			pthread_mutex_lock(&tconn->lock);
-			TAILQ_REMOVE(&tconn->rmas, rma_op, rmas);
-			pthread_mutex_unlock(&tconn->lock);
-			pthread_mutex_lock(&ep->lock);
-			TAILQ_REMOVE(&tep->rma_ops, rma_op, entry);
-			pthread_mutex_unlock(&ep->lock);
-			debug(CCI_DB_MSG, "%s: sending RMA completion MSG ***",
-				__func__);
-			ret = tcp_send_common(&conn->connection,
-						&iov,
-						1,
-						rma_op->context,
-						rma_op->flags,
-						NULL);
-			if (ret) {
-				tx->evt.event.send.status = ret;
-				pthread_mutex_lock(&ep->lock);
-				TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
-				pthread_mutex_unlock(&ep->lock);
-			} else {
-				tcp_put_tx(tx);
-			}
+/* Complete a finished RMA with tx's event, tx being the last of its txs.
+ * A blocking RMA raises no event: its waiter takes the status, or, if
+ * the caller gave up already, the status is dropped.
+ *
+ * NOTE: the caller holds ep->lock
+ */
+static void
+tcp_complete_rma_locked(cci__ep_t *ep, int flags, tcp_tx_t *waiter,
+			tcp_tx_t *tx)
+{
+	if (flags & CCI_FLAG_BLOCKING) {
+		if (waiter) {
+			waiter->evt.event.send.status =
+				tx->evt.event.send.status;
+			tcp_complete_tx_locked(ep, waiter);
 		}
-		free(rma_op);
-	} else if (rma_op->next == rma_op->num_msgs) {
-		/* no more fragments, we don't need this tx anymore */
-		debug(CCI_DB_MSG, "%s: releasing tx %p", __func__, (void*)tx);
-		tcp_put_tx(tx);
+		tcp_put_tx_locked(ep->priv, tx);
+	} else if (flags & CCI_FLAG_SILENT) {
+		tcp_put_tx_locked(ep->priv, tx);
 	} else {
-		/* send next fragment (or read fragment request) */
-		int i = rma_op->next++;
-		uint64_t offset =
-		    (uint64_t) i * (uint64_t) TCP_RMA_FRAG_SIZE;
-		tcp_rma_header_t *rma_hdr =
-			(tcp_rma_header_t *) tx->buffer;
-		const struct cci_rma_handle *ch = rma_op->local_handle;
-		tcp_rma_handle_t *local = (void*)((uintptr_t)ch->stuff[0]);
-
-		tx->state = TCP_TX_QUEUED;
-		tx->rma_len = TCP_RMA_FRAG_SIZE; /* for now */
-		tx->offset = 0;
-		tx->rma_id = i;
+		tcp_complete_tx_locked(ep, tx);
+	}
+	return;
+}
 
-		debug(CCI_DB_MSG, "%s: sending fragment %d at offset %"PRIu64,
-			__func__, i, offset);
+/* An RMA write was acked: either a fragment failed, or the last one of
+ * a lane landed. Once all lanes have, the write is done or, if striped,
+ * its completion msg is sent on the lane that finished last. */
+static void
+tcp_rma_write_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
+			uint32_t a, tcp_tx_t *anchor)
+{
+	tcp_ep_t *tep = ep->priv;
+	tcp_conn_t *tconn = conn->priv;
+	tcp_rma_op_t *rma_op = anchor->rma_op;
+	tcp_tx_t *waiter = NULL;
+	uint32_t status = a & TCP_ACK_STATUS_MASK;
+	int flags;
 
-		if (i == (int)(rma_op->num_msgs - 1)) {
-			if (rma_op->data_len % TCP_RMA_FRAG_SIZE)
-				tx->rma_len = rma_op->data_len % TCP_RMA_FRAG_SIZE;
-		}
+	if (status && (rma_op->status == CCI_SUCCESS))
+		rma_op->status = status;
 
-		tx->rma_ptr = (void*)((uintptr_t)local->start + rma_op->local_offset + offset);
+	if (!(a & TCP_ACK_RMA_DONE)) {
+		debug(CCI_DB_MSG, "%s: RMA write fragment failed with %s",
+			__func__, cci_strerror(&ep->endpoint, status));
+		tcp_put_rx(rx);
+		return;
+	}
 
-		debug(CCI_DB_MSG, "%s: %s local offset %"PRIu64" "
-			"remote offset %"PRIu64" length %u", __func__,
-			tcp_msg_type(msg_type),
-			rma_op->local_offset + offset,
-			rma_op->remote_offset + offset, tx->rma_len);
+	pthread_mutex_lock(&tconn->lock);
+	TAILQ_REMOVE(&tconn->pending, &anchor->evt, entry);
+	pthread_mutex_unlock(&tconn->lock);
 
-		if (msg_type == TCP_MSG_RMA_WRITE) {
-			tcp_pack_rma_write(rma_hdr, tx->rma_len, tx->id,
-					rma_op->local_handle->stuff[0],
-					rma_op->local_offset + offset,
-					rma_op->remote_handle->stuff[0],
-					rma_op->remote_offset + offset);
-		} else {
-			tcp_pack_rma_read_request(rma_hdr, tx->rma_len, tx->id,
-					rma_op->local_handle->stuff[0],
-					rma_op->local_offset + offset,
-					rma_op->remote_handle->stuff[0],
-					rma_op->remote_offset + offset);
-			tx->rma_ptr = NULL;
-			tx->rma_len = 0;
+	if (rma_op->nlanes > 1 && (--rma_op->pending ||
+		(rma_op->tx && !rma_op->status))) {
+		tcp_put_tx(anchor);
+		if (!rma_op->pending) {
+			debug(CCI_DB_MSG, "%s: sending RMA completion MSG ***",
+				__func__);
+			rma_op->tx->state = TCP_TX_QUEUED;
+			tcp_queue_tx(tep, tconn, &rma_op->tx->evt);
 		}
-
-		tcp_queue_tx(tep, tconn, &tx->evt);
+		tcp_put_rx(rx);
+		return;
 	}
 
-	tcp_put_rx(rx);
+	anchor->evt.event.send.status = rma_op->status;
+	if (rma_op->tx)
+		tcp_put_tx(rma_op->tx);
+	flags = rma_op->flags;
+	waiter = tcp_rma_release(ep, anchor->evt.conn, rma_op);
 
-	return;
+	pthread_mutex_lock(&ep->lock);
+	tcp_complete_rma_locked(ep, flags, waiter, anchor);
+	tcp_put_rx_locked(ep->priv, rx);
+	pthread_mutex_unlock(&ep->lock);
+
+	debug(CCI_DB_MSG, "%s: completed RMA write ***", __func__);
 }
 
+/* A read request was answered (by a reply or an error ack) */
 static void
-tcp_handle_rma_read_reply(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
-				uint32_t len, uint32_t tx_id)
+tcp_progress_rma(cci__ep_t *ep, cci__conn_t *conn,
+			tcp_rx_t *rx, uint32_t status, tcp_tx_t *tx)
 {
-	int ret;
+	int done = 0, next = 0;
 	tcp_ep_t *tep = ep->priv;
 	tcp_conn_t *tconn = conn->priv;
-	tcp_rma_header_t *rma_header = rx->buffer; /* need to read more */
-	uint32_t handle_len = 2 * sizeof(rma_header->local);
-	uint64_t local_handle, local_offset;
-	tcp_rma_handle_t *local, *h = NULL;
-	void *ptr = NULL;
-	tcp_tx_t *tx = &tep->txs[tx_id];
+	tcp_rma_op_t *rma_op = tx->rma_op;
 
-	debug(CCI_DB_MSG, "%s: recv'ing RMA_READ_REPLY on conn %p with len %u",
-		__func__, (void*)conn, len);
+	if (status && (rma_op->status == CCI_SUCCESS))
+		rma_op->status = status;
 
-	ret = tcp_recv_msg(tconn->pfd.fd, rma_header->header.data, handle_len);
-	if (ret) {
-		/* TODO handle error */
-		debug(CCI_DB_MSG, "%s: recv_msg() returned %s",
-			__func__, strerror(ret));
-		goto out;
+	pthread_mutex_lock(&tconn->lock);
+	TAILQ_REMOVE(&tconn->pending, &tx->evt, entry);
+	rma_op->pending--;
+	if (!rma_op->status && rma_op->next[tx->lane] < rma_op->num_msgs) {
+		/* send the next read request of this lane */
+		tcp_rma_pack_frag(rma_op, tx);
+		tcp_rma_queue_frag_locked(tconn, tx);
+		rma_op->pending++;
+		tconn->pfd.events = POLLIN | POLLOUT;
+		next = 1;
+	} else if (rma_op->pending == 0) {
+		/* all outstanding requests are answered */
+		done = 1;
 	}
+	pthread_mutex_unlock(&tconn->lock);
 
-	tcp_parse_rma_handle_offset(&rma_header->local, &local_handle,
-				     &local_offset);
-	local = (tcp_rma_handle_t *) (uintptr_t) local_handle;
+	if (next) {
+		/* queued above */
+	} else if (!done) {
+		debug(CCI_DB_MSG, "%s: releasing tx %p", __func__, (void*)tx);
+		tcp_put_tx(tx);
+	} else if (rma_op->status || !rma_op->tx) {
+		int flags = rma_op->flags;
+		tcp_tx_t *waiter = NULL;
 
-	pthread_mutex_lock(&ep->lock);
-	TAILQ_FOREACH(h, &tep->handles, entry) {
-		if (h == local) {
-			break;
-		}
+		tx->evt.event.send.status = rma_op->status;
+		if (rma_op->tx)
+			tcp_put_tx(rma_op->tx);
+		waiter = tcp_rma_release(ep, tx->evt.conn, rma_op);
+		pthread_mutex_lock(&ep->lock);
+		tcp_complete_rma_locked(ep, flags, waiter, tx);
+		pthread_mutex_unlock(&ep->lock);
+		debug(CCI_DB_MSG, "%s: completed RMA read ***", __func__);
+	} else {
+		/* the peer must not see the completion msg before we are
+		 * done reading its buffer, so it waits for the last reply.
+		 * Its ack completes the RMA. */
+		debug(CCI_DB_MSG, "%s: sending RMA completion MSG ***",
+			__func__);
+		tcp_put_tx(tx);
+		rma_op->tx->state = TCP_TX_QUEUED;
+		tcp_queue_tx(tep, tconn, &rma_op->tx->evt);
 	}
-	pthread_mutex_unlock(&ep->lock);
 
-	if (h != local) {
-		/* local is no longer valid, send CCI_ERR_RMA_HANDLE */
-		ret = CCI_ERR_RMA_HANDLE;
-		debug(CCI_DB_MSG, "%s: local handle not valid", __func__);
-		goto out;
-	} else if (local_offset > local->length) {
-		/* offset exceeds local handle's range, send nak */
-		ret = CCI_ERR_RMA_HANDLE;
-		debug(CCI_DB_MSG, "%s: local offset not valid", __func__);
-		goto out;
-	} else if ((local_offset + len) > local->length) {
-		/* length exceeds local handle's range, send nak */
-		ret = CCI_ERR_RMA_HANDLE;
-		debug(CCI_DB_MSG, "%s: local length not valid", __func__);
-		goto out;
-	}
+	tcp_put_rx(rx);
 
-	/* valid local handle, copy the data */
-	debug(CCI_DB_INFO, "%s: recv'ing data into target buffer", __func__);
-	ptr = (void*)((uintptr_t)local->start + (uintptr_t) local_offset);
-	ret = tcp_recv_msg(tconn->pfd.fd, ptr, len);
-	debug(CCI_DB_MSG, "%s: recv'd data into target buffer", __func__);
-	if (ret)
-		debug(CCI_DB_MSG, "%s: recv'ing RMA READ payload failed with %s",
-			__func__, strerror(ret));
-out:
-	if (ret) {
-		/* TODO we need to drain the message from the fd */
-	}
-	tcp_progress_rma(ep, conn, rx, ret, tx);
+	return;
+}
+
+/* The payload has landed in our buffer (or was dropped) */
+static void
+tcp_handle_rma_read_reply(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
+				uint32_t len, uint32_t tx_id, int status)
+{
+	tcp_ep_t *tep = ep->priv;
+	tcp_tx_t *tx = &tep->txs[tx_id];
+
+	debug(CCI_DB_MSG, "%s: recv'd RMA_READ_REPLY on conn %p with len %u "
+		"status %d", __func__, (void*)conn, len, status);
+
+	tcp_progress_rma(ep, conn, rx, status, tx);
 
 	return;
 }
@@ -3133,7 +4287,9 @@ tcp_handle_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 	tcp_ep_t *tep = ep->priv;
 	tcp_conn_t *tconn = conn->priv;
 	tcp_tx_t *tx = &tep->txs[tx_id];
-	uint32_t status = a & 0xFF;
+	tcp_tx_t *waiter = NULL;
+	uint32_t status = a & TCP_ACK_STATUS_MASK;
+	int rma = 0, rma_flags = 0;
 
 	debug(CCI_DB_MSG, "%s: conn %p acked tx %p (%s) with status %u (conn "
 		"status %s)", __func__, (void*)conn, (void*)tx,
@@ -3145,7 +4301,9 @@ tcp_handle_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 
 	switch (tx->msg_type) {
 	case TCP_MSG_SEND:
-		tx->evt.event.send.status = status ? CCI_ERR_DISCONNECTED : CCI_SUCCESS;
+		if (status && status != CCI_ERR_RNR)
+			status = CCI_ERR_DISCONNECTED;
+		tx->evt.event.send.status = status;
 		if (status)
 			debug((CCI_DB_MSG|CCI_DB_CONN), "%s: peer reported send completed "
 				"with error %s", __func__,
@@ -3155,14 +4313,40 @@ tcp_handle_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 		TAILQ_REMOVE(&tconn->pending, &tx->evt, entry);
 		pthread_mutex_unlock(&tconn->lock);
 
+		if (tx->rma_op) {
+			/* an RMA's completion msg, it completes the RMA */
+			tcp_rma_op_t *rma_op = tx->rma_op;
+
+			if (rma_op->status)
+				tx->evt.event.send.status = rma_op->status;
+			/* an unstriped write's anchor is held until now, on
+			 * the same lane as the msg */
+			if (rma_op->flags & CCI_FLAG_WRITE &&
+				rma_op->nlanes == 1) {
+				pthread_mutex_lock(&tconn->lock);
+				TAILQ_REMOVE(&tconn->pending,
+					&rma_op->anchor[0]->evt, entry);
+				pthread_mutex_unlock(&tconn->lock);
+				tcp_put_tx(rma_op->anchor[0]);
+			}
+			tx->rma_op = NULL;
+			rma = 1;
+			rma_flags = rma_op->flags;
+			waiter = tcp_rma_release(ep, tx->evt.conn, rma_op);
+		}
+
 		pthread_mutex_lock(&ep->lock);
 		if (!(tx->msg_type == TCP_MSG_CONN_REPLY &&
 			tconn->status == TCP_CONN_CLOSING)) {
-			if (tx->flags & CCI_FLAG_SILENT) {
+			if (rma) {
+				tcp_complete_rma_locked(ep, rma_flags, waiter,
+							tx);
+			} else if ((tx->flags & CCI_FLAG_SILENT) &&
+				!(tx->flags & CCI_FLAG_BLOCKING)) {
+				/* a blocking sender still waits for it */
 				tcp_put_tx_locked(tep, tx);
 			} else {
-				tx->state = TCP_TX_COMPLETED;
-				TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
+				tcp_complete_tx_locked(ep, tx);
 			}
 		} else {
 			/* We rejected this conn, clean it up */
@@ -3176,6 +4360,8 @@ tcp_handle_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 		pthread_mutex_unlock(&ep->lock);
 		break;
 	case TCP_MSG_RMA_WRITE:
+		tcp_rma_write_ack(ep, conn, rx, a, tx);
+		break;
 	case TCP_MSG_RMA_READ_REQUEST:
 		tcp_progress_rma(ep, conn, rx, status, tx);
 		break;
@@ -3187,46 +4373,165 @@ tcp_handle_ack(cci__ep_t *ep, cci__conn_t *conn, tcp_rx_t *rx,
 	return;
 }
 
+/* Queue a KEEPALIVE, or the reply to one. Without a free tx it is
+ * skipped, the next check tries again. */
 static void
+tcp_send_keepalive(cci__ep_t *ep, cci__conn_t *conn, int reply)
+{
+	tcp_ep_t *tep = ep->priv;
+	tcp_tx_t *tx = tcp_get_tx(ep, 0);
+
+	if (!tx) {
+		debug(CCI_DB_MSG, "%s: no txs available", __func__);
+		return;
+	}
+
+	tx->msg_type = TCP_MSG_KEEPALIVE;
+	tx->evt.event.type = CCI_EVENT_NONE;
+	tx->evt.conn = conn;
+	tx->len = sizeof(tcp_header_t);
+	tcp_pack_keepalive(tx->buffer, reply);
+	tx->state = TCP_TX_QUEUED;
+
+	tcp_queue_tx(tep, conn->priv, &tx->evt);
+}
+
+/* Raise CCI_EVENT_KEEPALIVE_TIMEDOUT and disarm the conn's keepalive,
+ * the application decides what to do next.
+ *
+ * Returns CCI_ENOBUFS without a free tx for the event. */
+static int
+tcp_keepalive_timedout(cci__ep_t *ep, cci__conn_t *conn)
+{
+	tcp_tx_t *tx = tcp_get_tx(ep, 0);
+
+	if (!tx)
+		return CCI_ENOBUFS;
+
+	debug(CCI_DB_CONN, "%s: conn %p keepalive timed out", __func__,
+		(void*)conn);
+
+	tx->msg_type = TCP_MSG_KEEPALIVE;
+	tx->evt.conn = conn;
+	tx->evt.event.type = CCI_EVENT_KEEPALIVE_TIMEDOUT;
+	tx->evt.event.keepalive.connection = &conn->connection;
+	tx->state = TCP_TX_COMPLETED;
+
+	pthread_mutex_lock(&ep->lock);
+	conn->keepalive_timeout = 0;
+	tcp_keepalive_arm_locked(ep, conn);
+	TAILQ_INSERT_TAIL(&ep->evts, &tx->evt, entry);
+	pthread_mutex_unlock(&ep->lock);
+
+	return CCI_SUCCESS;
+}
+
+/* Receive (part of) a message
+ *
+ * A message is read in up to three stages: the header, the data that
+ * belongs in the rx buffer and, for RMA_WRITE and RMA_READ_REPLY, the
+ * payload. When the socket runs dry, the rx and the offset are parked
+ * on the conn and the next call resumes where this one stopped, so a
+ * slow peer never holds up the other conns.
+ *
+ * Returns CCI_SUCCESS once a message was handled, CCI_EAGAIN if it is
+ * still partial, CCI_ENOBUFS if no rx is available, or an error (the
+ * conn is then closing).
+ */
+static int
 tcp_handle_recv(cci__ep_t *ep, cci__conn_t *conn)
 {
 	int ret;
+	tcp_ep_t *tep = ep->priv;
 	tcp_conn_t *tconn = conn->priv;
-	tcp_rx_t *rx = NULL;
+	tcp_rx_t *rx = tconn->rx;
 	tcp_header_t *hdr = NULL;
-	uint32_t len = sizeof(*hdr);
 	tcp_msg_type_t type;
-	uint32_t a, b;
-	uint32_t q_rx = 0;
+	uint32_t a, b, len;
 	int dbg = CCI_DB_MSG;
 
-	debug(CCI_DB_MSG, "%s: conn %p recv'd message", __func__, (void*)conn);
-
-	rx = tcp_get_rx(ep);
 	if (!rx) {
-		debug(CCI_DB_MSG, "%s: no rxs available", __func__);
-		/* TODO peek at header, get msg id, send RNR */
-		return;
-	}
+		rx = tcp_get_rx(ep);
+		if (!rx) {
+			debug(CCI_DB_MSG, "%s: no rxs available", __func__);
+			/* TODO peek at header, get msg id, send RNR */
+			return CCI_ENOBUFS;
+		}
 
-	rx->evt.conn = conn;
+		rx->evt.conn = conn;
+		tconn->rx = rx;
+		tcp_recv_stage(tconn, TCP_RECV_HEADER, rx->buffer,
+				sizeof(tcp_header_t));
+	}
 	hdr = rx->buffer;
 
-	ret = tcp_recv_msg(tconn->pfd.fd, hdr, len);
-	if (ret) {
-		/* TODO handle error */
-		debug(CCI_DB_MSG, "%s: tcp_recv_msg() returned %d (rx=%p hdr=%p)",
-			__func__, ret, (void*)rx, (void*)hdr);
-		q_rx = 1;
-		tcp_conn_set_closing(ep, conn);
-		goto out;
+	for (;;) {
+		ret = tcp_recv_some(tconn);
+		if (ret == CCI_EAGAIN)
+			return ret;
+		if (ret) {
+			/* TODO handle error */
+			debug(CCI_DB_MSG, "%s: tcp_recv_some() returned %d "
+				"(rx=%p stage %d %u of %u bytes)", __func__,
+				ret, (void*)rx, tconn->rstage, tconn->roff,
+				tconn->rlen);
+			tconn->rx = NULL;
+			tcp_put_rx(rx);
+			tcp_conn_set_closing(ep, conn);
+			return ret;
+		}
+
+		if (tconn->rstage == TCP_RECV_HEADER) {
+			tcp_parse_header(hdr, &type, &a, &b);
+			tconn->rtype = type;
+			tconn->ra = a;
+			tconn->rb = b;
+			len = tcp_recv_data_len(type, a);
+			if (len <= ep->buffer_len - sizeof(*hdr)) {
+				tcp_recv_stage(tconn, TCP_RECV_DATA, hdr->data,
+						len);
+			} else if (type == TCP_MSG_SEND &&
+				len <= ep->dev->device.max_send_size) {
+				/* without a large buffer, the msg is dropped
+				 * and nacked */
+				rx->big = tcp_get_big(ep);
+				tcp_recv_stage(tconn, TCP_RECV_DATA, rx->big,
+						len);
+			} else {
+				debug(CCI_DB_WARN, "%s: %s of %u bytes on conn "
+					"%p exceeds our max_send_size", __func__,
+					tcp_msg_type(type), len, (void*)conn);
+				tconn->rx = NULL;
+				tcp_put_rx(rx);
+				tcp_conn_set_closing(ep, conn);
+				return CCI_EMSGSIZE;
+			}
+		} else if (tconn->rstage == TCP_RECV_DATA &&
+			(tconn->rtype == TCP_MSG_RMA_WRITE ||
+			 tconn->rtype == TCP_MSG_RMA_READ_REPLY)) {
+			void *ptr = tcp_rma_payload_target(ep, rx, tconn->rtype,
+					tconn->ra, &tconn->rstatus);
+
+			tcp_recv_stage(tconn, TCP_RECV_PAYLOAD, ptr, tconn->ra);
+		} else {
+			break;
+		}
 	}
 
-	tcp_parse_header(hdr, &type, &a, &b);
+	/* the message is complete */
+	tconn->rx = NULL;
+	if (tconn->parent)
+		((tcp_conn_t *)tconn->parent->priv)->last_rx = tep->now;
+	else
+		tconn->last_rx = tep->now;
+	type = tconn->rtype;
+	a = tconn->ra;
+	b = tconn->rb;
 
 	if (type == TCP_MSG_CONN_REQUEST ||
 		type == TCP_MSG_CONN_REPLY ||
-		type == TCP_MSG_CONN_ACK)
+		type == TCP_MSG_CONN_ACK ||
+		type == TCP_MSG_CONN_LANE)
 		dbg = CCI_DB_CONN;
 
 	debug(dbg, "%s: msg type %s a=%u b=%u conn=%p",
@@ -3242,6 +4547,9 @@ tcp_handle_recv(cci__ep_t *ep, cci__conn_t *conn)
 	case TCP_MSG_CONN_ACK:
 		tcp_handle_conn_ack(ep, conn, rx, b);
 		break;
+	case TCP_MSG_CONN_LANE:
+		tcp_handle_conn_lane(ep, conn, rx, a, b);
+		break;
 	case TCP_MSG_SEND:
 		tcp_handle_send(ep, conn, rx, a, b);
 		break;
@@ -3251,15 +4559,18 @@ tcp_handle_recv(cci__ep_t *ep, cci__conn_t *conn)
 	case TCP_MSG_RNR:
 		break;
 	case TCP_MSG_KEEPALIVE:
+		if (!(a & 1))
+			tcp_send_keepalive(ep, conn, 1);
+		tcp_put_rx(rx);
 		break;
 	case TCP_MSG_RMA_WRITE:
-		tcp_handle_rma_write(ep, conn, rx, a, b);
+		tcp_handle_rma_write(ep, conn, rx, a, b, tconn->rstatus);
 		break;
 	case TCP_MSG_RMA_READ_REQUEST:
 		tcp_handle_rma_read_request(ep, conn, rx, a, b);
 		break;
 	case TCP_MSG_RMA_READ_REPLY:
-		tcp_handle_rma_read_reply(ep, conn, rx, a, b);
+		tcp_handle_rma_read_reply(ep, conn, rx, a, b, tconn->rstatus);
 		break;
 	case TCP_MSG_RMA_INVALID:
 		debug(CCI_DB_MSG, "%s: recv'd RMA_INVALID msg on conn %p",
@@ -3269,12 +4580,11 @@ tcp_handle_recv(cci__ep_t *ep, cci__conn_t *conn)
 		debug(CCI_DB_MSG, "%s: invalid msg type %d", __func__, type);
 		break;
 	}
-out:
-	if (q_rx)
-		tcp_put_rx(rx);
-	return;
+
+	return CCI_SUCCESS;
 }
 
+#ifndef HAVE_SYS_EPOLL_H
 /* Get next conn from tep->conns
  *
  * Caller holds ep->lock
@@ -3326,25 +4636,24 @@ get_conn_locked(cci__ep_t *ep, cci__conn_t **connp)
 	return ret;
 }
 
+#endif /* !HAVE_SYS_EPOLL_H */
+
 /* Caller holds ep->lock */
 static void
-delete_conn_locked(cci__conn_t *conn)
+delete_conn_locked(cci__ep_t *ep, cci__conn_t *conn)
 {
 	tcp_conn_t *tconn = conn->priv;
 
-	assert(tconn->rx == NULL);
+	/* a message may have been cut short */
+	if (tconn->rx) {
+		tcp_put_rx_locked(ep->priv, tconn->rx);
+		tconn->rx = NULL;
+	}
 	assert(TAILQ_EMPTY(&tconn->queued));
 	assert(TAILQ_EMPTY(&tconn->pending));
 	assert(TAILQ_EMPTY(&tconn->rmas));
 
-	free((char *)conn->uri);
-
-#if CCI_DEBUG
-	memset(tconn, 0xFF, sizeof(*tconn));
-	memset(conn, 0xFF, sizeof(*conn));
-#endif
-	free(tconn);
-	free(conn);
+	tcp_free_conn_locked(ep, conn);
 	return;
 }
 
@@ -3362,7 +4671,7 @@ conn_decref_locked(cci__ep_t *ep, cci__conn_t *conn)
 		assert(tconn->status < TCP_CONN_INIT);
 		TAILQ_REMOVE(&tep->conns, tconn, entry);
 		pthread_mutex_unlock(&tconn->lock);
-		delete_conn_locked(conn);
+		delete_conn_locked(ep, conn);
 		goto out;
 	}
 	pthread_mutex_unlock(&tconn->lock);
@@ -3380,6 +4689,7 @@ conn_decref(cci__ep_t *ep, cci__conn_t *conn)
 	return;
 }
 
+#ifndef HAVE_SYS_EPOLL_H
 /* Get the next conn to poll
  *
  * Maybe active, passive, or ready
@@ -3402,6 +4712,8 @@ get_next_conn(cci__ep_t *ep, cci__conn_t **connp)
 	return ret;
 }
 
+#endif /* !HAVE_SYS_EPOLL_H */
+
 static void
 events(short revents, char *str, int len)
 {
@@ -3447,49 +4759,78 @@ events(short revents, char *str, int len)
 
 #define POLL_EVENTS_LEN	(64)
 
+/* Read up to TCP_RECV_BATCH msgs (or accept up to TCP_ACCEPT_BATCH
+ * conns) so that an edge-triggered socket is either drained or revisited
+ * on the next pass. Peek first so that a stale edge does not take an rx.
+ *
+ * Returns 1 if more input may be waiting, 0 if the socket would block.
+ */
 static int
-tcp_poll_events(cci__ep_t *ep)
+tcp_drain_conn(cci__ep_t *ep, cci__conn_t *conn)
 {
-	int ret = CCI_EAGAIN;
-	char str[POLL_EVENTS_LEN];
-	tcp_ep_t *tep = ep->priv;
-	cci__conn_t *conn = NULL;
-	tcp_conn_t *tconn = NULL;
-	short revents = 0;
-
-	if (!tep)
-		return CCI_ENODEV;
+	int i, ret;
+	char c;
+	tcp_conn_t *tconn = conn->priv;
 
-	ret = get_next_conn(ep, &conn);
-	if (ret)
-		return CCI_EAGAIN;
+	if (tconn->is_listener) {
+		for (i = 0; i < TCP_ACCEPT_BATCH; i++) {
+			ret = tcp_handle_listen_socket(ep, conn);
+			if (ret == EAGAIN || ret == EWOULDBLOCK)
+				return 0;
+			/* else a conn, an aborted one or a lack of
+			 * resources, the backlog may still hold more */
+		}
+		return 1;
+	}
 
-	tconn = conn->priv;
-	/* Note: we have a ref on this conn */
+	for (i = 0; i < TCP_RECV_BATCH; i++) {
+		if (tconn->status <= TCP_CONN_INIT || !tconn->pfd.fd)
+			return 0;
 
-	if (!tconn->is_listener && tconn->status > TCP_CONN_INIT)
-		tconn->pfd.events = POLLIN | POLLOUT;
+		ret = recv(tconn->pfd.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
 
-	/* Another thread may have called disconnect() since we got it above and
-	 * closed the conn's fd. If so, we will get POLLNVAL. */
-	ret = poll(&tconn->pfd, 1, 0);
-	if (ret < 1) {
-		if (ret == -1) {
-			ret = errno;
-			debug(CCI_DB_EP, "%s: poll() on conn %p returned %s",
-				__func__, (void*)conn, strerror(ret));
-		} else {
-			ret = CCI_EAGAIN;
-		}
-		goto out;
+		/* data, EOF or an error - tcp_handle_recv() sorts it out */
+		ret = tcp_handle_recv(ep, conn);
+		if (ret == CCI_ENOBUFS)
+			return 1;
+		if (ret == CCI_EAGAIN)
+			return 0;
 	}
 
-	revents = tconn->pfd.revents;
+	return 1;
+}
+
+/* Handle the poll/epoll events reported for a conn
+ *
+ * Caller has a ref on conn.
+ *
+ * Returns 1 if more input may be waiting, 0 otherwise.
+ */
+static int
+tcp_handle_conn_events(cci__ep_t *ep, cci__conn_t *conn, short revents)
+{
+	int more = 0;
+	char str[POLL_EVENTS_LEN];
+	tcp_dev_t *tdev = ep->dev->priv;
+	tcp_conn_t *tconn = conn->priv;
 
 	events(revents, str, POLL_EVENTS_LEN);
-	debug(CCI_DB_EP, "%s: poll() on conn %p found events %s", __func__,
+	debug(CCI_DB_EP, "%s: conn %p has events %s", __func__,
 		(void*)conn, str);
 
+	if (revents & (POLLHUP | POLLERR) && tconn->ka_kernel &&
+	    conn->keepalive_timeout) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		/* the kernel gave up on the peer */
+		if (!getsockopt(tconn->pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len)
+		    && err == ETIMEDOUT)
+			tcp_keepalive_timedout(ep, conn);
+	}
+
 	if (revents & POLLHUP) {
 		tcp_conn_status_t old_status = tconn->status;
 		cci__evt_t *evt = NULL;
@@ -3501,6 +4842,17 @@ tcp_poll_events(cci__ep_t *ep)
 
 		tcp_conn_set_closing(ep, conn);
 
+		if (tconn->parent && old_status == TCP_CONN_ACTIVE1) {
+			/* a lane that never connected */
+			pthread_mutex_lock(&tconn->lock);
+			evt = TAILQ_FIRST(&tconn->queued);
+			TAILQ_REMOVE(&tconn->queued, evt, entry);
+			tconn->qbytes = 0;
+			pthread_mutex_unlock(&tconn->lock);
+			tcp_put_tx(container_of(evt, tcp_tx_t, evt));
+			goto out;
+		}
+
 		switch (old_status) {
 		case TCP_CONN_READY:
 			/* TODO drain queues */
@@ -3548,14 +4900,10 @@ tcp_poll_events(cci__ep_t *ep)
 		goto out;
 	}
 	if (revents & POLLIN) {
-		if (tconn->is_listener == 1) {
-			/* handle accept */
-			tcp_handle_listen_socket(ep, conn);
-		} else {
-			/* process recv */
-			tcp_handle_recv(ep, conn);
-		}
+		more = tcp_drain_conn(ep, conn);
 		revents &= ~POLLIN;
+		if (tdev->quickack && tconn->pfd.fd > 0)
+			tcp_set_quickack(tconn->pfd.fd);
 	}
 	if (revents & POLLOUT) {
 		int rc = 0;
@@ -3577,7 +4925,13 @@ tcp_poll_events(cci__ep_t *ep)
 				}
 			}
 
-			if (err == 0) {
+			if (err == 0 && tconn->parent) {
+				/* a lane is usable once connected, its
+				 * CONN_LANE goes out ahead of any fragment */
+				debug(CCI_DB_CONN, "%s: lane %p connect() completed",
+					__func__, (void*)conn);
+				tcp_lane_attach(ep, conn);
+			} else if (err == 0) {
 				/*  send CONN_REQUEST on new connection */
 				debug(CCI_DB_CONN, "%s: conn %p connect() completed",
 					__func__, (void*)conn);
@@ -3592,7 +4946,6 @@ tcp_poll_events(cci__ep_t *ep)
 				goto out;
 			}
 		}
-		tcp_progress_conn_sends(conn);
 		revents &= ~POLLOUT;
 	}
 	if (revents) {
@@ -3600,10 +4953,235 @@ tcp_poll_events(cci__ep_t *ep)
 		debug(CCI_DB_WARN, "%s: conn %p has unhandled revents %s",
 			__func__, (void*)conn, str);
 	}
+
+	/* flush anything queued above (ACKs, RMA fragments, ...) */
+	if (!tconn->is_listener && tconn->status > TCP_CONN_INIT)
+		tcp_progress_conn_sends(conn);
+out:
+	return more;
+}
+
+/* Handle the keepalives due by tep->now, at most TCP_KA_EXPIRE_MAX a
+ * pass. Conns heard from since are only rescheduled. */
+static void
+tcp_keepalive_expire(cci__ep_t *ep)
+{
+	tcp_ep_t *tep = ep->priv;
+	uint64_t now = tep->now;
+	cci__conn_t *due[TCP_KA_EXPIRE_MAX];
+	uint64_t timedout = 0;
+	int i, cnt = 0;
+
+	pthread_mutex_lock(&ep->lock);
+	while (tep->ka_cnt && cnt < TCP_KA_EXPIRE_MAX &&
+	       tep->ka_heap[0]->ka_deadline <= now) {
+		tcp_conn_t *tconn = tep->ka_heap[0];
+		uint32_t ka = tconn->conn->keepalive_timeout;
+		uint64_t idle = now - tconn->last_rx;
+
+		if (tconn->status != TCP_CONN_READY) {
+			tcp_ka_remove_locked(tep, tconn);
+			continue;
+		}
+		/* ping at half the timeout, give up at the whole */
+		if (idle < ka / 2) {
+			tconn->ka_deadline = tconn->last_rx + ka / 2;
+			tcp_ka_sift_down(tep, 0);
+			continue;
+		}
+		tconn->ka_deadline = idle < ka ? tconn->last_rx + ka : now;
+		if (idle < ka) {
+			tcp_ka_sift_down(tep, 0);
+		} else {
+			tcp_ka_remove_locked(tep, tconn);
+			timedout |= (uint64_t) 1 << cnt;
+		}
+		pthread_mutex_lock(&tconn->lock);
+		tconn->refcnt++;
+		pthread_mutex_unlock(&tconn->lock);
+		due[cnt++] = tconn->conn;
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	for (i = 0; i < cnt; i++) {
+		cci__conn_t *conn = due[i];
+
+		if (!(timedout & ((uint64_t) 1 << i))) {
+			tcp_send_keepalive(ep, conn, 0);
+			tcp_progress_conn_sends(conn);
+		} else if (tcp_keepalive_timedout(ep, conn)) {
+			/* no tx for the event, try again next pass */
+			pthread_mutex_lock(&ep->lock);
+			if (((tcp_conn_t *)conn->priv)->status == TCP_CONN_READY &&
+			    tcp_ka_insert_locked(tep, conn->priv))
+				debug(CCI_DB_WARN, "%s: no memory to time the "
+					"keepalive of conn %p", __func__,
+					(void*)conn);
+			pthread_mutex_unlock(&ep->lock);
+		}
+		conn_decref(ep, conn);
+	}
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Harvest the epoll set and handle the ready conns
+ *
+ * Conns with input left over (batch limit or no free rx) stay on
+ * tep->ready and are revisited on the next pass, after the conns
+ * that reported events in the meantime.
+ */
+static int
+tcp_poll_events(cci__ep_t *ep, int timeout)
+{
+	int ret = CCI_EAGAIN, i, nevents, cnt = 0;
+	tcp_ep_t *tep = ep->priv;
+	tcp_conn_t *tconn = NULL;
+	struct epoll_event evs[TCP_EP_NUM_EVTS];
+
+	if (!tep)
+		return CCI_ENODEV;
+
+	/* a single harvester, the others would find nothing to do */
+	if (pthread_mutex_trylock(&tep->progress_lock))
+		return CCI_EAGAIN;
+
+	if (ep->closing)
+		goto out;
+
+	pthread_mutex_lock(&ep->lock);
+	/* no events from a previous pass can refer to these anymore */
+	while (!TAILQ_EMPTY(&tep->zombies)) {
+		cci__conn_t *conn;
+
+		tconn = TAILQ_FIRST(&tep->zombies);
+		TAILQ_REMOVE(&tep->zombies, tconn, entry);
+		conn = tconn->conn;
+#if CCI_DEBUG
+		memset(tconn, 0xFF, sizeof(*tconn));
+		memset(conn, 0xFF, sizeof(*conn));
+#endif
+		free(tconn);
+		free(conn);
+	}
+	/* do not sleep on input we already know about, unless it is
+	 * waiting for the application to return rxs */
+	if (!TAILQ_EMPTY(&tep->ready) && !TAILQ_EMPTY(&tep->idle_rxs))
+		timeout = 0;
+	pthread_mutex_unlock(&ep->lock);
+
+	nevents = epoll_wait(tep->epfd, evs, TCP_EP_NUM_EVTS, timeout);
+	if (nevents == -1) {
+		if (errno != EINTR)
+			debug(CCI_DB_EP, "%s: epoll_wait() returned %s",
+				__func__, strerror(errno));
+		nevents = 0;
+	}
+	if (tep->ka_cnt)
+		tep->now = tcp_get_usecs();
+
+	pthread_mutex_lock(&ep->lock);
+	for (i = 0; i < nevents; i++) {
+		tconn = evs[i].data.ptr;
+
+		if (tconn->status <= TCP_CONN_INIT)
+			continue;
+
+		tconn->revents |= evs[i].events;
+		if (!tconn->ready) {
+			tconn->ready = 1;
+			TAILQ_INSERT_TAIL(&tep->ready, tconn, rentry);
+		}
+	}
+
+	TAILQ_FOREACH(tconn, &tep->ready, rentry)
+		cnt++;
+
+	while (cnt-- > 0 && !TAILQ_EMPTY(&tep->ready)) {
+		cci__conn_t *conn = NULL;
+		short revents = 0;
+		int more = 0;
+
+		tconn = TAILQ_FIRST(&tep->ready);
+		TAILQ_REMOVE(&tep->ready, tconn, rentry);
+		tconn->ready = 0;
+		revents = tconn->revents;
+		tconn->revents = 0;
+		conn = tconn->conn;
+
+		pthread_mutex_lock(&tconn->lock);
+		tconn->refcnt++;
+		pthread_mutex_unlock(&tconn->lock);
+		pthread_mutex_unlock(&ep->lock);
+
+		more = tcp_handle_conn_events(ep, conn, revents);
+		ret = CCI_SUCCESS;
+
+		pthread_mutex_lock(&ep->lock);
+		if (more && tconn->status > TCP_CONN_INIT) {
+			tconn->revents |= EPOLLIN;
+			if (!tconn->ready) {
+				tconn->ready = 1;
+				TAILQ_INSERT_TAIL(&tep->ready, tconn, rentry);
+			}
+		}
+		conn_decref_locked(ep, conn);
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	if (tep->ka_cnt)
+		tcp_keepalive_expire(ep);
+out:
+	pthread_mutex_unlock(&tep->progress_lock);
+	return ret;
+}
+#else /* !HAVE_SYS_EPOLL_H */
+static int
+tcp_poll_events(cci__ep_t *ep, int timeout)
+{
+	int ret = CCI_EAGAIN;
+	tcp_ep_t *tep = ep->priv;
+	cci__conn_t *conn = NULL;
+	tcp_conn_t *tconn = NULL;
+
+	if (!tep)
+		return CCI_ENODEV;
+
+	if (tep->ka_cnt) {
+		tep->now = tcp_get_usecs();
+		tcp_keepalive_expire(ep);
+	}
+
+	ret = get_next_conn(ep, &conn);
+	if (ret)
+		return CCI_EAGAIN;
+
+	tconn = conn->priv;
+	/* Note: we have a ref on this conn */
+
+	if (!tconn->is_listener && tconn->status > TCP_CONN_INIT)
+		tconn->pfd.events = POLLIN | POLLOUT;
+
+	/* Another thread may have called disconnect() since we got it above and
+	 * closed the conn's fd. If so, we will get POLLNVAL. */
+	ret = poll(&tconn->pfd, 1, 0);
+	if (ret < 1) {
+		if (ret == -1) {
+			ret = errno;
+			debug(CCI_DB_EP, "%s: poll() on conn %p returned %s",
+				__func__, (void*)conn, strerror(ret));
+		} else {
+			ret = CCI_EAGAIN;
+		}
+		goto out;
+	}
+
+	tcp_handle_conn_events(ep, conn, tconn->pfd.revents);
+	ret = CCI_SUCCESS;
 out:
 	conn_decref(ep, conn);
 	return ret;
 }
+#endif /* HAVE_SYS_EPOLL_H */
 
 static void *tcp_progress_thread(void *arg)
 {
@@ -3613,8 +5191,9 @@ static void *tcp_progress_thread(void *arg)
 	assert (ep);
 	tep = ep->priv;
 
+	/* with epoll, sleep in epoll_wait() while idle */
 	while (!ep->closing)
-		tcp_progress_ep(ep);
+		tcp_poll_events(ep, TCP_PROG_TIME_MS);
 
 	pthread_exit(NULL);
 	return (NULL);		/* make pgcc happy */
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2014 UT-Battelle, LLC.  All rights reserved.
+ * Copyright (c) 2014 Oak Ridge National Labs.  All rights reserved.
+ *
+ * See COPYING in top-level directory
+ *
+ * $COPYRIGHT$
+ *
+ */
+
+/* Connection storm: the client opens many connections at once and
+ * reports how fast the server accepted them. */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "cci.h"
+
+#define CONNS	(1000)
+
+int is_server = 0;
+int conns = CONNS;
+char *name;
+char *server_uri;
+cci_conn_attribute_t attr = CCI_CONN_ATTR_RO;
+cci_endpoint_t *endpoint = NULL;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "usage: %s -h <server_uri> [-n <conns>] "
+		"[-c <type>]\n", name);
+	fprintf(stderr, "       %s -s [-n <conns>]\n", name);
+	fprintf(stderr, "where:\n");
+	fprintf(stderr, "\t-h\tServer's URI\n");
+	fprintf(stderr, "\t-s\tSet to run as the server\n");
+	fprintf(stderr, "\t-n\tNumber of connections (default %d)\n", CONNS);
+	fprintf(stderr, "\t-c\tConnection type {RO | RU | UU}\n");
+	exit(EXIT_FAILURE);
+}
+
+static double elapsed_ms(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+		(now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static void report(const char *what, int cnt, int failed, double ms)
+{
+	printf("%s %d conns in %.1f ms, %.0f conns/s", what, cnt, ms,
+	       ms > 0.0 ? cnt * 1000.0 / ms : 0.0);
+	if (failed)
+		printf(", %d failed", failed);
+	printf("\n");
+	fflush(stdout);
+}
+
+static void do_client(void)
+{
+	int ret, started = 0, connected = 0, failed = 0;
+	struct timeval start;
+	cci_event_t *event;
+
+	gettimeofday(&start, NULL);
+
+	while (connected + failed < conns) {
+		/* keep going while the endpoint has txs for the requests */
+		while (started < conns) {
+			ret = cci_connect(endpoint, server_uri, NULL, 0, attr,
+					  NULL, 0, NULL);
+			if (ret == CCI_ENOBUFS)
+				break;
+			if (ret) {
+				fprintf(stderr, "cci_connect() failed with %s\n",
+					cci_strerror(endpoint, ret));
+				failed++;
+			}
+			started++;
+		}
+
+		ret = cci_get_event(endpoint, &event);
+		if (ret)
+			continue;
+		if (event->type == CCI_EVENT_CONNECT) {
+			if (event->connect.status == CCI_SUCCESS)
+				connected++;
+			else
+				failed++;
+		}
+		cci_return_event(event);
+	}
+
+	report("connected", connected, failed, elapsed_ms(&start));
+	sleep(1);
+	return;
+}
+
+static void do_server(void)
+{
+	int ret, accepted = 0, failed = 0;
+	struct timeval start;
+	cci_event_t *event;
+
+	for (;;) {
+		ret = cci_get_event(endpoint, &event);
+		if (ret)
+			continue;
+		switch (event->type) {
+		case CCI_EVENT_CONNECT_REQUEST:
+			/* time from the first request on */
+			if (accepted + failed == 0)
+				gettimeofday(&start, NULL);
+			ret = cci_accept(event, NULL);
+			if (ret)
+				failed++;
+			break;
+		case CCI_EVENT_ACCEPT:
+			if (event->accept.status == CCI_SUCCESS)
+				accepted++;
+			else
+				failed++;
+			if (accepted + failed == conns) {
+				report("accepted", accepted, failed,
+				       elapsed_ms(&start));
+				accepted = failed = 0;
+			}
+			break;
+		default:
+			break;
+		}
+		cci_return_event(event);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int ret, c;
+	uint32_t caps = 0;
+	char *uri = NULL;
+
+	name = argv[0];
+
+	while ((c = getopt(argc, argv, "h:sn:c:")) != -1) {
+		switch (c) {
+		case 'h':
+			server_uri = strdup(optarg);
+			break;
+		case 's':
+			is_server = 1;
+			break;
+		case 'n':
+			conns = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			if (strncasecmp("ru", optarg, 2) == 0)
+				attr = CCI_CONN_ATTR_RU;
+			else if (strncasecmp("ro", optarg, 2) == 0)
+				attr = CCI_CONN_ATTR_RO;
+			else if (strncasecmp("uu", optarg, 2) == 0)
+				attr = CCI_CONN_ATTR_UU;
+			else
+				print_usage();
+			break;
+		default:
+			print_usage();
+		}
+	}
+
+	if ((!is_server && !server_uri) || conns < 1)
+		print_usage();
+
+	ret = cci_init(CCI_ABI_VERSION, 0, &caps);
+	if (ret) {
+		fprintf(stderr, "cci_init() failed with %s\n",
+			cci_strerror(NULL, ret));
+		exit(EXIT_FAILURE);
+	}
+
+	ret = cci_create_endpoint(NULL, 0, &endpoint, NULL);
+	if (ret) {
+		fprintf(stderr, "cci_create_endpoint() failed with %s\n",
+			cci_strerror(NULL, ret));
+		exit(EXIT_FAILURE);
+	}
+
+	ret = cci_get_opt(endpoint, CCI_OPT_ENDPT_URI, &uri);
+	if (ret) {
+		fprintf(stderr, "cci_get_opt() failed with %s\n",
+			cci_strerror(NULL, ret));
+		exit(EXIT_FAILURE);
+	}
+	printf("Opened %s\n", uri);
+	fflush(stdout);
+
+	if (is_server)
+		do_server();
+	else
+		do_client();
+
+	ret = cci_destroy_endpoint(endpoint);
+	if (ret)
+		fprintf(stderr, "cci_destroy_endpoint() failed with %s\n",
+			cci_strerror(NULL, ret));
+
+	ret = cci_finalize();
+	if (ret)
+		fprintf(stderr, "cci_finalize() failed with %s\n",
+			cci_strerror(NULL, ret));
+
+	free(uri);
+	free(server_uri);
+	return 0;
+}
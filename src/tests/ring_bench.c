@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2014 UT-Battelle, LLC.  All rights reserved.
+ * Copyright (c) 2014 Oak Ridge National Labs.  All rights reserved.
+ *
+ * See COPYING in top-level directory
+ *
+ * $COPYRIGHT$
+ *
+ */
+
+/* Microbenchmark of the sm header rings: a producer and a consumer
+ * process share a ring in anonymous shared memory. Reports the message
+ * rate of a one-way stream and the one-way latency of a ping-pong over
+ * two rings. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "ring.h"
+
+#define ITERS	(10000000)
+
+int iters = ITERS;
+uint32_t depth = RING_NUM_ELEMS;
+int mpmc = 0;
+int cpus[2] = { -1, -1 };
+char *name;
+
+/* either ring, depth sized */
+typedef union bench_ring {
+	ring_t mpmc;
+	ring_spsc_t spsc;
+} bench_ring_t;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "usage: %s [-n <iters>] [-d <depth>] [-m] "
+		"[-p <cpu>] [-c <cpu>]\n", name);
+	fprintf(stderr, "where:\n");
+	fprintf(stderr, "\t-n\tNumber of elements (default %d)\n", ITERS);
+	fprintf(stderr, "\t-d\tRing depth, a power of two (default %d)\n",
+		RING_NUM_ELEMS);
+	fprintf(stderr, "\t-m\tUse the MPMC ring (depth at most %d)\n",
+		RING_NUM_ELEMS);
+	fprintf(stderr, "\t-p\tPin the producer to this cpu\n");
+	fprintf(stderr, "\t-c\tPin the consumer to this cpu\n");
+	exit(EXIT_FAILURE);
+}
+
+static double elapsed_us(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000.0 +
+		(now.tv_usec - start->tv_usec);
+}
+
+static void pin(int cpu)
+{
+#ifdef CPU_SET
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		fprintf(stderr, "sched_setaffinity(%d) failed with %s\n",
+			cpu, strerror(errno));
+#endif
+}
+
+static bench_ring_t *ring_alloc(void)
+{
+	size_t len = mpmc ? sizeof(ring_t) : ring_spsc_size(depth);
+	bench_ring_t *r;
+
+	r = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		 -1, 0);
+	if (r == MAP_FAILED) {
+		fprintf(stderr, "mmap() failed with %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (mpmc)
+		ring_init(&r->mpmc, depth);
+	else
+		ring_spsc_init(&r->spsc, depth);
+	return r;
+}
+
+/* Spin, and only give the core away when the other side does not show
+ * up, as on a single core. */
+static void push(bench_ring_t *r, uint32_t elem)
+{
+	int tries = 0;
+
+	while (mpmc ? ring_insert(&r->mpmc, elem) :
+	       ring_spsc_insert(&r->spsc, elem)) {
+		if (++tries == 256) {
+			sched_yield();
+			tries = 0;
+		}
+	}
+}
+
+static uint32_t pop(bench_ring_t *r)
+{
+	uint32_t elem = 0;
+	int tries = 0;
+
+	while (mpmc ? ring_remove(&r->mpmc, &elem) :
+	       ring_spsc_remove(&r->spsc, &elem)) {
+		if (++tries == 256) {
+			sched_yield();
+			tries = 0;
+		}
+	}
+	return elem;
+}
+
+static pid_t start_child(void)
+{
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+
+	if (pid == -1) {
+		fprintf(stderr, "fork() failed with %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0)
+		pin(cpus[1]);
+	return pid;
+}
+
+static void wait_child(pid_t pid)
+{
+	int status = 0;
+
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "consumer failed\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void do_stream(void)
+{
+	bench_ring_t *r = ring_alloc();
+	struct timeval start;
+	pid_t pid;
+	double us;
+	int i;
+
+	pid = start_child();
+	if (pid == 0) {
+		for (i = 0; i < iters; i++) {
+			if (pop(r) != (uint32_t) i) {
+				fprintf(stderr, "element %d out of order\n", i);
+				exit(EXIT_FAILURE);
+			}
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iters; i++)
+		push(r, (uint32_t) i);
+	wait_child(pid);
+	us = elapsed_us(&start);
+
+	printf("stream\t%d elems in %.0f us, %.2f Mops/s\n", iters, us,
+	       us > 0.0 ? iters / us : 0.0);
+}
+
+static void do_pingpong(void)
+{
+	bench_ring_t *ping = ring_alloc(), *pong = ring_alloc();
+	int i, cnt = iters / 10 ? iters / 10 : 1;
+	struct timeval start;
+	pid_t pid;
+	double us;
+
+	pid = start_child();
+	if (pid == 0) {
+		for (i = 0; i < cnt; i++)
+			push(pong, pop(ping));
+		exit(EXIT_SUCCESS);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < cnt; i++) {
+		push(ping, (uint32_t) i);
+		if (pop(pong) != (uint32_t) i) {
+			fprintf(stderr, "pong %d out of order\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	us = elapsed_us(&start);
+	wait_child(pid);
+
+	printf("latency\t%d round trips, %.1f ns one way\n", cnt,
+	       us * 1000.0 / cnt / 2.0);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	name = argv[0];
+
+	while ((c = getopt(argc, argv, "n:d:mp:c:")) != -1) {
+		switch (c) {
+		case 'n':
+			iters = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mpmc = 1;
+			break;
+		case 'p':
+			cpus[0] = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			cpus[1] = strtol(optarg, NULL, 0);
+			break;
+		default:
+			print_usage();
+		}
+	}
+
+	if (iters < 1 || !depth || (depth & (depth - 1)) ||
+	    (mpmc && depth > RING_NUM_ELEMS))
+		print_usage();
+
+	pin(cpus[0]);
+
+	printf("%s ring, depth %u\n", mpmc ? "mpmc" : "spsc", depth);
+	do_stream();
+	do_pingpong();
+
+	return 0;
+}
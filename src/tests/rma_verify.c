@@ -46,10 +46,11 @@ cci_connection_t *control = NULL;
 cci_connection_t *test = NULL;
 cci_conn_attribute_t attr = CCI_CONN_ATTR_RU;
 cci_rma_handle_t *local_rma_handle = NULL;
-cci_rma_handle_t remote_rma_handle;
+struct cci_rma_handle remote_rma_handle;	/* written once the server replies */
 cci_os_handle_t fd = 0;
 int ignore_os_handle = 0;
 int blocking = 0;
+int block_rma = 0;
 int nfds = 0;
 fd_set rfds;
 #define RMA_CTX_CNT	(1024)
@@ -111,7 +112,7 @@ crc32(uint32_t crc, const void *buf, size_t size);
 static void print_usage(void)
 {
 	fprintf(stderr, "usage: %s -h <server_uri> [-s] [-i <iters>] "
-		"[-c <type>] [-B|-I] [-o <local_offset>] [-O <remote_offset>"
+		"[-c <type>] [-B|-I] [-b] [-o <local_offset>] [-O <remote_offset>"
 		"[[-w | -r] [-R <reg_len>] [-l <max_len>]]\n", name);
 	fprintf(stderr, "where:\n");
 	fprintf(stderr, "\t-h\tServer's URI\n");
@@ -125,7 +126,8 @@ static void print_usage(void)
 	fprintf(stderr, "\t-o\tRMA local offset (default 0)\n");
 	fprintf(stderr, "\t-O\tRMA remote offset (default 0)\n");
 	fprintf(stderr, "\t-B\tBlock using the OS handle instead of polling\n");
-	fprintf(stderr, "\t-I\tGet OS handle but ignore it\n\n");
+	fprintf(stderr, "\t-I\tGet OS handle but ignore it\n");
+	fprintf(stderr, "\t-b\tIssue each RMA with CCI_FLAG_BLOCKING\n\n");
 	fprintf(stderr, "Example:\n");
 	fprintf(stderr, "server$ %s -h sock://foo -p 2211 -s\n", name);
 	fprintf(stderr, "client$ %s -h sock://foo -p 2211\n", name);
@@ -215,6 +217,12 @@ static void poll_events(void)
 			} else {
 				int i = 0;
 
+				/* a blocking RMA returns its status instead */
+				if (block_rma) {
+					fprintf(stderr, "Blocking RMA raised a "
+						"completion event.\n");
+					exit(EXIT_FAILURE);
+				}
 				for (i = 0; i < RMA_CTX_CNT; i++) {
 					int *ctx = (int *)event->send.context;
 
@@ -385,6 +393,8 @@ static void do_client(void)
 		opts.flags = CCI_FLAG_WRITE;
 	else
 		opts.flags = CCI_FLAG_READ;
+	if (block_rma)
+		opts.flags |= CCI_FLAG_BLOCKING;
 
 	rma_context = calloc(RMA_CTX_CNT, sizeof(*rma_context));
 	check_return(endpoint, "calloc rma_context", rma_context ? 0 : ENOMEM, 1);
@@ -563,7 +573,7 @@ int main(int argc, char *argv[])
 
 	name = argv[0];
 
-	while ((c = getopt(argc, argv, "h:si:c:wrl:o:O:R:BI")) != -1) {
+	while ((c = getopt(argc, argv, "h:si:c:wrl:o:O:R:BIb")) != -1) {
 		switch (c) {
 		case 'h':
 			server_uri = strdup(optarg);
@@ -611,6 +621,9 @@ int main(int argc, char *argv[])
 			ignore_os_handle = 1;
 			os_handle = &fd;
 			break;
+		case 'b':
+			block_rma = 1;
+			break;
 		default:
 			print_usage();
 		}